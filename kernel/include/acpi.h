@@ -0,0 +1,86 @@
+#ifndef NOX_ACPI_H
+#define NOX_ACPI_H
+
+#define ACPI_SIGNATURE_LENGTH 4
+#define ACPI_MADT_SIGNATURE "APIC"
+
+// Every system description table starts with one of these
+struct PACKED acpi_sdt_header {
+    char     signature[ACPI_SIGNATURE_LENGTH];
+    uint32_t length;    // Including the header
+    uint8_t  revision;
+    uint8_t  checksum;
+    char     oem_id[6];
+    char     oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+};
+
+// Multiple APIC Description Table, lists the interrupt controllers
+struct PACKED acpi_madt {
+    struct acpi_sdt_header header;
+    uint32_t lapic_address;
+    uint32_t flags;
+    // Followed by a list of entries, each starting with acpi_madt_entry
+};
+
+enum acpi_madt_type {
+    acpi_madt_type_lapic    = 0,
+    acpi_madt_type_ioapic   = 1,
+    acpi_madt_type_override = 2
+};
+
+enum acpi_madt_lapic_flag {
+    acpi_madt_lapic_flag_enabled = 1 << 0
+};
+
+struct PACKED acpi_madt_entry {
+    uint8_t type;
+    uint8_t length;
+};
+
+struct PACKED acpi_madt_lapic {
+    struct acpi_madt_entry entry;
+    uint8_t  processor_id;
+    uint8_t  apic_id;
+    uint32_t flags;
+};
+
+struct PACKED acpi_madt_ioapic {
+    struct acpi_madt_entry entry;
+    uint8_t  ioapic_id;
+    uint8_t  reserved;
+    uint32_t address;
+    uint32_t gsi_base;
+};
+
+struct PACKED acpi_madt_override {
+    struct acpi_madt_entry entry;
+    uint8_t  bus;
+    uint8_t  source;    // ISA IRQ
+    uint32_t gsi;
+    uint16_t flags;     // Polarity and trigger mode
+};
+
+// Zero in either field means whatever the bus uses, which for ISA is
+// active high and edge triggered
+enum acpi_madt_override_flag {
+    acpi_madt_override_polarity_mask  = 0x3,
+    acpi_madt_override_polarity_high  = 0x1,
+    acpi_madt_override_polarity_low   = 0x3,
+    acpi_madt_override_trigger_mask   = 0xC,
+    acpi_madt_override_trigger_edge   = 0x4,
+    acpi_madt_override_trigger_level  = 0xC
+};
+
+// Finds the root table the BIOS left us, false if there isn't one
+bool acpi_init();
+
+// Returns NULL if the table doesn't exist or its checksum is off
+struct acpi_sdt_header* acpi_find_table(const char* signature);
+
+// Walks the MADT entries, returns NULL after the last one
+struct acpi_madt_entry* acpi_madt_next(struct acpi_madt* madt, struct acpi_madt_entry* entry);
+
+#endif
@@ -1,3 +1,6 @@
+#ifndef NOX_APIC_H
+#define NOX_APIC_H
+
 #define APIC_MEM_BASE              0xFEE00000
 #define APIC_REG_ID_OFFSET         0x020 // Local APIC ID Register Read/Write.
 #define APIC_REG_VERSION_OFFSET    0x030 // Local APIC Version Register Read Only.
@@ -64,4 +67,30 @@
     3* - Introduced in the Pentium Pro processor. 
          This APIC register and its associated function are implementation dependent and may not
          be present in future IA-32 or Intel 64 processors.
-*/
\ No newline at end of file
+*/
+
+#define APIC_TIMER_VECTOR          0x30
+#define APIC_SPURIOUS_VECTOR       0xFF
+
+typedef void (*apic_timer_handler)();
+
+bool     apic_init();
+bool     apic_is_enabled();
+uint32_t apic_read(uint32_t offset);
+void     apic_write(uint32_t offset, uint32_t value);
+void     apic_send_eoi();
+uint32_t apic_get_id();
+
+// Inter-processor interrupts, they return once the IPI has been delivered
+void     apic_send_ipi(uint32_t apic_id, uint8_t vector);
+void     apic_send_ipi_all_but_self(uint8_t vector);
+void     apic_send_init(uint32_t apic_id);
+void     apic_send_startup(uint32_t apic_id, uintptr_t address);
+
+// Calibrates the timer against the PIT, handler is called on every expiry
+bool     apic_timer_init(apic_timer_handler handler);
+void     apic_timer_oneshot_ns(uint64_t ns);
+void     apic_timer_periodic_ns(uint64_t ns);
+void     apic_timer_stop();
+
+#endif
@@ -1,6 +1,34 @@
 #ifndef NOX_CPU_X86_H
 #define NOX_CPU_X86_H
 
+// Feature bits reported in EDX by CPUID leaf 1
+enum cpu_feature {
+    cpu_feature_pse  = 1 << 3,
+    cpu_feature_tsc  = 1 << 4,
+    cpu_feature_msr  = 1 << 5,
+    cpu_feature_apic = 1 << 9,
+    cpu_feature_sep  = 1 << 11,
+    cpu_feature_fxsr = 1 << 24,
+    cpu_feature_sse  = 1 << 25,
+    cpu_feature_sse2 = 1 << 26
+};
+
+#define CPU_EFLAGS_IF (1 << 9)
+
+#define CPU_MSR_APIC_BASE 0x1B
+
 void cpu_reset();
+void cpu_cpuid(uint32_t leaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx);
+bool cpu_has_feature(enum cpu_feature feature);
+uint64_t cpu_read_tsc();
+uint64_t cpu_read_msr(uint32_t msr);
+void cpu_write_msr(uint32_t msr, uint64_t value);
+
+// Disables interrupts, returns the flags to hand back to cpu_irq_restore
+uint32_t cpu_irq_save();
+void cpu_irq_restore(uint32_t flags);
+
+// 64 by 32 bit division, we've got no libgcc to do it for us
+uint64_t cpu_div_u64(uint64_t dividend, uint32_t divisor, uint32_t* remainder);
 
 #endif
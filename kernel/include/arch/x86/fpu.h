@@ -0,0 +1,26 @@
+#ifndef NOX_FPU_X86_H
+#define NOX_FPU_X86_H
+
+// What FXSAVE writes, it has to be 16 byte aligned
+#define FPU_STATE_SIZE  512
+#define FPU_STATE_ALIGN 16
+
+struct thread;
+
+// Turns on SSE and sets up the lazy switching on the boot CPU, the other
+// CPUs only need fpu_init_cpu
+void fpu_init();
+void fpu_init_cpu();
+
+// The FPU starts out unavailable to every thread. The first instruction
+// that touches it traps and loads the thread's state, and only a thread
+// that did that this time around has its state saved when switched away
+// from. Called by the scheduler with interrupts disabled.
+void fpu_switch_out(struct thread* prev);
+
+// The kernel is built without SSE, code that wants it anyway goes between
+// these. Interrupts are off in between, keep it short.
+uint32_t fpu_begin();
+void fpu_end(uint32_t flags);
+
+#endif
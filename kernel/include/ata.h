@@ -4,6 +4,9 @@
 #define ATA_CONTROL_REG_PORT 0x3F8
 #define ATA_CONTROL_ALTERNATIVE_REG_PORT 0x376
 
+#define ATA_SECTOR_SIZE 512
+#define ATA_REQUEST_MAX_BUFFERS 32
+
 // NOTE: The values for these are chosen to be
 //       the base port numbers used to access the
 //       various registers for each controller
@@ -48,11 +51,42 @@ enum ata_drive {
 };
 
 enum ata_cmd {
-    ata_cmd_read_sectors = 0x20
+    ata_cmd_read_sectors  = 0x20,
+    ata_cmd_write_sectors = 0x30,
+    ata_cmd_cache_flush   = 0xE7
+};
+
+enum ata_request_state {
+    ata_request_idle,
+    ata_request_busy,
+    ata_request_done,
+    ata_request_failed
+};
+
+// One transfer. Sectors move through the buffers sectors_per_buffer at a
+// time, so one request can fill pages that aren't contiguous in memory.
+// Whoever wants the drive next moves the one in flight along, so the
+// buffers have to be reachable from any thread until it's finished.
+struct ata_request {
+    uint32_t                lba;
+    uint16_t                sector_count;   // 1-256
+    uint16_t                sectors_done;
+    uint16_t                sectors_per_buffer;
+    uintptr_t               buffers[ATA_REQUEST_MAX_BUFFERS];
+    bool                    write;
+    bool                    flushing;       // All written, cache flush sent
+    enum ata_request_state  state;
 };
 
 void ata_init();
 bool ata_read_sectors(uint32_t lba, uint8_t block_count, uintptr_t buffer);
+bool ata_write_sectors(uint32_t lba, uint8_t block_count, uintptr_t buffer);
+
+// Only one request is in flight at a time. Rather than wait for the
+// drive, this returns false if someone else's is still going.
+bool ata_read_async(struct ata_request* request);
+bool ata_request_poll(struct ata_request* request);
+bool ata_request_wait(struct ata_request* request);
 
 #endif
 
@@ -0,0 +1,20 @@
+#ifndef NOX_CLOCK_H
+#define NOX_CLOCK_H
+
+// Calibrates the TSC against the PIT, needs pit_init to have run
+bool clock_init();
+
+// Nanoseconds since clock_init, straight from the TSC
+uint64_t clock_now_ns();
+
+uint32_t clock_tsc_khz();
+
+// Converts a TSC delta to nanoseconds and back
+uint64_t clock_tsc_to_ns(uint64_t tsc);
+uint64_t clock_ns_to_tsc(uint64_t ns);
+
+// What clock_now_ns computes with, ns = ((tsc - base) * mult) >> shift.
+// False when there's no TSC to compute with.
+bool clock_get_tsc_scale(uint64_t* base, uint32_t* mult, uint32_t* shift);
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef NOX_FAT_H
 #define NOX_FAT_H
 
+#include <lock.h>
+
 struct ebpb_fat16 {
     uint8_t      drive_number;
     uint8_t      reserved1;
@@ -70,13 +72,24 @@ struct fat_dir_entry {
     uint16_t    create_time;
 	uint16_t    create_date;
 	uint16_t    last_access_date;
-	uint16_t    last_access_time;
+	uint16_t    first_cluster_high; // FAT32 only, zero on FAT12/16
 	uint16_t    last_modified_time;
 	uint16_t    last_modified_date;
 	uint16_t    first_cluster;
 	uint32_t    size;
 } PACKED;
 
+// FAT32 only, located at the sector given by ebpb32.fs_info
+struct fat_fs_info {
+    uint32_t    lead_signature;    // FAT_FS_INFO_LEAD_SIGNATURE
+    uint8_t     reserved[480];
+    uint32_t    struct_signature;  // FAT_FS_INFO_STRUCT_SIGNATURE
+    uint32_t    free_count;        // 0xFFFFFFFF if unknown
+    uint32_t    next_free;         // Hint of where to start looking for free clusters
+    uint8_t     reserved2[12];
+    uint32_t    trail_signature;
+} PACKED;
+
 struct fat_part_info {
     struct mbr_partition_entry mbr_entry;
     uint32_t                  root_dir_sector;
@@ -88,12 +101,52 @@ struct fat_part_info {
     uint32_t                  fat_total_sectors;
     uint32_t                  total_sectors;
     uint32_t                  bytes_per_sector;
+    uint32_t                  num_fats;
+    uint32_t                  root_cluster;     // FAT32 only
+    uint32_t                  fs_info_sector;   // FAT32 only, 0 if there is none
     enum fat_version          version;
+
+    // Write support - one bit per cluster (set = in use), built from
+    // the FAT when the partition is initialized. Indexed by cluster number
+    // so bits 0 and 1 (the reserved clusters) are always set.
+    uint32_t*                 free_map;
+    uint32_t                  cluster_count;    // Number of data clusters
+    uint32_t                  free_count;
+    uint32_t                  next_free_hint;   // Where to start searching for free clusters
+
+    // Tail of the last file we extended, so appending to the same
+    // file again doesn't have to walk its whole cluster chain
+    uint32_t                  tail_file_cluster;
+    uint32_t                  tail_cluster;
+};
+
+// A position in a cluster chain, so walks can resume from where they ended
+struct fat_cursor {
+    uint32_t                  index;   // Index of cluster within the file
+    uint32_t                  cluster; // 0 if unknown
+};
+
+// An open file. Reads and readahead mapping each keep their own cursor, as
+// mapping runs ahead of reading and would otherwise send reads back to the
+// start of the chain. Pages of the same file may be read in parallel, the
+// lock keeps each cursor's index and cluster in step.
+struct fat_file {
+    struct fat_dir_entry      entry;
+    struct fat_cursor         read_cursor;
+    struct fat_cursor         map_cursor;
+    struct spinlock           cursor_lock;
 };
 
 bool fat_init(struct mbr_partition_entry* partition_entry, struct fat_part_info* info_result);
 bool fat_get_dir_entry(struct fat_part_info* part_info, const char* filename83, struct fat_dir_entry* result);
 bool fat_read_file(struct fat_part_info* part_info, struct fat_dir_entry* file, intptr_t buffer, size_t buffer_length);
+int32_t fat_read_file_range(struct fat_part_info* part_info, struct fat_file* file, uint32_t offset, intptr_t buffer, size_t length);
+uint32_t fat_map_file_range(struct fat_part_info* part_info, struct fat_file* file, uint32_t offset, size_t length, uint32_t* lba);
+
+bool fat_create_file(struct fat_part_info* part_info, const char* filename83, struct fat_dir_entry* result);
+bool fat_extend_file(struct fat_part_info* part_info, struct fat_dir_entry* file, size_t new_size);
+bool fat_truncate_file(struct fat_part_info* part_info, struct fat_dir_entry* file, size_t new_size);
+bool fat_write_file(struct fat_part_info* part_info, struct fat_dir_entry* file, size_t offset, intptr_t buffer, size_t length);
 
 #endif
 
@@ -34,5 +34,8 @@ const char* fs_get_printable_partition_type(enum partition_type type);
 bool fs_is_fat_type(enum partition_type type);
 void fs_cat(const char* filename);
 
+// Appends length bytes to the file, creating it if there is none
+bool fs_append(const char* filename, const char* data, size_t length);
+
 #endif
 
@@ -1,18 +1,36 @@
 #ifndef NOX_INTERRUPT_H
 #define NOX_INTERRUPT_H
 
+// The trap frame every interrupt stub builds, lowest address first. The
+// user stack is only there when we came from ring 3.
 struct irq_regs
 {
+    uintptr_t   gs;
+    uintptr_t   fs;
+    uintptr_t   es;
+    uintptr_t   ds;
     uintptr_t   edi;
     uintptr_t   esi;
     uintptr_t   ebp;
-    uintptr_t   esp;
+    uintptr_t   esp;        // Kernel ESP at PUSHA, not restored
     uintptr_t   ebx;
     uintptr_t   edx;
     uintptr_t   ecx;
     uintptr_t   eax;
+    uintptr_t   vector;
+    uintptr_t   error_code; // Zero for vectors that don't have one
+    uintptr_t   eip;
+    uintptr_t   cs;
+    uintptr_t   eflags;
+    uintptr_t   user_esp;
+    uintptr_t   user_ss;
 };
 
+// Vectors for devices that get their own, like MSI. Everything below is
+// the CPU exceptions, the PICs and the local APIC, 0x80 is the syscall.
+#define INTERRUPT_DYNAMIC_FIRST 0x40
+#define INTERRUPT_DYNAMIC_LAST  0x7F
+
 typedef void (*interrupt_handler)(uint8_t irq, struct irq_regs* regs);
 
 typedef enum {
@@ -24,12 +42,21 @@ typedef enum {
 } gate_type;
 
 void            interrupt_init_system();
+void            interrupt_init_cpu();
 void            interrupt_disable_all();
 void            interrupt_enable_all();
 enum kresult    interrupt_install_handler(uint8_t irq, interrupt_handler handler, gate_type type, uint8_t priv_level);
 void            interrupt_enable_handler(uint8_t irq);
 void            interrupt_disable_handler(uint8_t irq);
 
+// Hands out a free vector between INTERRUPT_DYNAMIC_FIRST and _LAST with
+// the handler installed, 0 when they're all taken
+uint8_t         interrupt_allocate_vector(interrupt_handler handler);
+void            interrupt_free_vector(uint8_t vector);
+
+// Restores the whole frame and IRETs to it, never returns
+void            interrupt_return(struct irq_regs* frame);
+
 #define interrupt_receive(irq, handler) interrupt_install_handler(irq, handler, gate_type_interrupt32, 0)
 #define interrupt_receive_trap(irq, handler) interrupt_install_handler(irq, handler, gate_type_trap32, 0)
 
@@ -0,0 +1,28 @@
+#ifndef NOX_IOAPIC_H
+#define NOX_IOAPIC_H
+
+#define IOAPIC_MAX_COUNT    4
+#define IOAPIC_ISA_IRQS     16
+
+// How a global system interrupt (GSI) is wired, ISA defaults to neither
+enum ioapic_flag {
+    ioapic_flag_level       = 1 << 0,
+    ioapic_flag_active_low  = 1 << 1
+};
+
+// Finds the I/O APICs and ISA overrides in the MADT and masks every input.
+// False if there's no MADT or no I/O APIC, the 8259s stay in charge then.
+bool ioapic_init();
+bool ioapic_is_enabled();
+
+// Where an ISA IRQ ended up once the MADT overrides are applied
+uint32_t ioapic_isa_to_gsi(uint8_t irq, uint32_t* flags);
+
+// Programs a redirection entry, masked. Delivered to a single local APIC
+// as a fixed interrupt, the handler EOIs through the local APIC.
+bool ioapic_route(uint32_t gsi, uint8_t vector, uint32_t flags, uint32_t apic_id);
+bool ioapic_set_destination(uint32_t gsi, uint32_t apic_id);
+void ioapic_mask(uint32_t gsi);
+void ioapic_unmask(uint32_t gsi);
+
+#endif
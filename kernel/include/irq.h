@@ -0,0 +1,24 @@
+#ifndef NOX_IRQ_H
+#define NOX_IRQ_H
+
+#define IRQ_COUNT 16
+
+// Legacy ISA IRQs. They go through the 8259s until irq_init finds an I/O
+// APIC, and through that from then on. The handler lives on vector
+// IRQ_0 + irq either way, so drivers don't have to care which.
+void irq_init();
+
+void irq_enable(uint8_t irq);
+void irq_disable(uint8_t irq);
+
+// Call from the handler once the device has been dealt with
+void irq_send_eoi(uint8_t irq);
+
+// Which CPU the IRQ is delivered to. Only the boot CPU gets anything
+// while the 8259s are in charge.
+bool irq_set_affinity(uint8_t irq, uint32_t cpu);
+uint32_t irq_get_affinity(uint8_t irq);
+
+void irq_print_routes();
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef NOX_LOCK_H
+#define NOX_LOCK_H
+
+// Build with LOCK_STATS defined (LOCK_STATS:=1 in kernel/make.mk) to count
+// acquisitions and contention per lock and track the longest hold, in TSC
+// cycles. Locks show up in lock_stats_print once first taken.
+#ifdef LOCK_STATS
+struct lock_stats {
+    const char*         name;
+    uint32_t            acquisitions;
+    uint32_t            contentions;    // Had to spin first
+    uint64_t            max_hold;
+    uint64_t            acquired_at;
+    bool                registered;
+    struct lock_stats*  next;
+};
+
+#define LOCK_STATS_INIT(lock_name) , .stats = { .name = lock_name }
+#else
+#define LOCK_STATS_INIT(lock_name)
+#endif
+
+// Plain test and test-and-set lock, the cheapest when there's little
+// contention. Not fair, a CPU can keep winning it.
+struct spinlock {
+    volatile uint32_t   locked;
+#ifdef LOCK_STATS
+    struct lock_stats   stats;
+#endif
+};
+
+// Hands the lock out in the order CPUs asked for it, for locks held long
+// enough that someone could otherwise starve
+struct ticket_lock {
+    volatile uint32_t   next;
+    volatile uint32_t   owner;
+#ifdef LOCK_STATS
+    struct lock_stats   stats;
+#endif
+};
+
+// Any number of readers or a single writer. A waiting writer holds off
+// new readers, so it can't be starved.
+struct rw_lock {
+    volatile uint32_t   state;  // Reader count plus the writer bit
+#ifdef LOCK_STATS
+    struct lock_stats   stats;
+#endif
+};
+
+#define SPINLOCK_INIT(name)    { .locked = 0 LOCK_STATS_INIT(name) }
+#define TICKET_LOCK_INIT(name) { .next = 0, .owner = 0 LOCK_STATS_INIT(name) }
+#define RW_LOCK_INIT(name)     { .state = 0 LOCK_STATS_INIT(name) }
+
+// None of these are recursive. A lock that is also taken from interrupt
+// handlers has to be taken with interrupts disabled everywhere, or the
+// handler spins on a CPU that already holds it. The _irqsave variants do
+// that and return the flags to hand back on unlock. They also keep us from
+// being preempted while someone else spins, so prefer them unless
+// interrupts are known to be off already.
+void spinlock_init(struct spinlock* lock, const char* name);
+void spinlock_lock(struct spinlock* lock);
+bool spinlock_try_lock(struct spinlock* lock);
+void spinlock_unlock(struct spinlock* lock);
+uint32_t spinlock_lock_irqsave(struct spinlock* lock);
+void spinlock_unlock_irqrestore(struct spinlock* lock, uint32_t flags);
+
+void ticket_lock_init(struct ticket_lock* lock, const char* name);
+void ticket_lock_lock(struct ticket_lock* lock);
+void ticket_lock_unlock(struct ticket_lock* lock);
+uint32_t ticket_lock_lock_irqsave(struct ticket_lock* lock);
+void ticket_lock_unlock_irqrestore(struct ticket_lock* lock, uint32_t flags);
+
+void rw_lock_init(struct rw_lock* lock, const char* name);
+void rw_lock_read_lock(struct rw_lock* lock);
+void rw_lock_read_unlock(struct rw_lock* lock);
+void rw_lock_write_lock(struct rw_lock* lock);
+void rw_lock_write_unlock(struct rw_lock* lock);
+uint32_t rw_lock_read_lock_irqsave(struct rw_lock* lock);
+void rw_lock_read_unlock_irqrestore(struct rw_lock* lock, uint32_t flags);
+uint32_t rw_lock_write_lock_irqsave(struct rw_lock* lock);
+void rw_lock_write_unlock_irqrestore(struct rw_lock* lock, uint32_t flags);
+
+// Prints every lock taken so far, or says the statistics weren't built in
+void lock_stats_print();
+
+#endif
@@ -24,6 +24,23 @@ enum acpi_attr_flags {
     acpi_attr_flags_non_volatile = 0x02
 };
 
+// Who an allocation is charged to in mem_print_breakdown
+enum mem_tag {
+    mem_tag_kernel,     // Anything without a better home
+    mem_tag_fs,         // FAT and the partition tables
+    mem_tag_page_cache,
+    mem_tag_mmap,
+    mem_tag_paging,     // Page tables and copy-on-write copies
+    mem_tag_elf,
+    mem_tag_thread,     // Stacks and run queues
+    mem_tag_usb,
+    mem_tag_count
+};
+
+// Called when the allocator runs dry, should free up to pages_wanted
+// pages and return how many it actually freed
+typedef size_t (*mem_reclaim_callback)(size_t pages_wanted);
+
 struct PACKED mem_map_entry {
     uint64_t base;
     uint64_t length;
@@ -31,14 +48,34 @@ struct PACKED mem_map_entry {
     uint32_t acpi_attr;
 };
 
+// Only memory below PAGING_USER_START is managed, the rest of the address
+// space isn't identity mapped once paging is on
 void mem_mgr_init(struct mem_map_entry mem_map[], uint32_t mem_entry_count);
 void mem_mgr_gdt_setup();
+void mem_mgr_gdt_setup_cpu(uint32_t cpu, uintptr_t kernel_stack);
+void mem_mgr_set_kernel_stack(uint32_t cpu, uintptr_t top);
+uintptr_t mem_mgr_get_kernel_stack(uint32_t cpu);
+uintptr_t mem_mgr_get_kernel_stack_slot(uint32_t cpu);
 
 size_t mem_page_count(bool get_allocated);
 bool mem_page_reserve(const char* identifier, void* address, size_t num_pages);
-void*  mem_page_get();
-void*  mem_page_get_many(uint16_t how_many);
+void*  mem_page_get(enum mem_tag tag);
+void*  mem_page_get_many(uint16_t how_many, enum mem_tag tag);
+
+// A page that's already all zeroes, usually from a pool the idle loop
+// keeps filled, otherwise zeroed on the spot
+void*  mem_page_get_zeroed(enum mem_tag tag);
+
+// Zeroes a few more pages for the pool, true while it isn't full yet.
+// Only takes memory that's free anyway, it never makes anyone reclaim.
+bool   mem_zero_pool_refill();
 void   mem_page_free(void* address);
 void   mem_print_usage();
 
+// Current and peak pages per tag plus the reservations, and with MEM_TRACE
+// the last allocations and frees with where they were called from
+void   mem_print_breakdown();
+void   mem_print_trace();
+bool   mem_register_reclaimer(mem_reclaim_callback callback);
+
 #endif
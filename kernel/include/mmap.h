@@ -0,0 +1,23 @@
+#ifndef NOX_MMAP_H
+#define NOX_MMAP_H
+
+enum mmap_flag {
+    mmap_flag_shared  = 0,      // Read-only, maps the page cache pages themselves
+    mmap_flag_private = 1 << 0, // Writable, each page is copied on its first write
+    mmap_flag_user    = 1 << 1  // Accessible from user mode
+};
+
+// Maps length bytes of the open file, starting at offset, at address. If
+// address is 0 a free spot in the kernel window is picked. Both offset and
+// address have to be page aligned. Returns NULL on failure.
+void* mmap_file(int32_t fd, uint32_t offset, size_t length, uintptr_t address, uint32_t flags);
+
+// Maps zeroed memory, always writable
+void* mmap_anonymous(uintptr_t address, size_t length, uint32_t flags);
+
+bool  mmap_unmap(void* address);
+
+// Unmaps every mapping that starts within the given range
+void  mmap_unmap_range(uintptr_t start, uintptr_t end);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef NOX_MSI_H
+#define NOX_MSI_H
+
+#include <pci.h>
+#include <interrupt.h>
+
+// A device's message signalled interrupt, owned by its driver
+struct msi {
+    struct pci_address  address;
+    uint8_t             capability;     // Offset in config space
+    bool                extended;       // MSI-X rather than MSI
+    volatile uint32_t*  entry;          // MSI-X table entry in use
+    uint8_t             vector;
+};
+
+// Gives the device a vector of its own, edge triggered and delivered
+// straight to the local APIC of the given CPU. Prefers MSI-X and falls
+// back to MSI, false if the device has neither or there's no local APIC.
+// Legacy INTx is turned off. The handler EOIs with apic_send_eoi.
+bool msi_enable(struct msi* msi, struct pci_address* address, uint32_t cpu, interrupt_handler handler);
+
+// Rewrites the message address, the next interrupt goes to the new CPU
+bool msi_set_affinity(struct msi* msi, uint32_t cpu);
+void msi_disable(struct msi* msi);
+
+#endif
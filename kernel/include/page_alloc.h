@@ -0,0 +1,70 @@
+#ifndef NOX_PAGE_ALLOC_H
+#define NOX_PAGE_ALLOC_H
+
+// The page map behind mem_mgr, one entry per page of memory, and the
+// searches over it. Nothing in here locks or touches the hardware, so it
+// builds on the host as well, see tools/allocbench.
+
+#define PAGE_USED (1 << 7)
+#define FIRST_IN_ALLOCATION (1 << 6)
+#define PAGE_RESERVED (1 << 5)
+#define PAGE_CACHED (1 << 4)    // Allocated in the map, but free in a magazine
+#define IS_PAGE_USED(x) ((x & PAGE_USED) == PAGE_USED)
+#define IS_FIRST_IN_ALLOCATION(x) ((x & FIRST_IN_ALLOCATION) == FIRST_IN_ALLOCATION)
+#define IS_PAGE_RESERVED(x) ((x & PAGE_RESERVED) == PAGE_RESERVED)
+#define IS_PAGE_CACHED(x) ((x & PAGE_CACHED) == PAGE_CACHED)
+
+// No page, none of the indices are ever this big
+#define PAGE_MAP_NONE ((size_t)-1)
+
+// The most pages one allocation can have, the count after the first is
+// kept in 16 bits
+#define PAGE_MAP_MAX_RUN 65536
+
+struct page {
+    uint8_t flags;
+    uint8_t tag;        // Of the allocation, only kept in its first page
+
+    // The pages after the first that belong to the allocation
+    uint16_t consecutive_pages_allocated;
+} PACKED;
+
+struct page_map {
+    struct page* pages;
+    size_t count;
+};
+
+enum page_map_result {
+    page_map_ok,
+    page_map_out_of_range,
+    page_map_not_first,     // Not where an allocation starts
+    page_map_reserved,
+    page_map_cached,        // Already free, it's sitting in a magazine
+    page_map_taken          // Something in the range is already used
+};
+
+// Every page starts out free
+void page_map_init(struct page_map* map, struct page* pages, size_t count);
+
+// Marks pages that are never handed out nor freed
+enum page_map_result page_map_reserve(struct page_map* map, size_t first, size_t count);
+
+// First fit for count pages in a row, returns the index of the first or
+// PAGE_MAP_NONE
+size_t page_map_alloc(struct page_map* map, size_t count);
+
+// Up to count single pages in one pass, for filling a magazine. They're
+// marked PAGE_CACHED, whoever hands one out clears that. Returns how many
+// indices were written.
+size_t page_map_alloc_cached(struct page_map* map, size_t* pages, size_t count);
+
+// Frees the whole allocation starting at first, refusing anything that
+// isn't one
+enum page_map_result page_map_free(struct page_map* map, size_t first);
+
+size_t page_map_count(struct page_map* map, bool allocated);
+
+// The longest run of free pages, how far from fragmented the map is
+size_t page_map_largest_free(struct page_map* map);
+
+#endif
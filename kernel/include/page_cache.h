@@ -0,0 +1,40 @@
+#ifndef NOX_PAGE_CACHE_H
+#define NOX_PAGE_CACHE_H
+
+struct vnode;
+
+// A single page of file data. Every page of a file lives in the cache at
+// most once, readers and mappings of the same file share it.
+struct page_cache_entry {
+    struct vnode*               node;
+    uint32_t                    index;      // Page index within the file
+    void*                       page;
+    uint32_t                    ref_count;  // Pinned entries are never reclaimed
+    bool                        pending;    // Still being read ahead, not valid yet
+
+    struct page_cache_entry*    hash_next;
+    struct page_cache_entry*    lru_prev;   // Towards most recently used
+    struct page_cache_entry*    lru_next;   // Towards least recently used
+};
+
+bool page_cache_init();
+
+// Returns the pinned page holding the given page of the file, reading it
+// from disk if it isn't cached. Release it with page_cache_put.
+struct page_cache_entry* page_cache_get(struct vnode* node, uint32_t index);
+void page_cache_put(struct page_cache_entry* entry);
+
+// Starts reading up to count pages from index onwards in the background.
+// Returns how many pages from index on are now cached or on their way.
+uint32_t page_cache_readahead(struct vnode* node, uint32_t index, uint32_t count);
+
+// Lets background reads make progress, never blocks
+void page_cache_poll();
+
+// Drops every unpinned page belonging to the given file
+void page_cache_invalidate(struct vnode* node);
+
+// Frees up to pages_wanted least recently used pages, returns how many were freed
+size_t page_cache_reclaim(size_t pages_wanted);
+
+#endif
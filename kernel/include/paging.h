@@ -0,0 +1,48 @@
+#ifndef NOX_PAGING_H
+#define NOX_PAGING_H
+
+// Virtual memory layout. Everything outside of the user range and the
+// kernel window is identity mapped, so the physical addresses handed out
+// by mem_mgr can still be used as pointers. That's also why mem_mgr stops
+// at PAGING_USER_START, RAM above 1 GiB isn't used.
+#define PAGING_USER_START       0x40000000
+#define PAGING_USER_END         0x80000000
+#define PAGING_WINDOW_START     0x80000000  // Kernel mappings of files and such
+#define PAGING_WINDOW_END       0xC0000000
+#define PAGING_MMIO_START       0xC0000000  // Devices live up here, it isn't cached
+
+enum paging_flag {
+    paging_flag_present  = 1 << 0,
+    paging_flag_write    = 1 << 1,
+    paging_flag_user     = 1 << 2,
+    paging_flag_no_cache = 1 << 4,
+    paging_flag_large    = 1 << 7,  // 4 MiB page, only valid in the directory
+    paging_flag_cow      = 1 << 9,  // Free for OS use, marks copy-on-write pages
+};
+
+enum paging_fault {
+    paging_fault_present = 1 << 0,  // Protection violation rather than a missing page
+    paging_fault_write   = 1 << 1,
+    paging_fault_user    = 1 << 2
+};
+
+// Flushes virt from every other CPU's TLB and only returns once they all
+// have. Only needed once other CPUs share the page directory.
+typedef void (*paging_shootdown_func)(uintptr_t virt);
+
+bool paging_init();
+bool paging_enabled();  // Not in the boot loader, everything is physical there
+void paging_set_shootdown(paging_shootdown_func func);
+
+// Changing or removing a mapping only returns once no CPU can still use
+// the old one, so whatever it pointed at may be freed right after. Other
+// CPUs have to take part, so don't hold a lock they may be spinning on
+// with interrupts off.
+bool paging_map(uintptr_t virt, uintptr_t phys, uint32_t flags);
+bool paging_unmap(uintptr_t virt);
+bool paging_get(uintptr_t virt, uintptr_t* phys, uint32_t* flags);
+
+// Returns true if the fault was dealt with and the access can be retried
+bool paging_handle_fault(uintptr_t address, uint32_t error_code);
+
+#endif
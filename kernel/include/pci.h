@@ -55,6 +55,15 @@
 #define PCI_MIN_TIME_REG_OFFSET            0x3E
 #define PCI_MAX_TIME_REG_OFFSET            0x3F
 
+#define PCI_COMMAND_INTX_DISABLE           (1 << 10)
+#define PCI_STATUS_CAPABILITIES            (1 << 4)
+
+// IDs of the capabilities we know about, found through pci_find_capability
+enum pci_capability {
+    pci_capability_msi  = 0x05,
+    pci_capability_msix = 0x11
+};
+
 // Legacy support register layout:
 // 15 - (R/WC) End of A20GATE pass through status. 1 = Sequence has ended
 // 14 - Reserved
@@ -148,4 +157,8 @@ bool pci_address_advance(struct pci_address* address);
 bool pci_device_get_next(struct pci_address* addr, int16_t class_id, int16_t sub_class, pci_device* result);
 uint32_t pci_device_get_memory_size(struct pci_address* addr, uint32_t bar_offset);
 
+// Walks the capability list, returns the capability's offset in config
+// space or 0 if the device doesn't have it
+uint8_t pci_find_capability(struct pci_address* addr, uint8_t id);
+
 #endif
@@ -1,7 +1,11 @@
 #ifndef NOX_PIT_H
 #define NOX_PIT_H
 
+typedef void (*pit_tick_handler)();
+
 void pit_init();
-void pit_wait(size_t ms);
+void pit_set_tick_handler(pit_tick_handler handler);
+uint64_t pit_get_ticks();
+void pit_spin_ms(uint32_t ms);
 
 #endif
@@ -0,0 +1,50 @@
+#ifndef NOX_SHARED_PAGE_H
+#define NOX_SHARED_PAGE_H
+
+// A page the kernel publishes into user space, read-only from there, so
+// the time and such don't need a syscall. It sits just below the user
+// stack. Keep userland.h in sync.
+#define SHARED_PAGE_ADDRESS     0x7FFF0000
+#define SHARED_PAGE_VERSION     1
+#define SHARED_PAGE_TICK_MS     10
+
+#define SHARED_PAGE_APIC_IDS    256
+
+enum shared_page_flag {
+    shared_page_flag_tsc    = 1 << 0,   // The TSC fields are good
+    shared_page_flag_rdtscp = 1 << 1    // RDTSCP leaves the CPU index in ECX
+};
+
+// Everything past the sequence is only consistent if it was even and the
+// same before and after reading. Odd means the kernel is in the middle of
+// an update.
+struct shared_page {
+    volatile uint32_t   sequence;
+    uint32_t            version;
+    uint32_t            flags;
+
+    // ns = ((tsc - tsc_base) * tsc_mult) >> tsc_shift, the same as
+    // clock_now_ns
+    uint64_t            tsc_base;
+    uint32_t            tsc_mult;
+    uint32_t            tsc_shift;
+    uint32_t            tsc_khz;
+
+    // Bumped every SHARED_PAGE_TICK_MS, a cheaper and coarser clock
+    uint64_t            ticks;
+    uint64_t            tick_ns;
+
+    uint32_t            cpu_count;
+    uint32_t            page_size;
+
+    // From the APIC ID CPUID reports to the kernel's CPU index
+    uint8_t             cpu_by_apic_id[SHARED_PAGE_APIC_IDS];
+};
+
+// Maps the page and starts the tick, needs the clock, timers and SMP up
+bool shared_page_init();
+
+// Per CPU, points RDTSCP at the CPU's index where there is one
+void shared_page_init_cpu(uint32_t cpu);
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef NOX_SMP_H
+#define NOX_SMP_H
+
+#include <lock.h>
+
+#define SMP_MAX_CPUS            8
+#define SMP_TRAMPOLINE_ADDRESS  0x6000  // Must be page aligned and below 1 MiB
+#define SMP_CALL_VECTOR         0x31
+#define SMP_RESCHEDULE_VECTOR   0x32
+#define SMP_SHOOTDOWN_VECTOR    0x33
+
+typedef void (*smp_call_func)(void* arg);
+
+// Pending cross-CPU call, one per CPU
+struct smp_call {
+    struct spinlock         lock;   // Held by the caller until it's done
+    volatile bool           done;
+    smp_call_func           func;
+    void*                   arg;
+};
+
+struct thread;
+struct tasklet;
+
+// Per-CPU data block
+struct cpu {
+    uint32_t                index;
+    uint32_t                apic_id;
+    volatile bool           online;
+    struct smp_call         call;
+
+    // Owned by the scheduler
+    struct thread*          current;
+    struct thread*          idle;
+    volatile bool           need_resched;
+
+    // Owned by softirq.c, only touched from this CPU with interrupts off
+    uint32_t                softirq_pending;
+    bool                    in_softirq;
+    struct tasklet*         tasklets;
+    struct tasklet*         tasklets_tail;
+
+    // Owned by fpu.c. Whose state the FPU registers hold, and whether it
+    // has been used since the thread was switched to.
+    struct thread*          fpu_owner;
+    bool                    fpu_active;
+};
+
+// Finds the other CPUs in the ACPI MADT and starts them. The boot CPU is
+// always index 0, and the only one if there's no MADT or local APIC.
+void smp_init();
+
+uint32_t smp_cpu_count();
+uint32_t smp_cpu_index();
+struct cpu* smp_cpu();  // The one we're running on
+struct cpu* smp_get_cpu(uint32_t index);
+
+void smp_send_ipi(uint32_t index, uint8_t vector);
+
+// Runs func on the given CPU and waits for it to finish. It's called
+// from an interrupt there, so it mustn't block.
+bool smp_call(uint32_t index, smp_call_func func, void* arg);
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef NOX_SOFTIRQ_H
+#define NOX_SOFTIRQ_H
+
+// Deferred interrupt work. Handlers do the bare minimum with interrupts
+// disabled, acknowledge the interrupt and leave the rest to a softirq,
+// which runs on the same CPU when the interrupt returns, with interrupts
+// enabled again. Softirqs never nest or get preempted, and mustn't block.
+// Whatever they share with interrupt handlers or threads has to be taken
+// with the _irqsave lock variants.
+enum softirq {
+    softirq_timer,
+    softirq_tasklet,
+
+    softirq_count
+};
+
+typedef void (*softirq_handler)();
+
+struct tasklet;
+typedef void (*tasklet_func)(struct tasklet* tasklet, void* data);
+
+// One-off work items run from softirq_tasklet. Scheduling one that is
+// already pending does nothing, and a tasklet never runs on two CPUs at
+// the same time, so its function needs no locking against itself.
+struct tasklet {
+    tasklet_func        func;
+    void*               data;
+    volatile uint32_t   state;
+    struct tasklet*     next;
+};
+
+#define TASKLET_INIT(tasklet_func, tasklet_data) { .func = tasklet_func, .data = tasklet_data }
+
+void softirq_register(enum softirq softirq, softirq_handler handler);
+
+// Marks it pending on this CPU. Cheap enough for any interrupt handler.
+void softirq_raise(enum softirq softirq);
+
+// Runs whatever is pending on this CPU, with interrupts on. Called on the
+// way out of interrupts that came in with interrupts enabled, never after
+// an exception, and by the idle thread for anything that kept getting
+// raised again and was left over.
+void softirq_run();
+bool softirq_pending();
+
+void tasklet_init(struct tasklet* tasklet, tasklet_func func, void* data);
+void tasklet_schedule(struct tasklet* tasklet);
+
+#endif
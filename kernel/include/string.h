@@ -10,5 +10,23 @@ bool kstrcmp(const char* a, const char* b);
 bool kstrcmp_n(const char* a, const char* b, size_t len);
 char* kstrcpy_n(char* dest, size_t len, char* src);
 
+// Copies at least this big bypass the cache with non-temporal stores,
+// once string_init has found SSE2. Beyond that size the destination
+// wouldn't stay cached anyway, and it would push out everything else.
+#define STRING_STREAM_THRESHOLD (64 * 1024)
+
+void string_init();
+
+// The compiler may emit calls to these on its own, so they keep their
+// usual names and signatures
+void* memcpy(void* dest, const void* src, size_t length);
+void* memmove(void* dest, const void* src, size_t length);
+void* memset(void* dest, int value, size_t length);
+int memcmp(const void* a, const void* b, size_t length);
+
+// memset that goes around the cache whatever the size, for memory that
+// won't be looked at again soon
+void* memset_uncached(void* dest, int value, size_t length);
+
 #endif
 
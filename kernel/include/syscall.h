@@ -0,0 +1,40 @@
+#ifndef NOX_SYSCALL_H
+#define NOX_SYSCALL_H
+
+struct irq_regs;
+
+#define SYSCALL_VECTOR      0x80
+#define SYSCALL_ERROR       0xFFFFFFFF
+
+#define SYSCALL_MSR_SYSENTER_CS     0x174
+#define SYSCALL_MSR_SYSENTER_ESP    0x175
+#define SYSCALL_MSR_SYSENTER_EIP    0x176
+
+// The number goes in EAX and up to three arguments in EBX, ESI and EDI.
+// The result comes back in EAX, SYSCALL_ERROR if it failed. ECX and EDX
+// are lost either way.
+//
+// Either int 0x80, or SYSENTER when the CPU has it (CPUID.1:EDX.SEP). For
+// SYSENTER the caller puts the stack to come back with in ECX and where
+// to continue in EDX. Keep userland.h in sync.
+enum syscall_number {
+    syscall_exit,       // Never returns
+    syscall_write,      // buffer, length. Onto the terminal.
+    syscall_sleep,      // ms
+    syscall_yield,
+
+    syscall_count
+};
+
+// Installs the int 0x80 gate and sets up SYSENTER on the boot CPU
+void syscall_init();
+void syscall_init_cpu(uint32_t cpu);
+
+// Both entry paths end up here with the same frame
+void syscall_handle(struct irq_regs* regs);
+
+// True if the whole range is mapped for user mode, and writable if asked.
+// Anything a syscall is handed has to pass this before it's touched.
+bool syscall_check_user(uintptr_t address, size_t length, bool write);
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef NOX_THREAD_H
+#define NOX_THREAD_H
+
+#define THREAD_NAME_LENGTH      16
+#define THREAD_STACK_PAGES      4
+#define THREAD_PRIORITY_LEVELS  32
+#define THREAD_SLICE_NS         10000000ull
+
+// Lower values run first. Threads of the same priority on the same CPU take
+// turns, one time slice each.
+enum thread_priority {
+    thread_priority_high   = 8,
+    thread_priority_normal = 16,
+    thread_priority_low    = 24
+};
+
+enum thread_state {
+    thread_state_ready,
+    thread_state_running,
+    thread_state_blocked,
+    thread_state_dead
+};
+
+typedef void (*thread_entry)(void* arg);
+
+// Kept at the bottom of the thread's own stack pages
+struct thread {
+    uintptr_t           esp;        // Saved while switched out
+    uintptr_t           stack_top;  // Where interrupts from user mode land
+    void*               stack;      // NULL for the boot thread
+    thread_entry        entry;
+    void*               arg;
+    enum thread_state   state;
+    uint8_t             priority;
+    uint32_t            id;
+    char                name[THREAD_NAME_LENGTH];
+
+    uint32_t            cpu;        // Last ran on, wake ups are handled there
+    volatile bool       on_cpu;     // Until its CPU has switched off its stack
+
+    // Queued for a wake up by another CPU
+    volatile bool       wake_pending;
+    struct thread*      wake_next;
+
+    // FXSAVE area, carved out of the stack pages. Only meaningful once the
+    // thread has touched the FPU.
+    void*               fpu_state;
+    bool                fpu_used;
+    uint32_t            fpu_cpu;    // Where it was last loaded
+};
+
+// Turns whoever calls it into the boot thread and starts scheduling
+void thread_init();
+
+// Sets up the idle thread and run queue of a CPU. Other CPUs then call
+// thread_run_idle on its stack, it never returns.
+struct thread* thread_create_idle(uint32_t cpu);
+void thread_run_idle();
+
+// Periodically evens out the run queues, once there's more than one CPU
+void thread_start_balancing();
+
+struct thread* thread_create(const char* name, thread_entry entry, void* arg, uint8_t priority);
+struct thread* thread_current();
+
+void thread_yield();
+void thread_exit();
+
+// Call with interrupts disabled, returns after someone else has called
+// thread_wake on the thread. Interrupts are still disabled then.
+void thread_block();
+void thread_wake(struct thread* thread);
+
+// Switches threads if the time slice ran out or a more important thread
+// woke up. Called on the way out of interrupts that came in with
+// interrupts enabled. There's no preempt count, code that mustn't be
+// switched away from keeps interrupts off.
+void thread_preempt();
+
+#endif
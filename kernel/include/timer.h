@@ -0,0 +1,38 @@
+#ifndef NOX_TIMER_H
+#define NOX_TIMER_H
+
+struct timer;
+typedef void (*timer_callback)(struct timer* timer, void* data);
+
+// Owned by the caller, must stay alive until it fires or is cancelled.
+// Callbacks run from the timer softirq on whichever CPU takes the timer
+// interrupt, with interrupts enabled but unable to block. They may restart
+// or cancel their own timer. A callback may still be running elsewhere
+// when timer_cancel returns.
+struct timer {
+    uint64_t        expires;    // In wheel ticks
+    uint64_t        period_ns;  // 0 for one-shot timers
+    timer_callback  callback;
+    void*           data;
+    struct timer*   next;
+    struct timer**  pprev;      // NULL while not pending
+};
+
+// Uses the local APIC in one-shot mode when there is one, so the CPU is
+// only interrupted when a timer is actually due. Otherwise the PIT tick
+// drives the timers.
+void timer_init();
+bool timer_is_tickless();
+
+// Timers are kept in a hierarchical wheel, starting and cancelling them is
+// O(1). They fire on the first wheel tick (~131us) at or after the delay.
+void timer_start(struct timer* timer, uint64_t delay_ns, timer_callback callback, void* data);
+void timer_start_periodic(struct timer* timer, uint64_t period_ns, timer_callback callback, void* data);
+bool timer_cancel(struct timer* timer);
+bool timer_is_pending(struct timer* timer);
+
+// Blocks the caller on a wait queue until the time has passed
+void sleep_ns(uint64_t ns);
+void sleep_ms(uint32_t ms);
+
+#endif
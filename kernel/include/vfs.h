@@ -0,0 +1,67 @@
+#ifndef NOX_VFS_H
+#define NOX_VFS_H
+
+#define VFS_MAX_VNODES      32
+#define VFS_MAX_OPEN_FILES  32
+#define VFS_NAME_LENGTH     11 // 8.3 names, as stored by FAT
+
+// Readahead window bounds, in pages
+#define VFS_READAHEAD_MIN   4
+#define VFS_READAHEAD_MAX   32
+
+enum vfs_seek {
+    vfs_seek_set = 0,
+    vfs_seek_cur = 1,
+    vfs_seek_end = 2
+};
+
+struct vnode;
+
+// Implemented by whatever file system is mounted
+struct vfs_fs_ops {
+
+    // Fills in size and fs_data of result, returns false if there is no such file
+    bool    (*lookup)(void* fs, const char* name, struct vnode* result);
+
+    // Reads up to length bytes at offset, returns bytes read or -1 on error.
+    // Only the page cache calls this, everyone else goes through vfs_read.
+    int32_t (*read)(struct vnode* node, uint32_t offset, intptr_t buffer, size_t length);
+
+    // Optional. Finds the first disk sector holding offset, returns how many
+    // bytes from there on are stored back to back, so they can be read ahead.
+    uint32_t (*map)(struct vnode* node, uint32_t offset, size_t length, uint32_t* lba);
+
+    // The vnode is going away, free whatever lookup allocated
+    void    (*release)(struct vnode* node);
+};
+
+// Vnodes stay around after their last close, so that their cached pages
+// can be found again when the same file is reopened
+struct vnode {
+    char                    name[VFS_NAME_LENGTH];
+    uint32_t                size;
+    uint32_t                ref_count;
+    uint32_t                last_used;  // For picking which unused vnode to recycle
+    bool                    stale;      // Forgotten while open, goes on last close
+    struct vfs_fs_ops*      ops;
+    void*                   fs;
+    void*                   fs_data;
+};
+
+void    vfs_mount(struct vfs_fs_ops* ops, void* fs);
+int32_t vfs_open(const char* name);
+int32_t vfs_read(int32_t fd, intptr_t buffer, size_t length);
+int32_t vfs_seek(int32_t fd, int32_t offset, enum vfs_seek whence);
+int32_t vfs_size(int32_t fd);
+bool    vfs_close(int32_t fd);
+
+// For holding on to a file beyond its descriptor, e.g. while it's mapped
+struct vnode*   vfs_get_vnode(int32_t fd);
+void            vfs_put_vnode(struct vnode* node);
+
+// Drops what's cached about the file, so the next open sees changes made
+// behind the VFS' back. Call it once the change is on disk. Whoever has the
+// file open keeps what they had until they close it.
+void    vfs_forget(const char* name);
+
+#endif
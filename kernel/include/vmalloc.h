@@ -0,0 +1,17 @@
+#ifndef NOX_VMALLOC_H
+#define NOX_VMALLOC_H
+
+// Kernel memory that's only contiguous in the kernel window, put together
+// from whatever single pages are free. For big buffers that
+// mem_page_get_many might not find in one piece. Each allocation is
+// followed by an unmapped guard page, running off the end faults. Before
+// paging is on it's just mem_page_get_many.
+void* vmalloc(size_t size, enum mem_tag tag);
+void  vmalloc_free(void* address);
+
+// Just the addresses in the kernel window, for callers that map the
+// pages themselves. Returns 0 if there's no room.
+uintptr_t vmalloc_reserve(uint32_t page_count);
+void      vmalloc_release(uintptr_t address, uint32_t page_count);
+
+#endif
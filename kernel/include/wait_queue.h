@@ -0,0 +1,35 @@
+#ifndef NOX_WAIT_QUEUE_H
+#define NOX_WAIT_QUEUE_H
+
+#include <lock.h>
+
+struct thread;
+
+// Lives on the waiter's stack for as long as it is queued
+struct wait_queue_entry {
+    volatile bool               woken;
+    struct thread*              thread;     // NULL before threads are up
+    struct wait_queue_entry*    next;
+};
+
+// Woken in the order they started waiting
+struct wait_queue {
+    struct spinlock             lock;
+    struct wait_queue_entry*    head;
+    struct wait_queue_entry**   tail;
+};
+
+void wait_queue_init(struct wait_queue* queue);
+
+// Take the queue's lock with spinlock_lock_irqsave, check whatever you're
+// waiting for, then call this. The lock is dropped while blocked and held
+// again on return, so a wake up from another CPU or an interrupt handler
+// can't get lost in between, as long as the waker changes the condition
+// under the same lock or before waking.
+void wait_queue_wait(struct wait_queue* queue);
+
+// Safe to call from interrupt context, return how many were woken
+uint32_t wait_queue_wake_one(struct wait_queue* queue);
+uint32_t wait_queue_wake_all(struct wait_queue* queue);
+
+#endif
@@ -31,6 +31,12 @@ AOBJECTS := $(subst $(ASOURCE_DIR), $(OBJ_DIR), $(AOBJECTS))
 PLATFORM_DEBUG:=PLATFORM_DEBUG_BOCHS
 PLATFORM_ARCH:=PLATFORM_ARCH_X86
 PLATFORM_BITS_VAL:=32
+
+# Set to 1 to count lock acquisitions, contention and hold times
+LOCK_STATS:=0
+
+# Set to 1 to keep the last page allocations and frees for 'mem trace'
+MEM_TRACE:=0
 CFLAGS=-std=c11 \
        -ffreestanding \
        -nostdlib \
@@ -40,6 +46,12 @@ CFLAGS=-std=c11 \
        -D $(PLATFORM_DEBUG) \
        -D $(PLATFORM_ARCH) \
        -D PLATFORM_BITS=$(PLATFORM_BITS_VAL)
+ifeq ($(LOCK_STATS),1)
+CFLAGS += -D LOCK_STATS
+endif
+ifeq ($(MEM_TRACE),1)
+CFLAGS += -D MEM_TRACE
+endif
 CINCLUDE := $(patsubst %,-I%, $(shell find $(INCLUDE_DIR) -type d))
 
 # Tell the main makefile which files to copy to the harddisk image
@@ -78,7 +90,7 @@ $(OBJ_DIR)/%.o : $(ASOURCE_DIR)/%.asm
 # Kloader
 #
 ################################################################################
-KLOADER_CSOURCES := $(CSOURCE_DIR)/ata.c $(CSOURCE_DIR)/fat.c $(CSOURCE_DIR)/fs.c $(CSOURCE_DIR)/kloader/kloader_main.c $(CSOURCE_DIR)/mem_mgr.c $(CSOURCE_DIR)/pio.c $(CSOURCE_DIR)/screen.c $(CSOURCE_DIR)/terminal.c $(CSOURCE_DIR)/string.c $(CSOURCE_DIR)/elf.c $(CSOURCE_DIR)/pci.c
+KLOADER_CSOURCES := $(CSOURCE_DIR)/ata.c $(CSOURCE_DIR)/fat.c $(CSOURCE_DIR)/fs.c $(CSOURCE_DIR)/kloader/kloader_main.c $(CSOURCE_DIR)/mem_mgr.c $(CSOURCE_DIR)/page_alloc.c $(CSOURCE_DIR)/pio.c $(CSOURCE_DIR)/screen.c $(CSOURCE_DIR)/terminal.c $(CSOURCE_DIR)/string.c $(CSOURCE_DIR)/elf.c $(CSOURCE_DIR)/pci.c $(CSOURCE_DIR)/vfs.c $(CSOURCE_DIR)/page_cache.c $(CSOURCE_DIR)/paging.c $(CSOURCE_DIR)/mmap.c $(CSOURCE_DIR)/vmalloc.c $(CSOURCE_DIR)/arch/x86/cpu.c $(CSOURCE_DIR)/lock.c
 KLOADER_ASOURCES := $(CSOURCE_DIR)/kloader/kloader_start.asm
 
 KLOADER_OBJECTS := $(KLOADER_CSOURCES:.c=.o)
@@ -0,0 +1,152 @@
+#include <types.h>
+#include <kernel.h>
+#include <terminal.h>
+#include <string.h>
+#include <paging.h>
+#include <acpi.h>
+
+// -------------------------------------------------------------------------
+// Static Defines
+// -------------------------------------------------------------------------
+#define RSDP_SIGNATURE        "RSD PTR "
+#define RSDP_SIGNATURE_LENGTH 8
+#define RSDP_ALIGNMENT        16
+#define RSDP_CHECKSUM_LENGTH  20 // Only the ACPI 1.0 part
+
+#define EBDA_SEGMENT_POINTER  0x40E
+#define EBDA_SEARCH_LENGTH    1024
+#define BIOS_AREA_START       0xE0000
+#define BIOS_AREA_END         0x100000
+
+// -------------------------------------------------------------------------
+// Static Types
+// -------------------------------------------------------------------------
+struct PACKED rsdp {
+    char     signature[RSDP_SIGNATURE_LENGTH];
+    uint8_t  checksum;
+    char     oem_id[6];
+    uint8_t  revision;
+    uint32_t rsdt_address;
+};
+
+struct PACKED rsdt {
+    struct acpi_sdt_header header;
+    uint32_t tables[];
+};
+
+// -------------------------------------------------------------------------
+// Forward Declarations
+// -------------------------------------------------------------------------
+static struct rsdp* find_rsdp(uintptr_t start, uintptr_t end);
+static bool checksum_ok(const void* data, size_t length);
+static bool is_mapped(uintptr_t address);
+
+// -------------------------------------------------------------------------
+// Globals
+// -------------------------------------------------------------------------
+static struct rsdt* g_rsdt;
+
+// -------------------------------------------------------------------------
+// Public Contract
+// -------------------------------------------------------------------------
+bool acpi_init()
+{
+    // The RSDP is either in the first KiB of the EBDA, or in the BIOS area
+    uintptr_t ebda = (uintptr_t)(*(uint16_t*)EBDA_SEGMENT_POINTER) << 4;
+
+    struct rsdp* rsdp = NULL;
+    if(ebda != 0)
+        rsdp = find_rsdp(ebda, ebda + EBDA_SEARCH_LENGTH);
+    if(rsdp == NULL)
+        rsdp = find_rsdp(BIOS_AREA_START, BIOS_AREA_END);
+
+    if(rsdp == NULL) {
+        KWARN("No ACPI tables");
+        return false;
+    }
+
+    // Tables handed to the user range or the kernel window aren't mapped
+    struct rsdt* rsdt = (struct rsdt*)(uintptr_t)rsdp->rsdt_address;
+    if(!is_mapped((uintptr_t)rsdt) || !checksum_ok(rsdt, rsdt->header.length)) {
+        KWARN("ACPI: Bad RSDT");
+        return false;
+    }
+
+    g_rsdt = rsdt;
+    return true;
+}
+
+struct acpi_sdt_header* acpi_find_table(const char* signature)
+{
+    if(g_rsdt == NULL)
+        return NULL;
+
+    size_t count = (g_rsdt->header.length - sizeof(struct acpi_sdt_header)) / sizeof(uint32_t);
+    for(size_t i = 0; i < count; i++) {
+        struct acpi_sdt_header* table = (struct acpi_sdt_header*)(uintptr_t)g_rsdt->tables[i];
+        if(!is_mapped((uintptr_t)table))
+            continue;
+
+        if(!kstrcmp_n(table->signature, signature, ACPI_SIGNATURE_LENGTH))
+            continue;
+
+        if(!checksum_ok(table, table->length)) {
+            KWARN("ACPI: Table with a bad checksum");
+            return NULL;
+        }
+
+        return table;
+    }
+
+    return NULL;
+}
+
+struct acpi_madt_entry* acpi_madt_next(struct acpi_madt* madt, struct acpi_madt_entry* entry)
+{
+    uintptr_t end = (uintptr_t)madt + madt->header.length;
+    uintptr_t next = entry == NULL
+        ? (uintptr_t)(madt + 1)
+        : (uintptr_t)entry + entry->length;
+
+    // A zero length entry would have us spinning forever
+    if(next + sizeof(struct acpi_madt_entry) > end)
+        return NULL;
+
+    struct acpi_madt_entry* result = (struct acpi_madt_entry*)next;
+    if(result->length < sizeof(struct acpi_madt_entry) || next + result->length > end)
+        return NULL;
+
+    return result;
+}
+
+// -------------------------------------------------------------------------
+// Static Functions
+// -------------------------------------------------------------------------
+static struct rsdp* find_rsdp(uintptr_t start, uintptr_t end)
+{
+    for(uintptr_t address = start; address + sizeof(struct rsdp) <= end; address += RSDP_ALIGNMENT) {
+        struct rsdp* rsdp = (struct rsdp*)address;
+
+        if(kstrcmp_n(rsdp->signature, RSDP_SIGNATURE, RSDP_SIGNATURE_LENGTH) &&
+                checksum_ok(rsdp, RSDP_CHECKSUM_LENGTH))
+            return rsdp;
+    }
+
+    return NULL;
+}
+
+static bool checksum_ok(const void* data, size_t length)
+{
+    const uint8_t* bytes = data;
+
+    uint8_t sum = 0;
+    for(size_t i = 0; i < length; i++)
+        sum += bytes[i];
+
+    return sum == 0;
+}
+
+static bool is_mapped(uintptr_t address)
+{
+    return address != 0 && (address < PAGING_USER_START || address >= PAGING_WINDOW_END);
+}
@@ -0,0 +1,213 @@
+#include <types.h>
+#include <kernel.h>
+#include <terminal.h>
+#include <interrupt.h>
+#include <pit.h>
+#include <apic.h>
+#include <arch/x86/cpu.h>
+
+// -------------------------------------------------------------------------
+// Static Defines
+// -------------------------------------------------------------------------
+#define APIC_BASE_ENABLE (1 << 11)
+#define APIC_BASE_ADDRESS_MASK 0xFFFFF000
+
+#define SIVR_ENABLE (1 << 8)
+
+#define LVT_MASKED (1 << 16)
+#define LVT_TIMER_ONESHOT (0 << 17)
+#define LVT_TIMER_PERIODIC (1 << 17)
+
+#define ICR_DELIVERY_FIXED   (0 << 8)
+#define ICR_DELIVERY_INIT    (5 << 8)
+#define ICR_DELIVERY_STARTUP (6 << 8)
+#define ICR_PENDING          (1 << 12)
+#define ICR_LEVEL_ASSERT     (1 << 14)
+#define ICR_ALL_BUT_SELF     (3 << 18)
+#define ICR_DESTINATION_SHIFT 24
+
+#define TIMER_DIVIDE_16 0x3
+#define CALIBRATION_MS 10
+
+// -------------------------------------------------------------------------
+// Forward Declarations
+// -------------------------------------------------------------------------
+static void isr_apic_timer(uint8_t irq, struct irq_regs* regs);
+static void isr_spurious(uint8_t irq, struct irq_regs* regs);
+static uint32_t ns_to_count(uint64_t ns);
+static void send_icr(uint32_t apic_id, uint32_t command);
+
+// -------------------------------------------------------------------------
+// Globals
+// -------------------------------------------------------------------------
+static volatile uint32_t* g_apic;
+static uint32_t g_timer_ticks_per_ms;
+static apic_timer_handler g_timer_handler;
+
+// -------------------------------------------------------------------------
+// Public Contract
+// -------------------------------------------------------------------------
+bool apic_init()
+{
+    if(!cpu_has_feature(cpu_feature_apic) || !cpu_has_feature(cpu_feature_msr)) {
+        KWARN("No local APIC");
+        return false;
+    }
+
+    // The BIOS may have moved it, so ask rather than assume APIC_MEM_BASE
+    uint64_t base = cpu_read_msr(CPU_MSR_APIC_BASE);
+    cpu_write_msr(CPU_MSR_APIC_BASE, base | APIC_BASE_ENABLE);
+    g_apic = (volatile uint32_t*)(uintptr_t)(base & APIC_BASE_ADDRESS_MASK);
+
+    interrupt_receive(APIC_SPURIOUS_VECTOR, isr_spurious);
+
+    // LINT0/1 are left as the BIOS set them up, so the PIC keeps working
+    apic_write(APIC_REG_TPR_OFFSET, 0);
+    apic_write(APIC_REG_SIVR_OFFSET, SIVR_ENABLE | APIC_SPURIOUS_VECTOR);
+
+    return true;
+}
+
+bool apic_is_enabled()
+{
+    return g_apic != NULL;
+}
+
+uint32_t apic_read(uint32_t offset)
+{
+    return g_apic[offset / sizeof(uint32_t)];
+}
+
+void apic_write(uint32_t offset, uint32_t value)
+{
+    g_apic[offset / sizeof(uint32_t)] = value;
+}
+
+void apic_send_eoi()
+{
+    apic_write(APIC_REG_EOI_OFFSET, 0);
+}
+
+uint32_t apic_get_id()
+{
+    return apic_read(APIC_REG_ID_OFFSET) >> 24;
+}
+
+void apic_send_ipi(uint32_t apic_id, uint8_t vector)
+{
+    send_icr(apic_id, ICR_DELIVERY_FIXED | ICR_LEVEL_ASSERT | vector);
+}
+
+void apic_send_ipi_all_but_self(uint8_t vector)
+{
+    send_icr(0, ICR_ALL_BUT_SELF | ICR_DELIVERY_FIXED | ICR_LEVEL_ASSERT | vector);
+}
+
+void apic_send_init(uint32_t apic_id)
+{
+    send_icr(apic_id, ICR_DELIVERY_INIT | ICR_LEVEL_ASSERT);
+}
+
+void apic_send_startup(uint32_t apic_id, uintptr_t address)
+{
+    // The vector is the page the CPU starts executing at in real mode
+    send_icr(apic_id, ICR_DELIVERY_STARTUP | ICR_LEVEL_ASSERT | ((address >> 12) & 0xFF));
+}
+
+bool apic_timer_init(apic_timer_handler handler)
+{
+    if(!apic_is_enabled())
+        return false;
+
+    // Count down from the top for a while, the PIT tells us how long
+    apic_write(APIC_REG_TMR_DCR_OFFSET, TIMER_DIVIDE_16);
+    apic_write(APIC_REG_LVT_TIMER_OFFSET, LVT_MASKED | APIC_TIMER_VECTOR);
+    apic_write(APIC_REG_TMR_ICR_OFFSET, 0xFFFFFFFF);
+
+    pit_spin_ms(CALIBRATION_MS);
+
+    uint32_t elapsed = 0xFFFFFFFF - apic_read(APIC_REG_TMR_CCR_OFFSET);
+    apic_write(APIC_REG_TMR_ICR_OFFSET, 0);
+
+    g_timer_ticks_per_ms = elapsed / CALIBRATION_MS;
+    if(g_timer_ticks_per_ms == 0) {
+        KERROR("APIC timer calibration failed");
+        return false;
+    }
+
+    g_timer_handler = handler;
+    interrupt_receive(APIC_TIMER_VECTOR, isr_apic_timer);
+
+    terminal_write_string("APIC timer runs at ");
+    terminal_write_uint32(g_timer_ticks_per_ms);
+    terminal_write_string(" ticks/ms\n");
+
+    return true;
+}
+
+void apic_timer_oneshot_ns(uint64_t ns)
+{
+    apic_write(APIC_REG_LVT_TIMER_OFFSET, LVT_TIMER_ONESHOT | APIC_TIMER_VECTOR);
+    apic_write(APIC_REG_TMR_ICR_OFFSET, ns_to_count(ns));
+}
+
+void apic_timer_periodic_ns(uint64_t ns)
+{
+    apic_write(APIC_REG_LVT_TIMER_OFFSET, LVT_TIMER_PERIODIC | APIC_TIMER_VECTOR);
+    apic_write(APIC_REG_TMR_ICR_OFFSET, ns_to_count(ns));
+}
+
+void apic_timer_stop()
+{
+    // Writing 0 stops the count without raising an interrupt
+    apic_write(APIC_REG_TMR_ICR_OFFSET, 0);
+    apic_write(APIC_REG_LVT_TIMER_OFFSET, LVT_MASKED | APIC_TIMER_VECTOR);
+}
+
+// -------------------------------------------------------------------------
+// Static Functions
+// -------------------------------------------------------------------------
+static uint32_t ns_to_count(uint64_t ns)
+{
+    // Anything too far out fires early, whoever set it just re-arms
+    uint32_t max_ms = 0xFFFFFFFF / g_timer_ticks_per_ms;
+    if(ns >= (uint64_t)max_ms * 1000000)
+        return 0xFFFFFFFF;
+
+    uint32_t count = (uint32_t)cpu_div_u64(ns * g_timer_ticks_per_ms, 1000000, NULL);
+
+    // A count of 0 would never fire
+    return count > 0 ? count : 1;
+}
+
+static void send_icr(uint32_t apic_id, uint32_t command)
+{
+    // Writing the low half sends it, so the destination goes first. The
+    // ICR is shared by everything on this CPU, interrupts included.
+    uint32_t flags = cpu_irq_save();
+
+    while(apic_read(APIC_REG_ICR0_OFFSET) & ICR_PENDING) {
+        // Wait for the last one to be delivered
+    }
+
+    apic_write(APIC_REG_ICR1_OFFSET, apic_id << ICR_DESTINATION_SHIFT);
+    apic_write(APIC_REG_ICR0_OFFSET, command);
+
+    while(apic_read(APIC_REG_ICR0_OFFSET) & ICR_PENDING) {
+    }
+
+    cpu_irq_restore(flags);
+}
+
+static void isr_apic_timer(uint8_t irq, struct irq_regs* regs)
+{
+    apic_send_eoi();
+
+    if(g_timer_handler != NULL)
+        g_timer_handler();
+}
+
+static void isr_spurious(uint8_t irq, struct irq_regs* regs)
+{
+    // Spurious interrupts must not be acknowledged
+}
@@ -1,5 +1,78 @@
+#include <types.h>
+#include <arch/x86/cpu.h>
+
 void cpu_reset()
 {
     __asm("mov $0xFE, %al;"
           "out %al, $0x64;");
 }
+
+void cpu_cpuid(uint32_t leaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx)
+{
+    __asm("cpuid"
+          : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+          : "a"(leaf), "c"(0));
+}
+
+bool cpu_has_feature(enum cpu_feature feature)
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpu_cpuid(1, &eax, &ebx, &ecx, &edx);
+
+    return (edx & feature) == feature;
+}
+
+uint64_t cpu_read_tsc()
+{
+    uint32_t low, high;
+    __asm volatile("rdtsc" : "=a"(low), "=d"(high));
+
+    return ((uint64_t)high << 32) | low;
+}
+
+uint64_t cpu_read_msr(uint32_t msr)
+{
+    uint32_t low, high;
+    __asm volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+
+    return ((uint64_t)high << 32) | low;
+}
+
+void cpu_write_msr(uint32_t msr, uint64_t value)
+{
+    __asm volatile("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+uint32_t cpu_irq_save()
+{
+    uint32_t flags;
+    __asm volatile("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+
+    return flags;
+}
+
+void cpu_irq_restore(uint32_t flags)
+{
+    if(flags & CPU_EFLAGS_IF)
+        __asm volatile("sti" : : : "memory");
+}
+
+uint64_t cpu_div_u64(uint64_t dividend, uint32_t divisor, uint32_t* remainder)
+{
+    uint32_t high = (uint32_t)(dividend >> 32);
+    uint32_t low = (uint32_t)dividend;
+
+    // Divide the high half first so the second DIV can't overflow
+    uint32_t quotient_high = high / divisor;
+    uint32_t rest = high % divisor;
+    uint32_t quotient_low;
+
+    __asm("divl %4"
+          : "=a"(quotient_low), "=d"(rest)
+          : "a"(low), "d"(rest), "rm"(divisor));
+
+    if(remainder != NULL)
+        *remainder = rest;
+
+    return ((uint64_t)quotient_high << 32) | quotient_low;
+}
@@ -0,0 +1,172 @@
+#include <types.h>
+#include <kernel.h>
+#include <terminal.h>
+#include <interrupt.h>
+#include <thread.h>
+#include <smp.h>
+#include <arch/x86/cpu.h>
+#include <arch/x86/fpu.h>
+
+// -------------------------------------------------------------------------
+// Static Defines
+// -------------------------------------------------------------------------
+#define CR0_MP          (1 << 1)    // WAIT traps too while TS is set
+#define CR0_EM          (1 << 2)    // No FPU, everything traps
+#define CR0_TS          (1 << 3)    // Set on a task switch, the next use traps
+#define CR0_NE          (1 << 5)    // Report errors through #MF, not the PIC
+
+#define CR4_OSFXSR      (1 << 9)    // We FXSAVE, SSE instructions are allowed
+#define CR4_OSXMMEXCPT  (1 << 10)   // And handle #XM
+
+#define MXCSR_DEFAULT   0x1F80      // Every exception masked
+
+#define VECTOR_NM       0x07
+#define VECTOR_MF       0x10
+#define VECTOR_XM       0x13
+
+// -------------------------------------------------------------------------
+// Forward Declarations
+// -------------------------------------------------------------------------
+static void device_not_available(uint8_t irq, struct irq_regs* regs);
+static void floating_point_error(uint8_t irq, struct irq_regs* regs);
+static void set_ts();
+static void clear_ts();
+
+// -------------------------------------------------------------------------
+// Globals
+// -------------------------------------------------------------------------
+static bool g_enabled;
+
+// -------------------------------------------------------------------------
+// Public Contract
+// -------------------------------------------------------------------------
+void fpu_init()
+{
+    if(!cpu_has_feature(cpu_feature_fxsr) || !cpu_has_feature(cpu_feature_sse)) {
+        KWARN("No FXSAVE or SSE, the FPU is off limits");
+        return;
+    }
+
+    g_enabled = true;
+
+    // An interrupt gate, a thread mustn't be switched away from half way
+    // through loading its state
+    interrupt_receive(VECTOR_NM, device_not_available);
+    interrupt_receive_trap(VECTOR_MF, floating_point_error);
+    interrupt_receive_trap(VECTOR_XM, floating_point_error);
+
+    fpu_init_cpu();
+}
+
+void fpu_init_cpu()
+{
+    uint32_t cr0, cr4;
+    __asm("mov %%cr0, %0" : "=r"(cr0));
+    __asm("mov %%cr4, %0" : "=r"(cr4));
+
+    // Without FXSAVE any use traps, and there's nothing to handle it
+    if(!g_enabled) {
+        cr0 |= CR0_EM;
+        __asm("mov %0, %%cr0" : : "r"(cr0));
+        return;
+    }
+
+    cr0 = (cr0 & ~CR0_EM) | CR0_MP | CR0_NE | CR0_TS;
+    cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+
+    __asm("mov %0, %%cr4" : : "r"(cr4));
+    __asm("mov %0, %%cr0" : : "r"(cr0));
+}
+
+void fpu_switch_out(struct thread* prev)
+{
+    struct cpu* cpu = smp_cpu();
+    if(!cpu->fpu_active)
+        return;
+
+    // The registers keep holding it, so if it comes back here before
+    // anyone else used the FPU it doesn't even need loading again
+    if(prev->state != thread_state_dead)
+        __asm volatile("fxsave (%0)" : : "r"(prev->fpu_state) : "memory");
+
+    cpu->fpu_active = false;
+    set_ts();
+}
+
+uint32_t fpu_begin()
+{
+    uint32_t flags = cpu_irq_save();
+    struct cpu* cpu = smp_cpu();
+
+    // Whoever was using it gets it back through the usual trap
+    if(cpu->fpu_active) {
+        __asm volatile("fxsave (%0)" : : "r"(cpu->current->fpu_state) : "memory");
+        cpu->fpu_active = false;
+    }
+
+    cpu->fpu_owner = NULL;
+    clear_ts();
+
+    return flags;
+}
+
+void fpu_end(uint32_t flags)
+{
+    set_ts();
+    cpu_irq_restore(flags);
+}
+
+// -------------------------------------------------------------------------
+// Static Functions
+// -------------------------------------------------------------------------
+static void device_not_available(uint8_t irq, struct irq_regs* regs)
+{
+    if(!g_enabled)
+        KPANIC("FPU used without FXSAVE support");
+
+    struct cpu* cpu = smp_cpu();
+    struct thread* thread = cpu->current;
+    if(thread == NULL)
+        KPANIC("FPU used before there were threads");
+
+    clear_ts();
+    cpu->fpu_active = true;
+
+    // Still in the registers from the last time it ran here
+    if(thread->fpu_used && cpu->fpu_owner == thread && thread->fpu_cpu == cpu->index)
+        return;
+
+    if(thread->fpu_used) {
+        __asm volatile("fxrstor (%0)" : : "r"(thread->fpu_state) : "memory");
+    }
+    else {
+        uint32_t mxcsr = MXCSR_DEFAULT;
+        __asm volatile("fninit; ldmxcsr %0" : : "m"(mxcsr));
+        thread->fpu_used = true;
+    }
+
+    cpu->fpu_owner = thread;
+    thread->fpu_cpu = cpu->index;
+}
+
+static void floating_point_error(uint8_t irq, struct irq_regs* regs)
+{
+    // Only user mode gets to unmask exceptions
+    if((regs->cs & 3) == 0)
+        KPANIC("FPU exception in the kernel");
+
+    KERROR("Unhandled FPU exception, killing the thread");
+    thread_exit();
+}
+
+static void set_ts()
+{
+    uint32_t cr0;
+    __asm("mov %%cr0, %0" : "=r"(cr0));
+    __asm("mov %0, %%cr0" : : "r"(cr0 | CR0_TS));
+}
+
+static void clear_ts()
+{
+    __asm("clts");
+}
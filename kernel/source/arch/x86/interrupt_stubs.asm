@@ -0,0 +1,94 @@
+;*******************************************************************************
+;
+;  Entry stubs for all 256 vectors. Each one makes the stack look the same,
+;  pushing a zero where the CPU didn't push an error code, then the vector,
+;  and heads into the common path. That saves the rest of the trap frame
+;  (struct irq_regs in interrupt.h) and calls interrupt_dispatch.
+;
+;*******************************************************************************
+KERNEL_DATA_SEGMENT         EQU 0x10    ; KERNEL_DATA_SEGMENT in mem_mgr.h
+
+;*******************************************************************************
+; Directives
+;*******************************************************************************
+[section .text]
+
+global interrupt_stub_table
+global interrupt_return
+
+extern interrupt_dispatch
+
+;*******************************************************************************
+; Stubs
+;*******************************************************************************
+; Exceptions 8, 10-14, 17, 21, 29 and 30 come with an error code already
+%assign vector 0
+%rep 256
+interrupt_stub_ %+ vector:
+%if vector == 8 || (vector >= 10 && vector <= 14) || vector == 17 || vector == 21 || vector == 29 || vector == 30
+    push dword vector
+%else
+    push byte 0
+    push dword vector
+%endif
+    jmp interrupt_common
+%assign vector vector + 1
+%endrep
+
+interrupt_common:
+    pusha
+    push ds
+    push es
+    push fs
+    push gs
+
+    ; We may have come from user mode, the kernel wants its own segments.
+    ; The user's are restored on the way out.
+    mov eax, KERNEL_DATA_SEGMENT
+    mov ds, eax
+    mov es, eax
+
+    ; Nothing clears the direction flag on the way in, and the string
+    ; instructions in memcpy and friends count on it being clear. IRET
+    ; restores the interrupted code's.
+    cld
+
+    ; The frame is the only argument
+    push esp
+    call interrupt_dispatch
+    add esp, 4
+
+interrupt_exit:
+    pop gs
+    pop fs
+    pop es
+    pop ds
+    popa
+
+    ; Vector and error code
+    add esp, 8
+    iret
+
+; void interrupt_return(struct irq_regs* frame)
+;
+; Leaves through the exit path with a frame we built ourselves, which is
+; how we get into user mode for the first time
+interrupt_return:
+    mov esp, [esp + 4]
+    jmp interrupt_exit
+
+;*******************************************************************************
+; Variables
+;*******************************************************************************
+[section .rodata]
+
+align 4
+interrupt_stub_table:
+%assign vector 0
+%rep 256
+    dd interrupt_stub_ %+ vector
+%assign vector vector + 1
+%endrep
+
+; NASM Syntax
+; vim: ft=nasm expandtab
@@ -0,0 +1,111 @@
+;*******************************************************************************
+;
+;  Application processor startup code. The SIPI starts the CPU in real mode
+;  at SMP_TRAMPOLINE_ADDRESS, smp.c copies this there and fills in the data
+;  block at the end before each CPU is started.
+;
+;*******************************************************************************
+TRAMPOLINE_ADDRESS          EQU 0x6000  ; SMP_TRAMPOLINE_ADDRESS in smp.h
+CODE_SEGMENT                EQU 0x08
+DATA_SEGMENT                EQU 0x10
+CR0_PE                      EQU 0x01
+
+; Where a label ends up once the code has been copied
+%define ADDRESS(label) (TRAMPOLINE_ADDRESS + (label) - smp_trampoline_start)
+
+;*******************************************************************************
+; Directives
+;*******************************************************************************
+[section .text]
+
+global smp_trampoline_start
+global smp_trampoline_data
+global smp_trampoline_end
+
+;*******************************************************************************
+; Entry point
+;*******************************************************************************
+bits 16
+smp_trampoline_start:
+    cli
+    cld
+
+    xor ax, ax
+    mov ds, ax
+
+    ; Same flat segments as the kernel GDT, the CPU loads its own later on
+    lgdt [ADDRESS(gdt_descriptor)]
+
+    mov eax, cr0
+    or eax, CR0_PE
+    mov cr0, eax
+
+    jmp dword CODE_SEGMENT:ADDRESS(protected_mode)
+
+bits 32
+protected_mode:
+    mov eax, DATA_SEGMENT
+    mov ds, eax
+    mov es, eax
+    mov fs, eax
+    mov gs, eax
+    mov ss, eax
+
+    ; Paging the way the boot CPU has it, the kernel is identity mapped so
+    ; we keep running right where we are
+    mov eax, [ADDRESS(smp_trampoline_data.cr4)]
+    mov cr4, eax
+    mov eax, [ADDRESS(smp_trampoline_data.cr3)]
+    mov cr3, eax
+    mov eax, [ADDRESS(smp_trampoline_data.cr0)]
+    mov cr0, eax
+
+    mov esp, [ADDRESS(smp_trampoline_data.stack)]
+
+    ; The CPU index is the only argument, there's nothing to return to
+    push dword [ADDRESS(smp_trampoline_data.cpu)]
+    push dword 0
+
+    jmp [ADDRESS(smp_trampoline_data.entry)]
+
+;*******************************************************************************
+; Variables
+;*******************************************************************************
+align 8
+gdt:
+	.null:
+		dq              0
+	.code:
+		dw 				0xFFFF 		; limit 0:15
+		dw 				0 			; base 0:15
+		db 				0 			; base 16:23
+		db 				0x9A		; access bytes
+		db 				0xCF		; limit & flags
+		db 				0 			; base 24:31
+	.data:
+		dw 				0xFFFF 		; limit 0:15
+		dw 				0 			; base 0:15
+		db 				0 			; base 16:23
+		db 				0x92		; access bytes
+		db 				0xCF		; limit & flags
+		db 				0 			; base 24:31
+.end:
+
+gdt_descriptor:
+		dw 				gdt.end - gdt - 1
+		dd              ADDRESS(gdt)
+
+; Matches struct trampoline_data in smp.c
+align 4
+smp_trampoline_data:
+    .cr0                    dd 0
+    .cr3                    dd 0
+    .cr4                    dd 0
+    .stack                  dd 0
+    .entry                  dd 0
+    .cpu                    dd 0
+
+smp_trampoline_end:
+
+; NASM Syntax
+; vim: ft=nasm expandtab
@@ -0,0 +1,100 @@
+;*******************************************************************************
+;
+;  SYSENTER entry. All the CPU gives us is CS, EIP and ESP from the MSRs,
+;  with interrupts off. ESP points at TSS.ESP0 of this CPU rather than at
+;  a stack, since that changes with every thread switch. The caller left
+;  its stack in ECX and where to continue in EDX.
+;
+;  We build the same frame an int 0x80 gets (struct irq_regs in
+;  interrupt.h), so syscall_handle can't tell the two apart, and leave with
+;  SYSEXIT instead of IRET.
+;
+;*******************************************************************************
+KERNEL_DATA_SEGMENT         EQU 0x10    ; These three are in mem_mgr.h
+USER_CODE_SEGMENT           EQU 0x1B
+USER_DATA_SEGMENT           EQU 0x23
+SYSCALL_VECTOR              EQU 0x80    ; syscall.h
+EFLAGS_TF                   EQU 0x100
+EFLAGS_IF                   EQU 0x200
+EFLAGS_NT                   EQU 0x4000
+
+;*******************************************************************************
+; Directives
+;*******************************************************************************
+[section .text]
+
+global syscall_sysenter_entry
+
+extern syscall_handle
+
+;*******************************************************************************
+; Entry
+;*******************************************************************************
+syscall_sysenter_entry:
+    mov esp, [esp]
+
+    ; SYSENTER only clears IF and VM, TF, NT, AC and DF are still the
+    ; user's. Switch to clean flags straight away, the way an interrupt
+    ; gate would, so a trap flag set by the user can't single step the
+    ; kernel. Bit 1 is always set.
+    pushfd
+    push dword 2
+    popfd
+
+    ; What the CPU would have pushed for an interrupt from ring 3, the
+    ; user's flags go where the stack segment belongs for now. The caller
+    ; had interrupts on, SYSENTER is what cleared them. There's no debug
+    ; handler and no task switching, so TF and NT don't go back.
+    push ecx
+    push dword [esp + 4]
+    mov dword [esp + 8], USER_DATA_SEGMENT
+    or dword [esp], EFLAGS_IF
+    and dword [esp], ~(EFLAGS_TF | EFLAGS_NT)
+    push dword USER_CODE_SEGMENT
+    push edx
+
+    push byte 0
+    push dword SYSCALL_VECTOR
+    pusha
+    push ds
+    push es
+    push fs
+    push gs
+
+    ; EAX is the syscall number, but it's saved in the frame by now
+    mov eax, KERNEL_DATA_SEGMENT
+    mov ds, eax
+    mov es, eax
+
+    sti
+
+    push esp
+    call syscall_handle
+    add esp, 4
+
+    cli
+
+    pop gs
+    pop fs
+    pop es
+    pop ds
+    popa
+
+    ; Vector and error code
+    add esp, 8
+
+    ; SYSEXIT wants EIP in EDX and ESP in ECX, the rest is its own. The
+    ; flags go back with interrupts still off, STI holds them off for one
+    ; more instruction so nothing can come in on this stack half unwound.
+    pop edx
+    add esp, 4
+    and dword [esp], ~EFLAGS_IF
+    popfd
+    pop ecx
+    add esp, 4
+
+    sti
+    sysexit
+
+; NASM Syntax
+; vim: ft=nasm expandtab
@@ -5,6 +5,15 @@
 #include <ata.h>
 #include <terminal.h>
 #include <pci.h>
+#include <lock.h>
+
+// -------------------------------------------------------------------------
+// Static Defines
+// -------------------------------------------------------------------------
+
+// Sectors moved per poll, about a page, so interrupts are never off for
+// longer than that
+#define ATA_POLL_SECTORS 8
 
 // -------------------------------------------------------------------------
 // Static Types
@@ -16,23 +25,31 @@ struct ata_channel {
     uint8_t nIEN;
 };
 
-enum ready_result {
-    ready_result_ready,
-    ready_result_df,
-    ready_result_err,
-};
-
 // -------------------------------------------------------------------------
 // Globals
 // -------------------------------------------------------------------------
 struct ata_channel g_channels[2];
 
+// The request the drive is currently working on, if any. It owns the
+// channel until it's finished, but anyone may move it along.
+static struct ata_request* g_pending;
+
+// Guards the task file registers and g_pending. Only ever held for a few
+// sectors' worth of port I/O, never while waiting on the drive, so a
+// thread that's preempted can't leave everyone else spinning behind it.
+// Ticketed so every waiter gets its turn at moving the drive along.
+static struct ticket_lock g_lock = TICKET_LOCK_INIT("ata");
+
 // -------------------------------------------------------------------------
 // Forward Declarations
 // -------------------------------------------------------------------------
 void select_drive(enum ata_controller controller, enum ata_drive drive);
 static void wait_400ns(enum ata_controller controller);
-static enum ready_result wait_until_ready(enum ata_controller controller);
+static bool submit_request(struct ata_request* request, enum ata_cmd cmd, bool wait);
+static bool transfer(uint32_t lba, uint8_t sector_count, uintptr_t buffer, bool write);
+static void issue_command(uint32_t lba, uint8_t sector_count, enum ata_cmd cmd);
+static void finish_request(struct ata_request* request, enum ata_request_state state);
+static bool poll_request(struct ata_request* request);
 
 // -------------------------------------------------------------------------
 // Externs
@@ -78,42 +95,43 @@ void ata_write(enum ata_controller controller, enum ata_register port, uint8_t v
 // sector_count of 0 means 256 sectors, 1-255 mean what they say
 bool ata_read_sectors(uint32_t lba, uint8_t sector_count, uintptr_t buffer)
 {
-    uint16_t* data = (uint16_t*)(buffer);
-
-    enum ata_drive drive = ata_drive_master;
-    // Structure of the drive_head register as it pertains to LBA is
-    // 7   6   5   4    |    3  2   1   0
-    // 1  LBA  1 Drive  | High 4 Bits of LBA
-    ata_write(ata_controller_primary, ata_register_drive_head, 0xE0 | (drive << 4) | ((lba >> 24) & 0x0F));
-
-    //  Send a NULL byte to port 0x1F1, if you like (it is ignored and wastes lots of CPU time): outb(0x1F1, 0x00)
-    ata_write(ata_controller_primary, ata_register_feat_err,  0x00);
+    return transfer(lba, sector_count, buffer, false);
+}
 
-    ata_write(ata_controller_primary, ata_register_sector_count, sector_count);
+// Same sector_count semantics as ata_read_sectors. Only returns once the
+// data actually hit the platters.
+bool ata_write_sectors(uint32_t lba, uint8_t sector_count, uintptr_t buffer)
+{
+    return transfer(lba, sector_count, buffer, true);
+}
 
-    ata_write(ata_controller_primary, ata_register_lba_low, (uint8_t)(lba));
-    ata_write(ata_controller_primary, ata_register_lba_mid, (uint8_t)(lba >> 8));
-    ata_write(ata_controller_primary, ata_register_lba_high, (uint8_t)(lba >> 16));
+bool ata_read_async(struct ata_request* request)
+{
+    request->write = false;
+    return submit_request(request, ata_cmd_read_sectors, false);
+}
 
-    ata_write(ata_controller_primary, ata_register_cmd_status, ata_cmd_read_sectors);
+// Moves whatever sectors the drive has ready into the request without
+// ever blocking, returns true once the request has finished
+bool ata_request_poll(struct ata_request* request)
+{
+    uint32_t flags = ticket_lock_lock_irqsave(&g_lock);
 
-    for (int sector = 0; sector < sector_count; sector++) {
+    // Someone else may have finished it for us
+    bool finished = request != g_pending ? request->state != ata_request_busy : poll_request(request);
 
-        // Wait for the sector to be read by the controller
-        if (ready_result_ready != wait_until_ready(ata_controller_primary)) {
-            KERROR("Polling ATA Status returned an error condition");
-            return false;
-        }
+    ticket_lock_unlock_irqrestore(&g_lock, flags);
+    return finished;
+}
 
-        // Read the 512 bytes comprising the sector data
-        for(int i = 0; i < 256; i++) {
-            *data++ = ata_read_data(ata_controller_primary);
-        }
+bool ata_request_wait(struct ata_request* request)
+{
+    while(!ata_request_poll(request)) {
+        // The drive has the next sector on its way
+        __asm("pause");
     }
 
-    wait_400ns(ata_controller_primary);
-
-    return true;
+    return request->state == ata_request_done;
 }
 
 void select_drive(enum ata_controller controller, enum ata_drive drive)
@@ -192,33 +210,152 @@ static void wait_400ns(enum ata_controller controller)
     ata_read(controller, ata_register_cmd_status);
 }
 
-static enum ready_result wait_until_ready(enum ata_controller controller)
+// Hands the request to the drive once it's done with the one before, or
+// gives up straight away if wait is false and it isn't yet
+static bool submit_request(struct ata_request* request, enum ata_cmd cmd, bool wait)
 {
-    uint8_t status;
+    if(request->sector_count == 0 || request->sector_count > 256 ||
+       request->sectors_per_buffer == 0 ||
+       request->sector_count > request->sectors_per_buffer * ATA_REQUEST_MAX_BUFFERS) {
+        KWARN("Invalid ATA request");
+        return false;
+    }
+
+    request->sectors_done = 0;
+    request->flushing = false;
+    request->state = ata_request_busy;
 
-    for (;;) {
-        status = ata_read(controller, ata_register_cmd_status);
+    for(;;) {
+        uint32_t flags = ticket_lock_lock_irqsave(&g_lock);
 
-        // We're not really sure about this yet, the info we've read so
-        // far is ambiguous about whether the busy flag is cleared when
-        // there is an error, so just check the error conditions.
-        if ((status & ata_status_error) == ata_status_error) {
-            return ready_result_err;
+        // The drive only does one thing at a time, help whatever it's on
+        // along rather than wait for its owner to get around to it
+        if(g_pending != NULL)
+            poll_request(g_pending);
+
+        bool issued = g_pending == NULL;
+        if(issued) {
+            // 256 is sent as 0, which the drive reads as 256
+            issue_command(request->lba, (uint8_t)request->sector_count, cmd);
+            g_pending = request;
         }
 
-        if ((status & ata_status_df) == ata_status_df) {
-            return ready_result_df;
+        ticket_lock_unlock_irqrestore(&g_lock, flags);
+
+        if(issued || !wait)
+            return issued;
+
+        __asm("pause");
+    }
+}
+
+static bool transfer(uint32_t lba, uint8_t sector_count, uintptr_t buffer, bool write)
+{
+    struct ata_request request = {
+        .lba = lba,
+        .sector_count = sector_count != 0 ? sector_count : 256,
+        .write = write
+    };
+    request.sectors_per_buffer = request.sector_count;
+    request.buffers[0] = buffer;
+
+    if(!submit_request(&request, write ? ata_cmd_write_sectors : ata_cmd_read_sectors, true))
+        return false;
+
+    return ata_request_wait(&request);
+}
+
+static void issue_command(uint32_t lba, uint8_t sector_count, enum ata_cmd cmd)
+{
+    enum ata_drive drive = ata_drive_master;
+    // Structure of the drive_head register as it pertains to LBA is
+    // 7   6   5   4    |    3  2   1   0
+    // 1  LBA  1 Drive  | High 4 Bits of LBA
+    ata_write(ata_controller_primary, ata_register_drive_head, 0xE0 | (drive << 4) | ((lba >> 24) & 0x0F));
+
+    //  Send a NULL byte to port 0x1F1, if you like (it is ignored and wastes lots of CPU time): outb(0x1F1, 0x00)
+    ata_write(ata_controller_primary, ata_register_feat_err,  0x00);
+
+    ata_write(ata_controller_primary, ata_register_sector_count, sector_count);
+
+    ata_write(ata_controller_primary, ata_register_lba_low, (uint8_t)(lba));
+    ata_write(ata_controller_primary, ata_register_lba_mid, (uint8_t)(lba >> 8));
+    ata_write(ata_controller_primary, ata_register_lba_high, (uint8_t)(lba >> 16));
+
+    ata_write(ata_controller_primary, ata_register_cmd_status, cmd);
+}
+
+static void finish_request(struct ata_request* request, enum ata_request_state state)
+{
+    if(g_pending == request)
+        g_pending = NULL;
+
+    // Its owner may return and drop it from its stack as soon as it sees
+    // this, so it's the last thing we touch
+    __atomic_store_n(&request->state, state, __ATOMIC_RELEASE);
+}
+
+// Called with the lock held, moves at most ATA_POLL_SECTORS sectors
+static bool poll_request(struct ata_request* request)
+{
+    for(uint32_t moved = 0; moved < ATA_POLL_SECTORS; moved++) {
+        if(request->state != ata_request_busy)
+            return true;
+
+        uint8_t status = ata_read(ata_controller_primary, ata_register_cmd_status);
+
+        // Still seeking, filling its buffer or writing, the other bits
+        // mean nothing until it's done
+        if((status & ata_status_busy) == ata_status_busy)
+            return false;
+
+        if((status & ata_status_error) == ata_status_error ||
+           (status & ata_status_df) == ata_status_df) {
+            KERROR(request->write ? "ATA write request failed" : "ATA read request failed");
+            finish_request(request, ata_request_failed);
+            return true;
         }
 
-        if ((status & ata_status_busy) == ata_status_busy) {
-            continue;
+        // Only writes are left here, the data has to make it out of the
+        // drive's cache before we tell anyone it's written
+        if(request->sectors_done == request->sector_count) {
+            if(request->flushing) {
+                finish_request(request, ata_request_done);
+                return true;
+            }
+
+            ata_write(ata_controller_primary, ata_register_cmd_status, ata_cmd_cache_flush);
+            request->flushing = true;
+            return false;
         }
 
-        if ((status & ata_status_drq) != ata_status_drq) {
-            continue;
+        if((status & ata_status_drq) != ata_status_drq)
+            return false;
+
+        uint16_t buffer_index = request->sectors_done / request->sectors_per_buffer;
+        uint16_t sector_in_buffer = request->sectors_done % request->sectors_per_buffer;
+        uint16_t* data = (uint16_t*)(request->buffers[buffer_index] + sector_in_buffer * ATA_SECTOR_SIZE);
+
+        if(request->write) {
+            for(int i = 0; i < 256; i++) {
+                OUTW(ata_controller_primary + ata_register_data, *data++);
+            }
         }
+        else {
+            for(int i = 0; i < 256; i++) {
+                *data++ = ata_read_data(ata_controller_primary);
+            }
+        }
+
+        if(++request->sectors_done == request->sector_count) {
+            wait_400ns(ata_controller_primary);
 
-        return ready_result_ready;
+            if(!request->write) {
+                finish_request(request, ata_request_done);
+                return true;
+            }
+        }
     }
-}
 
+    return false;
+}
@@ -9,6 +9,10 @@
 #include <string.h>
 #include <fs.h>
 #include <elf.h>
+#include <wait_queue.h>
+#include <lock.h>
+#include <irq.h>
+#include <mem_mgr.h>
 
 #define MAX_COMMAND_SIZE 1024
 #define COMMAND_BUFFER_SIZE (MAX_COMMAND_SIZE + 1)
@@ -19,6 +23,7 @@
 static size_t read_line(char* buffer, size_t buffer_size);
 static void dispatch_command(char** args, size_t arg_count);
 static size_t parse_command(char* buffer, size_t buffer_size, char** args, size_t args_size);
+static uint32_t parse_number(const char* text);
 static void cli_key_up(enum keys key);
 static void cli_key_down(enum keys key);
 
@@ -26,6 +31,7 @@ static void cli_key_down(enum keys key);
 static size_t g_input_read_index;
 static size_t g_input_write_index;
 static enum keys g_input_buffer[INPUT_BUFFER_SIZE];
+static struct wait_queue g_input_waiters;
 
 static bool g_shift_pressed;
 
@@ -36,6 +42,8 @@ static struct kb_subscriber g_subscriber = {
 
 // Exports
 void cli_init() {
+    wait_queue_init(&g_input_waiters);
+
     for(size_t i = 0; i < INPUT_BUFFER_SIZE; i++) {
         g_input_buffer[i] = -1;
     }
@@ -82,14 +90,18 @@ static void cli_key_up(enum keys key)
     if(g_input_write_index == INPUT_BUFFER_SIZE) {
         g_input_write_index = 0;
     }
+
+    wait_queue_wake_all(&g_input_waiters);
 }
 
 static char read_character(bool eat)
 {
-    // do do do do do do
-    enum keys k;
-    while ((k = g_input_buffer[g_input_read_index]) == -1) {
+    // Sleep until the keyboard hands us something
+    uint32_t flags = spinlock_lock_irqsave(&g_input_waiters.lock);
+    while (g_input_buffer[g_input_read_index] == -1) {
+        wait_queue_wait(&g_input_waiters);
     }
+    spinlock_unlock_irqrestore(&g_input_waiters.lock, flags);
 
     // Take one from the buffer
     enum keys key = g_input_buffer[g_input_read_index];
@@ -193,6 +205,15 @@ static void dispatch_command(char* args[], size_t arg_count)
         }
         fs_cat(args[1]);
     }
+    else if(kstrcmp(args[0], "write")) {
+        if(arg_count < 3) {
+            KERROR("Expected a file and some text");
+            return;
+        }
+
+        if(!fs_append(args[1], args[2], strlen(args[2])) || !fs_append(args[1], "\n", 1))
+            KERROR("Failed to write file");
+    }
     else if(kstrcmp(args[0], "elf")) {
         if(arg_count < 2) {
             KERROR("Expected at least one argument");
@@ -207,13 +228,31 @@ static void dispatch_command(char* args[], size_t arg_count)
         }
         elf_run(args[1]);
     }
+    else if(kstrcmp(args[0], "irq")) {
+        if(arg_count >= 3)
+            irq_set_affinity(parse_number(args[1]), parse_number(args[2]));
+        irq_print_routes();
+    }
+    else if(kstrcmp(args[0], "locks")) {
+        lock_stats_print();
+    }
+    else if(kstrcmp(args[0], "mem")) {
+        if(arg_count >= 2 && kstrcmp(args[1], "trace"))
+            mem_print_trace();
+        else
+            mem_print_breakdown();
+    }
     else if(kstrcmp(args[0], "help")) {
         terminal_write_string("These are the things you can do!\n");
         terminal_write_string("reset - Restarts the computer\n");
         terminal_write_string("clear - Clears the screen\n");
         terminal_write_string("cat <file> - Show file content\n");
+        terminal_write_string("write <file> <text> - Adds a line to the file\n");
         terminal_write_string("elf <file  - Prints file info\n");
         terminal_write_string("run <file> - Runs the given program\n");
+        terminal_write_string("irq [<irq> <cpu>] - Shows or moves IRQs\n");
+        terminal_write_string("locks - Lock statistics\n");
+        terminal_write_string("mem [trace] - Memory use by subsystem, or the last allocations\n");
     }
     else {
         print_invalid_command(args, arg_count);
@@ -277,3 +316,13 @@ static size_t parse_command(char* buffer, size_t buffer_size, char** args, size_
 
     return arg_count;
 }
+
+// Decimal only, stops at the first thing that isn't a digit
+static uint32_t parse_number(const char* text)
+{
+    uint32_t result = 0;
+    while(*text >= '0' && *text <= '9')
+        result = result * 10 + (*text++ - '0');
+
+    return result;
+}
@@ -0,0 +1,135 @@
+#include <types.h>
+#include <kernel.h>
+#include <terminal.h>
+#include <pit.h>
+#include <clock.h>
+#include <arch/x86/cpu.h>
+
+// -------------------------------------------------------------------------
+// Static Defines
+// -------------------------------------------------------------------------
+#define CALIBRATION_MS 10
+#define CALIBRATION_RUNS 3
+
+// -------------------------------------------------------------------------
+// Forward Declarations
+// -------------------------------------------------------------------------
+static uint64_t scale(uint64_t value, uint32_t mult, uint32_t shift);
+static void calc_mult_shift(uint32_t from_khz, uint32_t to_khz, uint32_t* mult, uint32_t* shift);
+
+// -------------------------------------------------------------------------
+// Globals
+// -------------------------------------------------------------------------
+static bool g_have_tsc;
+static uint32_t g_tsc_khz;
+static uint64_t g_tsc_base;
+
+// ns = (tsc * mult) >> shift, and the other way around
+static uint32_t g_ns_mult;
+static uint32_t g_ns_shift;
+static uint32_t g_tsc_mult;
+static uint32_t g_tsc_shift;
+
+// -------------------------------------------------------------------------
+// Public Contract
+// -------------------------------------------------------------------------
+bool clock_init()
+{
+    g_have_tsc = cpu_has_feature(cpu_feature_tsc);
+    if(!g_have_tsc) {
+        KWARN("No TSC, the clock only has PIT resolution");
+        return false;
+    }
+
+    // Anything that gets in the way only makes a run longer, so keep the shortest
+    uint32_t best = UINT32_MAXVALUE;
+    for(int i = 0; i < CALIBRATION_RUNS; i++) {
+        uint64_t start = cpu_read_tsc();
+        pit_spin_ms(CALIBRATION_MS);
+        uint64_t delta = cpu_read_tsc() - start;
+
+        if(delta < best)
+            best = (uint32_t)delta;
+    }
+
+    g_tsc_khz = best / CALIBRATION_MS;
+    if(g_tsc_khz == 0) {
+        KERROR("TSC calibration failed");
+        g_have_tsc = false;
+        return false;
+    }
+
+    calc_mult_shift(g_tsc_khz, 1000000, &g_ns_mult, &g_ns_shift);
+    calc_mult_shift(1000000, g_tsc_khz, &g_tsc_mult, &g_tsc_shift);
+    g_tsc_base = cpu_read_tsc();
+
+    terminal_write_string("TSC runs at ");
+    terminal_write_uint32(g_tsc_khz / 1000);
+    terminal_write_string(" MHz\n");
+
+    return true;
+}
+
+uint64_t clock_now_ns()
+{
+    if(!g_have_tsc)
+        return pit_get_ticks() * 1000000;
+
+    return scale(cpu_read_tsc() - g_tsc_base, g_ns_mult, g_ns_shift);
+}
+
+uint32_t clock_tsc_khz()
+{
+    return g_tsc_khz;
+}
+
+uint64_t clock_tsc_to_ns(uint64_t tsc)
+{
+    return scale(tsc, g_ns_mult, g_ns_shift);
+}
+
+uint64_t clock_ns_to_tsc(uint64_t ns)
+{
+    return scale(ns, g_tsc_mult, g_tsc_shift);
+}
+
+bool clock_get_tsc_scale(uint64_t* base, uint32_t* mult, uint32_t* shift)
+{
+    if(!g_have_tsc)
+        return false;
+
+    *base = g_tsc_base;
+    *mult = g_ns_mult;
+    *shift = g_ns_shift;
+    return true;
+}
+
+// -------------------------------------------------------------------------
+// Static Functions
+// -------------------------------------------------------------------------
+
+// (value * mult) >> shift without losing the top bits of the 96-bit product
+static uint64_t scale(uint64_t value, uint32_t mult, uint32_t shift)
+{
+    uint64_t low = (value & 0xFFFFFFFF) * mult;
+    uint64_t high = (value >> 32) * mult;
+
+    return (high << (32 - shift)) + (low >> shift);
+}
+
+// Picks the largest shift (up to 32) for which mult = (to << shift) / from
+// still fits in 32 bits, that gives the most precision
+static void calc_mult_shift(uint32_t from_khz, uint32_t to_khz, uint32_t* mult, uint32_t* shift)
+{
+    for(uint32_t s = 32; s > 0; s--) {
+        uint64_t m = cpu_div_u64((uint64_t)to_khz << s, from_khz, NULL);
+        if(m <= UINT32_MAXVALUE) {
+            *mult = (uint32_t)m;
+            *shift = s;
+            return;
+        }
+    }
+
+    *mult = to_khz / from_khz;
+    *shift = 0;
+}
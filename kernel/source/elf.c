@@ -1,11 +1,16 @@
 #include <types.h>
 #include <kernel.h>
-#include <fs.h>
-#include <fat.h>
+#include <vfs.h>
 #include <terminal.h>
 #include <mem_mgr.h>
 #include <string.h>
 #include <debug.h>
+#include <paging.h>
+#include <mmap.h>
+#include <arch/x86/cpu.h>
+
+#define USER_STACK_PAGES 4
+#define USER_STACK_TOP PAGING_USER_END
 
 typedef int (*userland_entry)();
 
@@ -221,11 +226,15 @@ struct elf32_phdr {
 static void print_file_not_found(const char* file);
 static void print_ph_flags(uint32_t flags);
 static void print_sh_flags(uint32_t flags);
-static void print_program_headers(struct elf32_header* elf, intptr_t buffer);
-static void print_section_headers(struct elf32_header* elf, intptr_t buffer);
+static void print_program_headers(struct elf32_header* elf, struct elf32_phdr* program_headers);
+static void print_section_headers(struct elf32_header* elf, struct elf32_shdr* section_headers, char* str_table, size_t str_table_size);
 static void print_ph_type(enum elf_ph_type type, size_t total_len);
 static void print_sh_type(enum elf_sh_type type, size_t total_len);
 static bool verify_header(struct elf32_header* header);
+static bool read_at(int32_t fd, uint32_t offset, intptr_t buffer, size_t length);
+static struct elf32_phdr* read_program_headers(int32_t fd, struct elf32_header* elf);
+static bool load_segments(int32_t fd, struct elf32_header* elf, struct elf32_phdr* phdrs);
+static bool map_segment(int32_t fd, struct elf32_phdr* ph);
 
 //=============================================================
 // Public Interface
@@ -234,131 +243,135 @@ static bool verify_header(struct elf32_header* header);
 // Finds the given elf on the drive, and loads it wherever it wants to be loaded
 bool elf_load_trusted(const char* filename, intptr_t* res_entry)
 {
-    struct fat_dir_entry entry;
-    if(!fat_get_dir_entry(fs_get_system_part(), filename, &entry)) {
+    int32_t fd = vfs_open(filename);
+    if(fd < 0) {
         KERROR("That file doesn't exist!");
         return false;
     }
 
-    // first off, allocate a buffer where we'll temporararily load the file
-    size_t pages_req = entry.size / PAGE_SIZE;
-    if(entry.size % PAGE_SIZE)
-        pages_req++;
-
-    intptr_t buffer = (intptr_t)mem_page_get_many(pages_req);
-    if(!fat_read_file(fs_get_system_part(), &entry, buffer, pages_req * PAGE_SIZE)) {
-        KERROR("Failed to read file");
+    struct elf32_header elf;
+    if(!read_at(fd, 0, (intptr_t)&elf, sizeof(struct elf32_header)) || !verify_header(&elf)) {
+        vfs_close(fd);
         return false;
     }
 
-    struct elf32_header* elf = (struct elf32_header*)buffer;
-    if(!verify_header(elf)) {
-        mem_page_free((void*)buffer);
+    struct elf32_phdr* phdrs = read_program_headers(fd, &elf);
+    if(phdrs == NULL) {
+        vfs_close(fd);
         return false;
     }
 
-    struct elf32_phdr* phdrs = (struct elf32_phdr*)(buffer + elf->phoff);
-
-    char* file_buf = (char*)(buffer);
-    for(size_t i = 0; i < elf->phnum; i++) {
-        struct elf32_phdr* ph = &phdrs[i];
-
-        if(ph->type != elf_ph_type_load)
-            continue;
-
-        // Load all loadable program headers into memory
-        kstrcpy_n((char*)(intptr_t)ph->vaddr, ph->file_size, file_buf + ph->offset);
-
-        if(ph->file_size < ph->mem_size) {
+    bool loaded = load_segments(fd, &elf, phdrs);
 
-            char* start = (char*)(intptr_t)(ph->vaddr + ph->file_size + 1);
-            size_t len = ph->mem_size - ph->file_size;
-            for(size_t i = 0; i < len; i++) {
-                *start++ = 0;
-            }
-        }
-    }
+    mem_page_free(phdrs);
+    vfs_close(fd);
 
-    *res_entry = (intptr_t)elf->entry;
-    return true;
+    *res_entry = (intptr_t)elf.entry;
+    return loaded;
 }
 
 void elf_info(const char* filename)
 {
-    struct fat_dir_entry entry;
-    if(!fat_get_dir_entry(fs_get_system_part(), filename, &entry)) {
+    int32_t fd = vfs_open(filename);
+    if(fd < 0) {
         print_file_not_found(filename);
         return;
     }
 
-    size_t pages_req = entry.size / PAGE_SIZE;
-    if(entry.size % PAGE_SIZE)
-        pages_req++;
-
-    intptr_t buffer = (intptr_t)mem_page_get_many(pages_req);
-
-    if(!fat_read_file(fs_get_system_part(), &entry, buffer, pages_req * PAGE_SIZE)) {
-        KERROR("Failed to read file");
+    struct elf32_header elf;
+    if(!read_at(fd, 0, (intptr_t)&elf, sizeof(struct elf32_header)) || !verify_header(&elf)) {
+        vfs_close(fd);
         return;
     }
 
-    // We have a buffer, yay!
-    struct elf32_header* elf = (struct elf32_header*)buffer;
+    // Only the headers and the section name table are read, never the whole file
+    struct elf32_shdr* section_headers = NULL;
+    char* str_table = NULL;
+    size_t sh_size = elf.shnum * sizeof(struct elf32_shdr);
 
-    if(!verify_header(elf)) {
-        return;
+    if(elf.shnum > 0 && sh_size <= PAGE_SIZE && elf.shstrndx < elf.shnum) {
+        section_headers = (struct elf32_shdr*)mem_page_get(mem_tag_elf);
+        str_table = (char*)mem_page_get(mem_tag_elf);
+
+        if(!read_at(fd, elf.shoff, (intptr_t)section_headers, sh_size)) {
+            KERROR("Failed to read section headers");
+            goto done;
+        }
+
+        struct elf32_shdr* sh_string_table = &section_headers[elf.shstrndx];
+        size_t str_table_size = sh_string_table->size < PAGE_SIZE ? sh_string_table->size : PAGE_SIZE;
+        if(!read_at(fd, sh_string_table->offset, (intptr_t)str_table, str_table_size)) {
+            KERROR("Failed to read section name table");
+            goto done;
+        }
+
+        print_section_headers(&elf, section_headers, str_table, str_table_size);
+    }
+    else {
+        KWARN("Too many section headers, skipping them");
+    }
+
+    struct elf32_phdr* phdrs = read_program_headers(fd, &elf);
+    if(phdrs != NULL) {
+        print_program_headers(&elf, phdrs);
+        mem_page_free(phdrs);
     }
 
-    // Go through all sections
-    print_section_headers(elf, buffer);
-    print_program_headers(elf, buffer);
+done:
+    if(section_headers != NULL)
+        mem_page_free(section_headers);
+    if(str_table != NULL)
+        mem_page_free(str_table);
 
-    mem_page_free((void*)buffer);
+    vfs_close(fd);
 }
 
 void elf_run(const char* filename)
 {
-    struct fat_dir_entry entry;
-    if(!fat_get_dir_entry(fs_get_system_part(), filename, &entry)) {
+    int32_t fd = vfs_open(filename);
+    if(fd < 0) {
         print_file_not_found(filename);
         return;
     }
 
-    size_t pages_req = entry.size / PAGE_SIZE;
-    if(entry.size % PAGE_SIZE)
-        pages_req++;
-
-    intptr_t buffer = (intptr_t)mem_page_get_many(pages_req);
-
-    if(!fat_read_file(fs_get_system_part(), &entry, buffer, pages_req * PAGE_SIZE)) {
-        KERROR("Failed to read file");
+    struct elf32_header elf;
+    if(!read_at(fd, 0, (intptr_t)&elf, sizeof(struct elf32_header)) || !verify_header(&elf)) {
+        vfs_close(fd);
         return;
     }
 
-    // We have a buffer, yay!
-    struct elf32_header* elf = (struct elf32_header*)buffer;
-
-    if(!verify_header(elf)) {
+    struct elf32_phdr* phdrs = read_program_headers(fd, &elf);
+    if(phdrs == NULL) {
+        vfs_close(fd);
         return;
     }
 
-    // Go through all sections
-    char* file_buf = (char*)(buffer);
-    struct elf32_phdr* phdrs = (struct elf32_phdr*)(file_buf + elf->phoff);
+    // Only one program at a time for now, drop whatever the last one had
+    mmap_unmap_range(PAGING_USER_START, PAGING_USER_END);
 
-    for(size_t i = 0; i < elf->phnum; i++) {
-        struct elf32_phdr* ph = &phdrs[i];
+    bool loaded = true;
+    for(size_t i = 0; i < elf.phnum && loaded; i++) {
+        if(phdrs[i].type == elf_ph_type_load)
+            loaded = map_segment(fd, &phdrs[i]);
+    }
 
-        if(ph->type != elf_ph_type_load)
-            continue;
+    // The mappings keep the file around, the descriptor isn't needed anymore
+    mem_page_free(phdrs);
+    vfs_close(fd);
 
-        // Load all loadable program headers into memory
-        kstrcpy_n((char*)(intptr_t)ph->vaddr, ph->file_size, file_buf + ph->offset);
+    if(!loaded)
+        return;
+
+    uintptr_t stack_bottom = USER_STACK_TOP - USER_STACK_PAGES * PAGE_SIZE;
+    if(mmap_anonymous(stack_bottom, USER_STACK_PAGES * PAGE_SIZE, mmap_flag_private | mmap_flag_user) == NULL) {
+        KERROR("Failed to map the user stack");
+        return;
     }
 
-    userland_entry user_entry = (userland_entry)(intptr_t)(elf->entry);
+    userland_entry user_entry = (userland_entry)(intptr_t)(elf.entry);
 
-    // TODO: user-mode stack setup
+    // Interrupts are back on once we're in user mode, or nothing could
+    // ever preempt it
     __asm ("cli;                \
             mov %0  ,  %%ax;    \
             mov %%ax,  %%ds;    \
@@ -366,8 +379,9 @@ void elf_run(const char* filename)
             mov %%ax,  %%fs;    \
             mov %%ax,  %%gs;    \
             push %0;            \
-            push $0x20000;      \
+            push %3;            \
             pushf;              \
+            orl %4, (%%esp);    \
             push %1;            \
             push %2;            \
             iret;               \
@@ -375,7 +389,9 @@ void elf_run(const char* filename)
             :
             : "i" (USER_DATA_SEGMENT),
               "i" (USER_CODE_SEGMENT),
-              "m" (user_entry)
+              "m" (user_entry),
+              "i" (USER_STACK_TOP),
+              "i" (CPU_EFLAGS_IF)
           );
 
     // We are never going to get here
@@ -484,16 +500,11 @@ static void print_sh_flags(uint32_t flags)
         terminal_write_char(' ');
 }
 
-static void print_section_headers(struct elf32_header* elf, intptr_t buffer)
+static void print_section_headers(struct elf32_header* elf, struct elf32_shdr* section_headers, char* str_table, size_t str_table_size)
 {
     terminal_write_string("Section headers:\n");
     terminal_write_string("[Nr] Name               Type           Addr       Offset   Size     ES   Flg\n");
 
-    struct elf32_shdr* section_headers = (struct elf32_shdr*)(intptr_t)(((char*)buffer) + elf->shoff);
-
-    struct elf32_shdr* sh_string_table = &section_headers[elf->shstrndx];
-    char* str_table_start = ((char*)buffer) + sh_string_table->offset;
-
     for(uint8_t i = 0; i < elf->shnum; i++) {
         struct elf32_shdr* cur = &section_headers[i];
 
@@ -504,7 +515,8 @@ static void print_section_headers(struct elf32_header* elf, intptr_t buffer)
         terminal_write_char(']');
         terminal_write_char(' ');
 
-        char* name = (str_table_start + cur->name);
+        // The name table may have been cut short
+        char* name = cur->name < str_table_size ? (str_table + cur->name) : "?";
         terminal_write_string_endpadded(name, 18);
         terminal_write_char(' ');
         print_sh_type(cur->type, 15);
@@ -521,9 +533,8 @@ static void print_section_headers(struct elf32_header* elf, intptr_t buffer)
     }
 }
 
-static void print_program_headers(struct elf32_header* elf, intptr_t buffer)
+static void print_program_headers(struct elf32_header* elf, struct elf32_phdr* program_headers)
 {
-    struct elf32_phdr* program_headers = (struct elf32_phdr*)(intptr_t)(((char*)buffer) + elf->phoff);
     KINFO("Program Headers:");
 
     // Format:
@@ -550,6 +561,113 @@ static void print_program_headers(struct elf32_header* elf, intptr_t buffer)
     }
 }
 
+static bool read_at(int32_t fd, uint32_t offset, intptr_t buffer, size_t length)
+{
+    if(vfs_seek(fd, offset, vfs_seek_set) < 0)
+        return false;
+
+    return vfs_read(fd, buffer, length) == (int32_t)length;
+}
+
+// Returns a page holding all program headers, the caller frees it
+static struct elf32_phdr* read_program_headers(int32_t fd, struct elf32_header* elf)
+{
+    size_t size = elf->phnum * sizeof(struct elf32_phdr);
+    if(size > PAGE_SIZE) {
+        KERROR("Too many program headers");
+        return NULL;
+    }
+
+    struct elf32_phdr* phdrs = (struct elf32_phdr*)mem_page_get(mem_tag_elf);
+    if(phdrs == NULL)
+        return NULL;
+
+    if(!read_at(fd, elf->phoff, (intptr_t)phdrs, size)) {
+        KERROR("Failed to read program headers");
+        mem_page_free(phdrs);
+        return NULL;
+    }
+
+    return phdrs;
+}
+
+static bool load_segments(int32_t fd, struct elf32_header* elf, struct elf32_phdr* phdrs)
+{
+    for(size_t i = 0; i < elf->phnum; i++) {
+        struct elf32_phdr* ph = &phdrs[i];
+
+        if(ph->type != elf_ph_type_load)
+            continue;
+
+        // Load all loadable program headers into memory
+        if(!read_at(fd, ph->offset, (intptr_t)ph->vaddr, ph->file_size)) {
+            KERROR("Failed to read segment");
+            return false;
+        }
+
+        if(ph->file_size < ph->mem_size)
+            memset((void*)(intptr_t)(ph->vaddr + ph->file_size), 0, ph->mem_size - ph->file_size);
+    }
+
+    return true;
+}
+
+// Maps the file backed part of a segment straight from the page cache,
+// read-only and shared unless it's writable, then it's copy-on-write
+static bool map_segment(int32_t fd, struct elf32_phdr* ph)
+{
+    uintptr_t start = ph->vaddr & ~(PAGE_SIZE - 1);
+    uintptr_t file_end = ph->vaddr + ph->file_size;
+    uintptr_t mem_end = ph->vaddr + ph->mem_size;
+    uintptr_t file_page_end = (file_end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    uintptr_t mem_page_end = (mem_end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    if(start < PAGING_USER_START || mem_page_end > PAGING_USER_END || mem_end < ph->vaddr) {
+        KERROR("Segment is outside of user space");
+        return false;
+    }
+
+    // Pages can only be shared if the file lays the segment out like memory does
+    if((ph->vaddr - ph->offset) % PAGE_SIZE != 0) {
+        KWARN("Segment isn't page aligned in the file, copying it");
+
+        if(mmap_anonymous(start, mem_page_end - start, mmap_flag_private | mmap_flag_user) == NULL)
+            return false;
+
+        return ph->file_size == 0 || read_at(fd, ph->offset, (intptr_t)ph->vaddr, ph->file_size);
+    }
+
+    bool writable = (ph->flags & elf_ph_flag_w) || ph->mem_size > ph->file_size;
+    uint32_t flags = mmap_flag_user | (writable ? mmap_flag_private : mmap_flag_shared);
+
+    if(ph->file_size > 0) {
+        uint32_t offset = ph->offset - (ph->vaddr - start);
+        if(mmap_file(fd, offset, file_end - start, start, flags) == NULL) {
+            KERROR("Failed to map segment");
+            return false;
+        }
+
+        // The rest of the last file page is whatever follows in the file,
+        // writing the zeroes gets that one page copied
+        uintptr_t zero_end = mem_end < file_page_end ? mem_end : file_page_end;
+        if(ph->mem_size > ph->file_size && zero_end > file_end)
+            memset((void*)file_end, 0, zero_end - file_end);
+    }
+    else {
+        file_page_end = start;
+    }
+
+    // BSS beyond the file is plain zeroed memory
+    if(mem_page_end > file_page_end) {
+        if(mmap_anonymous(file_page_end, mem_page_end - file_page_end, mmap_flag_private | mmap_flag_user) == NULL) {
+            KERROR("Failed to map segment BSS");
+            return false;
+        }
+    }
+
+    return true;
+}
+
 static bool verify_header(struct elf32_header* header)
 {
     if(header->ehsize != sizeof(struct elf32_header)) {
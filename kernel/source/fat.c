@@ -6,6 +6,7 @@
 #include <mem_mgr.h>
 #include <ata.h>
 #include <string.h>
+#include <vmalloc.h>
 
 // -------------------------------------------------------------------------
 // Static Declares
@@ -18,6 +19,14 @@
 #define FAT16_BAD 0xFFF7
 #define FAT32_BAD 0x0FFFFFF7
 
+// What we write to terminate a cluster chain
+#define FAT16_EOC 0xFFFF
+#define FAT32_EOC 0x0FFFFFFF
+
+#define FAT_FS_INFO_LEAD_SIGNATURE   0x41615252
+#define FAT_FS_INFO_STRUCT_SIGNATURE 0x61417272
+#define FAT_FS_INFO_UNKNOWN          0xFFFFFFFF
+
 #define ROOT_ENTRY_SIZE 32
 
 #define DIR_END 0
@@ -38,6 +47,24 @@ static inline bool is_directory(uint8_t attribute);
 static inline bool is_system(uint8_t attribute);
 static inline bool is_volume_id(uint8_t attribute);
 static void dump_fat_dir_entry(struct fat_dir_entry* entry);
+static inline uint32_t cluster_to_sector(struct fat_part_info* part_info, uint32_t cluster);
+static inline uint32_t get_first_cluster(struct fat_part_info* part_info, struct fat_dir_entry* entry);
+static inline void set_first_cluster(struct fat_part_info* part_info, struct fat_dir_entry* entry, uint32_t cluster);
+static bool is_end_of_chain(struct fat_part_info* part_info, uint32_t fat_entry);
+static uint32_t seek_cluster(struct fat_part_info* part_info, struct fat_file* file, struct fat_cursor* cursor, uint32_t cluster_index);
+static void set_cursor(struct fat_file* file, struct fat_cursor* cursor, uint32_t cluster_index, uint32_t cluster);
+static bool zero_fill(struct fat_part_info* part_info, struct fat_dir_entry* file, size_t new_size);
+static bool find_root_dir_entry(struct fat_part_info* part_info, const char* filename83, uint8_t* sector_buffer, uint32_t* result_sector, uint32_t* result_index);
+static bool update_dir_entry(struct fat_part_info* part_info, struct fat_dir_entry* file);
+static bool build_free_map(struct fat_part_info* part_info);
+static bool flush_fs_info(struct fat_part_info* part_info);
+static uint32_t find_free_run(struct fat_part_info* part_info, uint32_t wanted, uint32_t* run_length);
+static uint32_t allocate_clusters(struct fat_part_info* part_info, uint32_t tail, uint32_t count, uint32_t* new_tail);
+static void rollback_allocation(struct fat_part_info* part_info, uint32_t original_tail, uint32_t first, uint32_t last);
+static bool free_cluster_chain(struct fat_part_info* part_info, uint32_t cluster);
+static uint32_t get_chain_tail(struct fat_part_info* part_info, uint32_t first_cluster);
+static bool write_fat_entries(struct fat_part_info* part_info, uint32_t first, uint32_t count, bool link);
+static bool set_fat_entry(struct fat_part_info* part_info, uint32_t cluster, uint32_t value);
 
 // -------------------------------------------------------------------------
 // Public Contract
@@ -47,7 +74,7 @@ bool fat_init(struct mbr_partition_entry* partition_entry, struct fat_part_info*
     terminal_write_string("FAT: Initializing partition.\n");
     terminal_indentation_increase();
 
-    uint8_t* buffer = (uint8_t*)(intptr_t)(mem_page_get());
+    uint8_t* buffer = (uint8_t*)(intptr_t)(mem_page_get(mem_tag_fs));
 
     if(!ata_read_sectors(partition_entry->lba_begin, 1, (intptr_t)buffer)) {
         KWARN("Failed to read first sector of FAT partition");
@@ -66,6 +93,18 @@ bool fat_init(struct mbr_partition_entry* partition_entry, struct fat_part_info*
     info_result->data_begin = info_result->fat_begin + info_result->fat_total_sectors + info_result->num_root_dir_sectors;
     info_result->version = fat_get_version(info_result);
     info_result->bytes_per_sector = bpb->bytes_per_sector;
+    info_result->num_fats = bpb->num_fats;
+    info_result->cluster_count = (info_result->total_sectors - (info_result->data_begin - bpb->hidden_sectors)) /
+        bpb->sectors_per_cluster;
+    info_result->root_cluster = 0;
+    info_result->fs_info_sector = 0;
+
+    if(info_result->version == fat_version_32) {
+        info_result->root_cluster = bpb->ebpb.ebpb32.root_cluster;
+
+        if(bpb->ebpb.ebpb32.fs_info != 0 && bpb->ebpb.ebpb32.fs_info != 0xFFFF)
+            info_result->fs_info_sector = partition_entry->lba_begin + bpb->ebpb.ebpb32.fs_info;
+    }
 
     if(false)
         dump_fat_part_info(info_result);
@@ -80,6 +119,9 @@ bool fat_init(struct mbr_partition_entry* partition_entry, struct fat_part_info*
     // Free the buffer, we don't need it no more
     mem_page_free(buffer);
 
+    if(!build_free_map(info_result))
+        KWARN("FAT: No free cluster map, partition is read-only");
+
     KINFO("FAT successfully initialized");
 
     terminal_indentation_decrease();
@@ -89,9 +131,14 @@ bool fat_init(struct mbr_partition_entry* partition_entry, struct fat_part_info*
 bool fat_read_file(struct fat_part_info* part_info, struct fat_dir_entry* file, intptr_t buffer, size_t buffer_length)
 {
     uint32_t bytes_per_cluster = (part_info->num_sectors_per_cluster * part_info->bytes_per_sector);
-    uint32_t next_cluster = file->first_cluster;
+    uint32_t next_cluster = get_first_cluster(part_info, file);
+
+    // Empty files don't have any clusters
+    if(next_cluster == 0)
+        return true;
+
     while(true) {
-        uint32_t first_sector = part_info->data_begin + ((next_cluster - 2) * part_info->num_sectors_per_cluster);  
+        uint32_t first_sector = cluster_to_sector(part_info, next_cluster);
 
         if(!ata_read_sectors(first_sector, part_info->num_sectors_per_cluster, buffer)) {
             KWARN("Failed to read sector for file. what Up?");
@@ -110,62 +157,388 @@ bool fat_read_file(struct fat_part_info* part_info, struct fat_dir_entry* file,
     return true;
 }
 
+// Reads length bytes starting at offset, returns the number of bytes read or -1
+int32_t fat_read_file_range(struct fat_part_info* part_info, struct fat_file* file, uint32_t offset, intptr_t buffer, size_t length)
+{
+    uint32_t bytes_per_sector = part_info->bytes_per_sector;
+    uint32_t bytes_per_cluster = part_info->num_sectors_per_cluster * bytes_per_sector;
+
+    if(offset >= file->entry.size)
+        return 0;
+
+    if(length > file->entry.size - offset)
+        length = file->entry.size - offset;
+
+    uint32_t cluster_index = offset / bytes_per_cluster;
+    uint32_t cluster = seek_cluster(part_info, file, &file->read_cursor, cluster_index);
+
+    uint32_t cluster_offset = offset % bytes_per_cluster;
+    uint8_t sector_buffer[bytes_per_sector];
+    size_t total = 0;
+
+    while(total < length) {
+        if(cluster < 2 || is_end_of_chain(part_info, cluster)) {
+            KWARN("FAT: Cluster chain ended before the end of the file");
+            return -1;
+        }
+
+        uint32_t sector_in_cluster = cluster_offset / bytes_per_sector;
+        uint32_t byte_in_sector = cluster_offset % bytes_per_sector;
+        uint32_t lba = cluster_to_sector(part_info, cluster) + sector_in_cluster;
+        size_t remaining = length - total;
+        uint32_t read;
+
+        if(byte_in_sector == 0 && remaining >= bytes_per_sector) {
+            // Whole sectors go straight into the caller's buffer
+            uint32_t sectors = remaining / bytes_per_sector;
+            if(sectors > part_info->num_sectors_per_cluster - sector_in_cluster)
+                sectors = part_info->num_sectors_per_cluster - sector_in_cluster;
+
+            if(!ata_read_sectors(lba, sectors, buffer)) {
+                KWARN("FAT: Failed to read file data");
+                return -1;
+            }
+
+            read = sectors * bytes_per_sector;
+        }
+        else {
+            read = bytes_per_sector - byte_in_sector;
+            if(read > remaining)
+                read = remaining;
+
+            if(!ata_read_sectors(lba, 1, (intptr_t)sector_buffer)) {
+                KWARN("FAT: Failed to read file data");
+                return -1;
+            }
+
+            memcpy((void*)buffer, &sector_buffer[byte_in_sector], read);
+        }
+
+        buffer += read;
+        total += read;
+        cluster_offset += read;
+
+        if(cluster_offset == bytes_per_cluster && total < length) {
+            cluster = get_fat_entry_for_cluster(part_info, cluster);
+            cluster_index++;
+            cluster_offset = 0;
+        }
+    }
+
+    set_cursor(file, &file->read_cursor, cluster_index, cluster);
+
+    return (int32_t)total;
+}
+
+// Finds where on disk the byte at offset lives, returns how many bytes from
+// there on (up to length) are stored in consecutive sectors, or 0 on error.
+// Offset has to be sector aligned.
+uint32_t fat_map_file_range(struct fat_part_info* part_info, struct fat_file* file, uint32_t offset, size_t length, uint32_t* lba)
+{
+    uint32_t bytes_per_sector = part_info->bytes_per_sector;
+    uint32_t bytes_per_cluster = part_info->num_sectors_per_cluster * bytes_per_sector;
+
+    if(offset >= file->entry.size || offset % bytes_per_sector != 0)
+        return 0;
+
+    if(length > file->entry.size - offset)
+        length = file->entry.size - offset;
+
+    uint32_t cluster_index = offset / bytes_per_cluster;
+    uint32_t cluster = seek_cluster(part_info, file, &file->map_cursor, cluster_index);
+    if(cluster < 2 || is_end_of_chain(part_info, cluster))
+        return 0;
+
+    set_cursor(file, &file->map_cursor, cluster_index, cluster);
+
+    uint32_t cluster_offset = offset % bytes_per_cluster;
+    *lba = cluster_to_sector(part_info, cluster) + cluster_offset / bytes_per_sector;
+
+    // Keep going for as long as the chain is laid out back to back
+    uint32_t mapped = bytes_per_cluster - cluster_offset;
+    while(mapped < length) {
+        uint32_t next = get_fat_entry_for_cluster(part_info, cluster);
+        if(next != cluster + 1)
+            break;
+
+        cluster = next;
+        mapped += bytes_per_cluster;
+    }
+
+    return mapped < length ? mapped : length;
+}
+
 // Note: This is currently limited to the root director
 //       In the future it could take in the fat_dir_entry of the directory to look in
 bool fat_get_dir_entry(struct fat_part_info* part_info, const char* filename83, struct fat_dir_entry* result)
 {
-    size_t cluster_byte_size = (part_info->num_sectors_per_cluster * part_info->bytes_per_sector);
-    size_t buffer_page_size = cluster_byte_size / PAGE_SIZE;
-    if(cluster_byte_size % PAGE_SIZE)
-        buffer_page_size++;
+    uint8_t sector_buffer[part_info->bytes_per_sector];
+    uint32_t sector;
+    uint32_t index;
 
-    intptr_t buffer = (intptr_t)mem_page_get_many(buffer_page_size);
+    if(!find_root_dir_entry(part_info, filename83, sector_buffer, &sector, &index))
+        return false;
 
-    size_t entries_in_cluster = (part_info->num_sectors_per_cluster * part_info->bytes_per_sector) /
-        sizeof(struct fat_dir_entry);
+    // Copy into result as the buffer only lives on our stack
+    struct fat_dir_entry* entry = &((struct fat_dir_entry*)sector_buffer)[index];
+    memcpy(result, entry, sizeof(struct fat_dir_entry));
 
-    uint32_t next_cluster = 2; // Root dir starts at sector 2
-    uint32_t next_sector = part_info->root_dir_sector;
-    while(true) {
-        if(!ata_read_sectors(next_sector, part_info->num_sectors_per_cluster, buffer)) {
-            KWARN("Failed to read cluster for directory");
+    return true;
+}
+
+bool fat_create_file(struct fat_part_info* part_info, const char* filename83, struct fat_dir_entry* result)
+{
+    if(part_info->free_map == NULL) {
+        KWARN("FAT: Partition is read-only");
+        return false;
+    }
+
+    uint8_t sector_buffer[part_info->bytes_per_sector];
+    uint32_t sector;
+    uint32_t index;
+
+    if(find_root_dir_entry(part_info, filename83, sector_buffer, &sector, &index)) {
+        KWARN("FAT: File already exists");
+        return false;
+    }
+
+    // Passing no name gives us the first unused slot instead
+    if(!find_root_dir_entry(part_info, NULL, sector_buffer, &sector, &index)) {
+        KWARN("FAT: Root directory is full");
+        return false;
+    }
+
+    // Empty files have no clusters, the first write allocates them
+    struct fat_dir_entry* entry = &((struct fat_dir_entry*)sector_buffer)[index];
+    memset(entry, 0, sizeof(struct fat_dir_entry));
+
+    kstrcpy_n(entry->name, 11, (char*)filename83);
+    entry->attribute = fat_attr_archive;
+
+    if(!ata_write_sectors(sector, 1, (intptr_t)sector_buffer)) {
+        KWARN("FAT: Failed to write directory entry");
+        return false;
+    }
+
+    memcpy(result, entry, sizeof(struct fat_dir_entry));
+    return true;
+}
+
+// Grows the file to new_size bytes, allocating clusters as needed.
+// Note: The contents of the newly added range are undefined until written,
+// whatever the clusters held before shows through. Truncating upwards and
+// writing past the end zero it instead.
+bool fat_extend_file(struct fat_part_info* part_info, struct fat_dir_entry* file, size_t new_size)
+{
+    if(part_info->free_map == NULL) {
+        KWARN("FAT: Partition is read-only");
+        return false;
+    }
+
+    if(new_size <= file->size)
+        return true;
+
+    uint32_t bytes_per_cluster = part_info->num_sectors_per_cluster * part_info->bytes_per_sector;
+    uint32_t clusters_have = (file->size + bytes_per_cluster - 1) / bytes_per_cluster;
+    uint32_t clusters_need = (new_size + bytes_per_cluster - 1) / bytes_per_cluster;
+    uint32_t first_cluster = get_first_cluster(part_info, file);
+
+    // Empty files may still own a cluster
+    if(first_cluster != 0 && clusters_have == 0)
+        clusters_have = 1;
+
+    if(clusters_need > clusters_have) {
+        uint32_t tail = first_cluster == 0 ? 0 : get_chain_tail(part_info, first_cluster);
+        uint32_t new_tail;
+
+        uint32_t allocated = allocate_clusters(part_info, tail, clusters_need - clusters_have, &new_tail);
+        if(allocated == 0) {
+            KWARN("FAT: Out of disk space");
             return false;
         }
 
-        struct fat_dir_entry* root_entries = (struct fat_dir_entry*)(buffer);
+        if(first_cluster == 0) {
+            first_cluster = allocated;
+            set_first_cluster(part_info, file, first_cluster);
+        }
+
+        part_info->tail_file_cluster = first_cluster;
+        part_info->tail_cluster = new_tail;
+    }
 
-        for(int i = 0; i < entries_in_cluster; i++) {
-            struct fat_dir_entry* entry = &root_entries[i];
+    file->size = new_size;
 
-            if(entry->name[0] == DIR_END)
-                break;
-            if(entry->name[0] == UNUSED_DIR_ENTRY  ||
-                    is_volume_id(entry->attribute) ||
-                    is_system(entry->attribute))
-                continue;
+    return update_dir_entry(part_info, file) && flush_fs_info(part_info);
+}
 
-            if(!kstrcmp_n(entry->name, filename83, 11)) {
-                continue; // Not this file!
+bool fat_truncate_file(struct fat_part_info* part_info, struct fat_dir_entry* file, size_t new_size)
+{
+    if(part_info->free_map == NULL) {
+        KWARN("FAT: Partition is read-only");
+        return false;
+    }
+
+    if(new_size >= file->size)
+        return zero_fill(part_info, file, new_size);
+
+    uint32_t bytes_per_cluster = part_info->num_sectors_per_cluster * part_info->bytes_per_sector;
+    uint32_t clusters_keep = (new_size + bytes_per_cluster - 1) / bytes_per_cluster;
+    uint32_t first_cluster = get_first_cluster(part_info, file);
+
+    if(first_cluster != 0) {
+        uint32_t free_from;
+
+        if(clusters_keep == 0) {
+            free_from = first_cluster;
+            set_first_cluster(part_info, file, 0);
+        }
+        else {
+            uint32_t last_kept = first_cluster;
+            for(uint32_t i = 1; i < clusters_keep; i++)
+                last_kept = get_fat_entry_for_cluster(part_info, last_kept);
+
+            free_from = get_fat_entry_for_cluster(part_info, last_kept);
+
+            if(!write_fat_entries(part_info, last_kept, 1, true))
+                return false;
+        }
+
+        if(part_info->tail_file_cluster == first_cluster) {
+            part_info->tail_file_cluster = 0;
+            part_info->tail_cluster = 0;
+        }
+
+        if(!free_cluster_chain(part_info, free_from))
+            return false;
+    }
+
+    file->size = new_size;
+
+    return update_dir_entry(part_info, file) && flush_fs_info(part_info);
+}
+
+bool fat_write_file(struct fat_part_info* part_info, struct fat_dir_entry* file, size_t offset, intptr_t buffer, size_t length)
+{
+    if(length == 0)
+        return true;
+
+    // Nothing may show through between the old end and where we write
+    if(offset > file->size && !zero_fill(part_info, file, offset))
+        return false;
+
+    uint32_t bytes_per_sector = part_info->bytes_per_sector;
+    uint32_t bytes_per_cluster = part_info->num_sectors_per_cluster * bytes_per_sector;
+    uint32_t start_index = offset / bytes_per_cluster;
+    uint32_t clusters_have = (file->size + bytes_per_cluster - 1) / bytes_per_cluster;
+    uint32_t first_cluster = get_first_cluster(part_info, file);
+
+    // Appends start in the last cluster or the one right after it, the
+    // tail cache finds those without walking the chain
+    uint32_t old_tail = 0;
+    if(first_cluster != 0 && clusters_have > 0 &&
+       (start_index == clusters_have - 1 || start_index == clusters_have))
+        old_tail = get_chain_tail(part_info, first_cluster);
+
+    if(offset + length > file->size && !fat_extend_file(part_info, file, offset + length))
+        return false;
+
+    uint32_t cluster;
+    if(old_tail != 0 && start_index == clusters_have - 1) {
+        cluster = old_tail;
+    }
+    else if(old_tail != 0) {
+        cluster = get_fat_entry_for_cluster(part_info, old_tail);
+    }
+    else {
+        cluster = get_first_cluster(part_info, file);
+        for(uint32_t i = 0; i < start_index; i++)
+            cluster = get_fat_entry_for_cluster(part_info, cluster);
+    }
+
+    uint32_t cluster_offset = offset % bytes_per_cluster;
+    uint8_t sector_buffer[bytes_per_sector];
+
+    while(length > 0) {
+        if(cluster < 2 || is_end_of_chain(part_info, cluster)) {
+            KWARN("FAT: Cluster chain ended before the end of the file");
+            return false;
+        }
+
+        uint32_t sector_in_cluster = cluster_offset / bytes_per_sector;
+        uint32_t byte_in_sector = cluster_offset % bytes_per_sector;
+        uint32_t lba = cluster_to_sector(part_info, cluster) + sector_in_cluster;
+        uint32_t written;
+
+        if(byte_in_sector == 0 && length >= bytes_per_sector) {
+            // Whole sectors go straight from the caller's buffer to the disk
+            uint32_t sectors = length / bytes_per_sector;
+            if(sectors > part_info->num_sectors_per_cluster - sector_in_cluster)
+                sectors = part_info->num_sectors_per_cluster - sector_in_cluster;
+
+            if(!ata_write_sectors(lba, sectors, buffer)) {
+                KWARN("FAT: Failed to write file data");
+                return false;
+            }
+
+            written = sectors * bytes_per_sector;
+        }
+        else {
+            // Partial sector, read-modify-write
+            written = bytes_per_sector - byte_in_sector;
+            if(written > length)
+                written = length;
+
+            if(!ata_read_sectors(lba, 1, (intptr_t)sector_buffer)) {
+                KWARN("FAT: Failed to read file data");
+                return false;
             }
 
-            // Copy into result as the entry we have will be freed
-            kstrcpy_n((char*)result, sizeof(struct fat_dir_entry), (char*)entry);
+            memcpy(&sector_buffer[byte_in_sector], (void*)buffer, written);
 
-            mem_page_free((void*)buffer);
-            return true;
+            if(!ata_write_sectors(lba, 1, (intptr_t)sector_buffer)) {
+                KWARN("FAT: Failed to write file data");
+                return false;
+            }
         }
 
-        // No dice - Get next cluster
-        next_cluster = get_fat_entry_for_cluster(part_info, next_cluster);
+        buffer += written;
+        length -= written;
+        cluster_offset += written;
 
-        if(is_eof(part_info, next_cluster) || is_bad(part_info, next_cluster))
-            break;
+        if(cluster_offset == bytes_per_cluster && length > 0) {
+            cluster = get_fat_entry_for_cluster(part_info, cluster);
+            cluster_offset = 0;
+        }
+    }
+
+    return true;
+}
+
+// Grows the file to new_size by writing zeros past its end, a page at a time
+static bool zero_fill(struct fat_part_info* part_info, struct fat_dir_entry* file, size_t new_size)
+{
+    if(new_size <= file->size)
+        return true;
+
+    uint8_t* zeros = (uint8_t*)mem_page_get(mem_tag_fs);
+    if(zeros == NULL) {
+        KWARN("FAT: Out of memory");
+        return false;
+    }
+
+    memset(zeros, 0, PAGE_SIZE);
+
+    bool success = true;
+    while(success && file->size < new_size) {
+        size_t length = new_size - file->size;
+        if(length > PAGE_SIZE)
+            length = PAGE_SIZE;
 
-        next_sector = part_info->data_begin + ((next_cluster - 2) * part_info->num_sectors_per_cluster);
+        success = fat_write_file(part_info, file, file->size, (intptr_t)zeros, length);
     }
 
-    mem_page_free((void*)buffer);
-    return false;
+    mem_page_free(zeros);
+    return success;
 }
 
 static uint32_t get_fat_entry_for_cluster(struct fat_part_info* part_info, uint32_t cluster)
@@ -240,6 +613,487 @@ static enum fat_version fat_get_version(struct fat_part_info* part_info)
         return fat_version_32;
 }
 
+// -------------------------------------------------------------------------
+// Directory Helpers
+// -------------------------------------------------------------------------
+
+// Looks for filename83 in the root directory, leaving the sector it was found
+// in in sector_buffer. Passing NULL for the name finds the first unused entry.
+static bool find_root_dir_entry(struct fat_part_info* part_info, const char* filename83, uint8_t* sector_buffer, uint32_t* result_sector, uint32_t* result_index)
+{
+    uint32_t entries_per_sector = part_info->bytes_per_sector / sizeof(struct fat_dir_entry);
+
+    // FAT12/16 have a fixed size root directory right after the FATs,
+    // on FAT32 it's a regular cluster chain
+    uint32_t cluster = part_info->version == fat_version_32 ? part_info->root_cluster : 0;
+    uint32_t sector = cluster != 0 ? cluster_to_sector(part_info, cluster) : part_info->root_dir_sector;
+    uint32_t sectors_left = cluster != 0 ? part_info->num_sectors_per_cluster : part_info->num_root_dir_sectors;
+
+    while(true) {
+        if(sectors_left == 0) {
+            if(cluster == 0)
+                return false;
+
+            cluster = get_fat_entry_for_cluster(part_info, cluster);
+            if(cluster < 2 || is_end_of_chain(part_info, cluster))
+                return false;
+
+            sector = cluster_to_sector(part_info, cluster);
+            sectors_left = part_info->num_sectors_per_cluster;
+        }
+
+        if(!ata_read_sectors(sector, 1, (intptr_t)sector_buffer)) {
+            KWARN("Failed to read sector for directory");
+            return false;
+        }
+
+        struct fat_dir_entry* entries = (struct fat_dir_entry*)sector_buffer;
+
+        for(uint32_t i = 0; i < entries_per_sector; i++) {
+            struct fat_dir_entry* entry = &entries[i];
+            bool is_unused = (uint8_t)entry->name[0] == UNUSED_DIR_ENTRY;
+
+            if(filename83 == NULL) {
+                if(entry->name[0] != DIR_END && !is_unused)
+                    continue;
+            }
+            else {
+                if(entry->name[0] == DIR_END)
+                    return false;
+                if(is_unused ||
+                        is_volume_id(entry->attribute) ||
+                        is_system(entry->attribute))
+                    continue;
+
+                if(!kstrcmp_n(entry->name, filename83, 11)) {
+                    continue; // Not this file!
+                }
+            }
+
+            *result_sector = sector;
+            *result_index = i;
+            return true;
+        }
+
+        sector++;
+        sectors_left--;
+    }
+}
+
+static bool update_dir_entry(struct fat_part_info* part_info, struct fat_dir_entry* file)
+{
+    uint8_t sector_buffer[part_info->bytes_per_sector];
+    uint32_t sector;
+    uint32_t index;
+
+    if(!find_root_dir_entry(part_info, file->name, sector_buffer, &sector, &index)) {
+        KWARN("FAT: Lost track of directory entry");
+        return false;
+    }
+
+    struct fat_dir_entry* entry = &((struct fat_dir_entry*)sector_buffer)[index];
+    memcpy(entry, file, sizeof(struct fat_dir_entry));
+
+    return ata_write_sectors(sector, 1, (intptr_t)sector_buffer);
+}
+
+// -------------------------------------------------------------------------
+// Cluster Allocation
+// -------------------------------------------------------------------------
+static inline bool is_cluster_used(struct fat_part_info* part_info, uint32_t cluster)
+{
+    return (part_info->free_map[cluster / 32] & (1u << (cluster % 32))) != 0;
+}
+
+static inline void mark_cluster_used(struct fat_part_info* part_info, uint32_t cluster)
+{
+    part_info->free_map[cluster / 32] |= (1u << (cluster % 32));
+}
+
+static inline void mark_cluster_free(struct fat_part_info* part_info, uint32_t cluster)
+{
+    part_info->free_map[cluster / 32] &= ~(1u << (cluster % 32));
+}
+
+// Reads the whole FAT once so that finding free clusters never has to
+// touch the disk again
+static bool build_free_map(struct fat_part_info* part_info)
+{
+    part_info->free_map = NULL;
+    part_info->free_count = 0;
+    part_info->next_free_hint = 2;
+    part_info->tail_file_cluster = 0;
+    part_info->tail_cluster = 0;
+
+    // FAT12 entries straddle byte (and sector) boundaries, writing those
+    // isn't supported.
+    if(part_info->version == fat_version_12)
+        return false;
+
+    uint32_t map_bits = part_info->cluster_count + 2;
+    uint32_t map_bytes = ((map_bits + 31) / 32) * sizeof(uint32_t);
+    size_t map_pages = map_bytes / PAGE_SIZE;
+    if(map_bytes % PAGE_SIZE)
+        map_pages++;
+
+    // One bit per cluster runs to a good few pages on big volumes, they
+    // don't have to be next to each other
+    uint32_t* free_map = (uint32_t*)vmalloc(map_pages * PAGE_SIZE, mem_tag_fs);
+    uint8_t* buffer = (uint8_t*)mem_page_get(mem_tag_fs);
+    if(free_map == NULL || buffer == NULL) {
+        if(free_map != NULL)
+            vmalloc_free(free_map);
+        if(buffer != NULL)
+            mem_page_free(buffer);
+        return false;
+    }
+
+    // Everything starts out used, that way the reserved clusters
+    // and the bits past the last cluster are never handed out
+    for(size_t i = 0; i < (map_pages * PAGE_SIZE) / sizeof(uint32_t); i++)
+        free_map[i] = 0xFFFFFFFF;
+
+    part_info->free_map = free_map;
+
+    uint32_t entry_size = part_info->version == fat_version_32 ? 4 : 2;
+    uint32_t sectors_per_read = PAGE_SIZE / part_info->bytes_per_sector;
+    uint32_t entries_per_sector = part_info->bytes_per_sector / entry_size;
+    uint32_t cluster = 0;
+
+    for(uint32_t sector = 0; sector < part_info->fat_size && cluster < map_bits; sector += sectors_per_read) {
+        uint32_t count = part_info->fat_size - sector;
+        if(count > sectors_per_read)
+            count = sectors_per_read;
+
+        if(!ata_read_sectors(part_info->fat_begin + sector, count, (intptr_t)buffer)) {
+            KWARN("FAT: Failed to read FAT sector");
+            mem_page_free(buffer);
+            vmalloc_free(free_map);
+            part_info->free_map = NULL;
+            return false;
+        }
+
+        uint32_t entries = count * entries_per_sector;
+        for(uint32_t i = 0; i < entries && cluster < map_bits; i++, cluster++) {
+            uint32_t value = entry_size == 4 ?
+                ((uint32_t*)buffer)[i] & 0x0FFFFFFF :
+                ((uint16_t*)buffer)[i];
+
+            if(cluster >= 2 && value == 0) {
+                mark_cluster_free(part_info, cluster);
+                part_info->free_count++;
+            }
+        }
+    }
+
+    // FAT32 remembers where the last allocation ended, start from there
+    if(part_info->fs_info_sector != 0) {
+        struct fat_fs_info* fs_info = (struct fat_fs_info*)buffer;
+
+        if(ata_read_sectors(part_info->fs_info_sector, 1, (intptr_t)buffer) &&
+           fs_info->lead_signature == FAT_FS_INFO_LEAD_SIGNATURE &&
+           fs_info->struct_signature == FAT_FS_INFO_STRUCT_SIGNATURE &&
+           fs_info->next_free >= 2 && fs_info->next_free < map_bits) {
+            part_info->next_free_hint = fs_info->next_free;
+        }
+    }
+
+    mem_page_free(buffer);
+    return true;
+}
+
+// Keeps the FAT32 FSInfo sector in sync with our view of the free space
+static bool flush_fs_info(struct fat_part_info* part_info)
+{
+    if(part_info->fs_info_sector == 0)
+        return true;
+
+    uint8_t sector_buffer[part_info->bytes_per_sector];
+    struct fat_fs_info* fs_info = (struct fat_fs_info*)sector_buffer;
+
+    if(!ata_read_sectors(part_info->fs_info_sector, 1, (intptr_t)sector_buffer))
+        return false;
+
+    if(fs_info->lead_signature != FAT_FS_INFO_LEAD_SIGNATURE ||
+       fs_info->struct_signature != FAT_FS_INFO_STRUCT_SIGNATURE)
+        return true; // Not a valid FSInfo, leave it alone
+
+    fs_info->free_count = part_info->free_count;
+    fs_info->next_free = part_info->next_free_hint;
+
+    return ata_write_sectors(part_info->fs_info_sector, 1, (intptr_t)sector_buffer);
+}
+
+// Finds a run of up to 'wanted' free clusters, starting at the allocation hint.
+// If there is no run that long, the longest one found is returned instead.
+static uint32_t find_free_run(struct fat_part_info* part_info, uint32_t wanted, uint32_t* run_length)
+{
+    uint32_t map_bits = part_info->cluster_count + 2;
+    uint32_t cluster = part_info->next_free_hint;
+    uint32_t scanned = 0;
+    uint32_t best_first = 0;
+    uint32_t best_length = 0;
+
+    while(scanned < map_bits) {
+        if(cluster >= map_bits)
+            cluster = 2;
+
+        // Skip 32 clusters at a time while the map is full
+        if((cluster % 32) == 0 && part_info->free_map[cluster / 32] == 0xFFFFFFFF) {
+            cluster += 32;
+            scanned += 32;
+            continue;
+        }
+
+        if(is_cluster_used(part_info, cluster)) {
+            cluster++;
+            scanned++;
+            continue;
+        }
+
+        uint32_t first = cluster;
+        uint32_t length = 0;
+        while(length < wanted && cluster < map_bits && !is_cluster_used(part_info, cluster)) {
+            length++;
+            cluster++;
+        }
+
+        if(length == wanted) {
+            *run_length = length;
+            return first;
+        }
+
+        if(length > best_length) {
+            best_first = first;
+            best_length = length;
+        }
+
+        scanned += length;
+    }
+
+    *run_length = best_length;
+    return best_first;
+}
+
+// Allocates count clusters and chains them onto 'tail' (0 starts a new chain).
+// Returns the first cluster allocated (0 on failure) and the new end of the chain.
+static uint32_t allocate_clusters(struct fat_part_info* part_info, uint32_t tail, uint32_t count, uint32_t* new_tail)
+{
+    uint32_t map_bits = part_info->cluster_count + 2;
+    uint32_t original_tail = tail;
+    uint32_t first_allocated = 0;
+
+    if(count > part_info->free_count)
+        return 0;
+
+    while(count > 0) {
+        uint32_t run_first;
+        uint32_t run_length = 0;
+
+        if(tail != 0 && tail + 1 < map_bits && !is_cluster_used(part_info, tail + 1)) {
+            // The file can keep growing in place, this is the common
+            // case when appending
+            run_first = tail + 1;
+            while(run_length < count &&
+                  run_first + run_length < map_bits &&
+                  !is_cluster_used(part_info, run_first + run_length)) {
+                run_length++;
+            }
+        }
+        else {
+            run_first = find_free_run(part_info, count, &run_length);
+            if(run_length == 0) {
+                rollback_allocation(part_info, original_tail, first_allocated, tail);
+                return 0;
+            }
+        }
+
+        for(uint32_t i = 0; i < run_length; i++)
+            mark_cluster_used(part_info, run_first + i);
+
+        part_info->free_count -= run_length;
+        part_info->next_free_hint = run_first + run_length;
+
+        // When the run directly follows the tail, linking the tail to it is
+        // part of the same FAT update
+        bool ok;
+        if(tail != 0 && tail + 1 == run_first)
+            ok = write_fat_entries(part_info, tail, run_length + 1, true);
+        else
+            ok = write_fat_entries(part_info, run_first, run_length, true) &&
+                 (tail == 0 || set_fat_entry(part_info, tail, run_first));
+
+        if(!ok) {
+            // The run may be partly linked in on disk, put it back as free
+            // and drop the tail's link to it along with everything else
+            write_fat_entries(part_info, run_first, run_length, false);
+            for(uint32_t i = 0; i < run_length; i++)
+                mark_cluster_free(part_info, run_first + i);
+
+            part_info->free_count += run_length;
+            rollback_allocation(part_info, original_tail, first_allocated, tail);
+            return 0;
+        }
+
+        if(first_allocated == 0)
+            first_allocated = run_first;
+
+        tail = run_first + run_length - 1;
+        count -= run_length;
+    }
+
+    *new_tail = tail;
+    return first_allocated;
+}
+
+// Frees the runs an allocation that failed part way through had already
+// chained on, from first up to last, and ends the file at its old tail
+// again. Best effort, we're already on an error path.
+static void rollback_allocation(struct fat_part_info* part_info, uint32_t original_tail, uint32_t first, uint32_t last)
+{
+    uint32_t end_of_chain = part_info->version == fat_version_32 ? FAT32_EOC : FAT16_EOC;
+
+    if(first != 0) {
+        // Cut the chain after the last complete run so that freeing it
+        // stops there, whatever the failed run left behind
+        if(!set_fat_entry(part_info, last, end_of_chain) || !free_cluster_chain(part_info, first))
+            KWARN("FAT: Failed to free clusters of a failed allocation");
+    }
+
+    if(original_tail != 0 && !set_fat_entry(part_info, original_tail, end_of_chain))
+        KWARN("FAT: Failed to end the chain of a failed allocation");
+}
+
+static bool free_cluster_chain(struct fat_part_info* part_info, uint32_t cluster)
+{
+    while(cluster >= 2 && !is_end_of_chain(part_info, cluster)) {
+
+        // Free contiguous stretches of the chain with a single FAT update
+        uint32_t first = cluster;
+        uint32_t length = 1;
+        uint32_t next = get_fat_entry_for_cluster(part_info, cluster);
+        while(next == cluster + 1) {
+            cluster = next;
+            length++;
+            next = get_fat_entry_for_cluster(part_info, cluster);
+        }
+
+        if(!write_fat_entries(part_info, first, length, false))
+            return false;
+
+        for(uint32_t i = 0; i < length; i++)
+            mark_cluster_free(part_info, first + i);
+
+        part_info->free_count += length;
+        cluster = next;
+    }
+
+    return true;
+}
+
+static uint32_t get_chain_tail(struct fat_part_info* part_info, uint32_t first_cluster)
+{
+    uint32_t cluster = first_cluster;
+
+    // Appending to the same file over and over is common (logs!),
+    // start from where we left off last time
+    if(part_info->tail_file_cluster == first_cluster && part_info->tail_cluster != 0)
+        cluster = part_info->tail_cluster;
+
+    while(true) {
+        uint32_t next = get_fat_entry_for_cluster(part_info, cluster);
+        if(next < 2 || is_end_of_chain(part_info, next))
+            break;
+
+        cluster = next;
+    }
+
+    part_info->tail_file_cluster = first_cluster;
+    part_info->tail_cluster = cluster;
+    return cluster;
+}
+
+static void put_fat_value(struct fat_part_info* part_info, uint8_t* sector_buffer, uint32_t index, uint32_t value)
+{
+    if(part_info->version == fat_version_32) {
+        // The top four bits are reserved and must be preserved
+        uint32_t* entry = &((uint32_t*)sector_buffer)[index];
+        *entry = (*entry & 0xF0000000) | (value & 0x0FFFFFFF);
+    }
+    else {
+        ((uint16_t*)sector_buffer)[index] = (uint16_t)value;
+    }
+}
+
+static bool write_fat_sector(struct fat_part_info* part_info, uint32_t fat_sector, uint8_t* sector_buffer)
+{
+    // Keep all copies of the FAT identical
+    for(uint32_t i = 0; i < part_info->num_fats; i++) {
+        uint32_t lba = part_info->fat_begin + (i * part_info->fat_size) + fat_sector;
+
+        if(!ata_write_sectors(lba, 1, (intptr_t)sector_buffer)) {
+            KWARN("FAT: Failed to write FAT sector");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Writes 'count' consecutive FAT entries starting at 'first'. If 'link' is set
+// they're chained together with the last one marked as the end of the chain,
+// otherwise they are all marked free.
+static bool write_fat_entries(struct fat_part_info* part_info, uint32_t first, uint32_t count, bool link)
+{
+    uint32_t entry_size = part_info->version == fat_version_32 ? 4 : 2;
+    uint32_t entries_per_sector = part_info->bytes_per_sector / entry_size;
+    uint32_t end_of_chain = part_info->version == fat_version_32 ? FAT32_EOC : FAT16_EOC;
+    uint32_t last = first + count - 1;
+    uint8_t sector_buffer[part_info->bytes_per_sector];
+
+    uint32_t cluster = first;
+    while(cluster <= last) {
+        uint32_t fat_sector = cluster / entries_per_sector;
+
+        if(!ata_read_sectors(part_info->fat_begin + fat_sector, 1, (intptr_t)sector_buffer)) {
+            KWARN("FAT: Failed to read FAT sector");
+            return false;
+        }
+
+        // Update every entry that lives in this sector before writing it back
+        do {
+            uint32_t value = 0;
+            if(link)
+                value = cluster == last ? end_of_chain : cluster + 1;
+
+            put_fat_value(part_info, sector_buffer, cluster % entries_per_sector, value);
+            cluster++;
+        } while(cluster <= last && cluster / entries_per_sector == fat_sector);
+
+        if(!write_fat_sector(part_info, fat_sector, sector_buffer))
+            return false;
+    }
+
+    return true;
+}
+
+static bool set_fat_entry(struct fat_part_info* part_info, uint32_t cluster, uint32_t value)
+{
+    uint32_t entry_size = part_info->version == fat_version_32 ? 4 : 2;
+    uint32_t entries_per_sector = part_info->bytes_per_sector / entry_size;
+    uint32_t fat_sector = cluster / entries_per_sector;
+    uint8_t sector_buffer[part_info->bytes_per_sector];
+
+    if(!ata_read_sectors(part_info->fat_begin + fat_sector, 1, (intptr_t)sector_buffer)) {
+        KWARN("FAT: Failed to read FAT sector");
+        return false;
+    }
+
+    put_fat_value(part_info, sector_buffer, cluster % entries_per_sector, value);
+
+    return write_fat_sector(part_info, fat_sector, sector_buffer);
+}
+
 // -------------------------------------------------------------------------
 // Static Utilities
 // -------------------------------------------------------------------------
@@ -281,6 +1135,60 @@ static inline bool is_lfn(uint8_t attribute)
           is_volume_id(attribute); 
 }
 
+static inline uint32_t cluster_to_sector(struct fat_part_info* part_info, uint32_t cluster)
+{
+    return part_info->data_begin + ((cluster - 2) * part_info->num_sectors_per_cluster);
+}
+
+static inline uint32_t get_first_cluster(struct fat_part_info* part_info, struct fat_dir_entry* entry)
+{
+    if(part_info->version == fat_version_32)
+        return ((uint32_t)entry->first_cluster_high << 16) | entry->first_cluster;
+
+    return entry->first_cluster;
+}
+
+static inline void set_first_cluster(struct fat_part_info* part_info, struct fat_dir_entry* entry, uint32_t cluster)
+{
+    entry->first_cluster = (uint16_t)cluster;
+
+    if(part_info->version == fat_version_32)
+        entry->first_cluster_high = (uint16_t)(cluster >> 16);
+}
+
+// Walks to the given cluster of the file, starting at the cursor when it
+// isn't past it already
+static uint32_t seek_cluster(struct fat_part_info* part_info, struct fat_file* file, struct fat_cursor* cursor, uint32_t cluster_index)
+{
+    uint32_t cluster = get_first_cluster(part_info, &file->entry);
+    uint32_t index = 0;
+
+    uint32_t flags = spinlock_lock_irqsave(&file->cursor_lock);
+    if(cursor->cluster != 0 && cursor->index <= cluster_index) {
+        cluster = cursor->cluster;
+        index = cursor->index;
+    }
+    spinlock_unlock_irqrestore(&file->cursor_lock, flags);
+
+    for(; index < cluster_index; index++)
+        cluster = get_fat_entry_for_cluster(part_info, cluster);
+
+    return cluster;
+}
+
+static void set_cursor(struct fat_file* file, struct fat_cursor* cursor, uint32_t cluster_index, uint32_t cluster)
+{
+    uint32_t flags = spinlock_lock_irqsave(&file->cursor_lock);
+    cursor->index = cluster_index;
+    cursor->cluster = cluster;
+    spinlock_unlock_irqrestore(&file->cursor_lock, flags);
+}
+
+static bool is_end_of_chain(struct fat_part_info* part_info, uint32_t fat_entry)
+{
+    return is_eof(part_info, fat_entry) || is_bad(part_info, fat_entry);
+}
+
 static bool is_eof(struct fat_part_info* part_info, uint32_t fat_entry)
 {
     switch(part_info->version) {
@@ -403,10 +1311,6 @@ static void dump_fat_dir_entry(struct fat_dir_entry* entry)
 
     fat_date_to_string(entry->last_access_date, date_str);
     terminal_write_string(date_str);
-    terminal_write_char(' ');
-
-    fat_time_to_string(entry->last_access_time, time_str);
-    terminal_write_string(time_str);
     terminal_write_char('\n');
 
     terminal_write_string("Last modified: ");
@@ -5,13 +5,47 @@
 #include <ata.h>
 #include <fat.h>
 #include <terminal.h>
-
+#include <vfs.h>
+#include <page_cache.h>
+#include <mmap.h>
+#include <lock.h>
+
+#define CAT_MAX_BYTES 100
+
+// -------------------------------------------------------------------------
+// Forward Declarations
+// -------------------------------------------------------------------------
+static bool fat_vfs_lookup(void* fs, const char* name, struct vnode* result);
+static int32_t fat_vfs_read(struct vnode* node, uint32_t offset, intptr_t buffer, size_t length);
+static uint32_t fat_vfs_map(struct vnode* node, uint32_t offset, size_t length, uint32_t* lba);
+static void fat_vfs_release(struct vnode* node);
+
+// -------------------------------------------------------------------------
+// Globals
+// -------------------------------------------------------------------------
 struct fat_part_info g_system_part;
 
+static struct vfs_fs_ops g_fat_vfs_ops = {
+    .lookup = fat_vfs_lookup,
+    .read = fat_vfs_read,
+    .map = fat_vfs_map,
+    .release = fat_vfs_release
+};
+
+// Backing storage for vnode->fs_data, one per vnode at most. The VFS looks
+// files up without its own lock held, so handing them out takes ours.
+static struct fat_file g_fat_files[VFS_MAX_VNODES];
+static bool g_fat_files_used[VFS_MAX_VNODES];
+static struct spinlock g_fat_files_lock = SPINLOCK_INIT("fat_files");
+
+// -------------------------------------------------------------------------
+// Public Contract
+// -------------------------------------------------------------------------
+
 bool fs_init()
 {
     // Initialize file system
-    uint32_t* buffer = (uint32_t*)(mem_page_get());
+    uint32_t* buffer = (uint32_t*)(mem_page_get(mem_tag_fs));
 
     if(!ata_read_sectors(0, 1, (intptr_t)buffer)) {
         KERROR("Failed to read MBR!");
@@ -28,6 +62,9 @@ bool fs_init()
             continue;
         }
 
+        page_cache_init();
+        vfs_mount(&g_fat_vfs_ops, &g_system_part);
+
         // We're only supposed to have one partition
         KINFO("System partition initialized");
         return true;
@@ -70,34 +107,107 @@ bool fs_is_fat_type(enum partition_type type)
 
 void fs_cat(const char* filename)
 {
-    struct fat_dir_entry entry;
-    if(!fat_get_dir_entry(&g_system_part, filename, &entry)) {
+    int32_t fd = vfs_open(filename);
+    if(fd < 0) {
         terminal_write_string("No such file '");
         terminal_write_string(filename);
         terminal_write_string("'\n");
         return;
     }
 
-    size_t pages_req = entry.size / PAGE_SIZE;
-    if(entry.size % PAGE_SIZE)
-        pages_req++;
-
-    intptr_t buffer = (intptr_t)mem_page_get_many(pages_req);
+    int32_t size = vfs_size(fd);
+    if(size == 0) {
+        terminal_write_char('\n');
+        vfs_close(fd);
+        return;
+    }
 
-    if(!fat_read_file(&g_system_part, &entry, buffer, pages_req * PAGE_SIZE)) {
+    // Look at the cached pages directly rather than copying them out
+    size_t length = size > CAT_MAX_BYTES ? CAT_MAX_BYTES : (size_t)size;
+    char* data = (char*)mmap_file(fd, 0, length, 0, mmap_flag_shared);
+    if(data == NULL) {
         KERROR("Failed to read file");
+        vfs_close(fd);
         return;
     }
 
-    if(entry.size > 100) {
-        terminal_write_string_n((char*)buffer, 100);
+    terminal_write_string_n(data, length);
+
+    if(size > CAT_MAX_BYTES)
         terminal_write_string("...\n");
-    }
-    else {
-        terminal_write_string_n((char*)buffer, entry.size);
+    else
         terminal_write_char('\n');
+
+    mmap_unmap(data);
+    vfs_close(fd);
+}
+
+bool fs_append(const char* filename, const char* data, size_t length)
+{
+    struct fat_dir_entry entry;
+    if(!fat_get_dir_entry(&g_system_part, filename, &entry) &&
+       !fat_create_file(&g_system_part, filename, &entry))
+        return false;
+
+    bool written = fat_write_file(&g_system_part, &entry, entry.size, (intptr_t)data, length);
+
+    // Nothing in the VFS writes yet, so whatever it has cached is stale now.
+    // Only once the write is done, or an open in between would cache what
+    // it read halfway through. Even a failed write may have grown the file.
+    vfs_forget(filename);
+    return written;
+}
+
+// -------------------------------------------------------------------------
+// FAT VFS glue
+// -------------------------------------------------------------------------
+static bool fat_vfs_lookup(void* fs, const char* name, struct vnode* result)
+{
+    struct fat_part_info* part_info = (struct fat_part_info*)fs;
+
+    struct fat_dir_entry entry;
+    if(!fat_get_dir_entry(part_info, name, &entry))
+        return false;
+
+    uint32_t flags = spinlock_lock_irqsave(&g_fat_files_lock);
+
+    for(size_t i = 0; i < VFS_MAX_VNODES; i++) {
+        if(g_fat_files_used[i])
+            continue;
+
+        g_fat_files_used[i] = true;
+        spinlock_unlock_irqrestore(&g_fat_files_lock, flags);
+
+        struct fat_file* file = &g_fat_files[i];
+        file->entry = entry;
+        file->read_cursor.cluster = 0;
+        file->map_cursor.cluster = 0;
+        spinlock_init(&file->cursor_lock, "fat_cursor");
+
+        result->size = file->entry.size;
+        result->fs_data = file;
+        return true;
     }
 
-    mem_page_free((void*)buffer);
+    spinlock_unlock_irqrestore(&g_fat_files_lock, flags);
+    return false;
+}
+
+static int32_t fat_vfs_read(struct vnode* node, uint32_t offset, intptr_t buffer, size_t length)
+{
+    return fat_read_file_range((struct fat_part_info*)node->fs, (struct fat_file*)node->fs_data, offset, buffer, length);
+}
+
+static uint32_t fat_vfs_map(struct vnode* node, uint32_t offset, size_t length, uint32_t* lba)
+{
+    return fat_map_file_range((struct fat_part_info*)node->fs, (struct fat_file*)node->fs_data, offset, length, lba);
 }
 
+static void fat_vfs_release(struct vnode* node)
+{
+    struct fat_file* file = (struct fat_file*)node->fs_data;
+
+    uint32_t flags = spinlock_lock_irqsave(&g_fat_files_lock);
+    g_fat_files_used[file - g_fat_files] = false;
+    spinlock_unlock_irqrestore(&g_fat_files_lock, flags);
+}
@@ -3,6 +3,13 @@
 #include <types.h>
 #include <interrupt.h>
 #include <terminal.h>
+#include <paging.h>
+#include <thread.h>
+#include <lock.h>
+#include <smp.h>
+#include <softirq.h>
+#include <pic.h>
+#include <arch/x86/cpu.h>
 
 struct PACKED idt_descriptor
 {
@@ -31,26 +38,6 @@ struct PACKED idt_entry
     uint16_t                    offset_high;  // 31:16 of offset
 };
 
-struct PACKED dispatcher
-{
-    uint8_t             pusha;
-    uint8_t             push_esp;
-    uint8_t             push_imm;
-    uint8_t             push_imm_arg;
-    uint8_t             call;
-    uintptr_t           target;
-    uint8_t             add_imm;
-    uint8_t             add_imm_reg;
-    uint8_t             add_imm_arg;
-    uint8_t             popa;
-    uint8_t             iret;
-};
-
-struct dispatcher_data
-{
-    interrupt_handler   handler;
-};
-
 // -------------------------------------------------------------------------
 // Forward Declares
 // -------------------------------------------------------------------------
@@ -58,7 +45,7 @@ static struct idt_descriptor        idt_get();
 static void                         idt_install(struct idt_descriptor* idt);
 static void                         idt_entry_setup(struct idt_entry* entry, uint8_t irq, gate_type type, uint8_t priv_level);
 static enum kresult                 idt_entry_verify(struct idt_entry const * const entry, uint8_t const irq, gate_type const type, uint8_t const priv_level);
-static void                         irq_dispatcher(uint8_t irq, struct irq_regs* regs);
+void                                interrupt_dispatch(struct irq_regs* regs);
 
 static void                         double_fault(uint8_t irq, struct irq_regs* regs);
 static void                         gpf(uint8_t irq, struct irq_regs* regs);
@@ -74,8 +61,14 @@ static void                         invalid_opcode(uint8_t irq, struct irq_regs*
 static struct idt_descriptor        g_idt_descriptor = {};
 static struct idt_entry             g_idt_entries[256] = {};
 
-static struct dispatcher            g_dispatchers[256] = {};
-static struct dispatcher_data       g_dispatcher_data[256] = {};
+// Entry stubs from interrupt_stubs.asm, one per vector
+extern const uintptr_t              interrupt_stub_table[256];
+
+static interrupt_handler            g_handlers[256] = {};
+
+// A bit per dynamic vector that's handed out
+static uint64_t                     g_allocated_vectors;
+static struct spinlock              g_vector_lock = SPINLOCK_INIT("vectors");
 
 // -------------------------------------------------------------------------
 // Exports
@@ -95,6 +88,12 @@ void interrupt_init_system()
     interrupt_receive_trap(0x0E, page_fault);
 }
 
+// The IDT is shared, other CPUs only have to load it
+void interrupt_init_cpu()
+{
+    idt_install(&g_idt_descriptor);
+}
+
 void interrupt_disable_all()
 {
     __asm("cli");
@@ -120,9 +119,7 @@ enum kresult interrupt_install_handler(uint8_t irq, interrupt_handler handler, g
         return result;
     }
 
-    // Add the handler to the dispatch table
-    struct dispatcher_data* data = &g_dispatcher_data[irq];
-    data->handler = handler;
+    g_handlers[irq] = handler;
 
     return kresult_ok;
 }
@@ -154,6 +151,42 @@ void interrupt_disableHandler(uint8_t irq)
     entry->type_attr.bits.present = 0;
 }
 
+uint8_t interrupt_allocate_vector(interrupt_handler handler)
+{
+    uint32_t flags = spinlock_lock_irqsave(&g_vector_lock);
+
+    uint8_t vector = 0;
+    uint64_t free = ~g_allocated_vectors;
+    if(free != 0) {
+        uint32_t index = __builtin_ctzll(free);
+        g_allocated_vectors |= 1ull << index;
+        vector = INTERRUPT_DYNAMIC_FIRST + index;
+    }
+
+    spinlock_unlock_irqrestore(&g_vector_lock, flags);
+
+    if(vector == 0) {
+        KWARN("Out of interrupt vectors");
+        return 0;
+    }
+
+    interrupt_receive(vector, handler);
+    return vector;
+}
+
+void interrupt_free_vector(uint8_t vector)
+{
+    if(vector < INTERRUPT_DYNAMIC_FIRST || vector > INTERRUPT_DYNAMIC_LAST)
+        return;
+
+    // Stray interrupts on it get reported as unhandled from now on
+    g_handlers[vector] = NULL;
+
+    uint32_t flags = spinlock_lock_irqsave(&g_vector_lock);
+    g_allocated_vectors &= ~(1ull << (vector - INTERRUPT_DYNAMIC_FIRST));
+    spinlock_unlock_irqrestore(&g_vector_lock, flags);
+}
+
 // -------------------------------------------------------------------------
 // Private
 // -------------------------------------------------------------------------
@@ -171,65 +204,40 @@ static struct idt_descriptor idt_get()
     return addr;
 }
 
-static void irq_dispatcher(uint8_t irq, struct irq_regs* regs)
+// Called by every stub in interrupt_stubs.asm with the frame it built
+void interrupt_dispatch(struct irq_regs* regs)
 {
-    struct dispatcher_data* data = &g_dispatcher_data[irq];
+    uint8_t irq = regs->vector;
+    interrupt_handler handler = g_handlers[irq];
 
-    if (data->handler == 0) {
-        terminal_write_string("irq_dispatcher, missing handler for interrupt ");
+    if (handler == NULL) {
+        terminal_write_string("interrupt_dispatch, missing handler for interrupt ");
         terminal_write_uint32_x(irq);
         terminal_write_string("\n");
         return;
     }
 
-    data->handler(irq, regs);
-}
-
-static void irq_dispatcher_create(struct dispatcher* destination, uint8_t irq)
-{
-    // CALL is relative to the next instruction
-    uintptr_t next_instruction = (uintptr_t)&destination->add_imm;
-    uintptr_t target = (uintptr_t)irq_dispatcher;
-    uintptr_t relative = target - next_instruction;
-
-    struct dispatcher result = {
-        //
-        // PUSHA
-        .pusha = 0x60,
+    handler(irq, regs);
 
-        // PUSH a pointer to the registers
-        // saved on the stack
-        .push_esp = 0x54,
-
-        // PUSH the IRQ Number
-        .push_imm = 0x6A,
-        .push_imm_arg = irq,
-
-        // CALL target
-        .call = 0xE8,
-        .target = relative,
-
-        // ADD ESP, 0x08 (unwind args from CALL)
-        .add_imm = 0x83,
-        .add_imm_reg = 0xC4,
-        .add_imm_arg = 0x08,
-
-        // POPA
-        .popa = 0x61,
-
-        // IRET
-        .iret = 0xCF
-    };
+    // An exception can come from code that had interrupts off on purpose,
+    // a page fault under an irqsave lock say. Turning them on or switching
+    // away there would break whatever it was holding, so only interrupts
+    // that were let in get to run the deferred work.
+    if(irq < IRQ_0 || (regs->eflags & CPU_EFLAGS_IF) == 0)
+        return;
 
-    *destination = result;
+    // Handlers have sent their EOI by now, so the deferred part can run
+    // with interrupts back on. Then it's safe to switch away and finish
+    // the interrupt once we're scheduled again, unless we came in on top
+    // of a softirq, which has to finish on this CPU first.
+    softirq_run();
+    if(!smp_cpu()->in_softirq)
+        thread_preempt();
 }
 
 static void idt_entry_setup(struct idt_entry* entry, uint8_t irq, gate_type type, uint8_t priv_level)
 {
-    struct dispatcher* dispatcher = &g_dispatchers[irq];
-    irq_dispatcher_create(dispatcher, irq);
-
-    uintptr_t handler_ptr = (uintptr_t)dispatcher;
+    uintptr_t handler_ptr = interrupt_stub_table[irq];
 
     entry->offset_low = (uint16_t)(handler_ptr & 0xFFFF);
     entry->offset_high = (uint16_t)((handler_ptr >> 16) & 0xFFFF);
@@ -287,24 +295,10 @@ static void print_error_code(uint32_t error_code)
 
 static void gpf(uint8_t irq, struct irq_regs* regs)
 {
-    // When we enter an ISR, the stack stack looks like this:
-    //  ____________
-    // |EFlags     | +12
-    // |CS         | +8
-    // |EIP        | +4
-    // |Error code | +0   <---- ESP
-
-    // Because we save all registers in this handy dandy irq_regs
-    // struct upon entering an ISR in assembly, we can now extract
-    // those values!
-
-    // Assume 32-bit stack :(
-    uint32_t* esp = (uint32_t*)(intptr_t)(regs->esp);
-
-    uint32_t error_code = esp[0];
-    uint32_t eip =        esp[1];
-    uint32_t cs =         esp[2];
-    uint32_t eflags =     esp[3];
+    uint32_t error_code = regs->error_code;
+    uint32_t eip =        regs->eip;
+    uint32_t cs =         regs->cs;
+    uint32_t eflags =     regs->eflags;
 
     KERROR("FAULT: Generation Protection Fault!");
     print_error_code(error_code);
@@ -322,8 +316,27 @@ static void gpf(uint8_t irq, struct irq_regs* regs)
 
 static void page_fault(uint8_t irq, struct irq_regs* regs)
 {
+    uint32_t error_code = regs->error_code;
+    uint32_t eip = regs->eip;
+
+    uintptr_t address;
+    __asm("mov %%cr2, %0" : "=r"(address));
+
+    // Copy-on-write and friends
+    if(paging_handle_fault(address, error_code))
+        return;
+
     KERROR("FAULT: Page fault!");
+    terminal_write_string("Address: ");
+    terminal_write_uint32_x(address);
+    terminal_write_string(" Error code: ");
+    terminal_write_uint32_x(error_code);
+    terminal_write_string(" EIP: ");
+    terminal_write_uint32_x(eip);
+    terminal_write_char('\n');
+
     BREAK();
+    KPANIC("Unhandled page fault");
 }
 
 static void stack_segment_fault(uint8_t irq, struct irq_regs* regs)
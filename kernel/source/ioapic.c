@@ -0,0 +1,229 @@
+#include <types.h>
+#include <kernel.h>
+#include <terminal.h>
+#include <acpi.h>
+#include <apic.h>
+#include <lock.h>
+#include <ioapic.h>
+
+// -------------------------------------------------------------------------
+// Static Defines
+// -------------------------------------------------------------------------
+#define IOAPIC_REG_SELECT       0x00    // Byte offsets from the base
+#define IOAPIC_REG_WINDOW       0x10
+
+#define IOAPIC_VERSION          0x01    // Indirect registers
+#define IOAPIC_REDIRECTION      0x10    // Two per entry, low dword first
+
+#define VERSION_MAX_ENTRY_SHIFT 16
+
+#define ENTRY_ACTIVE_LOW        (1 << 13)
+#define ENTRY_LEVEL             (1 << 15)
+#define ENTRY_MASKED            (1 << 16)
+#define ENTRY_DESTINATION_SHIFT 24      // In the high dword
+
+// -------------------------------------------------------------------------
+// Static Types
+// -------------------------------------------------------------------------
+struct ioapic {
+    volatile uint32_t*  base;
+    uint32_t            gsi_base;
+    uint32_t            entries;
+};
+
+// -------------------------------------------------------------------------
+// Forward Declarations
+// -------------------------------------------------------------------------
+static struct ioapic* find_ioapic(uint32_t gsi);
+static uint32_t read_register(struct ioapic* ioapic, uint8_t reg);
+static void write_register(struct ioapic* ioapic, uint8_t reg, uint32_t value);
+static uint32_t override_flags(uint16_t flags);
+
+// -------------------------------------------------------------------------
+// Globals
+// -------------------------------------------------------------------------
+static struct ioapic g_ioapics[IOAPIC_MAX_COUNT];
+static uint32_t g_ioapic_count;
+
+// ISA IRQs are identity mapped unless the MADT says otherwise
+static uint32_t g_isa_gsi[IOAPIC_ISA_IRQS];
+static uint32_t g_isa_flags[IOAPIC_ISA_IRQS];
+
+// The select and window registers are a pair, nobody may come in between
+static struct spinlock g_lock = SPINLOCK_INIT("ioapic");
+
+// -------------------------------------------------------------------------
+// Public Contract
+// -------------------------------------------------------------------------
+bool ioapic_init()
+{
+    if(!apic_is_enabled())
+        return false;
+
+    struct acpi_madt* madt = (struct acpi_madt*)acpi_find_table(ACPI_MADT_SIGNATURE);
+    if(madt == NULL)
+        return false;
+
+    for(uint32_t i = 0; i < IOAPIC_ISA_IRQS; i++) {
+        g_isa_gsi[i] = i;
+        g_isa_flags[i] = 0;
+    }
+
+    for(struct acpi_madt_entry* entry = acpi_madt_next(madt, NULL); entry != NULL; entry = acpi_madt_next(madt, entry)) {
+        if(entry->type == acpi_madt_type_ioapic) {
+            if(g_ioapic_count == IOAPIC_MAX_COUNT) {
+                KWARN("Too many I/O APICs, ignoring the rest");
+                continue;
+            }
+
+            struct acpi_madt_ioapic* madt_ioapic = (struct acpi_madt_ioapic*)entry;
+            struct ioapic* ioapic = &g_ioapics[g_ioapic_count++];
+            ioapic->base = (volatile uint32_t*)(uintptr_t)madt_ioapic->address;
+            ioapic->gsi_base = madt_ioapic->gsi_base;
+        }
+        else if(entry->type == acpi_madt_type_override) {
+            struct acpi_madt_override* override = (struct acpi_madt_override*)entry;
+            if(override->bus != 0 || override->source >= IOAPIC_ISA_IRQS)
+                continue;
+
+            g_isa_gsi[override->source] = override->gsi;
+            g_isa_flags[override->source] = override_flags(override->flags);
+        }
+    }
+
+    if(g_ioapic_count == 0)
+        return false;
+
+    // Nothing gets through until someone routes it
+    for(uint32_t i = 0; i < g_ioapic_count; i++) {
+        struct ioapic* ioapic = &g_ioapics[i];
+        ioapic->entries = ((read_register(ioapic, IOAPIC_VERSION) >> VERSION_MAX_ENTRY_SHIFT) & 0xFF) + 1;
+
+        for(uint32_t entry = 0; entry < ioapic->entries; entry++) {
+            write_register(ioapic, IOAPIC_REDIRECTION + entry * 2, ENTRY_MASKED);
+            write_register(ioapic, IOAPIC_REDIRECTION + entry * 2 + 1, 0);
+        }
+    }
+
+    return true;
+}
+
+bool ioapic_is_enabled()
+{
+    return g_ioapic_count != 0;
+}
+
+uint32_t ioapic_isa_to_gsi(uint8_t irq, uint32_t* flags)
+{
+    if(irq >= IOAPIC_ISA_IRQS) {
+        *flags = 0;
+        return irq;
+    }
+
+    *flags = g_isa_flags[irq];
+    return g_isa_gsi[irq];
+}
+
+bool ioapic_route(uint32_t gsi, uint8_t vector, uint32_t flags, uint32_t apic_id)
+{
+    struct ioapic* ioapic = find_ioapic(gsi);
+    if(ioapic == NULL) {
+        KWARN("No I/O APIC handles that GSI");
+        return false;
+    }
+
+    uint32_t low = vector | ENTRY_MASKED;
+    if(flags & ioapic_flag_active_low)
+        low |= ENTRY_ACTIVE_LOW;
+    if(flags & ioapic_flag_level)
+        low |= ENTRY_LEVEL;
+
+    uint8_t reg = IOAPIC_REDIRECTION + (gsi - ioapic->gsi_base) * 2;
+
+    uint32_t irq_flags = spinlock_lock_irqsave(&g_lock);
+    write_register(ioapic, reg, ENTRY_MASKED);
+    write_register(ioapic, reg + 1, apic_id << ENTRY_DESTINATION_SHIFT);
+    write_register(ioapic, reg, low);
+    spinlock_unlock_irqrestore(&g_lock, irq_flags);
+
+    return true;
+}
+
+bool ioapic_set_destination(uint32_t gsi, uint32_t apic_id)
+{
+    struct ioapic* ioapic = find_ioapic(gsi);
+    if(ioapic == NULL)
+        return false;
+
+    // Takes effect with the next interrupt, one already in flight still
+    // goes to the old CPU
+    uint32_t flags = spinlock_lock_irqsave(&g_lock);
+    write_register(ioapic, IOAPIC_REDIRECTION + (gsi - ioapic->gsi_base) * 2 + 1, apic_id << ENTRY_DESTINATION_SHIFT);
+    spinlock_unlock_irqrestore(&g_lock, flags);
+
+    return true;
+}
+
+void ioapic_mask(uint32_t gsi)
+{
+    struct ioapic* ioapic = find_ioapic(gsi);
+    if(ioapic == NULL)
+        return;
+
+    uint8_t reg = IOAPIC_REDIRECTION + (gsi - ioapic->gsi_base) * 2;
+
+    uint32_t flags = spinlock_lock_irqsave(&g_lock);
+    write_register(ioapic, reg, read_register(ioapic, reg) | ENTRY_MASKED);
+    spinlock_unlock_irqrestore(&g_lock, flags);
+}
+
+void ioapic_unmask(uint32_t gsi)
+{
+    struct ioapic* ioapic = find_ioapic(gsi);
+    if(ioapic == NULL)
+        return;
+
+    uint8_t reg = IOAPIC_REDIRECTION + (gsi - ioapic->gsi_base) * 2;
+
+    uint32_t flags = spinlock_lock_irqsave(&g_lock);
+    write_register(ioapic, reg, read_register(ioapic, reg) & ~ENTRY_MASKED);
+    spinlock_unlock_irqrestore(&g_lock, flags);
+}
+
+// -------------------------------------------------------------------------
+// Static Functions
+// -------------------------------------------------------------------------
+static struct ioapic* find_ioapic(uint32_t gsi)
+{
+    for(uint32_t i = 0; i < g_ioapic_count; i++) {
+        struct ioapic* ioapic = &g_ioapics[i];
+        if(gsi >= ioapic->gsi_base && gsi < ioapic->gsi_base + ioapic->entries)
+            return ioapic;
+    }
+
+    return NULL;
+}
+
+static uint32_t read_register(struct ioapic* ioapic, uint8_t reg)
+{
+    ioapic->base[IOAPIC_REG_SELECT / sizeof(uint32_t)] = reg;
+    return ioapic->base[IOAPIC_REG_WINDOW / sizeof(uint32_t)];
+}
+
+static void write_register(struct ioapic* ioapic, uint8_t reg, uint32_t value)
+{
+    ioapic->base[IOAPIC_REG_SELECT / sizeof(uint32_t)] = reg;
+    ioapic->base[IOAPIC_REG_WINDOW / sizeof(uint32_t)] = value;
+}
+
+static uint32_t override_flags(uint16_t flags)
+{
+    uint32_t result = 0;
+
+    if((flags & acpi_madt_override_polarity_mask) == acpi_madt_override_polarity_low)
+        result |= ioapic_flag_active_low;
+    if((flags & acpi_madt_override_trigger_mask) == acpi_madt_override_trigger_level)
+        result |= ioapic_flag_level;
+
+    return result;
+}
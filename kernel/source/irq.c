@@ -0,0 +1,155 @@
+#include <types.h>
+#include <kernel.h>
+#include <terminal.h>
+#include <pic.h>
+#include <apic.h>
+#include <ioapic.h>
+#include <smp.h>
+#include <irq.h>
+
+// -------------------------------------------------------------------------
+// Forward Declarations
+// -------------------------------------------------------------------------
+static bool route(uint8_t irq);
+
+// -------------------------------------------------------------------------
+// Globals
+// -------------------------------------------------------------------------
+static bool g_use_ioapic;
+
+// Remembered so they can be moved over to the I/O APIC
+static uint16_t g_enabled;
+static uint32_t g_affinity[IRQ_COUNT];
+
+// -------------------------------------------------------------------------
+// Public Contract
+// -------------------------------------------------------------------------
+void irq_init()
+{
+    if(!ioapic_init()) {
+        KINFO("No I/O APIC, IRQs stay on the PIC");
+        return;
+    }
+
+    // Interrupts are still off, so nothing is lost during the move. The
+    // PIC keeps whatever couldn't be routed.
+    for(uint8_t irq = 0; irq < IRQ_COUNT; irq++) {
+        if((g_enabled & (1 << irq)) && route(irq))
+            pic_disable_irq(irq);
+    }
+
+    g_use_ioapic = true;
+    KINFO("IRQs are routed through the I/O APIC");
+}
+
+void irq_enable(uint8_t irq)
+{
+    if(irq >= IRQ_COUNT)
+        return;
+
+    g_enabled |= 1 << irq;
+
+    if(!g_use_ioapic) {
+        pic_enable_irq(irq);
+        return;
+    }
+
+    route(irq);
+}
+
+void irq_disable(uint8_t irq)
+{
+    if(irq >= IRQ_COUNT)
+        return;
+
+    g_enabled &= ~(1 << irq);
+
+    if(!g_use_ioapic) {
+        pic_disable_irq(irq);
+        return;
+    }
+
+    uint32_t flags;
+    ioapic_mask(ioapic_isa_to_gsi(irq, &flags));
+}
+
+void irq_send_eoi(uint8_t irq)
+{
+    if(g_use_ioapic)
+        apic_send_eoi();
+    else
+        pic_send_eoi(irq);
+}
+
+bool irq_set_affinity(uint8_t irq, uint32_t cpu)
+{
+    if(irq >= IRQ_COUNT)
+        return false;
+
+    struct cpu* target = smp_get_cpu(cpu);
+    if(target == NULL || !target->online) {
+        KWARN("No such CPU to send the IRQ to");
+        return false;
+    }
+
+    if(!g_use_ioapic) {
+        if(cpu != 0) {
+            KWARN("The PIC can only interrupt the boot CPU");
+            return false;
+        }
+
+        return true;
+    }
+
+    g_affinity[irq] = cpu;
+
+    uint32_t flags;
+    return ioapic_set_destination(ioapic_isa_to_gsi(irq, &flags), target->apic_id);
+}
+
+uint32_t irq_get_affinity(uint8_t irq)
+{
+    return irq < IRQ_COUNT ? g_affinity[irq] : 0;
+}
+
+void irq_print_routes()
+{
+    terminal_write_string(g_use_ioapic ? "Routed through the I/O APIC\n" : "Routed through the PIC\n");
+
+    for(uint8_t irq = 0; irq < IRQ_COUNT; irq++) {
+        if(!(g_enabled & (1 << irq)))
+            continue;
+
+        uint32_t flags;
+        uint32_t gsi = g_use_ioapic ? ioapic_isa_to_gsi(irq, &flags) : irq;
+
+        terminal_write_string("IRQ ");
+        terminal_write_uint32(irq);
+        terminal_write_string(" GSI ");
+        terminal_write_uint32(gsi);
+        terminal_write_string(" CPU ");
+        terminal_write_uint32(g_affinity[irq]);
+        terminal_write_string("\n");
+    }
+}
+
+// -------------------------------------------------------------------------
+// Static Functions
+// -------------------------------------------------------------------------
+
+// Points the IRQ at its CPU and lets it through
+static bool route(uint8_t irq)
+{
+    struct cpu* cpu = smp_get_cpu(g_affinity[irq]);
+    if(cpu == NULL)
+        cpu = smp_get_cpu(0);
+
+    uint32_t flags;
+    uint32_t gsi = ioapic_isa_to_gsi(irq, &flags);
+
+    if(!ioapic_route(gsi, IRQ_0 + irq, flags, cpu->apic_id))
+        return false;
+
+    ioapic_unmask(gsi);
+    return true;
+}
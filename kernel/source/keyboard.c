@@ -2,14 +2,19 @@
 #include <stdbool.h>
 
 #include <pic.h>
+#include <irq.h>
 #include <pio.h>
 #include <interrupt.h>
+#include <softirq.h>
 #include <kernel.h>
 #include <keyboard.h>
 #include <scan_code.h>
 #include <terminal.h>
 #include <debug.h>
 
+// Scan codes waiting for the tasklet, a power of two
+#define KB_BUFFER_SIZE 64
+
 enum key_event_type {
     key_event_type_down,
     key_event_type_up
@@ -20,7 +25,17 @@ bool g_initial_ack_received;
 struct sc_set*          g_current_set;
 struct sc_map*          g_current_map;
 
+// Filled by the interrupt, emptied by the tasklet. Each side only moves
+// its own index, so they need no lock.
+static uint8_t              g_buffer[KB_BUFFER_SIZE];
+static volatile uint32_t    g_buffer_head;
+static volatile uint32_t    g_buffer_tail;
+
 static void kb_handle_interrupt(uint8_t irq, struct irq_regs* regs);
+static void kb_handle_scan_codes(struct tasklet* tasklet, void* data);
+static void kb_handle_scan_code(uint8_t scan_code);
+
+static struct tasklet g_tasklet = TASKLET_INIT(kb_handle_scan_codes, NULL);
 
 char kb_get_printable_key(bool shift, enum keys key)
 {
@@ -181,7 +196,7 @@ void kb_init()
     reset_map();
 
     // Enable the keyboard
-    pic_enable_irq(pic_irq_keyboard);
+    irq_enable(pic_irq_keyboard);
     OUTB(0x60, 0xF4); // Enable on the encoder
     OUTB(0x64, 0xAE); // Enable on the controller
 
@@ -192,6 +207,34 @@ static void kb_handle_interrupt(uint8_t irq, struct irq_regs* regs)
 {
     uint8_t scan_code = INB(0x60);
 
+    // A full buffer means the tasklet is way behind, the key is lost
+    if(g_buffer_head - g_buffer_tail < KB_BUFFER_SIZE) {
+        g_buffer[g_buffer_head & (KB_BUFFER_SIZE - 1)] = scan_code;
+        __sync_synchronize();
+        g_buffer_head = g_buffer_head + 1;
+    }
+
+    irq_send_eoi(pic_irq_keyboard);
+
+    // Translating and handing the key out, which usually ends up drawing
+    // to the terminal, happens with interrupts on
+    tasklet_schedule(&g_tasklet);
+}
+
+static void kb_handle_scan_codes(struct tasklet* tasklet, void* data)
+{
+    while(g_buffer_tail != g_buffer_head) {
+        __sync_synchronize();
+        uint8_t scan_code = g_buffer[g_buffer_tail & (KB_BUFFER_SIZE - 1)];
+        __sync_synchronize();
+        g_buffer_tail = g_buffer_tail + 1;
+
+        kb_handle_scan_code(scan_code);
+    }
+}
+
+static void kb_handle_scan_code(uint8_t scan_code)
+{
     if(scan_code == 0xFA && !g_initial_ack_received) {
 
         // Currently, we seem to be getting an interrupt
@@ -201,7 +244,6 @@ static void kb_handle_interrupt(uint8_t irq, struct irq_regs* regs)
         // know why this is being sent. We have only ever seen it
         // get "sent" once, in this instance. So we simply ignore it.
         g_initial_ack_received = true;
-        pic_send_eoi(pic_irq_keyboard);
         return;
     }
 
@@ -244,7 +286,5 @@ static void kb_handle_interrupt(uint8_t irq, struct irq_regs* regs)
                 break;
         }
     }
-
-    pic_send_eoi(pic_irq_keyboard);
 }
 
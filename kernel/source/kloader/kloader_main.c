@@ -8,6 +8,7 @@
 #include <fat.h>
 #include <debug.h>
 #include <elf.h>
+#include <string.h>
 
 #define KERNEL_LOAD_ADDRESS 0x100000
 
@@ -15,6 +16,8 @@ typedef void ((*kernel_entry)(struct mem_map_entry[], uint32_t));
 
 void kloader_cmain(struct mem_map_entry mem_map[], uint32_t mem_entry_count)
 {
+    string_init();
+
     screen_init();
     screen_cursor_hide();
     terminal_init();
@@ -0,0 +1,292 @@
+#include <types.h>
+#include <kernel.h>
+#include <terminal.h>
+#include <lock.h>
+#include <arch/x86/cpu.h>
+
+// -------------------------------------------------------------------------
+// Static Defines
+// -------------------------------------------------------------------------
+#define RW_LOCK_WRITER  0x80000000
+#define RW_LOCK_READERS 0x7FFFFFFF
+
+// -------------------------------------------------------------------------
+// Forward Declarations
+// -------------------------------------------------------------------------
+#ifdef LOCK_STATS
+static void stats_acquired(struct lock_stats* stats, bool contended);
+static void stats_released(struct lock_stats* stats);
+static void stats_register(struct lock_stats* stats);
+#endif
+
+// -------------------------------------------------------------------------
+// Globals
+// -------------------------------------------------------------------------
+#ifdef LOCK_STATS
+static struct lock_stats* g_stats;
+#endif
+
+// -------------------------------------------------------------------------
+// Public Contract
+// -------------------------------------------------------------------------
+void spinlock_init(struct spinlock* lock, const char* name)
+{
+    *lock = (struct spinlock)SPINLOCK_INIT(name);
+}
+
+void spinlock_lock(struct spinlock* lock)
+{
+    bool contended = false;
+
+    // Spin on a plain read so waiting CPUs don't keep stealing the cache
+    // line from each other, only try the swap once it looks free
+    while(__sync_lock_test_and_set(&lock->locked, 1) != 0) {
+        contended = true;
+        while(lock->locked != 0) {
+            __asm("pause");
+        }
+    }
+
+#ifdef LOCK_STATS
+    stats_acquired(&lock->stats, contended);
+#else
+    (void)contended;
+#endif
+}
+
+bool spinlock_try_lock(struct spinlock* lock)
+{
+    if(lock->locked != 0 || __sync_lock_test_and_set(&lock->locked, 1) != 0)
+        return false;
+
+#ifdef LOCK_STATS
+    stats_acquired(&lock->stats, false);
+#endif
+    return true;
+}
+
+void spinlock_unlock(struct spinlock* lock)
+{
+#ifdef LOCK_STATS
+    stats_released(&lock->stats);
+#endif
+    __sync_lock_release(&lock->locked);
+}
+
+uint32_t spinlock_lock_irqsave(struct spinlock* lock)
+{
+    uint32_t flags = cpu_irq_save();
+    spinlock_lock(lock);
+    return flags;
+}
+
+void spinlock_unlock_irqrestore(struct spinlock* lock, uint32_t flags)
+{
+    spinlock_unlock(lock);
+    cpu_irq_restore(flags);
+}
+
+void ticket_lock_init(struct ticket_lock* lock, const char* name)
+{
+    *lock = (struct ticket_lock)TICKET_LOCK_INIT(name);
+}
+
+void ticket_lock_lock(struct ticket_lock* lock)
+{
+    uint32_t ticket = __sync_fetch_and_add(&lock->next, 1);
+
+    bool contended = false;
+    while(lock->owner != ticket) {
+        contended = true;
+        __asm("pause");
+    }
+
+    // Nothing from the critical section may be read before we own it
+    __sync_synchronize();
+
+#ifdef LOCK_STATS
+    stats_acquired(&lock->stats, contended);
+#else
+    (void)contended;
+#endif
+}
+
+void ticket_lock_unlock(struct ticket_lock* lock)
+{
+#ifdef LOCK_STATS
+    stats_released(&lock->stats);
+#endif
+
+    // Only the owner ever writes it, but its stores have to land first
+    __sync_synchronize();
+    lock->owner = lock->owner + 1;
+}
+
+uint32_t ticket_lock_lock_irqsave(struct ticket_lock* lock)
+{
+    uint32_t flags = cpu_irq_save();
+    ticket_lock_lock(lock);
+    return flags;
+}
+
+void ticket_lock_unlock_irqrestore(struct ticket_lock* lock, uint32_t flags)
+{
+    ticket_lock_unlock(lock);
+    cpu_irq_restore(flags);
+}
+
+void rw_lock_init(struct rw_lock* lock, const char* name)
+{
+    *lock = (struct rw_lock)RW_LOCK_INIT(name);
+}
+
+void rw_lock_read_lock(struct rw_lock* lock)
+{
+    bool contended = false;
+
+    while(true) {
+        uint32_t state = lock->state;
+        if((state & RW_LOCK_WRITER) == 0 &&
+           __sync_bool_compare_and_swap(&lock->state, state, state + 1))
+            break;
+
+        contended = true;
+        __asm("pause");
+    }
+
+    // Readers overlap, so only count them. Hold times are for writers.
+#ifdef LOCK_STATS
+    stats_register(&lock->stats);
+    __sync_fetch_and_add(&lock->stats.acquisitions, 1);
+    if(contended)
+        __sync_fetch_and_add(&lock->stats.contentions, 1);
+#else
+    (void)contended;
+#endif
+}
+
+void rw_lock_read_unlock(struct rw_lock* lock)
+{
+    __sync_fetch_and_sub(&lock->state, 1);
+}
+
+void rw_lock_write_lock(struct rw_lock* lock)
+{
+    bool contended = false;
+
+    // Claim the writer bit first, that keeps new readers out
+    while(true) {
+        uint32_t state = lock->state;
+        if((state & RW_LOCK_WRITER) == 0 &&
+           __sync_bool_compare_and_swap(&lock->state, state, state | RW_LOCK_WRITER))
+            break;
+
+        contended = true;
+        __asm("pause");
+    }
+
+    // Then wait for the ones already inside to leave
+    while((lock->state & RW_LOCK_READERS) != 0) {
+        contended = true;
+        __asm("pause");
+    }
+
+#ifdef LOCK_STATS
+    stats_acquired(&lock->stats, contended);
+#else
+    (void)contended;
+#endif
+}
+
+void rw_lock_write_unlock(struct rw_lock* lock)
+{
+#ifdef LOCK_STATS
+    stats_released(&lock->stats);
+#endif
+    __sync_fetch_and_and(&lock->state, ~RW_LOCK_WRITER);
+}
+
+uint32_t rw_lock_read_lock_irqsave(struct rw_lock* lock)
+{
+    uint32_t flags = cpu_irq_save();
+    rw_lock_read_lock(lock);
+    return flags;
+}
+
+void rw_lock_read_unlock_irqrestore(struct rw_lock* lock, uint32_t flags)
+{
+    rw_lock_read_unlock(lock);
+    cpu_irq_restore(flags);
+}
+
+uint32_t rw_lock_write_lock_irqsave(struct rw_lock* lock)
+{
+    uint32_t flags = cpu_irq_save();
+    rw_lock_write_lock(lock);
+    return flags;
+}
+
+void rw_lock_write_unlock_irqrestore(struct rw_lock* lock, uint32_t flags)
+{
+    rw_lock_write_unlock(lock);
+    cpu_irq_restore(flags);
+}
+
+void lock_stats_print()
+{
+#ifdef LOCK_STATS
+    terminal_write_string("Lock                 Taken      Contended  Max hold (cycles)\n");
+
+    for(struct lock_stats* stats = g_stats; stats != NULL; stats = stats->next) {
+        terminal_write_string_endpadded(stats->name != NULL ? stats->name : "?", 21);
+        terminal_write_uint32(stats->acquisitions);
+        terminal_write_string(" ");
+        terminal_write_uint32(stats->contentions);
+        terminal_write_string(" ");
+        terminal_write_uint64_x(stats->max_hold);
+        terminal_write_string("\n");
+    }
+#else
+    terminal_write_string("Lock statistics aren't built in, set LOCK_STATS\n");
+#endif
+}
+
+// -------------------------------------------------------------------------
+// Static Functions
+// -------------------------------------------------------------------------
+#ifdef LOCK_STATS
+
+// Called with the lock held, so the counters need no atomics
+static void stats_acquired(struct lock_stats* stats, bool contended)
+{
+    stats_register(stats);
+
+    stats->acquisitions++;
+    if(contended)
+        stats->contentions++;
+
+    stats->acquired_at = cpu_read_tsc();
+}
+
+static void stats_released(struct lock_stats* stats)
+{
+    uint64_t held = cpu_read_tsc() - stats->acquired_at;
+    if(held > stats->max_hold)
+        stats->max_hold = held;
+}
+
+// Locks are mostly static, so they join the list the first time they're
+// taken instead of needing an init call
+static void stats_register(struct lock_stats* stats)
+{
+    if(stats->registered || !__sync_bool_compare_and_swap(&stats->registered, false, true))
+        return;
+
+    struct lock_stats* head;
+    do {
+        head = g_stats;
+        stats->next = head;
+    } while(!__sync_bool_compare_and_swap(&g_stats, head, stats));
+}
+
+#endif
@@ -18,21 +18,22 @@
 #include <fat.h>
 #include <elf.h>
 #include <pic.h>
-
-static void call_test_sys_call(uint32_t foo)
-{
-    __asm("mov %0, %%eax"
-            :
-            : "r"(foo)
-            : "eax");
-    __asm("int $0x80");
-}
-
-void isr_syscall(uint8_t irq, struct irq_regs* regs)
+#include <paging.h>
+#include <clock.h>
+#include <timer.h>
+#include <thread.h>
+#include <acpi.h>
+#include <smp.h>
+#include <irq.h>
+#include <syscall.h>
+#include <shared_page.h>
+#include <arch/x86/fpu.h>
+#include <string.h>
+
+static void cli_main(void* arg)
 {
-    terminal_write_string("0x80 Sys Call, foo: ");
-    terminal_write_uint32_x(regs->eax);
-    terminal_write_string("\n");
+    cli_init();
+    cli_run();
 }
 
 void print_welcome()
@@ -47,6 +48,8 @@ void print_welcome()
 
 SECTION_BOOT void _start(struct mem_map_entry mem_map[], uint32_t mem_entry_count)
 {
+    string_init();
+
     screen_init();
     screen_cursor_hide();
 
@@ -55,13 +58,16 @@ SECTION_BOOT void _start(struct mem_map_entry mem_map[], uint32_t mem_entry_coun
     print_welcome();
 
     interrupt_init_system();
-    interrupt_receive_trap(0x80, isr_syscall);
+    syscall_init();
+    fpu_init();
 
     pic_init();
 
     mem_mgr_init(mem_map, mem_entry_count);
     mem_mgr_gdt_setup();
 
+    paging_init();
+
     kb_init();
 
     // Let's do some hdd stuff m8
@@ -70,23 +76,27 @@ SECTION_BOOT void _start(struct mem_map_entry mem_map[], uint32_t mem_entry_coun
     fs_init();
 
     pit_init();
+    clock_init();
+    timer_init();
+    thread_init();
+
+    acpi_init();
+    smp_init();
+    irq_init();
+    shared_page_init();
 
     // Re-enable interrupts, we're ready now!
     interrupt_enable_all();
 
     usb_init();
 
-    call_test_sys_call(0x1234);
-
     terminal_write_string("Kernel initialized, off to you, interrupts!\n");
 
-    elf_run("USERLANDELF");
-
-    cli_init();
-
+    // The shell gets its own thread, we head off to user mode
+    thread_create("cli", cli_main, NULL, thread_priority_normal);
 
-    cli_run();
+    elf_run("USERLANDELF");
 
-    while(1);
+    thread_exit();
 }
 
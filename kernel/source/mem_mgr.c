@@ -3,6 +3,12 @@
 #include <mem_mgr.h>
 #include <terminal.h>
 #include <debug.h>
+#include <smp.h>
+#include <lock.h>
+#include <page_alloc.h>
+#include <paging.h>
+#include <string.h>
+#include <arch/x86/cpu.h>
 
 //#define GDT_DEBUG
 
@@ -10,12 +16,22 @@
 // Static Defines
 // -------------------------------------------------------------------------
 
-#define PAGE_USED (1 << 7)
-#define FIRST_IN_ALLOCATION (1 << 6)
-#define PAGE_RESERVED (1 << 5)
-#define IS_PAGE_USED(x) ((x & PAGE_USED) == PAGE_USED)
-#define IS_FIRST_IN_ALLOCATION(x) ((x & FIRST_IN_ALLOCATION) == FIRST_IN_ALLOCATION)
-#define IS_PAGE_RESERVED(x) ((x & PAGE_RESERVED) == PAGE_RESERVED)
+#define MAX_RECLAIMERS 4
+
+// Pages kept zeroed ahead of time, and how many the idle loop zeroes
+// before looking for other work again
+#define ZERO_POOL_SIZE 64
+#define ZERO_POOL_BATCH 4
+
+// Single pages each CPU keeps to itself, and how many move to or from the
+// global map at once when it runs empty or full
+#define MAGAZINE_SIZE 32
+#define MAGAZINE_BATCH 16
+
+#define MAX_RESERVATIONS 8
+
+// The last allocations and frees, when built with MEM_TRACE
+#define TRACE_SIZE 64
 
 #define NYBL(TargetType, Value, AtBit) ((((TargetType)Value) >> AtBit) & 0x0F)
 #define BYTE(TargetType, Value, AtBit) ((((TargetType)Value) >> AtBit) & 0xFF)
@@ -34,13 +50,32 @@
 // -------------------------------------------------------------------------
 // Static Types
 // -------------------------------------------------------------------------
-struct page {
-    uint8_t flags;
+// Only ever touched by its own CPU with interrupts off, so it needs no
+// lock. The pages in it are still allocated as far as the map is concerned.
+struct magazine {
+    void* pages[MAGAZINE_SIZE];
+    size_t count;
+};
 
-    // Note: The fact that this is an uint16 means page allocations
-    //       are limited to UINT16_MAXVALUE, which is roughly 256MB
-    uint16_t consecutive_pages_allocated;
-} PACKED;
+struct tag_stats {
+    volatile uint32_t pages;
+    volatile uint32_t peak;
+    volatile uint32_t allocations;
+};
+
+struct reservation {
+    const char* identifier;
+    uintptr_t address;
+    size_t pages;
+};
+
+struct trace_entry {
+    uintptr_t address;
+    uintptr_t caller;
+    uint16_t pages;
+    uint8_t tag;
+    bool freed;
+};
 
 struct gtdd {
     uint16_t size;   // Size of table - 1
@@ -63,8 +98,8 @@ enum gdt_access {
 };
 
 // Stores data for a task, in our case
-// we only have one task which we use
-// for all user-mode code. Its only
+// there's one per CPU, shared by all
+// the threads running on it. Its only
 // utility is so that INT can determine
 // what stack to setup when switching
 // back into kernel mode
@@ -125,12 +160,43 @@ static struct mem_map_entry** g_mem_map;
 static uint32_t g_mem_map_entries;
 
 // Map of all pages we can allocate
-static struct page* g_pages;
-static size_t g_max_pages;
+static struct page_map g_page_map;
+static struct spinlock g_pages_lock = SPINLOCK_INIT("pages");
 static size_t g_total_available_memory;
 
-// Global descriptor table
-static uint64_t g_gdt[] ALIGN(8) = {
+// Caches that hand memory back when we run out
+static mem_reclaim_callback g_reclaimers[MAX_RECLAIMERS];
+
+// Allocated as far as the map is concerned, handed out by
+// mem_page_get_zeroed and given back first when memory runs out
+static void* g_zero_pool[ZERO_POOL_SIZE];
+static size_t g_zero_pool_count;
+static struct spinlock g_zero_pool_lock = SPINLOCK_INIT("zero_pool");
+
+static struct magazine g_magazines[SMP_MAX_CPUS];
+
+static struct tag_stats g_tag_stats[mem_tag_count];
+static struct reservation g_reservations[MAX_RESERVATIONS];
+static size_t g_reservation_count;
+
+static const char* const g_tag_names[mem_tag_count] = {
+    [mem_tag_kernel]     = "kernel",
+    [mem_tag_fs]         = "fs",
+    [mem_tag_page_cache] = "page cache",
+    [mem_tag_mmap]       = "mmap",
+    [mem_tag_paging]     = "paging",
+    [mem_tag_elf]        = "elf",
+    [mem_tag_thread]     = "thread",
+    [mem_tag_usb]        = "usb"
+};
+
+#ifdef MEM_TRACE
+static struct trace_entry g_trace[TRACE_SIZE];
+static volatile uint32_t g_trace_next;
+#endif
+
+// Global descriptor table, every CPU gets a copy pointing at its own TSS
+static const uint64_t g_gdt_template[] = {
     GDT_ENTRY_(0, 0, 0, 0),
     GDT_ENTRY(0x00FFFFFF, 0x00000000, gdt_access_rw | gdt_access_present | gdt_access_executable, gdt_flag_4k | gdt_flag_32bit),
     GDT_ENTRY(0x00FFFFFF, 0x00000000, gdt_access_rw | gdt_access_present, gdt_flag_4k | gdt_flag_32bit),
@@ -140,13 +206,15 @@ static uint64_t g_gdt[] ALIGN(8) = {
     GDT_ENTRY_(0, 0, 0, 0)
 };
 
-static size_t g_gdt_count = sizeof(g_gdt) / sizeof(uint64_t);
+#define GDT_ENTRY_COUNT (sizeof(g_gdt_template) / sizeof(uint64_t))
+static uint64_t g_gdt[SMP_MAX_CPUS][GDT_ENTRY_COUNT] ALIGN(8);
+static size_t g_gdt_count = GDT_ENTRY_COUNT;
 
-static struct gtdd g_gtdd ALIGN(8);
+static struct gtdd g_gtdd[SMP_MAX_CPUS] ALIGN(8);
 
 #define TSS_GTD_TYPE (0x89)
 #define TSS_GDTD_INDEX (g_gdt_count - 1)
-static struct tss g_tss ALIGN(8);
+static struct tss g_tss[SMP_MAX_CPUS] ALIGN(8);
 
 // -------------------------------------------------------------------------
 // Forward Declarations
@@ -155,11 +223,27 @@ static char* get_mem_type(enum region_type type);
 static void print_memory_nice(uint64_t memory_in_bytes);
 static void print_mem_entry(size_t index, uint64_t base, uint64_t length, char* description);
 static void test_allocator();
-static void tss_install();
-static void gdt_install();
+static bool is_page_usable(struct mem_map_entry mem_map[], uint32_t count, size_t page);
+static size_t next_region_boundary(struct mem_map_entry mem_map[], uint32_t count, size_t page);
+static size_t reserve_unusable(struct mem_map_entry mem_map[], uint32_t count);
+static void tss_install(uint32_t cpu);
+static void gdt_install(uint32_t cpu);
+static void* find_pages_locked(uint16_t how_many);
+static void free_pages_locked(void* address);
+static bool reclaim_pages(size_t pages_wanted);
+static size_t drain_zero_pool(size_t pages_wanted);
+static struct magazine* local_magazine();
+static void* magazine_get();
+static bool magazine_put(size_t page_index);
+static size_t magazine_drain(struct magazine* magazine, size_t how_many);
+static size_t magazine_flush();
+static void* get_page();
+static void account(void* address, size_t pages, enum mem_tag tag, uintptr_t caller);
+static void unaccount(size_t page_index, uintptr_t caller);
+static void trace(uintptr_t address, size_t pages, enum mem_tag tag, bool freed, uintptr_t caller);
 
 #ifdef GDT_DEBUG
-void print_gdt()
+void print_gdt(uint32_t cpu)
 {
     terminal_write_string("Global Descriptor Table: \n");
     terminal_indentation_increase();
@@ -167,7 +251,7 @@ void print_gdt()
         terminal_write_char('[');
         terminal_write_uint32(i);
         terminal_write_string("] ");
-        terminal_write_uint64_bytes(g_gdt[i]);
+        terminal_write_uint64_bytes(g_gdt[cpu][i]);
         terminal_write_string(".\n");
     }
     terminal_indentation_decrease();
@@ -187,17 +271,19 @@ void mem_mgr_init(struct mem_map_entry mem_map[], uint32_t mem_entry_count)
         return;
     }
 
+    uint64_t memory_end = 0;
     for (int i = 0; i < mem_entry_count; i++) {
         struct mem_map_entry* entry = &mem_map[i];
 
         if(entry->type == region_type_normal) {
             g_total_available_memory += entry->length;
+            if(entry->base + entry->length > memory_end)
+                memory_end = entry->base + entry->length;
         }
 
         if(1 == 0)
             print_mem_entry(i, entry->base, entry->length, get_mem_type(entry->type));
     }
-    g_max_pages = g_total_available_memory / PAGE_SIZE;
 
     uint32_t kernel_end = (uint32_t)(intptr_t)&LD_KERNEL_END;
     uint32_t kernel_start = (uint32_t)(intptr_t)&LD_KERNEL_START;
@@ -212,20 +298,25 @@ void mem_mgr_init(struct mem_map_entry mem_map[], uint32_t mem_entry_count)
       kernel_pages++;
 
     // We put the page map right after the kernel in memory
-    g_pages = (struct page*)(intptr_t)(kernel_start + (kernel_pages * PAGE_SIZE));
+    struct page* pages = (struct page*)(intptr_t)(kernel_start + (kernel_pages * PAGE_SIZE));
+
+    // The map runs up to the end of the highest RAM, the holes below it are
+    // reserved further down. Pages are handed out as identity mapped
+    // pointers, and paging only identity maps what's below the user range,
+    // whatever RAM there is past 1 GiB goes unused.
+    size_t max_pages = PAGING_USER_START / PAGE_SIZE;
+    if(memory_end < PAGING_USER_START)
+        max_pages = (size_t)(memory_end / PAGE_SIZE);
+    else if(memory_end > PAGING_USER_START)
+        KWARN("Only using the first 1 GiB of memory");
 
     // Reserve pages for the page map itself
-    size_t max_pages = g_total_available_memory / PAGE_SIZE;
     size_t mem_map_size = (max_pages * sizeof(struct page)) ;
     size_t mem_map_pages = mem_map_size / PAGE_SIZE;
     if(mem_map_size % PAGE_SIZE != 0)
         mem_map_pages++;
 
-    // Zero out the memory map
-    for(size_t i = 0; i < g_max_pages; i++) {
-        g_pages[i].flags = 0;
-        g_pages[i].consecutive_pages_allocated = 0;
-    }
+    page_map_init(&g_page_map, pages, max_pages);
 
     // Reserve the pages we know about right now
     // Screen is 80*25 2-byte characters
@@ -235,9 +326,19 @@ void mem_mgr_init(struct mem_map_entry mem_map[], uint32_t mem_entry_count)
         KERROR("Failed to reserve screen memory!");
     if(!mem_page_reserve("KRNL", (void*)(intptr_t)kernel_start, kernel_pages))
         KERROR("Failed to reserve pages for the kernel!");
-    if(!mem_page_reserve("PAGES", (void*)g_pages, mem_map_pages))
+    if(!mem_page_reserve("PAGES", (void*)pages, mem_map_pages))
         KERROR("Failed to reserve pages for the page map!");
 
+    // Whatever the firmware didn't call RAM. Nothing may be handed out
+    // before this, the zero pool and the magazines would stream into it.
+    size_t firmware_pages = reserve_unusable(mem_map, mem_entry_count);
+    if(firmware_pages > 0 && g_reservation_count < MAX_RESERVATIONS) {
+        struct reservation* reservation = &g_reservations[g_reservation_count++];
+        reservation->identifier = "FIRMWARE";
+        reservation->address = 0;
+        reservation->pages = firmware_pages;
+    }
+
     // And just a quick test to make sure everything words
     test_allocator();
 
@@ -247,11 +348,22 @@ void mem_mgr_init(struct mem_map_entry mem_map[], uint32_t mem_entry_count)
 
 void mem_mgr_gdt_setup()
 {
-    // Set up the TSS
-    g_tss.ss0 = 0x10; // Kernel data-segment selector
-
     // ISR stack is one page, might want to make bigger?
-    g_tss.esp0 = (uint32_t)(intptr_t)(mem_page_get() + PAGE_SIZE);
+    mem_mgr_gdt_setup_cpu(0, (uintptr_t)mem_page_get(mem_tag_thread) + PAGE_SIZE);
+}
+
+// Runs on the CPU in question, it loads the tables it builds
+void mem_mgr_gdt_setup_cpu(uint32_t cpu, uintptr_t kernel_stack)
+{
+    struct tss* tss = &g_tss[cpu];
+    uint64_t* gdt = g_gdt[cpu];
+
+    for(size_t i = 0; i < g_gdt_count; i++)
+        gdt[i] = g_gdt_template[i];
+
+    // Set up the TSS
+    tss->ss0 = 0x10; // Kernel data-segment selector
+    tss->esp0 = (uint32_t)kernel_stack;
 
     // This is the index from the start of the TSS of the IO
     // Port Bitmap - our limit for the TSS in the GDT
@@ -259,9 +371,9 @@ void mem_mgr_gdt_setup()
     // no IO Port Bitmap at all. Chapter 16, Volume 1 of the
     // x86 Developer Guide says that the bitmap may be partial,
     // so this is entirely okay.
-    g_tss.iopb = sizeof(struct tss);
+    tss->iopb = sizeof(struct tss);
 
-    uint32_t tss_base = (uint32_t)(intptr_t)(&g_tss);
+    uint32_t tss_base = (uint32_t)(intptr_t)tss;
     uint32_t tss_size = sizeof(struct tss);
 
     // TSS Access byte is different from normal GDT entries:
@@ -275,7 +387,7 @@ void mem_mgr_gdt_setup()
     //
     // This means the base value is 1~~01001, with '~~' being the priv level
     // (The TSS flag nybble is a bit different as well, but nothing that is relevant to us)
-    g_gdt[TSS_GDTD_INDEX] = GDT_ENTRY_(tss_size - 1, tss_base, 0x89, 0);
+    gdt[TSS_GDTD_INDEX] = GDT_ENTRY_(tss_size - 1, tss_base, 0x89, 0);
 
     // This is what it is at runtime: 6700 805A 01E9 0000
     // Base: 015A80
@@ -284,15 +396,34 @@ void mem_mgr_gdt_setup()
     // Flags: 0
 
 #ifdef GDT_DEBUG
-    print_gdt();
+    print_gdt(cpu);
 #endif
 
-    g_gtdd.size = (sizeof(uint64_t) * g_gdt_count) - 1;
-    g_gtdd.offset = (uint32_t)(intptr_t)&g_gdt;
+    g_gtdd[cpu].size = (sizeof(uint64_t) * g_gdt_count) - 1;
+    g_gtdd[cpu].offset = (uint32_t)(intptr_t)gdt;
+
+    gdt_install(cpu);
+
+    tss_install(cpu);
+}
 
-    gdt_install();
+// Where the CPU switches stacks to when user mode is interrupted, every
+// thread has its own
+void mem_mgr_set_kernel_stack(uint32_t cpu, uintptr_t top)
+{
+    g_tss[cpu].esp0 = (uint32_t)top;
+}
 
-    tss_install();
+uintptr_t mem_mgr_get_kernel_stack(uint32_t cpu)
+{
+    return g_tss[cpu].esp0;
+}
+
+// Where the TSS keeps it, for SYSENTER which can only be pointed at a
+// fixed address and has to load the stack from there
+uintptr_t mem_mgr_get_kernel_stack_slot(uint32_t cpu)
+{
+    return (uintptr_t)&g_tss[cpu].esp0;
 }
 
 uint64_t gdte_create(uint32_t limit, uint32_t base, uint8_t access, enum gdt_flag flags)
@@ -300,6 +431,75 @@ uint64_t gdte_create(uint32_t limit, uint32_t base, uint8_t access, enum gdt_fla
     return GDT_ENTRY(limit, base, access, flags);
 }
 
+void mem_print_breakdown()
+{
+    size_t cached = g_zero_pool_count;
+    for(size_t i = 0; i < SMP_MAX_CPUS; i++)
+        cached += g_magazines[i].count;
+
+    terminal_write_string("Pages by subsystem, now/peak (allocations):\n");
+    terminal_indentation_increase();
+
+    for(size_t i = 0; i < mem_tag_count; i++) {
+        struct tag_stats* stats = &g_tag_stats[i];
+        if(stats->allocations == 0)
+            continue;
+
+        terminal_write_string(g_tag_names[i]);
+        terminal_write_string(": ");
+        terminal_write_uint32(stats->pages);
+        terminal_write_char('/');
+        terminal_write_uint32(stats->peak);
+        terminal_write_string(" (");
+        terminal_write_uint32(stats->allocations);
+        terminal_write_string(")\n");
+    }
+
+    // Allocated as far as the page map is concerned, but free to take
+    terminal_write_string("zero pool and magazines: ");
+    terminal_write_uint32(cached);
+    terminal_write_char('\n');
+
+    for(size_t i = 0; i < g_reservation_count; i++) {
+        struct reservation* reservation = &g_reservations[i];
+        terminal_write_string("reserved ");
+        terminal_write_string(reservation->identifier);
+        terminal_write_string(" at ");
+        terminal_write_uint32_x(reservation->address);
+        terminal_write_string(": ");
+        terminal_write_uint32(reservation->pages);
+        terminal_write_char('\n');
+    }
+
+    terminal_indentation_decrease();
+    mem_print_usage();
+}
+
+void mem_print_trace()
+{
+#ifdef MEM_TRACE
+    // Oldest first, entries being written right now may come out torn
+    uint32_t next = g_trace_next;
+    for(uint32_t i = 0; i < TRACE_SIZE; i++) {
+        struct trace_entry* entry = &g_trace[(next + i) % TRACE_SIZE];
+        if(entry->address == 0)
+            continue;
+
+        terminal_write_string(entry->freed ? "free  " : "alloc ");
+        terminal_write_string(g_tag_names[entry->tag]);
+        terminal_write_char(' ');
+        terminal_write_uint32_x(entry->address);
+        terminal_write_string(" x");
+        terminal_write_uint32(entry->pages);
+        terminal_write_string(" from ");
+        terminal_write_uint32_x(entry->caller);
+        terminal_write_char('\n');
+    }
+#else
+    terminal_write_string("Built without MEM_TRACE\n");
+#endif
+}
+
 void mem_print_usage()
 {
     size_t available_pages = mem_page_count(true);
@@ -310,46 +510,39 @@ void mem_print_usage()
     terminal_write_string(" (");
     terminal_write_uint32(mem_page_count(true));
     terminal_write_string("/");
-    terminal_write_uint32(g_max_pages);
+    terminal_write_uint32(g_page_map.count);
     terminal_write_string(" pages)\n");
 }
 
 bool mem_page_reserve(const char* identifier, void* address, size_t num_pages)
 {
     size_t page_index = ((size_t)(intptr_t)(address)) / PAGE_SIZE;
-    if(page_index < 0 || page_index > g_max_pages)
-    {
-        KWARN("An attempt was made to reserve a page outside of memory");
-        terminal_write_string("The page at ");
-        terminal_write_uint32_x((uint32_t)(intptr_t)address);
-        terminal_write_string(" has already been reserved!\n");
-        return false;
-    }
 
-    if(IS_PAGE_RESERVED(g_pages[page_index].flags)) {
-        KWARN("An attempt was made to re-reserve a page!");
-        SHOWVAL_x("The following page is already reserved: ", (uint32_t)(intptr_t)address);
-        return false;
-    }
+    uint32_t flags = spinlock_lock_irqsave(&g_pages_lock);
+    enum page_map_result result = page_map_reserve(&g_page_map, page_index, num_pages);
+    spinlock_unlock_irqrestore(&g_pages_lock, flags);
 
-    if(num_pages == 1) {
-        g_pages[page_index].flags = PAGE_USED | PAGE_RESERVED;
-        return true;
-    }
-
-    // Make sure all requested pages are available
-    for(size_t i = 0; i < num_pages; i++) {
-        struct page* cur = &g_pages[page_index + 1];
-
-        if(IS_PAGE_USED(cur->flags) || IS_PAGE_RESERVED(cur->flags))
+    switch(result) {
+        case page_map_ok:
+            break;
+        case page_map_out_of_range:
+            KWARN("An attempt was made to reserve a page outside of memory");
+            SHOWVAL_x("The page at: ", (uint32_t)(intptr_t)address);
+            return false;
+        case page_map_reserved:
+            KWARN("An attempt was made to re-reserve a page!");
+            SHOWVAL_x("The following page is already reserved: ", (uint32_t)(intptr_t)address);
+            return false;
+        default:
             return false;
     }
 
-    // We now know for a fact all is available, just mark them
-    g_pages[page_index].flags = PAGE_USED | PAGE_RESERVED;
-
-    for(size_t i = 0; i < num_pages; i++) {
-        g_pages[page_index + i].flags = PAGE_USED | PAGE_RESERVED;
+    // Kept for mem_print_breakdown, the identifiers are all literals
+    if(g_reservation_count < MAX_RESERVATIONS) {
+        struct reservation* reservation = &g_reservations[g_reservation_count++];
+        reservation->identifier = identifier;
+        reservation->address = (uintptr_t)address;
+        reservation->pages = num_pages;
     }
 
     return true;
@@ -357,66 +550,97 @@ bool mem_page_reserve(const char* identifier, void* address, size_t num_pages)
 
 size_t mem_page_count(bool get_allocated)
 {
-    size_t result = 0;
-    for(size_t i = 0; i < g_max_pages; i++) {
-        bool is_used = IS_PAGE_USED(g_pages[i].flags);
-        if((get_allocated && is_used) ||(!get_allocated && !is_used))
-            result++;
+    return page_map_count(&g_page_map, get_allocated);
+}
+
+void* mem_page_get_many(uint16_t how_many, enum mem_tag tag)
+{
+    // Ask the caches to give some memory back before giving up
+    void* result = find_pages_locked(how_many);
+    if(result == NULL && reclaim_pages(how_many))
+        result = find_pages_locked(how_many);
+
+    if(result == NULL) {
+        KWARN("No pages available!");
+        return NULL;
     }
 
+    account(result, how_many, tag, (uintptr_t)__builtin_return_address(0));
     return result;
 }
 
-void* mem_page_get_many(uint16_t how_many)
+void* mem_page_get(enum mem_tag tag)
 {
-    // THe first page is a given, we knew that...
-    how_many--;
+    void* result = get_page();
+    if(result != NULL)
+        account(result, 1, tag, (uintptr_t)__builtin_return_address(0));
 
-    for(size_t i = 0; i < g_max_pages; i++) {
-        struct page* cur = &g_pages[i];
+    return result;
+}
 
-        if(IS_PAGE_USED(cur->flags) || IS_FIRST_IN_ALLOCATION(cur->flags))
-            continue;
+void* mem_page_get_zeroed(enum mem_tag tag)
+{
+    void* result = NULL;
 
-        // Do we have how_many free pages after this?
-        size_t free_found = 0;
-        while(free_found < how_many &&  ++cur) {
-            if(!IS_PAGE_USED(cur->flags) && !IS_FIRST_IN_ALLOCATION(cur->flags)) {
-                free_found++;
-            }
-        }
+    uint32_t flags = spinlock_lock_irqsave(&g_zero_pool_lock);
+    if(g_zero_pool_count > 0)
+        result = g_zero_pool[--g_zero_pool_count];
+    spinlock_unlock_irqrestore(&g_zero_pool_lock, flags);
 
-        if(free_found != how_many) {
-            continue;
-        }
+    // The pool ran dry, it costs the caller the zeroing this time
+    if(result == NULL) {
+        result = get_page();
+        if(result == NULL)
+            return NULL;
 
-        g_pages[i].flags = PAGE_USED | FIRST_IN_ALLOCATION;
-        g_pages[i].consecutive_pages_allocated = how_many;
-        for(size_t j = 0; j < how_many; j++) {
-            g_pages[i + j].flags |= PAGE_USED;
-        }
-
-        return (void*)(intptr_t)(i * PAGE_SIZE);
+        memset(result, 0, PAGE_SIZE);
     }
 
-    KWARN("No pages available!");
-
-    return NULL;
+    account(result, 1, tag, (uintptr_t)__builtin_return_address(0));
+    return result;
 }
 
-void* mem_page_get()
+bool mem_zero_pool_refill()
 {
-    for(size_t i = 0; i < g_max_pages; i++) {
-        struct page* cur = &g_pages[i];
+    for(size_t i = 0; i < ZERO_POOL_BATCH; i++) {
+        if(g_zero_pool_count >= ZERO_POOL_SIZE)
+            return false;
+
+        // Never at the expense of the caches, only memory nobody wants
+        void* page = find_pages_locked(1);
+        if(page == NULL)
+            return false;
 
-        if(!IS_PAGE_USED(cur->flags) && ! IS_FIRST_IN_ALLOCATION(cur->flags)) {
-            cur->flags = PAGE_USED | FIRST_IN_ALLOCATION;
+        // Nobody touches it until it's handed out, no point caching it
+        memset_uncached(page, 0, PAGE_SIZE);
 
-            return (void*)(intptr_t)(i * PAGE_SIZE);
+        uint32_t flags = spinlock_lock_irqsave(&g_zero_pool_lock);
+        bool full = g_zero_pool_count >= ZERO_POOL_SIZE;
+        if(!full)
+            g_zero_pool[g_zero_pool_count++] = page;
+        spinlock_unlock_irqrestore(&g_zero_pool_lock, flags);
+
+        // Another CPU got there first
+        if(full) {
+            free_pages_locked(page);
+            return false;
         }
     }
 
-    return NULL;
+    return g_zero_pool_count < ZERO_POOL_SIZE;
+}
+
+bool mem_register_reclaimer(mem_reclaim_callback callback)
+{
+    for(size_t i = 0; i < MAX_RECLAIMERS; i++) {
+        if(g_reclaimers[i] == NULL) {
+            g_reclaimers[i] = callback;
+            return true;
+        }
+    }
+
+    KWARN("Too many reclaimers registered");
+    return false;
 }
 
 void mem_page_free(void* address)
@@ -427,37 +651,269 @@ void mem_page_free(void* address)
     }
 
     size_t page_index = ((size_t)(intptr_t)(address)) / PAGE_SIZE;
-    if(page_index < 0 || page_index > g_max_pages)
+    if(page_index >= g_page_map.count)
         return;
 
-    struct page* cur = &g_pages[page_index];
-    if(!IS_FIRST_IN_ALLOCATION(cur->flags)) {
-        terminal_write_string("Invalid call to page_free(");
-        terminal_write_uint32_x((uint32_t)(intptr_t)address);
-        terminal_write_string(" not first page!\n");
-        return; // This is not the first page of an allocation
-    }
+    // Anything that isn't the start of a live allocation gets complained
+    // about further down, and isn't counted
+    uint8_t page_flags = g_page_map.pages[page_index].flags;
+    if(IS_FIRST_IN_ALLOCATION(page_flags) && !IS_PAGE_CACHED(page_flags) && !IS_PAGE_RESERVED(page_flags))
+        unaccount(page_index, (uintptr_t)__builtin_return_address(0));
 
-    if(IS_PAGE_RESERVED(cur->flags)) {
-        KERROR("Tried to free reserved page!");
+    if(magazine_put(page_index))
         return;
-    }
-
-    size_t pages_left = cur->consecutive_pages_allocated;
 
-    // Free the first page
-    cur->flags = 0;
-    cur->consecutive_pages_allocated = 0;
-    cur++;
-    // Free the consecutive pages
-    for(size_t i = 0; i < pages_left; i++) {
-        g_pages[page_index + i].flags = 0;
-    }
+    free_pages_locked(address);
 }
 
 // -------------------------------------------------------------------------
 // Static Functions
 // -------------------------------------------------------------------------
+static void free_pages_locked(void* address)
+{
+    size_t page_index = ((size_t)(intptr_t)(address)) / PAGE_SIZE;
+
+    uint32_t flags = spinlock_lock_irqsave(&g_pages_lock);
+    enum page_map_result result = page_map_free(&g_page_map, page_index);
+    spinlock_unlock_irqrestore(&g_pages_lock, flags);
+
+    switch(result) {
+        case page_map_not_first:
+            terminal_write_string("Invalid call to page_free(");
+            terminal_write_uint32_x((uint32_t)(intptr_t)address);
+            terminal_write_string(" not first page!\n");
+            break;
+        case page_map_reserved:
+            KERROR("Tried to free reserved page!");
+            break;
+        case page_map_cached:
+            // Already free, it's just sitting in some CPU's magazine
+            KERROR("Page freed twice!");
+            break;
+        default:
+            break;
+    }
+}
+
+// One page without anyone being charged for it
+static void* get_page()
+{
+    // Most of the time the CPU's own magazine has one
+    void* result = magazine_get();
+    if(result != NULL)
+        return result;
+
+    result = find_pages_locked(1);
+    if(result == NULL && reclaim_pages(1))
+        result = find_pages_locked(1);
+
+    return result;
+}
+
+static void account(void* address, size_t pages, enum mem_tag tag, uintptr_t caller)
+{
+    if(tag >= mem_tag_count)
+        tag = mem_tag_kernel;
+
+    // Only the owner of the page writes it, no need for the lock
+    g_page_map.pages[(uintptr_t)address / PAGE_SIZE].tag = tag;
+
+    struct tag_stats* stats = &g_tag_stats[tag];
+    __sync_fetch_and_add(&stats->allocations, 1);
+    uint32_t now = __sync_add_and_fetch(&stats->pages, pages);
+
+    uint32_t peak = stats->peak;
+    while(now > peak && !__sync_bool_compare_and_swap(&stats->peak, peak, now))
+        peak = stats->peak;
+
+    trace((uintptr_t)address, pages, tag, false, caller);
+}
+
+static void unaccount(size_t page_index, uintptr_t caller)
+{
+    struct page* cur = &g_page_map.pages[page_index];
+    size_t pages = cur->consecutive_pages_allocated + 1;
+
+    __sync_fetch_and_sub(&g_tag_stats[cur->tag].pages, pages);
+    trace(page_index * PAGE_SIZE, pages, cur->tag, true, caller);
+}
+
+static void trace(uintptr_t address, size_t pages, enum mem_tag tag, bool freed, uintptr_t caller)
+{
+#ifdef MEM_TRACE
+    struct trace_entry* entry = &g_trace[__sync_fetch_and_add(&g_trace_next, 1) % TRACE_SIZE];
+    entry->address = address;
+    entry->caller = caller;
+    entry->pages = (uint16_t)pages;
+    entry->tag = (uint8_t)tag;
+    entry->freed = freed;
+#endif
+}
+
+// The reclaimers free pages themselves, so they run without the lock
+static void* find_pages_locked(uint16_t how_many)
+{
+    uint32_t flags = spinlock_lock_irqsave(&g_pages_lock);
+    size_t index = page_map_alloc(&g_page_map, how_many);
+    spinlock_unlock_irqrestore(&g_pages_lock, flags);
+
+    return index == PAGE_MAP_NONE ? NULL : (void*)(intptr_t)(index * PAGE_SIZE);
+}
+
+static bool reclaim_pages(size_t pages_wanted)
+{
+    // Pages sitting in our magazine cost nothing to give back, zeroed
+    // pages are next cheapest, the idle loop makes more. The other CPUs'
+    // magazines stay put, there's at most MAGAZINE_SIZE pages in each.
+    size_t freed = magazine_flush();
+    if(freed < pages_wanted)
+        freed += drain_zero_pool(pages_wanted - freed);
+    for(size_t i = 0; i < MAX_RECLAIMERS && freed < pages_wanted; i++) {
+        if(g_reclaimers[i] != NULL)
+            freed += g_reclaimers[i](pages_wanted - freed);
+    }
+
+    return freed > 0;
+}
+
+static size_t drain_zero_pool(size_t pages_wanted)
+{
+    size_t freed = 0;
+
+    while(freed < pages_wanted) {
+        void* page = NULL;
+
+        uint32_t flags = spinlock_lock_irqsave(&g_zero_pool_lock);
+        if(g_zero_pool_count > 0)
+            page = g_zero_pool[--g_zero_pool_count];
+        spinlock_unlock_irqrestore(&g_zero_pool_lock, flags);
+
+        if(page == NULL)
+            break;
+
+        free_pages_locked(page);
+        freed++;
+    }
+
+    return freed;
+}
+
+// Interrupts off. Every CPU loads its own copy of the GDT, so where that
+// is says which CPU this is without asking the APIC. NULL until
+// mem_mgr_gdt_setup_cpu has run, and in the loader.
+static struct magazine* local_magazine()
+{
+    struct gtdd gtdd;
+    __asm volatile("sgdt %0" : "=m"(gtdd));
+
+    uintptr_t base = (uintptr_t)g_gdt;
+    if(gtdd.offset < base || gtdd.offset >= base + sizeof(g_gdt))
+        return NULL;
+
+    return &g_magazines[(gtdd.offset - base) / sizeof(g_gdt[0])];
+}
+
+static void* magazine_get()
+{
+    uint32_t flags = cpu_irq_save();
+
+    struct magazine* magazine = local_magazine();
+    if(magazine == NULL) {
+        cpu_irq_restore(flags);
+        return NULL;
+    }
+
+    if(magazine->count == 0) {
+        size_t indices[MAGAZINE_BATCH];
+
+        uint32_t lock_flags = spinlock_lock_irqsave(&g_pages_lock);
+        size_t found = page_map_alloc_cached(&g_page_map, indices, MAGAZINE_BATCH);
+        spinlock_unlock_irqrestore(&g_pages_lock, lock_flags);
+
+        for(size_t i = 0; i < found; i++)
+            magazine->pages[i] = (void*)(intptr_t)(indices[i] * PAGE_SIZE);
+        magazine->count = found;
+    }
+
+    void* result = NULL;
+    if(magazine->count > 0) {
+        result = magazine->pages[--magazine->count];
+        g_page_map.pages[(uintptr_t)result / PAGE_SIZE].flags &= ~PAGE_CACHED;
+    }
+
+    cpu_irq_restore(flags);
+    return result;
+}
+
+// False if the page has to go back to the map itself
+static bool magazine_put(size_t page_index)
+{
+    struct page* cur = &g_page_map.pages[page_index];
+
+    // Allocations of more than one page, and anything mem_page_free is
+    // going to complain about, go the slow way
+    if(!IS_FIRST_IN_ALLOCATION(cur->flags) || IS_PAGE_RESERVED(cur->flags) ||
+            cur->consecutive_pages_allocated != 0)
+        return false;
+
+    uint32_t flags = cpu_irq_save();
+
+    struct magazine* magazine = local_magazine();
+    if(magazine == NULL) {
+        cpu_irq_restore(flags);
+        return false;
+    }
+
+    if(IS_PAGE_CACHED(cur->flags)) {
+        cpu_irq_restore(flags);
+        KERROR("Page freed twice!");
+        return true;
+    }
+
+    if(magazine->count == MAGAZINE_SIZE)
+        magazine_drain(magazine, MAGAZINE_BATCH);
+
+    cur->flags |= PAGE_CACHED;
+    magazine->pages[magazine->count++] = (void*)(intptr_t)(page_index * PAGE_SIZE);
+
+    cpu_irq_restore(flags);
+    return true;
+}
+
+// Interrupts off, hands the oldest pages back to the map
+static size_t magazine_drain(struct magazine* magazine, size_t how_many)
+{
+    if(how_many > magazine->count)
+        how_many = magazine->count;
+
+    uint32_t flags = spinlock_lock_irqsave(&g_pages_lock);
+    for(size_t i = 0; i < how_many; i++) {
+        size_t index = (uintptr_t)magazine->pages[i] / PAGE_SIZE;
+        g_page_map.pages[index].flags &= ~PAGE_CACHED;
+        page_map_free(&g_page_map, index);
+    }
+    spinlock_unlock_irqrestore(&g_pages_lock, flags);
+
+    magazine->count -= how_many;
+    for(size_t i = 0; i < magazine->count; i++)
+        magazine->pages[i] = magazine->pages[i + how_many];
+
+    return how_many;
+}
+
+static size_t magazine_flush()
+{
+    uint32_t flags = cpu_irq_save();
+
+    size_t freed = 0;
+    struct magazine* magazine = local_magazine();
+    if(magazine != NULL)
+        freed = magazine_drain(magazine, magazine->count);
+
+    cpu_irq_restore(flags);
+    return freed;
+}
+
 static void print_memory_nice(uint64_t memory_in_bytes)
 {
     uint32_t kb = memory_in_bytes / 1024;
@@ -512,6 +968,82 @@ static void print_mem_entry(size_t index, uint64_t base, uint64_t length, char*
     terminal_write_string(")\n");
 }
 
+// Usable means all of the page is in a normal region, and none of it is in
+// anything else, the map may well have overlapping entries
+static bool is_page_usable(struct mem_map_entry mem_map[], uint32_t count, size_t page)
+{
+    uint64_t start = (uint64_t)page * PAGE_SIZE;
+    uint64_t end = start + PAGE_SIZE;
+    bool in_normal = false;
+
+    for(uint32_t i = 0; i < count; i++) {
+        uint64_t base = mem_map[i].base;
+        uint64_t limit = base + mem_map[i].length;
+
+        if(mem_map[i].type == region_type_normal) {
+            if(base <= start && end <= limit)
+                in_normal = true;
+        }
+        else if(base < end && start < limit) {
+            return false;
+        }
+    }
+
+    return in_normal;
+}
+
+// The next page after this one where some region starts or ends, whether
+// a page is usable only changes at those
+static size_t next_region_boundary(struct mem_map_entry mem_map[], uint32_t count, size_t page)
+{
+    size_t next = g_page_map.count;
+
+    for(uint32_t i = 0; i < count; i++) {
+        uint64_t base = mem_map[i].base;
+        uint64_t limit = base + mem_map[i].length;
+        // Rounded both ways, RAM ends where it's rounded inwards and
+        // everything else where it's rounded outwards
+        uint64_t edges[2] = { base / PAGE_SIZE, (base + PAGE_SIZE - 1) / PAGE_SIZE };
+        uint64_t ends[2] = { limit / PAGE_SIZE, (limit + PAGE_SIZE - 1) / PAGE_SIZE };
+
+        for(int j = 0; j < 2; j++) {
+            if(edges[j] > page && edges[j] < next)
+                next = (size_t)edges[j];
+            if(ends[j] > page && ends[j] < next)
+                next = (size_t)ends[j];
+        }
+    }
+
+    return next;
+}
+
+// Reserves every page in the map that isn't usable RAM and hasn't been
+// reserved yet, like the EBDA, the VGA memory and the ROMs below 1 MiB and
+// the holes between regions. Returns how many that was.
+static size_t reserve_unusable(struct mem_map_entry mem_map[], uint32_t count)
+{
+    size_t reserved = 0;
+    size_t page = 0;
+
+    uint32_t flags = spinlock_lock_irqsave(&g_pages_lock);
+
+    while(page < g_page_map.count) {
+        size_t next = next_region_boundary(mem_map, count, page);
+
+        if(!is_page_usable(mem_map, count, page)) {
+            for(size_t i = page; i < next; i++) {
+                if(page_map_reserve(&g_page_map, i, 1) == page_map_ok)
+                    reserved++;
+            }
+        }
+
+        page = next;
+    }
+
+    spinlock_unlock_irqrestore(&g_pages_lock, flags);
+    return reserved;
+}
+
 static char* get_mem_type(enum region_type type)
 {
     switch(type) {
@@ -537,13 +1069,13 @@ static void test_allocator()
     // checker though, so I'm leaving it in for now
     size_t allocated_pages = mem_page_count(true);
     void* allocations[10];
-    allocations[9] = mem_page_get_many(14);
+    allocations[9] = mem_page_get_many(14, mem_tag_kernel);
     if(allocations[9] == NULL) {
         KWARN("Failed to allocate 14 pages!");
     }
 
     for(uint32_t i = 0; i < 9; i++)
-        allocations[i] = mem_page_get();
+        allocations[i] = mem_page_get(mem_tag_kernel);
 
     for(uint32_t i = 0; i < 10; i++)
     {
@@ -563,13 +1095,13 @@ static void test_allocator()
     }
 }
 
-static void gdt_install()
+static void gdt_install(uint32_t cpu)
 {
 #ifdef GDT_DEBUG
     KINFO("Installing GDT");
-    SHOWVAL_x("GTDD Address: ", (uint32_t)(intptr_t)&g_gtdd);
-    SHOWVAL("Size: ", g_gtdd.size);
-    SHOWVAL_x("GTD address: ", g_gtdd.offset);
+    SHOWVAL_x("GTDD Address: ", (uint32_t)(intptr_t)&g_gtdd[cpu]);
+    SHOWVAL("Size: ", g_gtdd[cpu].size);
+    SHOWVAL_x("GTD address: ", g_gtdd[cpu].offset);
 #endif
 
     __asm ("mov %0  ,  %%ax;    \
@@ -578,21 +1110,21 @@ static void gdt_install()
             mov %%ax,  %%fs;    \
             mov %%ax,  %%gs;    \
             mov %%ax,  %%ss;    \
-            lgdt (%1);          \
+            lgdt %1;            \
             ljmp %2, $_gdt_loaded; \
             _gdt_loaded:"
             :
             : "i" (KERNEL_DATA_SEGMENT),
-              "m" (g_gtdd),
+              "m" (g_gtdd[cpu]),
               "i" (KERNEL_CODE_SEGMENT)
             );
 }
 
-static void tss_install()
+static void tss_install(uint32_t cpu)
 {
 #ifdef GDT_DEBUG
     terminal_write_string("Installing LDT: ");
-    terminal_write_uint64_x(g_gdt[TSS_GDTD_INDEX]);
+    terminal_write_uint64_x(g_gdt[cpu][TSS_GDTD_INDEX]);
     terminal_write_char('\n');
 #endif
 
@@ -0,0 +1,319 @@
+#include <types.h>
+#include <kernel.h>
+#include <mem_mgr.h>
+#include <terminal.h>
+#include <vfs.h>
+#include <page_cache.h>
+#include <paging.h>
+#include <mmap.h>
+#include <vmalloc.h>
+#include <lock.h>
+
+// -------------------------------------------------------------------------
+// Static Defines
+// -------------------------------------------------------------------------
+#define MMAP_MAX_MAPPINGS 64
+
+// -------------------------------------------------------------------------
+// Static Types
+// -------------------------------------------------------------------------
+struct mapping {
+    uintptr_t                   start;      // 0 if the slot is free
+    uint32_t                    page_count;
+    uint32_t                    flags;
+    bool                        busy;       // Being set up or torn down
+
+    // Only for file mappings
+    struct vnode*               node;
+    struct page_cache_entry**   entries;    // One per page, holds a reference
+};
+
+// -------------------------------------------------------------------------
+// Forward Declarations
+// -------------------------------------------------------------------------
+static struct mapping* mapping_create(uintptr_t address, size_t length, uint32_t flags);
+static void* mapping_publish(struct mapping* mapping);
+static void mapping_destroy(struct mapping* mapping);
+static bool mapping_claim(struct mapping* mapping, uintptr_t start, uintptr_t end);
+static uint32_t page_flags(uint32_t flags);
+static bool range_is_valid(uintptr_t address, uint32_t page_count);
+
+// -------------------------------------------------------------------------
+// Globals
+// -------------------------------------------------------------------------
+static struct mapping g_mappings[MMAP_MAX_MAPPINGS];
+
+// Guards handing out slots and user addresses. A busy mapping belongs to
+// whoever set it, building or tearing it down happens without the lock.
+static struct spinlock g_lock = SPINLOCK_INIT("mmap");
+
+// -------------------------------------------------------------------------
+// Public Contract
+// -------------------------------------------------------------------------
+void* mmap_file(int32_t fd, uint32_t offset, size_t length, uintptr_t address, uint32_t flags)
+{
+    if(offset % PAGE_SIZE != 0) {
+        KWARN("mmap: Offset has to be page aligned");
+        return NULL;
+    }
+
+    struct vnode* node = vfs_get_vnode(fd);
+    if(node == NULL)
+        return NULL;
+
+    if(offset >= node->size) {
+        vfs_put_vnode(node);
+        return NULL;
+    }
+
+    struct mapping* mapping = mapping_create(address, length, flags);
+    if(mapping == NULL) {
+        vfs_put_vnode(node);
+        return NULL;
+    }
+
+    mapping->node = node;
+
+    mapping->entries = (struct page_cache_entry**)vmalloc(mapping->page_count * sizeof(struct page_cache_entry*), mem_tag_mmap);
+    if(mapping->entries == NULL) {
+        mapping_destroy(mapping);
+        return NULL;
+    }
+
+    for(uint32_t i = 0; i < mapping->page_count; i++)
+        mapping->entries[i] = NULL;
+
+    // Private pages start out read-only as well, the first write copies them
+    uint32_t pte_flags = page_flags(flags) & ~paging_flag_write;
+    if(flags & mmap_flag_private)
+        pte_flags |= paging_flag_cow;
+
+    uint32_t first_page = offset / PAGE_SIZE;
+    for(uint32_t i = 0; i < mapping->page_count; i++) {
+
+        // Keep the drive busy with what's coming up
+        if(i % VFS_READAHEAD_MAX == 0)
+            page_cache_readahead(node, first_page + i, mapping->page_count - i);
+
+        struct page_cache_entry* entry = page_cache_get(node, first_page + i);
+        if(entry == NULL) {
+            mapping_destroy(mapping);
+            return NULL;
+        }
+
+        mapping->entries[i] = entry;
+
+        if(!paging_map(mapping->start + i * PAGE_SIZE, (uintptr_t)entry->page, pte_flags)) {
+            mapping_destroy(mapping);
+            return NULL;
+        }
+    }
+
+    return mapping_publish(mapping);
+}
+
+void* mmap_anonymous(uintptr_t address, size_t length, uint32_t flags)
+{
+    struct mapping* mapping = mapping_create(address, length, flags);
+    if(mapping == NULL)
+        return NULL;
+
+    uint32_t pte_flags = page_flags(flags) | paging_flag_write;
+
+    for(uint32_t i = 0; i < mapping->page_count; i++) {
+        void* page = mem_page_get_zeroed(mem_tag_mmap);
+        if(page == NULL) {
+            mapping_destroy(mapping);
+            return NULL;
+        }
+
+        if(!paging_map(mapping->start + i * PAGE_SIZE, (uintptr_t)page, pte_flags)) {
+            mem_page_free(page);
+            mapping_destroy(mapping);
+            return NULL;
+        }
+    }
+
+    return mapping_publish(mapping);
+}
+
+bool mmap_unmap(void* address)
+{
+    for(size_t i = 0; i < MMAP_MAX_MAPPINGS; i++) {
+        struct mapping* mapping = &g_mappings[i];
+
+        if(address != NULL && mapping_claim(mapping, (uintptr_t)address, (uintptr_t)address + 1)) {
+            mapping_destroy(mapping);
+            return true;
+        }
+    }
+
+    KWARN("mmap: No mapping at that address");
+    return false;
+}
+
+void mmap_unmap_range(uintptr_t start, uintptr_t end)
+{
+    for(size_t i = 0; i < MMAP_MAX_MAPPINGS; i++) {
+        struct mapping* mapping = &g_mappings[i];
+
+        if(mapping_claim(mapping, start, end))
+            mapping_destroy(mapping);
+    }
+}
+
+// -------------------------------------------------------------------------
+// Static Functions
+// -------------------------------------------------------------------------
+static struct mapping* mapping_create(uintptr_t address, size_t length, uint32_t flags)
+{
+    uint32_t page_count = (length + PAGE_SIZE - 1) / PAGE_SIZE;
+    if(page_count == 0 || address % PAGE_SIZE != 0)
+        return NULL;
+
+    // The window hands out its own addresses, and may have to allocate to
+    // do it, so that happens before taking the lock
+    bool reserved = address == 0;
+    if(reserved) {
+        address = vmalloc_reserve(page_count);
+        if(address == 0)
+            return NULL;
+    }
+
+    uint32_t irq_flags = spinlock_lock_irqsave(&g_lock);
+
+    struct mapping* mapping = NULL;
+    for(size_t i = 0; i < MMAP_MAX_MAPPINGS; i++) {
+        if(g_mappings[i].start == 0 && !g_mappings[i].busy) {
+            mapping = &g_mappings[i];
+            break;
+        }
+    }
+
+    bool valid = reserved || range_is_valid(address, page_count);
+    if(mapping != NULL && valid) {
+        mapping->start = address;
+        mapping->page_count = page_count;
+        mapping->flags = flags;
+        mapping->busy = true;
+        mapping->node = NULL;
+        mapping->entries = NULL;
+    }
+
+    spinlock_unlock_irqrestore(&g_lock, irq_flags);
+
+    if(mapping != NULL && valid)
+        return mapping;
+
+    if(mapping == NULL)
+        KWARN("mmap: Too many mappings");
+    else
+        KWARN("mmap: Address is taken or outside of the mappable ranges");
+
+    if(reserved)
+        vmalloc_release(address, page_count);
+    return NULL;
+}
+
+// Lets others unmap it now that it's complete
+static void* mapping_publish(struct mapping* mapping)
+{
+    uint32_t irq_flags = spinlock_lock_irqsave(&g_lock);
+    mapping->busy = false;
+    spinlock_unlock_irqrestore(&g_lock, irq_flags);
+
+    return (void*)mapping->start;
+}
+
+// Makes the mapping ours to tear down if it starts in the given range,
+// unless someone else got it first
+static bool mapping_claim(struct mapping* mapping, uintptr_t start, uintptr_t end)
+{
+    uint32_t irq_flags = spinlock_lock_irqsave(&g_lock);
+
+    bool claimed = mapping->start != 0 && mapping->start >= start && mapping->start < end && !mapping->busy;
+    if(claimed)
+        mapping->busy = true;
+
+    spinlock_unlock_irqrestore(&g_lock, irq_flags);
+    return claimed;
+}
+
+// Also tears down half built mappings
+static void mapping_destroy(struct mapping* mapping)
+{
+    for(uint32_t i = 0; i < mapping->page_count; i++) {
+        uintptr_t virt = mapping->start + i * PAGE_SIZE;
+        uintptr_t phys;
+        uint32_t flags;
+
+        bool mapped = paging_get(virt, &phys, &flags);
+        struct page_cache_entry* entry = mapping->entries != NULL ? mapping->entries[i] : NULL;
+
+        // Unmapping waits for every CPU to drop the page from its TLB, only
+        // then can it be freed or handed back to the cache
+        if(mapped)
+            paging_unmap(virt);
+
+        // Pages that were written to have a private copy we own
+        if(mapped && (entry == NULL || phys != (uintptr_t)entry->page))
+            mem_page_free((void*)phys);
+
+        if(entry != NULL)
+            page_cache_put(entry);
+    }
+
+    if(mapping->entries != NULL)
+        vmalloc_free(mapping->entries);
+
+    if(mapping->node != NULL)
+        vfs_put_vnode(mapping->node);
+
+    if(mapping->start >= PAGING_WINDOW_START && mapping->start < PAGING_WINDOW_END)
+        vmalloc_release(mapping->start, mapping->page_count);
+
+    uint32_t irq_flags = spinlock_lock_irqsave(&g_lock);
+
+    mapping->start = 0;
+    mapping->page_count = 0;
+    mapping->busy = false;
+    mapping->node = NULL;
+    mapping->entries = NULL;
+
+    spinlock_unlock_irqrestore(&g_lock, irq_flags);
+}
+
+static uint32_t page_flags(uint32_t flags)
+{
+    uint32_t result = paging_flag_present;
+    if(flags & mmap_flag_user)
+        result |= paging_flag_user;
+
+    return result;
+}
+
+// With the lock held. Mappings still being built have nothing mapped yet,
+// so they're checked for as well as the pages.
+static bool range_is_valid(uintptr_t address, uint32_t page_count)
+{
+    uintptr_t end = address + page_count * PAGE_SIZE;
+
+    // Fixed addresses are for user space, the window is handed out by us
+    if(address < PAGING_USER_START || end > PAGING_USER_END || end <= address)
+        return false;
+
+    for(size_t i = 0; i < MMAP_MAX_MAPPINGS; i++) {
+        struct mapping* mapping = &g_mappings[i];
+        if(mapping->start != 0 && address < mapping->start + mapping->page_count * PAGE_SIZE && mapping->start < end)
+            return false;
+    }
+
+    for(uintptr_t virt = address; virt < end; virt += PAGE_SIZE) {
+        uintptr_t phys;
+        uint32_t flags;
+        if(paging_get(virt, &phys, &flags))
+            return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,231 @@
+#include <types.h>
+#include <kernel.h>
+#include <terminal.h>
+#include <pci.h>
+#include <paging.h>
+#include <apic.h>
+#include <smp.h>
+#include <msi.h>
+
+// -------------------------------------------------------------------------
+// Static Defines
+// -------------------------------------------------------------------------
+
+// Messages are memory writes into this window, the destination APIC ID
+// goes in bits 19:12. Fixed delivery, physical destination, edge.
+#define MSI_ADDRESS_BASE            0xFEE00000
+#define MSI_ADDRESS_DESTINATION(id) ((id) << 12)
+
+// MSI capability, offsets from its start
+#define MSI_CONTROL                 0x02
+#define MSI_ADDRESS_LOW             0x04
+#define MSI_ADDRESS_HIGH            0x08    // Only with 64-bit addresses
+#define MSI_DATA_32                 0x08
+#define MSI_DATA_64                 0x0C
+
+#define MSI_CONTROL_ENABLE          (1 << 0)
+#define MSI_CONTROL_MULTIPLE_ENABLE (7 << 4)
+#define MSI_CONTROL_64BIT           (1 << 7)
+
+// MSI-X capability
+#define MSIX_CONTROL                0x02
+#define MSIX_TABLE                  0x04    // BAR index in bits 2:0
+
+#define MSIX_CONTROL_FUNCTION_MASK  (1 << 14)
+#define MSIX_CONTROL_ENABLE         (1 << 15)
+#define MSIX_TABLE_BAR_MASK         0x7
+
+// Table entries are four dwords
+#define MSIX_ENTRY_ADDRESS_LOW      0
+#define MSIX_ENTRY_ADDRESS_HIGH     1
+#define MSIX_ENTRY_DATA             2
+#define MSIX_ENTRY_CONTROL          3
+#define MSIX_ENTRY_MASKED           (1 << 0)
+
+// -------------------------------------------------------------------------
+// Forward Declarations
+// -------------------------------------------------------------------------
+static bool setup_msix(struct msi* msi, uint32_t apic_id);
+static void setup_msi(struct msi* msi, uint32_t apic_id);
+static void write_message(struct msi* msi, uint32_t apic_id);
+static void set_control(struct msi* msi, uint16_t clear, uint16_t set);
+static bool get_apic_id(uint32_t cpu, uint32_t* apic_id);
+
+// -------------------------------------------------------------------------
+// Public Contract
+// -------------------------------------------------------------------------
+bool msi_enable(struct msi* msi, struct pci_address* address, uint32_t cpu, interrupt_handler handler)
+{
+    uint32_t apic_id;
+    if(!apic_is_enabled() || !get_apic_id(cpu, &apic_id))
+        return false;
+
+    *msi = (struct msi) {
+        .address = *address
+    };
+
+    uint8_t msix = pci_find_capability(address, pci_capability_msix);
+    uint8_t plain = pci_find_capability(address, pci_capability_msi);
+    if(msix == 0 && plain == 0)
+        return false;
+
+    msi->vector = interrupt_allocate_vector(handler);
+    if(msi->vector == 0)
+        return false;
+
+    msi->extended = msix != 0;
+    msi->capability = msix != 0 ? msix : plain;
+
+    if(msi->extended && !setup_msix(msi, apic_id)) {
+        msi->extended = false;
+        msi->capability = plain;
+        msi->entry = NULL;
+    }
+
+    if(!msi->extended) {
+        if(plain == 0) {
+            interrupt_free_vector(msi->vector);
+            msi->vector = 0;
+            return false;
+        }
+
+        setup_msi(msi, apic_id);
+    }
+
+    // The device mustn't keep asserting its shared line as well. Status
+    // shares the dword, writing zeroes there leaves it alone.
+    uint16_t command = pci_read_word(address, PCI_COMMAND_REG_OFFSET);
+    pci_write_dword(address, PCI_COMMAND_REG_OFFSET, command | PCI_COMMAND_INTX_DISABLE);
+
+    return true;
+}
+
+bool msi_set_affinity(struct msi* msi, uint32_t cpu)
+{
+    uint32_t apic_id;
+    if(msi->vector == 0 || !get_apic_id(cpu, &apic_id))
+        return false;
+
+    // Masked while the address and data disagree, MSI has no mask bit
+    // we can count on, so it's turned off for the moment instead
+    if(msi->extended) {
+        msi->entry[MSIX_ENTRY_CONTROL] |= MSIX_ENTRY_MASKED;
+        write_message(msi, apic_id);
+        msi->entry[MSIX_ENTRY_CONTROL] &= ~MSIX_ENTRY_MASKED;
+    }
+    else {
+        set_control(msi, MSI_CONTROL_ENABLE, 0);
+        write_message(msi, apic_id);
+        set_control(msi, 0, MSI_CONTROL_ENABLE);
+    }
+
+    return true;
+}
+
+void msi_disable(struct msi* msi)
+{
+    if(msi->vector == 0)
+        return;
+
+    if(msi->extended) {
+        msi->entry[MSIX_ENTRY_CONTROL] |= MSIX_ENTRY_MASKED;
+        set_control(msi, MSIX_CONTROL_ENABLE, 0);
+    }
+    else {
+        set_control(msi, MSI_CONTROL_ENABLE, 0);
+    }
+
+    interrupt_free_vector(msi->vector);
+    msi->vector = 0;
+}
+
+// -------------------------------------------------------------------------
+// Static Functions
+// -------------------------------------------------------------------------
+
+// Only the first table entry is used, one vector per device is all our
+// drivers want
+static bool setup_msix(struct msi* msi, uint32_t apic_id)
+{
+    uint32_t table = pci_read_dword(&msi->address, msi->capability + MSIX_TABLE);
+    uint8_t bar = table & MSIX_TABLE_BAR_MASK;
+    if(bar > 5)
+        return false;
+
+    uint32_t base = pci_read_dword(&msi->address, PCI_BASE_ADDR0_REG_OFFSET + bar * 4);
+
+    // Has to be memory space, and up where devices are mapped uncached.
+    // Anything else falls back to plain MSI.
+    if((base & 1) != 0 || (base & 0xFFFFFFF0) < PAGING_MMIO_START) {
+        KWARN("MSI-X table isn't reachable, using MSI");
+        return false;
+    }
+
+    uintptr_t address = (base & 0xFFFFFFF0) + (table & ~MSIX_TABLE_BAR_MASK);
+    msi->entry = (volatile uint32_t*)address;
+
+    // Everything stays masked until the entry is complete
+    set_control(msi, 0, MSIX_CONTROL_ENABLE | MSIX_CONTROL_FUNCTION_MASK);
+
+    msi->entry[MSIX_ENTRY_CONTROL] |= MSIX_ENTRY_MASKED;
+    write_message(msi, apic_id);
+    msi->entry[MSIX_ENTRY_CONTROL] &= ~MSIX_ENTRY_MASKED;
+
+    set_control(msi, MSIX_CONTROL_FUNCTION_MASK, 0);
+    return true;
+}
+
+static void setup_msi(struct msi* msi, uint32_t apic_id)
+{
+    // A single message, so the vector is the one we allocated and not a
+    // block of them
+    set_control(msi, MSI_CONTROL_ENABLE | MSI_CONTROL_MULTIPLE_ENABLE, 0);
+    write_message(msi, apic_id);
+    set_control(msi, 0, MSI_CONTROL_ENABLE);
+}
+
+static void write_message(struct msi* msi, uint32_t apic_id)
+{
+    uint32_t address = MSI_ADDRESS_BASE | MSI_ADDRESS_DESTINATION(apic_id);
+
+    if(msi->extended) {
+        msi->entry[MSIX_ENTRY_ADDRESS_LOW] = address;
+        msi->entry[MSIX_ENTRY_ADDRESS_HIGH] = 0;
+        msi->entry[MSIX_ENTRY_DATA] = msi->vector;
+        return;
+    }
+
+    uint8_t cap = msi->capability;
+    bool is_64bit = pci_read_word(&msi->address, cap + MSI_CONTROL) & MSI_CONTROL_64BIT;
+
+    pci_write_dword(&msi->address, cap + MSI_ADDRESS_LOW, address);
+    if(is_64bit) {
+        pci_write_dword(&msi->address, cap + MSI_ADDRESS_HIGH, 0);
+        pci_write_dword(&msi->address, cap + MSI_DATA_64, msi->vector);
+    }
+    else {
+        pci_write_dword(&msi->address, cap + MSI_DATA_32, msi->vector);
+    }
+}
+
+// The control word shares a dword with the capability header, which is
+// read only, so the whole dword gets written back
+static void set_control(struct msi* msi, uint16_t clear, uint16_t set)
+{
+    uint32_t value = pci_read_dword(&msi->address, msi->capability);
+    uint16_t control = ((value >> 16) & ~clear) | set;
+
+    pci_write_dword(&msi->address, msi->capability, (value & 0xFFFF) | ((uint32_t)control << 16));
+}
+
+static bool get_apic_id(uint32_t cpu, uint32_t* apic_id)
+{
+    struct cpu* target = smp_get_cpu(cpu);
+    if(target == NULL || !target->online) {
+        KWARN("No such CPU to send the MSI to");
+        return false;
+    }
+
+    *apic_id = target->apic_id;
+    return true;
+}
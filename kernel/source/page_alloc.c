@@ -0,0 +1,145 @@
+#include <types.h>
+#include <kernel.h>
+#include <page_alloc.h>
+
+// -------------------------------------------------------------------------
+// Forward Declarations
+// -------------------------------------------------------------------------
+static bool is_free(struct page* page);
+
+// -------------------------------------------------------------------------
+// Public Contract
+// -------------------------------------------------------------------------
+void page_map_init(struct page_map* map, struct page* pages, size_t count)
+{
+    map->pages = pages;
+    map->count = count;
+
+    for(size_t i = 0; i < count; i++) {
+        pages[i].flags = 0;
+        pages[i].tag = 0;
+        pages[i].consecutive_pages_allocated = 0;
+    }
+}
+
+enum page_map_result page_map_reserve(struct page_map* map, size_t first, size_t count)
+{
+    if(first >= map->count || count > map->count - first)
+        return page_map_out_of_range;
+
+    if(IS_PAGE_RESERVED(map->pages[first].flags))
+        return page_map_reserved;
+
+    // Make sure all requested pages are available
+    for(size_t i = first; i < first + count; i++) {
+        if(!is_free(&map->pages[i]))
+            return page_map_taken;
+    }
+
+    for(size_t i = first; i < first + count; i++)
+        map->pages[i].flags = PAGE_USED | PAGE_RESERVED;
+
+    return page_map_ok;
+}
+
+size_t page_map_alloc(struct page_map* map, size_t count)
+{
+    if(count == 0 || count > PAGE_MAP_MAX_RUN)
+        return PAGE_MAP_NONE;
+
+    size_t run = 0;
+    for(size_t i = 0; i < map->count; i++) {
+        if(!is_free(&map->pages[i])) {
+            run = 0;
+            continue;
+        }
+
+        if(++run < count)
+            continue;
+
+        size_t first = i + 1 - count;
+        map->pages[first].flags = PAGE_USED | FIRST_IN_ALLOCATION;
+        map->pages[first].consecutive_pages_allocated = (uint16_t)(count - 1);
+
+        for(size_t j = first + 1; j <= i; j++)
+            map->pages[j].flags = PAGE_USED;
+
+        return first;
+    }
+
+    return PAGE_MAP_NONE;
+}
+
+size_t page_map_alloc_cached(struct page_map* map, size_t* pages, size_t count)
+{
+    size_t found = 0;
+
+    for(size_t i = 0; i < map->count && found < count; i++) {
+        struct page* cur = &map->pages[i];
+
+        if(is_free(cur)) {
+            cur->flags = PAGE_USED | FIRST_IN_ALLOCATION | PAGE_CACHED;
+            cur->consecutive_pages_allocated = 0;
+            pages[found++] = i;
+        }
+    }
+
+    return found;
+}
+
+enum page_map_result page_map_free(struct page_map* map, size_t first)
+{
+    if(first >= map->count)
+        return page_map_out_of_range;
+
+    struct page* cur = &map->pages[first];
+    if(!IS_FIRST_IN_ALLOCATION(cur->flags))
+        return page_map_not_first;
+
+    if(IS_PAGE_RESERVED(cur->flags))
+        return page_map_reserved;
+
+    if(IS_PAGE_CACHED(cur->flags))
+        return page_map_cached;
+
+    size_t last = first + cur->consecutive_pages_allocated;
+    for(size_t i = first; i <= last && i < map->count; i++) {
+        map->pages[i].flags = 0;
+        map->pages[i].consecutive_pages_allocated = 0;
+    }
+
+    return page_map_ok;
+}
+
+size_t page_map_count(struct page_map* map, bool allocated)
+{
+    size_t result = 0;
+    for(size_t i = 0; i < map->count; i++) {
+        if(IS_PAGE_USED(map->pages[i].flags) == allocated)
+            result++;
+    }
+
+    return result;
+}
+
+size_t page_map_largest_free(struct page_map* map)
+{
+    size_t largest = 0;
+    size_t run = 0;
+
+    for(size_t i = 0; i < map->count; i++) {
+        run = is_free(&map->pages[i]) ? run + 1 : 0;
+        if(run > largest)
+            largest = run;
+    }
+
+    return largest;
+}
+
+// -------------------------------------------------------------------------
+// Static Functions
+// -------------------------------------------------------------------------
+static bool is_free(struct page* page)
+{
+    return !IS_PAGE_USED(page->flags) && !IS_FIRST_IN_ALLOCATION(page->flags);
+}
@@ -0,0 +1,504 @@
+#include <types.h>
+#include <kernel.h>
+#include <mem_mgr.h>
+#include <ata.h>
+#include <terminal.h>
+#include <vfs.h>
+#include <lock.h>
+#include <page_cache.h>
+#include <arch/x86/cpu.h>
+
+// -------------------------------------------------------------------------
+// Static Defines
+// -------------------------------------------------------------------------
+#define PAGE_CACHE_BUCKETS 256
+#define ENTRIES_PER_PAGE (PAGE_SIZE / sizeof(struct page_cache_entry))
+#define SECTORS_PER_PAGE (PAGE_SIZE / ATA_SECTOR_SIZE)
+
+// -------------------------------------------------------------------------
+// Static Types
+// -------------------------------------------------------------------------
+
+// The readahead in flight, it holds a reference to each of its entries
+// until the drive is done with them
+struct readahead {
+    bool                        active;
+    struct vnode*               node;
+    struct ata_request          request;
+    struct page_cache_entry*    entries[ATA_REQUEST_MAX_BUFFERS];
+    uint32_t                    entry_count;
+};
+
+// -------------------------------------------------------------------------
+// Forward Declarations
+// -------------------------------------------------------------------------
+static uint32_t start_readahead(struct vnode* node, uint32_t index, uint32_t count);
+static uint32_t hash(struct vnode* node, uint32_t index);
+static struct page_cache_entry* find_entry(struct vnode* node, uint32_t index);
+static struct page_cache_entry* alloc_entry();
+static void remove_entry(struct page_cache_entry* entry);
+static void unlink_entry(struct page_cache_entry* entry);
+static void free_entry(struct page_cache_entry* entry);
+static void lru_unlink(struct page_cache_entry* entry);
+static void lru_push_front(struct page_cache_entry* entry);
+static void* read_page(struct vnode* node, uint32_t index);
+static void zero_past_end(struct vnode* node, uint32_t index, void* page);
+static struct page_cache_entry* insert_entry(struct vnode* node, uint32_t index, void* page);
+static void complete_readahead();
+
+// -------------------------------------------------------------------------
+// Globals
+// -------------------------------------------------------------------------
+static struct page_cache_entry* g_buckets[PAGE_CACHE_BUCKETS];
+
+// Every cached page, most recently used first
+static struct page_cache_entry* g_lru_head;
+static struct page_cache_entry* g_lru_tail;
+
+// Entries are carved out of whole pages and never given back
+static struct page_cache_entry* g_free_entries;
+
+static struct readahead g_readahead;
+
+// Guards everything above. Never held while waiting on the disk, pages are
+// read with it dropped and readahead is only ever polled, so it's short
+// enough to take with interrupts off. Reclaim only tries it, the
+// allocation asking may come from in here.
+static struct spinlock g_lock = SPINLOCK_INIT("page_cache");
+
+// -------------------------------------------------------------------------
+// Public Contract
+// -------------------------------------------------------------------------
+bool page_cache_init()
+{
+    return mem_register_reclaimer(page_cache_reclaim);
+}
+
+struct page_cache_entry* page_cache_get(struct vnode* node, uint32_t index)
+{
+    // Read with the lock dropped, if nobody beat us to it
+    void* page = NULL;
+
+    uint32_t flags = spinlock_lock_irqsave(&g_lock);
+
+    struct page_cache_entry* entry;
+    for(;;) {
+        entry = find_entry(node, index);
+        if(entry != NULL && !entry->pending) {
+            entry->ref_count++;
+            lru_unlink(entry);
+            lru_push_front(entry);
+            break;
+        }
+
+        if(entry == NULL && page != NULL) {
+            entry = insert_entry(node, index, page);
+            if(entry != NULL)
+                page = NULL;
+            break;
+        }
+
+        // The readahead is bringing it in, help the drive along until it
+        // has, if it failed we read it ourselves
+        if(entry != NULL) {
+            ata_request_poll(&g_readahead.request);
+            complete_readahead();
+
+            spinlock_unlock_irqrestore(&g_lock, flags);
+            __asm("pause");
+            flags = spinlock_lock_irqsave(&g_lock);
+            continue;
+        }
+
+        spinlock_unlock_irqrestore(&g_lock, flags);
+
+        page = read_page(node, index);
+        if(page == NULL)
+            return NULL;
+
+        flags = spinlock_lock_irqsave(&g_lock);
+    }
+
+    spinlock_unlock_irqrestore(&g_lock, flags);
+
+    if(page != NULL)
+        mem_page_free(page);
+
+    return entry;
+}
+
+void page_cache_put(struct page_cache_entry* entry)
+{
+    uint32_t flags = spinlock_lock_irqsave(&g_lock);
+
+    if(entry->ref_count == 0)
+        KWARN("Page cache: Unbalanced put");
+    else
+        entry->ref_count--;
+
+    spinlock_unlock_irqrestore(&g_lock, flags);
+}
+
+uint32_t page_cache_readahead(struct vnode* node, uint32_t index, uint32_t count)
+{
+    if(node->ops->map == NULL)
+        return 0;
+
+    uint32_t flags = spinlock_lock_irqsave(&g_lock);
+    uint32_t issued = start_readahead(node, index, count);
+    spinlock_unlock_irqrestore(&g_lock, flags);
+
+    return issued;
+}
+
+void page_cache_poll()
+{
+    uint32_t flags = spinlock_lock_irqsave(&g_lock);
+
+    if(g_readahead.active) {
+        ata_request_poll(&g_readahead.request);
+        complete_readahead();
+    }
+
+    spinlock_unlock_irqrestore(&g_lock, flags);
+}
+
+void page_cache_invalidate(struct vnode* node)
+{
+    uint32_t flags = spinlock_lock_irqsave(&g_lock);
+
+    struct page_cache_entry* cur = g_lru_head;
+    while(cur != NULL) {
+        struct page_cache_entry* next = cur->lru_next;
+
+        if(cur->node == node) {
+            // Still on their way in, rather than wait for the drive we cut
+            // them loose and let the readahead free them when it's done
+            if(cur->pending) {
+                unlink_entry(cur);
+                cur->node = NULL;
+            }
+            else if(cur->ref_count > 0) {
+                KWARN("Page cache: Invalidating a pinned page");
+            }
+            else {
+                remove_entry(cur);
+            }
+        }
+
+        cur = next;
+    }
+
+    spinlock_unlock_irqrestore(&g_lock, flags);
+}
+
+size_t page_cache_reclaim(size_t pages_wanted)
+{
+    // Whoever holds the lock may well be the one out of memory. Interrupts
+    // go off first like everywhere else, being preempted with it held would
+    // leave the others spinning.
+    uint32_t flags = cpu_irq_save();
+    if(!spinlock_try_lock(&g_lock)) {
+        cpu_irq_restore(flags);
+        return 0;
+    }
+
+    size_t freed = 0;
+
+    // Walk from the cold end, skipping anything someone is still using
+    struct page_cache_entry* cur = g_lru_tail;
+    while(cur != NULL && freed < pages_wanted) {
+        struct page_cache_entry* prev = cur->lru_prev;
+
+        if(cur->ref_count == 0) {
+            remove_entry(cur);
+            freed++;
+        }
+
+        cur = prev;
+    }
+
+    spinlock_unlock_irqrestore(&g_lock, flags);
+    return freed;
+}
+
+// -------------------------------------------------------------------------
+// Static Functions
+// -------------------------------------------------------------------------
+static uint32_t start_readahead(struct vnode* node, uint32_t index, uint32_t count)
+{
+    // The drive only takes one request at a time
+    if(g_readahead.active) {
+        complete_readahead();
+        if(g_readahead.active)
+            return 0;
+    }
+
+    uint32_t first_index = index;
+
+    uint32_t page_count = (node->size + PAGE_SIZE - 1) / PAGE_SIZE;
+    if(count > ATA_REQUEST_MAX_BUFFERS)
+        count = ATA_REQUEST_MAX_BUFFERS;
+
+    // No point reading what we already have
+    while(count > 0 && index < page_count && find_entry(node, index) != NULL) {
+        index++;
+        count--;
+    }
+
+    if(index >= page_count || count == 0)
+        return index - first_index;
+
+    if(count > page_count - index)
+        count = page_count - index;
+
+    // Only read as far as the file is stored in consecutive sectors
+    uint32_t offset = index * PAGE_SIZE;
+    uint32_t lba;
+    uint32_t mapped = node->ops->map(node, offset, count * PAGE_SIZE, &lba);
+    if(offset + mapped < node->size)
+        mapped -= mapped % PAGE_SIZE;
+    if(mapped == 0)
+        return index - first_index;
+
+    count = (mapped + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    struct readahead* ra = &g_readahead;
+    ra->entry_count = 0;
+    for(uint32_t i = 0; i < count; i++) {
+        if(find_entry(node, index + i) != NULL)
+            break;
+
+        void* page = mem_page_get(mem_tag_page_cache);
+        if(page == NULL) {
+            KWARN("Page cache: Out of memory");
+            break;
+        }
+
+        struct page_cache_entry* entry = insert_entry(node, index + i, page);
+        if(entry == NULL) {
+            mem_page_free(page);
+            break;
+        }
+
+        entry->pending = true;
+        ra->entries[ra->entry_count] = entry;
+        ra->request.buffers[ra->entry_count] = (uintptr_t)entry->page;
+        ra->entry_count++;
+    }
+
+    if(ra->entry_count == 0)
+        return index - first_index;
+
+    if(mapped > ra->entry_count * PAGE_SIZE)
+        mapped = ra->entry_count * PAGE_SIZE;
+
+    ra->node = node;
+    ra->request.lba = lba;
+    ra->request.sector_count = (mapped + ATA_SECTOR_SIZE - 1) / ATA_SECTOR_SIZE;
+    ra->request.sectors_per_buffer = SECTORS_PER_PAGE;
+    ra->active = true;
+
+    // The drive may be busy with someone else's read, we'll try again later
+    if(!ata_read_async(&ra->request)) {
+        ra->request.state = ata_request_failed;
+        complete_readahead();
+        return index - first_index;
+    }
+
+    return index + ra->entry_count - first_index;
+}
+
+static uint32_t hash(struct vnode* node, uint32_t index)
+{
+    uint32_t key = ((uint32_t)(intptr_t)node >> 4) ^ (index * 2654435761u);
+    return (key ^ (key >> 16)) % PAGE_CACHE_BUCKETS;
+}
+
+static struct page_cache_entry* find_entry(struct vnode* node, uint32_t index)
+{
+    struct page_cache_entry* cur = g_buckets[hash(node, index)];
+    while(cur != NULL) {
+        if(cur->node == node && cur->index == index)
+            return cur;
+
+        cur = cur->hash_next;
+    }
+
+    return NULL;
+}
+
+static struct page_cache_entry* alloc_entry()
+{
+    if(g_free_entries == NULL) {
+        struct page_cache_entry* entries = (struct page_cache_entry*)mem_page_get(mem_tag_page_cache);
+        if(entries == NULL) {
+            KWARN("Page cache: Out of memory for entries");
+            return NULL;
+        }
+
+        for(size_t i = 0; i < ENTRIES_PER_PAGE; i++) {
+            entries[i].hash_next = g_free_entries;
+            g_free_entries = &entries[i];
+        }
+    }
+
+    struct page_cache_entry* entry = g_free_entries;
+    g_free_entries = entry->hash_next;
+
+    entry->hash_next = NULL;
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+    return entry;
+}
+
+static void remove_entry(struct page_cache_entry* entry)
+{
+    unlink_entry(entry);
+    free_entry(entry);
+}
+
+// Takes it out of the hash and the LRU, nobody can find it after this
+static void unlink_entry(struct page_cache_entry* entry)
+{
+    struct page_cache_entry** link = &g_buckets[hash(entry->node, entry->index)];
+    while(*link != entry)
+        link = &(*link)->hash_next;
+    *link = entry->hash_next;
+
+    lru_unlink(entry);
+}
+
+static void free_entry(struct page_cache_entry* entry)
+{
+    mem_page_free(entry->page);
+
+    entry->node = NULL;
+    entry->page = NULL;
+    entry->hash_next = g_free_entries;
+    g_free_entries = entry;
+}
+
+static void lru_unlink(struct page_cache_entry* entry)
+{
+    if(entry->lru_prev != NULL)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        g_lru_head = entry->lru_next;
+
+    if(entry->lru_next != NULL)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        g_lru_tail = entry->lru_prev;
+
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+static void lru_push_front(struct page_cache_entry* entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = g_lru_head;
+
+    if(g_lru_head != NULL)
+        g_lru_head->lru_prev = entry;
+    else
+        g_lru_tail = entry;
+
+    g_lru_head = entry;
+}
+
+// Adds a pinned entry for the given page, which it takes over unless this
+// fails. Its content is up to the caller.
+static struct page_cache_entry* insert_entry(struct vnode* node, uint32_t index, void* page)
+{
+    struct page_cache_entry* entry = alloc_entry();
+    if(entry == NULL)
+        return NULL;
+
+    entry->page = page;
+    entry->node = node;
+    entry->index = index;
+    entry->ref_count = 1;
+    entry->pending = false;
+
+    uint32_t bucket = hash(node, index);
+    entry->hash_next = g_buckets[bucket];
+    g_buckets[bucket] = entry;
+    lru_push_front(entry);
+
+    return entry;
+}
+
+static void complete_readahead()
+{
+    struct readahead* ra = &g_readahead;
+    if(!ra->active || ra->request.state == ata_request_busy)
+        return;
+
+    bool success = ra->request.state == ata_request_done;
+    for(uint32_t i = 0; i < ra->entry_count; i++) {
+        struct page_cache_entry* entry = ra->entries[i];
+
+        entry->pending = false;
+        entry->ref_count--;
+
+        // Invalidated while the drive was still busy with it
+        if(entry->node == NULL)
+            free_entry(entry);
+        else if(success)
+            zero_past_end(entry->node, entry->index, entry->page);
+        else
+            remove_entry(entry);
+    }
+
+    ra->entry_count = 0;
+    ra->active = false;
+}
+
+// Reads a page of the file into a fresh page of its own, the lock must not
+// be held since the file system goes to the disk for it
+static void* read_page(struct vnode* node, uint32_t index)
+{
+    void* page = mem_page_get(mem_tag_page_cache);
+    if(page == NULL) {
+        KWARN("Page cache: Out of memory");
+        return NULL;
+    }
+
+    uint32_t offset = index * PAGE_SIZE;
+    size_t length = 0;
+
+    if(offset < node->size) {
+        length = node->size - offset;
+        if(length > PAGE_SIZE)
+            length = PAGE_SIZE;
+    }
+
+    // The file system maps the page onto its clusters
+    if(length > 0 && node->ops->read(node, offset, (intptr_t)page, length) != (int32_t)length) {
+        KWARN("Page cache: Failed to read page");
+        mem_page_free(page);
+        return NULL;
+    }
+
+    zero_past_end(node, index, page);
+    return page;
+}
+
+// Anything past the end of the file reads as zero
+static void zero_past_end(struct vnode* node, uint32_t index, void* page)
+{
+    uint32_t offset = index * PAGE_SIZE;
+    size_t length = 0;
+
+    if(offset < node->size) {
+        length = node->size - offset;
+        if(length > PAGE_SIZE)
+            return;
+    }
+
+    char* tail = (char*)page + length;
+    for(size_t i = length; i < PAGE_SIZE; i++)
+        *tail++ = 0;
+}
@@ -0,0 +1,279 @@
+#include <types.h>
+#include <kernel.h>
+#include <mem_mgr.h>
+#include <terminal.h>
+#include <string.h>
+#include <lock.h>
+#include <paging.h>
+
+// -------------------------------------------------------------------------
+// Static Defines
+// -------------------------------------------------------------------------
+#define ENTRIES_PER_TABLE 1024
+#define LARGE_PAGE_SIZE (PAGE_SIZE * ENTRIES_PER_TABLE)
+#define ADDRESS_MASK 0xFFFFF000
+#define FLAGS_MASK 0x00000FFF
+
+#define DIRECTORY_INDEX(Virt) ((Virt) >> 22)
+#define TABLE_INDEX(Virt) (((Virt) >> 12) & 0x3FF)
+
+#define CR0_WP (1 << 16)
+#define CR0_PG (1 << 31)
+#define CR4_PSE (1 << 4)
+
+#define VGA_TEXT_ADDRESS 0xB8000
+
+// -------------------------------------------------------------------------
+// Forward Declarations
+// -------------------------------------------------------------------------
+static uint32_t* get_table(uintptr_t virt, uint32_t** spare);
+static bool has_table(uintptr_t virt);
+static uint32_t* get_entry(uintptr_t virt);
+static void invalidate(uintptr_t virt);
+static void shootdown(uintptr_t virt);
+
+// -------------------------------------------------------------------------
+// Globals
+// -------------------------------------------------------------------------
+static uint32_t* g_page_directory;
+
+// Every CPU shares the one directory. Guards creating and splitting tables
+// and changing entries, so two CPUs can't both give a directory slot a new
+// table or both copy the same copy-on-write page. Tables are never freed
+// and entries are written whole, so looking one up doesn't need it.
+static struct spinlock g_lock = SPINLOCK_INIT("paging");
+
+// Set by smp once there are other CPUs to tell
+static paging_shootdown_func g_shootdown;
+
+// -------------------------------------------------------------------------
+// Public Contract
+// -------------------------------------------------------------------------
+bool paging_init()
+{
+    g_page_directory = (uint32_t*)mem_page_get(mem_tag_paging);
+    if(g_page_directory == NULL) {
+        KERROR("Paging: No memory for the page directory");
+        return false;
+    }
+
+    // Identity map everything with 4 MiB pages, except the ranges that are
+    // mapped page by page later on. Those get their tables when first used.
+    for(uint32_t i = 0; i < ENTRIES_PER_TABLE; i++) {
+        uintptr_t virt = i * LARGE_PAGE_SIZE;
+
+        if(virt >= PAGING_USER_START && virt < PAGING_WINDOW_END)
+            g_page_directory[i] = 0;
+        else if(virt >= PAGING_MMIO_START)
+            g_page_directory[i] = virt | paging_flag_no_cache | paging_flag_large | paging_flag_write | paging_flag_present;
+        else
+            g_page_directory[i] = virt | paging_flag_large | paging_flag_write | paging_flag_present;
+    }
+
+    // Userland still writes straight to the screen
+    if(!paging_map(VGA_TEXT_ADDRESS, VGA_TEXT_ADDRESS, paging_flag_user | paging_flag_write))
+        return false;
+
+    uint32_t cr4;
+    __asm("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= CR4_PSE;
+    __asm("mov %0, %%cr4" : : "r"(cr4));
+
+    __asm("mov %0, %%cr3" : : "r"(g_page_directory) : "memory");
+
+    // WP makes the kernel honour read-only pages too, which copy-on-write relies on
+    uint32_t cr0;
+    __asm("mov %%cr0, %0" : "=r"(cr0));
+    cr0 |= CR0_PG | CR0_WP;
+    __asm("mov %0, %%cr0" : : "r"(cr0) : "memory");
+
+    KINFO("Paging enabled");
+    return true;
+}
+
+void paging_set_shootdown(paging_shootdown_func func)
+{
+    g_shootdown = func;
+}
+
+bool paging_map(uintptr_t virt, uintptr_t phys, uint32_t flags)
+{
+    // Allocating can mean reclaiming, which mustn't happen under the lock,
+    // so a new table is got ready first if it looks like we need one
+    uint32_t* spare = NULL;
+
+    uint32_t irq_flags = spinlock_lock_irqsave(&g_lock);
+    while(!has_table(virt) && spare == NULL) {
+        spinlock_unlock_irqrestore(&g_lock, irq_flags);
+
+        spare = (uint32_t*)mem_page_get(mem_tag_paging);
+        if(spare == NULL) {
+            KERROR("Paging: No memory for a page table");
+            return false;
+        }
+
+        irq_flags = spinlock_lock_irqsave(&g_lock);
+    }
+
+    uint32_t* table = get_table(virt, &spare);
+    uint32_t old_entry = table[TABLE_INDEX(virt)];
+    table[TABLE_INDEX(virt)] = (phys & ADDRESS_MASK) | (flags & FLAGS_MASK) | paging_flag_present;
+    invalidate(virt);
+
+    spinlock_unlock_irqrestore(&g_lock, irq_flags);
+
+    // Nothing caches entries that weren't present
+    if(old_entry & paging_flag_present)
+        shootdown(virt);
+
+    // Someone else gave the slot its table meanwhile
+    if(spare != NULL)
+        mem_page_free(spare);
+
+    return true;
+}
+
+bool paging_unmap(uintptr_t virt)
+{
+    uint32_t irq_flags = spinlock_lock_irqsave(&g_lock);
+
+    uint32_t* entry = get_entry(virt);
+    uint32_t old_entry = 0;
+    if(entry != NULL) {
+        old_entry = *entry;
+        *entry = 0;
+        invalidate(virt);
+    }
+
+    spinlock_unlock_irqrestore(&g_lock, irq_flags);
+
+    if(old_entry & paging_flag_present)
+        shootdown(virt);
+
+    return entry != NULL;
+}
+
+bool paging_enabled()
+{
+    uint32_t cr0;
+    __asm("mov %%cr0, %0" : "=r"(cr0));
+
+    return (cr0 & CR0_PG) != 0;
+}
+
+bool paging_get(uintptr_t virt, uintptr_t* phys, uint32_t* flags)
+{
+    uint32_t* entry = get_entry(virt);
+    if(entry == NULL || (*entry & paging_flag_present) == 0)
+        return false;
+
+    *phys = *entry & ADDRESS_MASK;
+    *flags = *entry & FLAGS_MASK;
+    return true;
+}
+
+bool paging_handle_fault(uintptr_t address, uint32_t error_code)
+{
+    // Only writes to pages that are there can be copy-on-write
+    if((error_code & paging_fault_present) == 0 || (error_code & paging_fault_write) == 0)
+        return false;
+
+    uint32_t* entry = get_entry(address);
+    if(entry == NULL || (*entry & paging_flag_cow) == 0)
+        return false;
+
+    void* copy = mem_page_get(mem_tag_paging);
+    if(copy == NULL) {
+        KERROR("Paging: Out of memory for copy-on-write");
+        return false;
+    }
+
+    uint32_t irq_flags = spinlock_lock_irqsave(&g_lock);
+
+    // Another CPU may have taken the same fault and copied it already
+    uintptr_t page = address & ADDRESS_MASK;
+    bool needed = (*entry & paging_flag_cow) != 0;
+    if(needed) {
+        // The page is still readable through the faulting address
+        memcpy(copy, (void*)page, PAGE_SIZE);
+
+        uint32_t flags = (*entry & FLAGS_MASK & ~paging_flag_cow) | paging_flag_write;
+        *entry = (uint32_t)(uintptr_t)copy | flags;
+        invalidate(page);
+    }
+
+    spinlock_unlock_irqrestore(&g_lock, irq_flags);
+
+    // Other threads of ours would keep reading the shared page otherwise,
+    // and never see what we write to the copy
+    if(needed)
+        shootdown(page);
+    else
+        mem_page_free(copy);
+
+    return true;
+}
+
+// -------------------------------------------------------------------------
+// Static Functions
+// -------------------------------------------------------------------------
+// Creating a table takes the page in spare, with the lock held
+static uint32_t* get_table(uintptr_t virt, uint32_t** spare)
+{
+    uint32_t* pde = &g_page_directory[DIRECTORY_INDEX(virt)];
+
+    if(has_table(virt))
+        return (uint32_t*)(uintptr_t)(*pde & ADDRESS_MASK);
+
+    if(spare == NULL || *spare == NULL)
+        return NULL;
+
+    uint32_t* table = *spare;
+    *spare = NULL;
+
+    // Splitting a large page keeps whatever it mapped
+    for(uint32_t i = 0; i < ENTRIES_PER_TABLE; i++) {
+        if(*pde & paging_flag_present)
+            table[i] = ((*pde & ADDRESS_MASK) + i * PAGE_SIZE) | (*pde & (paging_flag_write | paging_flag_user | paging_flag_no_cache | paging_flag_present));
+        else
+            table[i] = 0;
+    }
+
+    // Access is decided per page, so the directory allows everything
+    *pde = (uint32_t)(uintptr_t)table | paging_flag_user | paging_flag_write | paging_flag_present;
+    invalidate(virt & ~(LARGE_PAGE_SIZE - 1));
+
+    return table;
+}
+
+static bool has_table(uintptr_t virt)
+{
+    uint32_t pde = g_page_directory[DIRECTORY_INDEX(virt)];
+    return (pde & paging_flag_present) && (pde & paging_flag_large) == 0;
+}
+
+static uint32_t* get_entry(uintptr_t virt)
+{
+    uint32_t* table = get_table(virt, NULL);
+    if(table == NULL)
+        return NULL;
+
+    return &table[TABLE_INDEX(virt)];
+}
+
+static void invalidate(uintptr_t virt)
+{
+    // Before paging is on there is nothing to flush. Flushing any address
+    // inside a large page drops the whole large page.
+    if(!paging_enabled())
+        return;
+
+    __asm("invlpg (%0)" : : "r"(virt) : "memory");
+}
+
+// Without the lock, the other CPUs may need it to get to flushing
+static void shootdown(uintptr_t virt)
+{
+    if(g_shootdown != NULL && paging_enabled())
+        g_shootdown(virt);
+}
@@ -1,6 +1,12 @@
 #include <types.h>
 #include <pio.h>
 #include <pci.h>
+#include <lock.h>
+
+// -------------------------------------------------------------------------
+// Static Defines
+// -------------------------------------------------------------------------
+#define MAX_CAPABILITIES 48 // All that fit in config space, in case of loops
 
 // -------------------------------------------------------------------------
 // Forward declarations 
@@ -8,6 +14,13 @@
 static uint32_t pci_read(uint8_t bus, uint8_t dev, uint8_t func, uint8_t reg_offset, uint8_t len);
 static void pci_write(uint8_t bus, uint8_t dev, uint8_t func, uint8_t port, uint8_t len, uint32_t value);
 
+// -------------------------------------------------------------------------
+// Globals
+// -------------------------------------------------------------------------
+
+// The address and data ports are a pair, nobody may come in between
+static struct spinlock g_config_lock = SPINLOCK_INIT("pci");
+
 // -------------------------------------------------------------------------
 // Exports
 // -------------------------------------------------------------------------
@@ -71,10 +84,14 @@ static uint32_t pci_read(uint8_t bus, uint8_t dev, uint8_t func, uint8_t reg_off
 		(reg_offset & 0xFC);
 
 
+	uint32_t flags = spinlock_lock_irqsave(&g_config_lock);
+
 	OUTD(PCI_ADDR_IO_PORT, val);
 
 	ret = IND(PCI_DATA_IO_PORT + (reg_offset & 0x3));
 
+	spinlock_unlock_irqrestore(&g_config_lock, flags);
+
 	ret &= (0xFFFFFFFF >> ((4-len) * 8));
 
 	return ret;
@@ -89,6 +106,8 @@ static void pci_write(uint8_t bus, uint8_t dev, uint8_t func, uint8_t reg_offset
 		(func << 8) |
 		(reg_offset & 0xFC);
 
+	uint32_t flags = spinlock_lock_irqsave(&g_config_lock);
+
 	OUTD(PCI_ADDR_IO_PORT, val);
 
 	// get current value
@@ -103,6 +122,8 @@ static void pci_write(uint8_t bus, uint8_t dev, uint8_t func, uint8_t reg_offset
 	val |= value;
 
 	OUTD(PCI_DATA_IO_PORT + (reg_offset & 0x3), val);
+
+	spinlock_unlock_irqrestore(&g_config_lock, flags);
 }
 
 bool pci_device_get_next(struct pci_address* addr, int16_t class_id, int16_t sub_class, pci_device* result)
@@ -164,3 +185,21 @@ uint32_t pci_device_get_memory_size(struct pci_address* addr, uint32_t bar_offse
     return ~(size & ~1);
 }
 
+uint8_t pci_find_capability(struct pci_address* addr, uint8_t id)
+{
+    if(!(pci_read_word(addr, PCI_STATUS_REG_OFFSET) & PCI_STATUS_CAPABILITIES))
+        return 0;
+
+    // The bottom two bits are reserved in every pointer
+    uint8_t offset = pci_read_byte(addr, PCI_CAPS_OFF_REG_OFFSET) & 0xFC;
+
+    for(uint32_t i = 0; i < MAX_CAPABILITIES && offset != 0; i++) {
+        uint16_t header = pci_read_word(addr, offset);
+        if((header & 0xFF) == id)
+            return offset;
+
+        offset = (header >> 8) & 0xFC;
+    }
+
+    return 0;
+}
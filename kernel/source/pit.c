@@ -3,19 +3,28 @@
 #include "pic.h"
 #include "terminal.h"
 #include <interrupt.h>
+#include <pit.h>
+#include <irq.h>
 
 #define PIT_IO_PORT_CHANNEL_0 0x40
 #define PIT_IO_PORT_CHANNEL_1 0x41
 #define PIT_IO_PORT_CHANNEL_2 0x42
 #define PIT_IO_PORT_COMMAND   0x43
+#define PIT_IO_PORT_CONTROL   0x61 // Channel 2 gate and output, shared with the speaker
+#define PIT_FREQUENCY 1193182
+#define PIT_MAX_SPIN_MS 50         // A 16-bit count lasts ~54ms
 #define PIT_BINARY_MODE 0 // 16-bit Binary mode
 #define PIT_BCD_MODE 1    // four-digit BCD
 
+#define CONTROL_GATE_2    (1 << 0)
+#define CONTROL_SPEAKER   (1 << 1)
+#define CONTROL_OUTPUT_2  (1 << 5)
+
 // -------------------------------------------------------------------------
 // Forward Declarations
 // -------------------------------------------------------------------------
 static void isr_timer(uint8_t irq, struct irq_regs* irq_regs);
-static void start_pit();
+static void spin_count(uint16_t count);
 
 // -------------------------------------------------------------------------
 // Local types
@@ -50,7 +59,8 @@ enum pit_channel {
 // Global variables
 // -------------------------------------------------------------------------
 static volatile uint64_t g_pit_ticks = 0;
-static uint32_t g_default_pit_divisor = (1193180 / 1000); // Once per millisecond
+static pit_tick_handler g_tick_handler;
+static uint32_t g_default_pit_divisor = (PIT_FREQUENCY / 1000); // Once per millisecond
 
 // -------------------------------------------------------------------------
 // Exports
@@ -61,46 +71,73 @@ void pit_init()
     // Not gonna get any timer interrupts if we don't
     // turn them on dawg
     interrupt_receive(IRQ_0, isr_timer);
-    pic_enable_irq(pic_irq_timer);
+    irq_enable(pic_irq_timer);
 
-    // Set the PIT to fire off an interrupt in the specified time
-    OUTB(PIT_IO_PORT_COMMAND, pit_mode_oneshot|
+    // The rate generator reloads the count by itself, so this is the
+    // last time we have to touch channel 0
+    OUTB(PIT_IO_PORT_COMMAND, pit_mode_rate |
             pit_channel_0 |
             pit_access_both);
 
-    start_pit();
+    OUTB(PIT_IO_PORT_CHANNEL_0, (uint8_t)(g_default_pit_divisor & 0xFF));
+    OUTB(PIT_IO_PORT_CHANNEL_0, (uint8_t)((g_default_pit_divisor >> 8) & 0xFF));
 }
 
-void pit_wait(size_t ms)
+void pit_set_tick_handler(pit_tick_handler handler)
 {
-    // The PIT ticks once every millisecond
-    uint32_t now = g_pit_ticks;
-    uint32_t end = now + ms;
+    g_tick_handler = handler;
+}
 
-    while(g_pit_ticks < end) {
-        __asm("HLT");
+uint64_t pit_get_ticks()
+{
+    return g_pit_ticks;
+}
+
+// Busy waits on channel 2, so it works with interrupts off and
+// doesn't disturb the tick. Meant for calibrating other clocks.
+void pit_spin_ms(uint32_t ms)
+{
+    while(ms > 0) {
+        uint32_t chunk = ms > PIT_MAX_SPIN_MS ? PIT_MAX_SPIN_MS : ms;
+        spin_count((uint16_t)(PIT_FREQUENCY / 1000 * chunk));
+        ms -= chunk;
     }
 }
 
 // -------------------------------------------------------------------------
 // Static Functions
 // -------------------------------------------------------------------------
-static void start_pit()
+static void spin_count(uint16_t count)
 {
-    OUTB(PIT_IO_PORT_CHANNEL_0, (uint8_t)(g_default_pit_divisor & 0xFF));
-    OUTB(PIT_IO_PORT_CHANNEL_0, (uint8_t)((g_default_pit_divisor >> 8) & 0xFF));
+    // Gate low while loading the count, speaker off
+    uint8_t control = INB(PIT_IO_PORT_CONTROL) & ~(CONTROL_SPEAKER | CONTROL_GATE_2);
+    OUTB(PIT_IO_PORT_CONTROL, control);
+
+    // In one-shot mode the output goes high once the count runs out
+    OUTB(PIT_IO_PORT_COMMAND, pit_mode_oneshot |
+            pit_channel_2 |
+            pit_access_both);
+    OUTB(PIT_IO_PORT_CHANNEL_2, (uint8_t)(count & 0xFF));
+    OUTB(PIT_IO_PORT_CHANNEL_2, (uint8_t)((count >> 8) & 0xFF));
+
+    // Counting starts when the gate goes high
+    OUTB(PIT_IO_PORT_CONTROL, control | CONTROL_GATE_2);
+
+    while((INB(PIT_IO_PORT_CONTROL) & CONTROL_OUTPUT_2) == 0) {
+        // Waiting for the count to run out
+    }
+
+    OUTB(PIT_IO_PORT_CONTROL, control);
 }
 
 static void isr_timer(uint8_t irq, struct irq_regs* regs)
 {
-    // The amount of time we set to wait has now passed
+    // The PIT reloads itself, all we do is count
     g_pit_ticks++;
 
-    // To keep track of time in the kernel -
-    // we set the interrupt to fire again
-    start_pit();
+    if(g_tick_handler != NULL)
+        g_tick_handler();
 
-    // Tell the PIC we have handled the interrupt
-    pic_send_eoi(pic_irq_timer);
+    // Tell the PIC or I/O APIC we have handled the interrupt
+    irq_send_eoi(pic_irq_timer);
 }
-
@@ -0,0 +1,137 @@
+#include <types.h>
+#include <kernel.h>
+#include <terminal.h>
+#include <mem_mgr.h>
+#include <paging.h>
+#include <clock.h>
+#include <timer.h>
+#include <smp.h>
+#include <lock.h>
+#include <shared_page.h>
+#include <arch/x86/cpu.h>
+
+// -------------------------------------------------------------------------
+// Static Defines
+// -------------------------------------------------------------------------
+#define CPUID_EXTENDED_MAX      0x80000000
+#define CPUID_EXTENDED_FEATURES 0x80000001
+#define CPUID_RDTSCP            (1 << 27)   // In EDX
+
+#define CPU_MSR_TSC_AUX         0xC0000103
+
+// -------------------------------------------------------------------------
+// Forward Declarations
+// -------------------------------------------------------------------------
+static bool has_rdtscp();
+static void write_begin();
+static void write_end();
+static void tick(struct timer* timer, void* data);
+
+// -------------------------------------------------------------------------
+// Globals
+// -------------------------------------------------------------------------
+static struct shared_page* g_page;
+static struct timer g_tick_timer;
+
+// Writers take turns, readers never wait for anything
+static struct spinlock g_lock = SPINLOCK_INIT("shared_page");
+
+// -------------------------------------------------------------------------
+// Public Contract
+// -------------------------------------------------------------------------
+bool shared_page_init()
+{
+    void* page = mem_page_get_zeroed(mem_tag_kernel);
+    if(page == NULL) {
+        KERROR("Out of memory for the shared page");
+        return false;
+    }
+
+    g_page = (struct shared_page*)page;
+
+    // We keep writing through the identity mapping, user space only gets
+    // to read
+    if(!paging_map(SHARED_PAGE_ADDRESS, (uintptr_t)page, paging_flag_user)) {
+        KERROR("Failed to map the shared page");
+        mem_page_free(page);
+        g_page = NULL;
+        return false;
+    }
+
+    uint32_t flags = spinlock_lock_irqsave(&g_lock);
+    write_begin();
+
+    g_page->version = SHARED_PAGE_VERSION;
+    g_page->page_size = PAGE_SIZE;
+
+    if(clock_get_tsc_scale(&g_page->tsc_base, &g_page->tsc_mult, &g_page->tsc_shift)) {
+        g_page->tsc_khz = clock_tsc_khz();
+        g_page->flags |= shared_page_flag_tsc;
+    }
+
+    if(has_rdtscp()) {
+        g_page->flags |= shared_page_flag_rdtscp;
+        shared_page_init_cpu(0);
+    }
+
+    g_page->cpu_count = smp_cpu_count();
+    for(uint32_t i = 0; i < g_page->cpu_count; i++) {
+        struct cpu* cpu = smp_get_cpu(i);
+        g_page->cpu_by_apic_id[cpu->apic_id & (SHARED_PAGE_APIC_IDS - 1)] = (uint8_t)i;
+    }
+
+    g_page->tick_ns = clock_now_ns();
+
+    write_end();
+    spinlock_unlock_irqrestore(&g_lock, flags);
+
+    timer_start_periodic(&g_tick_timer, SHARED_PAGE_TICK_MS * 1000000ull, tick, NULL);
+    return true;
+}
+
+void shared_page_init_cpu(uint32_t cpu)
+{
+    if(has_rdtscp())
+        cpu_write_msr(CPU_MSR_TSC_AUX, cpu);
+}
+
+// -------------------------------------------------------------------------
+// Static Functions
+// -------------------------------------------------------------------------
+static bool has_rdtscp()
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpu_cpuid(CPUID_EXTENDED_MAX, &eax, &ebx, &ecx, &edx);
+    if(eax < CPUID_EXTENDED_FEATURES)
+        return false;
+
+    cpu_cpuid(CPUID_EXTENDED_FEATURES, &eax, &ebx, &ecx, &edx);
+    return (edx & CPUID_RDTSCP) != 0;
+}
+
+// With the lock held. The sequence goes odd before anything changes and
+// even again once it's all written, a reader that saw either the odd value
+// or two different ones tries again.
+static void write_begin()
+{
+    g_page->sequence = g_page->sequence + 1;
+    __sync_synchronize();
+}
+
+static void write_end()
+{
+    __sync_synchronize();
+    g_page->sequence = g_page->sequence + 1;
+}
+
+static void tick(struct timer* timer, void* data)
+{
+    uint32_t flags = spinlock_lock_irqsave(&g_lock);
+    write_begin();
+
+    g_page->ticks++;
+    g_page->tick_ns = clock_now_ns();
+
+    write_end();
+    spinlock_unlock_irqrestore(&g_lock, flags);
+}
@@ -0,0 +1,338 @@
+#include <types.h>
+#include <kernel.h>
+#include <terminal.h>
+#include <interrupt.h>
+#include <mem_mgr.h>
+#include <apic.h>
+#include <acpi.h>
+#include <clock.h>
+#include <thread.h>
+#include <smp.h>
+#include <syscall.h>
+#include <shared_page.h>
+#include <paging.h>
+#include <arch/x86/cpu.h>
+#include <arch/x86/fpu.h>
+
+// -------------------------------------------------------------------------
+// Static Defines
+// -------------------------------------------------------------------------
+#define INIT_DELAY_US     10000
+#define STARTUP_DELAY_US  200
+#define ONLINE_TIMEOUT_US 100000
+#define APIC_ID_COUNT     256
+
+// -------------------------------------------------------------------------
+// Static Types
+// -------------------------------------------------------------------------
+
+// Filled in for each CPU we start, matches the end of smp_trampoline.asm
+struct PACKED trampoline_data {
+    uint32_t cr0;
+    uint32_t cr3;
+    uint32_t cr4;
+    uint32_t stack;
+    uint32_t entry;
+    uint32_t cpu;
+};
+
+// -------------------------------------------------------------------------
+// Forward Declarations
+// -------------------------------------------------------------------------
+static bool start_cpu(struct cpu* cpu, struct trampoline_data* data);
+static void ap_main(uint32_t index);
+static void delay_us(uint32_t us);
+static void isr_call(uint8_t irq, struct irq_regs* regs);
+static void shootdown(uintptr_t virt);
+static void shootdown_ack(uint32_t index);
+static void isr_shootdown(uint8_t irq, struct irq_regs* regs);
+
+// -------------------------------------------------------------------------
+// Globals
+// -------------------------------------------------------------------------
+extern uint8_t smp_trampoline_start[];
+extern uint8_t smp_trampoline_data[];
+extern uint8_t smp_trampoline_end[];
+
+static struct cpu g_cpus[SMP_MAX_CPUS];
+static uint32_t g_cpu_count = 1;
+static bool g_started_aps;
+
+// Which CPU an APIC ID belongs to, the ID register is the cheapest thing
+// that tells CPUs apart. User mode owns the segment registers.
+static uint8_t g_cpu_by_apic_id[APIC_ID_COUNT];
+
+// The TLB shootdown in flight, there's only ever one. Each CPU that still
+// has to flush the address has its bit set in pending.
+static struct spinlock g_shootdown_lock = SPINLOCK_INIT("shootdown");
+static volatile uintptr_t g_shootdown_address;
+static volatile uint32_t g_shootdown_pending;
+
+// -------------------------------------------------------------------------
+// Public Contract
+// -------------------------------------------------------------------------
+void smp_init()
+{
+    if(!apic_is_enabled())
+        return;
+
+    g_cpus[0].apic_id = apic_get_id();
+    g_cpus[0].online = true;
+    spinlock_init(&g_cpus[0].call.lock, "smp_call");
+
+    interrupt_receive(SMP_CALL_VECTOR, isr_call);
+    interrupt_receive(SMP_SHOOTDOWN_VECTOR, isr_shootdown);
+
+    // Before the others start, they share the page directory from then on
+    paging_set_shootdown(shootdown);
+
+    struct acpi_madt* madt = (struct acpi_madt*)acpi_find_table(ACPI_MADT_SIGNATURE);
+    if(madt == NULL) {
+        KWARN("No MADT, only using the boot CPU");
+        return;
+    }
+
+    // Set up the trampoline once, only the data differs between CPUs
+    uint8_t* trampoline = (uint8_t*)SMP_TRAMPOLINE_ADDRESS;
+    size_t trampoline_size = smp_trampoline_end - smp_trampoline_start;
+    for(size_t i = 0; i < trampoline_size; i++)
+        trampoline[i] = smp_trampoline_start[i];
+
+    struct trampoline_data* data = (struct trampoline_data*)
+        (trampoline + (smp_trampoline_data - smp_trampoline_start));
+
+    uint32_t cr0, cr3, cr4;
+    __asm("mov %%cr0, %0" : "=r"(cr0));
+    __asm("mov %%cr3, %0" : "=r"(cr3));
+    __asm("mov %%cr4, %0" : "=r"(cr4));
+    data->cr0 = cr0;
+    data->cr3 = cr3;
+    data->cr4 = cr4;
+    data->entry = (uint32_t)(uintptr_t)ap_main;
+
+    for(struct acpi_madt_entry* entry = acpi_madt_next(madt, NULL); entry != NULL; entry = acpi_madt_next(madt, entry)) {
+        if(entry->type != acpi_madt_type_lapic)
+            continue;
+
+        struct acpi_madt_lapic* lapic = (struct acpi_madt_lapic*)entry;
+        if(!(lapic->flags & acpi_madt_lapic_flag_enabled) || lapic->apic_id == g_cpus[0].apic_id)
+            continue;
+
+        if(g_cpu_count == SMP_MAX_CPUS) {
+            KWARN("Too many CPUs, ignoring the rest");
+            break;
+        }
+
+        struct cpu* cpu = &g_cpus[g_cpu_count];
+        cpu->index = g_cpu_count;
+        spinlock_init(&cpu->call.lock, "smp_call");
+        cpu->apic_id = lapic->apic_id;
+
+        if(start_cpu(cpu, data))
+            g_cpu_count++;
+    }
+
+    if(g_cpu_count > 1)
+        thread_start_balancing();
+
+    terminal_write_string("Running on ");
+    terminal_write_uint32(g_cpu_count);
+    terminal_write_string(" CPU(s)\n");
+}
+
+uint32_t smp_cpu_count()
+{
+    return g_cpu_count;
+}
+
+uint32_t smp_cpu_index()
+{
+    if(!g_started_aps)
+        return 0;
+
+    return g_cpu_by_apic_id[apic_get_id() & (APIC_ID_COUNT - 1)];
+}
+
+struct cpu* smp_cpu()
+{
+    return &g_cpus[smp_cpu_index()];
+}
+
+struct cpu* smp_get_cpu(uint32_t index)
+{
+    return index < g_cpu_count ? &g_cpus[index] : NULL;
+}
+
+void smp_send_ipi(uint32_t index, uint8_t vector)
+{
+    if(index < g_cpu_count)
+        apic_send_ipi(g_cpus[index].apic_id, vector);
+}
+
+bool smp_call(uint32_t index, smp_call_func func, void* arg)
+{
+    if(index >= g_cpu_count || !g_cpus[index].online)
+        return false;
+
+    if(index == smp_cpu_index()) {
+        func(arg);
+        return true;
+    }
+
+    // One call per CPU at a time, later callers wait their turn
+    struct smp_call* call = &g_cpus[index].call;
+    spinlock_lock(&call->lock);
+
+    call->func = func;
+    call->arg = arg;
+    call->done = false;
+    __sync_synchronize();
+
+    apic_send_ipi(g_cpus[index].apic_id, SMP_CALL_VECTOR);
+
+    // It may be waiting on us to flush before it can get to our call
+    while(!call->done) {
+        shootdown_ack(smp_cpu_index());
+        __asm("pause");
+    }
+
+    spinlock_unlock(&call->lock);
+    return true;
+}
+
+// -------------------------------------------------------------------------
+// Static Functions
+// -------------------------------------------------------------------------
+
+// INIT-SIPI-SIPI as the MP spec has it, the second SIPI is only needed if
+// the first one got lost
+static bool start_cpu(struct cpu* cpu, struct trampoline_data* data)
+{
+    cpu->idle = thread_create_idle(cpu->index);
+    if(cpu->idle == NULL)
+        return false;
+
+    data->stack = cpu->idle->stack_top;
+    data->cpu = cpu->index;
+
+    g_cpu_by_apic_id[cpu->apic_id] = cpu->index;
+    g_started_aps = true;
+
+    apic_send_init(cpu->apic_id);
+    delay_us(INIT_DELAY_US);
+
+    apic_send_startup(cpu->apic_id, SMP_TRAMPOLINE_ADDRESS);
+    delay_us(STARTUP_DELAY_US);
+
+    if(!cpu->online) {
+        apic_send_startup(cpu->apic_id, SMP_TRAMPOLINE_ADDRESS);
+        delay_us(STARTUP_DELAY_US);
+    }
+
+    // Only one CPU runs on the trampoline data at a time
+    uint64_t timeout = clock_now_ns() + ONLINE_TIMEOUT_US * 1000ull;
+    while(!cpu->online && clock_now_ns() < timeout) {
+        __asm("pause");
+    }
+
+    if(!cpu->online) {
+        KWARN("CPU didn't come online");
+        mem_page_free(cpu->idle->stack);
+        cpu->idle = NULL;
+        g_cpu_by_apic_id[cpu->apic_id] = 0;
+        return false;
+    }
+
+    return true;
+}
+
+// Where application processors arrive from the trampoline
+static void ap_main(uint32_t index)
+{
+    struct cpu* cpu = &g_cpus[index];
+
+    mem_mgr_gdt_setup_cpu(index, cpu->idle->stack_top);
+    interrupt_init_cpu();
+    syscall_init_cpu(index);
+    shared_page_init_cpu(index);
+    fpu_init_cpu();
+    apic_init();
+
+    cpu->online = true;
+
+    // We're already on the idle thread's stack, become it
+    thread_run_idle();
+}
+
+static void delay_us(uint32_t us)
+{
+    uint64_t until = clock_now_ns() + us * 1000ull;
+    while(clock_now_ns() < until) {
+        __asm("pause");
+    }
+}
+
+static void isr_call(uint8_t irq, struct irq_regs* regs)
+{
+    struct smp_call* call = &g_cpus[smp_cpu_index()].call;
+
+    call->func(call->arg);
+    __sync_synchronize();
+    call->done = true;
+
+    apic_send_eoi();
+}
+
+// Interrupts stay off throughout, we can't be moved to another CPU or
+// start another shootdown from an interrupt halfway through
+static void shootdown(uintptr_t virt)
+{
+    uint32_t flags = cpu_irq_save();
+    uint32_t self = smp_cpu_index();
+
+    // Whoever has it may be waiting for us to flush, so keep doing that
+    // while we wait our turn
+    while(!spinlock_try_lock(&g_shootdown_lock)) {
+        shootdown_ack(self);
+        __asm("pause");
+    }
+
+    uint32_t targets = 0;
+    for(uint32_t i = 0; i < SMP_MAX_CPUS; i++) {
+        if(i != self && g_cpus[i].online)
+            targets |= 1u << i;
+    }
+
+    g_shootdown_address = virt;
+    __atomic_store_n(&g_shootdown_pending, targets, __ATOMIC_SEQ_CST);
+
+    for(uint32_t i = 0; i < SMP_MAX_CPUS; i++) {
+        if(targets & (1u << i))
+            apic_send_ipi(g_cpus[i].apic_id, SMP_SHOOTDOWN_VECTOR);
+    }
+
+    while(__atomic_load_n(&g_shootdown_pending, __ATOMIC_ACQUIRE) != 0) {
+        __asm("pause");
+    }
+
+    spinlock_unlock(&g_shootdown_lock);
+    cpu_irq_restore(flags);
+}
+
+// Flushes the address if it's still our turn, from the IPI or from anyone
+// spinning with interrupts off who would otherwise hold everyone up
+static void shootdown_ack(uint32_t index)
+{
+    uint32_t bit = 1u << index;
+    if((__atomic_load_n(&g_shootdown_pending, __ATOMIC_ACQUIRE) & bit) == 0)
+        return;
+
+    __asm("invlpg (%0)" : : "r"(g_shootdown_address) : "memory");
+    __atomic_and_fetch(&g_shootdown_pending, ~bit, __ATOMIC_RELEASE);
+}
+
+static void isr_shootdown(uint8_t irq, struct irq_regs* regs)
+{
+    shootdown_ack(smp_cpu_index());
+    apic_send_eoi();
+}
@@ -0,0 +1,157 @@
+#include <types.h>
+#include <kernel.h>
+#include <terminal.h>
+#include <smp.h>
+#include <softirq.h>
+#include <arch/x86/cpu.h>
+
+// -------------------------------------------------------------------------
+// Static Defines
+// -------------------------------------------------------------------------
+
+// Work that keeps raising itself gets this many passes per interrupt, the
+// rest waits for the next one or the idle thread
+#define SOFTIRQ_MAX_ROUNDS  8
+
+#define TASKLET_SCHEDULED   (1 << 0)
+#define TASKLET_RUNNING     (1 << 1)
+
+// -------------------------------------------------------------------------
+// Forward Declarations
+// -------------------------------------------------------------------------
+static void run_tasklets();
+static void queue_tasklet(struct cpu* cpu, struct tasklet* tasklet);
+
+// -------------------------------------------------------------------------
+// Globals
+// -------------------------------------------------------------------------
+static softirq_handler g_handlers[softirq_count] = {
+    [softirq_tasklet] = run_tasklets
+};
+
+// -------------------------------------------------------------------------
+// Public Contract
+// -------------------------------------------------------------------------
+void softirq_register(enum softirq softirq, softirq_handler handler)
+{
+    if(softirq >= softirq_count) {
+        KWARN("Invalid softirq");
+        return;
+    }
+
+    g_handlers[softirq] = handler;
+}
+
+void softirq_raise(enum softirq softirq)
+{
+    uint32_t flags = cpu_irq_save();
+    smp_cpu()->softirq_pending |= 1u << softirq;
+    cpu_irq_restore(flags);
+}
+
+void softirq_run()
+{
+    uint32_t flags = cpu_irq_save();
+    struct cpu* cpu = smp_cpu();
+
+    // An interrupt taken while we're running handlers comes back here on
+    // its way out, it only gets to add to the pending bits
+    if(cpu->in_softirq) {
+        cpu_irq_restore(flags);
+        return;
+    }
+
+    cpu->in_softirq = true;
+
+    for(uint32_t round = 0; round < SOFTIRQ_MAX_ROUNDS && cpu->softirq_pending != 0; round++) {
+        uint32_t pending = cpu->softirq_pending;
+        cpu->softirq_pending = 0;
+
+        // Nothing switches us away in here, so cpu stays ours
+        __asm("sti");
+
+        while(pending != 0) {
+            uint32_t softirq = (uint32_t)__builtin_ctz(pending);
+            pending &= pending - 1;
+
+            if(g_handlers[softirq] != NULL)
+                g_handlers[softirq]();
+        }
+
+        __asm("cli");
+    }
+
+    cpu->in_softirq = false;
+    cpu_irq_restore(flags);
+}
+
+bool softirq_pending()
+{
+    uint32_t flags = cpu_irq_save();
+    bool pending = smp_cpu()->softirq_pending != 0;
+    cpu_irq_restore(flags);
+
+    return pending;
+}
+
+void tasklet_init(struct tasklet* tasklet, tasklet_func func, void* data)
+{
+    *tasklet = (struct tasklet)TASKLET_INIT(func, data);
+}
+
+void tasklet_schedule(struct tasklet* tasklet)
+{
+    if(__sync_fetch_and_or(&tasklet->state, TASKLET_SCHEDULED) & TASKLET_SCHEDULED)
+        return;
+
+    uint32_t flags = cpu_irq_save();
+    queue_tasklet(smp_cpu(), tasklet);
+    cpu_irq_restore(flags);
+}
+
+// -------------------------------------------------------------------------
+// Static Functions
+// -------------------------------------------------------------------------
+static void run_tasklets()
+{
+    uint32_t flags = cpu_irq_save();
+    struct cpu* cpu = smp_cpu();
+    struct tasklet* list = cpu->tasklets;
+    cpu->tasklets = NULL;
+    cpu->tasklets_tail = NULL;
+    cpu_irq_restore(flags);
+
+    while(list != NULL) {
+        struct tasklet* tasklet = list;
+        list = tasklet->next;
+        tasklet->next = NULL;
+
+        // Scheduled again here while another CPU is still running it, it
+        // goes back on our list until that's done
+        if(__sync_fetch_and_or(&tasklet->state, TASKLET_RUNNING) & TASKLET_RUNNING) {
+            flags = cpu_irq_save();
+            queue_tasklet(cpu, tasklet);
+            cpu_irq_restore(flags);
+            continue;
+        }
+
+        // From here on it can be scheduled again, even by itself
+        __sync_fetch_and_and(&tasklet->state, ~TASKLET_SCHEDULED);
+        tasklet->func(tasklet, tasklet->data);
+        __sync_fetch_and_and(&tasklet->state, ~TASKLET_RUNNING);
+    }
+}
+
+// Interrupts disabled, on the given CPU
+static void queue_tasklet(struct cpu* cpu, struct tasklet* tasklet)
+{
+    tasklet->next = NULL;
+
+    if(cpu->tasklets_tail != NULL)
+        cpu->tasklets_tail->next = tasklet;
+    else
+        cpu->tasklets = tasklet;
+
+    cpu->tasklets_tail = tasklet;
+    cpu->softirq_pending |= 1u << softirq_tasklet;
+}
@@ -1,5 +1,21 @@
 #include <types.h>
 #include <string.h>
+#include <arch/x86/cpu.h>
+
+// Below this a plain byte loop beats setting up the string instructions
+#define SMALL_COPY 16
+
+#define STREAM_BLOCK 64
+
+static void copy_forward(void* dest, const void* src, size_t length);
+static void copy_backward(void* dest, const void* src, size_t length);
+static void fill(void* dest, uint8_t value, size_t length);
+static void stream_copy(void* dest, const void* src, size_t length);
+static void stream_fill(void* dest, uint8_t value, size_t length);
+
+// MOVNTI only needs SSE2 from the CPU, it stores from general registers
+// so there is no FPU state involved and it's fine in interrupts too
+static bool g_stream;
 
 size_t strlen(const char* str)
 {
@@ -9,13 +25,15 @@ size_t strlen(const char* str)
 	return ret;
 }
 
-char* kstrcpy_n(char* dest, size_t len, char* src)
+void string_init()
 {
-    for(size_t i = 0; i < len; i++) {
-        *dest++ = *src++;
-    }
+    g_stream = cpu_has_feature(cpu_feature_sse2);
+}
 
-    return dest;
+char* kstrcpy_n(char* dest, size_t len, char* src)
+{
+    memcpy(dest, src, len);
+    return dest + len;
 }
 
 bool kstrcmp(const char* a, const char* b)
@@ -32,12 +50,68 @@ bool kstrcmp(const char* a, const char* b)
 
 bool kstrcmp_n(const char* a, const char* b, size_t len)
 {
-    for(size_t i = 0; i < len; i++) {
-        if(a[i] != b[i])
-            return false;
+    return memcmp(a, b, len) == 0;
+}
+
+void* memcpy(void* dest, const void* src, size_t length)
+{
+    if(g_stream && length >= STRING_STREAM_THRESHOLD)
+        stream_copy(dest, src, length);
+    else
+        copy_forward(dest, src, length);
+
+    return dest;
+}
+
+void* memmove(void* dest, const void* src, size_t length)
+{
+    // Only a destination inside the source has to go back to front
+    if((uintptr_t)dest - (uintptr_t)src >= length)
+        return memcpy(dest, src, length);
+
+    copy_backward(dest, src, length);
+    return dest;
+}
+
+void* memset(void* dest, int value, size_t length)
+{
+    if(g_stream && length >= STRING_STREAM_THRESHOLD)
+        stream_fill(dest, (uint8_t)value, length);
+    else
+        fill(dest, (uint8_t)value, length);
+
+    return dest;
+}
+
+void* memset_uncached(void* dest, int value, size_t length)
+{
+    if(g_stream)
+        stream_fill(dest, (uint8_t)value, length);
+    else
+        fill(dest, (uint8_t)value, length);
+
+    return dest;
+}
+
+int memcmp(const void* a, const void* b, size_t length)
+{
+    const uint8_t* x = a;
+    const uint8_t* y = b;
+
+    // A dword at a time until something differs, the bytes then say which
+    // way round it is
+    while(length >= sizeof(uint32_t) && *(const uint32_t*)x == *(const uint32_t*)y) {
+        x += sizeof(uint32_t);
+        y += sizeof(uint32_t);
+        length -= sizeof(uint32_t);
     }
 
-    return true;
+    for(size_t i = 0; i < length; i++) {
+        if(x[i] != y[i])
+            return x[i] - y[i];
+    }
+
+    return 0;
 }
 
 char* itoa(int32_t number, char* buf) {
@@ -84,3 +158,139 @@ uint8_t nybble_to_ascii(uint8_t val)
 		return 'A' + (val - 10);
 }
 
+static void copy_forward(void* dest, const void* src, size_t length)
+{
+    uint32_t d0, d1, d2;
+
+    if(length < SMALL_COPY) {
+        __asm volatile("rep movsb"
+                : "=&c"(d0), "=&D"(d1), "=&S"(d2)
+                : "0"(length), "1"(dest), "2"(src)
+                : "memory");
+        return;
+    }
+
+    // Line the destination up first, misaligned stores cost the most
+    size_t head = -(uintptr_t)dest & 3;
+    length -= head;
+
+    __asm volatile("rep movsb\n\t"
+                   "mov %4, %%ecx\n\t"
+                   "rep movsl\n\t"
+                   "mov %5, %%ecx\n\t"
+                   "rep movsb"
+            : "=&c"(d0), "=&D"(d1), "=&S"(d2)
+            : "0"(head), "g"(length / 4), "g"(length & 3), "1"(dest), "2"(src)
+            : "memory");
+}
+
+// The same with the direction flag set, starting from the last byte
+static void copy_backward(void* dest, const void* src, size_t length)
+{
+    uint32_t d0, d1, d2;
+
+    __asm volatile("std\n\t"
+                   "rep movsb\n\t"
+                   "sub $3, %%esi\n\t"
+                   "sub $3, %%edi\n\t"
+                   "mov %4, %%ecx\n\t"
+                   "rep movsl\n\t"
+                   "cld"
+            : "=&c"(d0), "=&D"(d1), "=&S"(d2)
+            : "0"(length & 3), "g"(length / 4),
+              "1"((uint8_t*)dest + length - 1), "2"((const uint8_t*)src + length - 1)
+            : "memory");
+}
+
+static void fill(void* dest, uint8_t value, size_t length)
+{
+    uint32_t d0, d1;
+    uint32_t pattern = value * 0x01010101u;
+
+    size_t head = length < SMALL_COPY ? length : -(uintptr_t)dest & 3;
+    length -= head;
+
+    __asm volatile("rep stosb\n\t"
+                   "mov %3, %%ecx\n\t"
+                   "rep stosl\n\t"
+                   "mov %4, %%ecx\n\t"
+                   "rep stosb"
+            : "=&c"(d0), "=&D"(d1)
+            : "0"(head), "g"(length / 4), "g"(length & 3), "1"(dest), "a"(pattern)
+            : "memory");
+}
+
+#define STREAM_COPY_8(offset) \
+    "mov " #offset "(%%esi), %%eax\n\t" \
+    "mov " #offset "+4(%%esi), %%edx\n\t" \
+    "movnti %%eax, " #offset "(%%edi)\n\t" \
+    "movnti %%edx, " #offset "+4(%%edi)\n\t"
+
+#define STREAM_FILL_8(offset) \
+    "movnti %%eax, " #offset "(%%edi)\n\t" \
+    "movnti %%eax, " #offset "+4(%%edi)\n\t"
+
+// Whole blocks straight to memory, the ragged ends through the cache
+static void stream_copy(void* dest, const void* src, size_t length)
+{
+    size_t head = -(uintptr_t)dest & (STREAM_BLOCK - 1);
+    copy_forward(dest, src, head);
+
+    uint8_t* d = (uint8_t*)dest + head;
+    const uint8_t* s = (const uint8_t*)src + head;
+    length -= head;
+
+    size_t blocks = length / STREAM_BLOCK;
+    if(blocks != 0) {
+        __asm volatile("1:\n\t"
+                       STREAM_COPY_8(0)
+                       STREAM_COPY_8(8)
+                       STREAM_COPY_8(16)
+                       STREAM_COPY_8(24)
+                       STREAM_COPY_8(32)
+                       STREAM_COPY_8(40)
+                       STREAM_COPY_8(48)
+                       STREAM_COPY_8(56)
+                       "add $64, %%esi\n\t"
+                       "add $64, %%edi\n\t"
+                       "dec %%ecx\n\t"
+                       "jnz 1b\n\t"
+                       "sfence"
+                : "+S"(s), "+D"(d), "+c"(blocks)
+                :
+                : "eax", "edx", "memory");
+    }
+
+    copy_forward(d, s, length % STREAM_BLOCK);
+}
+
+static void stream_fill(void* dest, uint8_t value, size_t length)
+{
+    size_t head = -(uintptr_t)dest & (STREAM_BLOCK - 1);
+    fill(dest, value, head);
+
+    uint8_t* d = (uint8_t*)dest + head;
+    length -= head;
+
+    size_t blocks = length / STREAM_BLOCK;
+    if(blocks != 0) {
+        __asm volatile("1:\n\t"
+                       STREAM_FILL_8(0)
+                       STREAM_FILL_8(8)
+                       STREAM_FILL_8(16)
+                       STREAM_FILL_8(24)
+                       STREAM_FILL_8(32)
+                       STREAM_FILL_8(40)
+                       STREAM_FILL_8(48)
+                       STREAM_FILL_8(56)
+                       "add $64, %%edi\n\t"
+                       "dec %%ecx\n\t"
+                       "jnz 1b\n\t"
+                       "sfence"
+                : "+D"(d), "+c"(blocks)
+                : "a"(value * 0x01010101u)
+                : "memory");
+    }
+
+    fill(d, value, length % STREAM_BLOCK);
+}
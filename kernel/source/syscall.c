@@ -0,0 +1,139 @@
+#include <types.h>
+#include <kernel.h>
+#include <terminal.h>
+#include <interrupt.h>
+#include <mem_mgr.h>
+#include <paging.h>
+#include <thread.h>
+#include <timer.h>
+#include <syscall.h>
+#include <arch/x86/cpu.h>
+
+// -------------------------------------------------------------------------
+// Static Types
+// -------------------------------------------------------------------------
+typedef uint32_t (*syscall_func)(uint32_t arg0, uint32_t arg1, uint32_t arg2);
+
+// -------------------------------------------------------------------------
+// Forward Declarations
+// -------------------------------------------------------------------------
+static void isr_syscall(uint8_t irq, struct irq_regs* regs);
+static uint32_t sys_exit(uint32_t code, uint32_t unused1, uint32_t unused2);
+static uint32_t sys_write(uint32_t buffer, uint32_t length, uint32_t unused);
+static uint32_t sys_sleep(uint32_t ms, uint32_t unused1, uint32_t unused2);
+static uint32_t sys_yield(uint32_t unused0, uint32_t unused1, uint32_t unused2);
+
+// -------------------------------------------------------------------------
+// Globals
+// -------------------------------------------------------------------------
+
+// In syscall_entry.asm
+extern void syscall_sysenter_entry();
+
+static const syscall_func g_syscalls[syscall_count] = {
+    [syscall_exit]  = sys_exit,
+    [syscall_write] = sys_write,
+    [syscall_sleep] = sys_sleep,
+    [syscall_yield] = sys_yield
+};
+
+// -------------------------------------------------------------------------
+// Public Contract
+// -------------------------------------------------------------------------
+void syscall_init()
+{
+    // Ring 3 has to be allowed to raise it. A trap gate, so interrupts
+    // stay on while we're in here.
+    interrupt_install_handler(SYSCALL_VECTOR, isr_syscall, gate_type_trap32, 3);
+
+    syscall_init_cpu(0);
+}
+
+void syscall_init_cpu(uint32_t cpu)
+{
+    if(!cpu_has_feature(cpu_feature_sep))
+        return;
+
+    // SS follows CS in the GDT, and SYSEXIT finds the user segments after
+    // those two, which is how ours are laid out. There's no way to point
+    // ESP at a different stack per thread, so it points at the one the TSS
+    // holds and the entry code loads it from there.
+    cpu_write_msr(SYSCALL_MSR_SYSENTER_CS, KERNEL_CODE_SEGMENT);
+    cpu_write_msr(SYSCALL_MSR_SYSENTER_ESP, mem_mgr_get_kernel_stack_slot(cpu));
+    cpu_write_msr(SYSCALL_MSR_SYSENTER_EIP, (uintptr_t)syscall_sysenter_entry);
+}
+
+void syscall_handle(struct irq_regs* regs)
+{
+    uint32_t number = regs->eax;
+    if(number >= syscall_count || g_syscalls[number] == NULL) {
+        regs->eax = SYSCALL_ERROR;
+        return;
+    }
+
+    regs->eax = g_syscalls[number](regs->ebx, regs->esi, regs->edi);
+}
+
+bool syscall_check_user(uintptr_t address, size_t length, bool write)
+{
+    if(address < PAGING_USER_START || address >= PAGING_USER_END)
+        return false;
+    if(length > PAGING_USER_END - address)
+        return false;
+    if(length == 0)
+        return true;
+
+    // User mappings are made up front, so what isn't mapped now is a bad
+    // pointer rather than something a fault would bring in
+    uintptr_t end = address + length - 1;
+    for(uintptr_t page = address & ~(PAGE_SIZE - 1); page <= end; page += PAGE_SIZE) {
+        uint32_t flags;
+        uintptr_t phys;
+        if(!paging_get(page, &phys, &flags))
+            return false;
+
+        if((flags & paging_flag_present) == 0 || (flags & paging_flag_user) == 0)
+            return false;
+
+        // Copy-on-write pages get their copy when we write to them
+        if(write && (flags & (paging_flag_write | paging_flag_cow)) == 0)
+            return false;
+    }
+
+    return true;
+}
+
+// -------------------------------------------------------------------------
+// Static Functions
+// -------------------------------------------------------------------------
+static void isr_syscall(uint8_t irq, struct irq_regs* regs)
+{
+    syscall_handle(regs);
+}
+
+static uint32_t sys_exit(uint32_t code, uint32_t unused1, uint32_t unused2)
+{
+    thread_exit();
+    return SYSCALL_ERROR;
+}
+
+static uint32_t sys_write(uint32_t buffer, uint32_t length, uint32_t unused)
+{
+    if(!syscall_check_user(buffer, length, false))
+        return SYSCALL_ERROR;
+
+    terminal_write_string_n((const char*)(uintptr_t)buffer, length);
+    return length;
+}
+
+static uint32_t sys_sleep(uint32_t ms, uint32_t unused1, uint32_t unused2)
+{
+    sleep_ms(ms);
+    return 0;
+}
+
+static uint32_t sys_yield(uint32_t unused0, uint32_t unused1, uint32_t unused2)
+{
+    thread_yield();
+    return 0;
+}
@@ -3,6 +3,7 @@
 #include <terminal.h>
 #include <string.h>
 #include <bit_utils.h>
+#include <lock.h>
 
 // -------------------------------------------------------------------------
 // Static defines
@@ -29,11 +30,15 @@ static uint16_t g_buffer[BUFFER_MAX_ROWS][BUFFER_MAX_COLUMNS];
 // Indicates how far down the buffer we have scrolled
 static size_t g_buffer_row_offset = 0;
 
+// Covers the buffer and cursor, taken per character or string written
+static struct spinlock g_lock = SPINLOCK_INIT("terminal");
+
 // -------------------------------------------------------------------------
 // Forward declaractions
 // -------------------------------------------------------------------------
 static uint16_t vgaentry_create(char c, uint8_t color);
 static void buffer_sync_with_screen();
+static void put_char(const char c);
 
 void terminal_init()
 {
@@ -45,6 +50,8 @@ void terminal_init()
 
 void terminal_clear()
 {
+    uint32_t flags = spinlock_lock_irqsave(&g_lock);
+
     uint16_t empty = vgaentry_create(' ', g_current_color);
 
     for(size_t x = 0; x < BUFFER_MAX_COLUMNS; x++) {
@@ -58,6 +65,8 @@ void terminal_clear()
     g_buffer_row_offset = 0;
 
     buffer_sync_with_screen();
+
+    spinlock_unlock_irqrestore(&g_lock, flags);
 }
 
 void terminal_reset_color()
@@ -91,8 +100,13 @@ void terminal_write_string(const char* data)
 
 void terminal_write_string_n(const char* data, size_t length)
 {
+    // Whole strings at once, so other CPUs don't print into the middle
+    uint32_t flags = spinlock_lock_irqsave(&g_lock);
+
 	for (size_t i = 0; i < length; i++)
-		terminal_write_char(data[i]);
+		put_char(data[i]);
+
+    spinlock_unlock_irqrestore(&g_lock, flags);
 }
 
 void terminal_write_uint32(uint32_t val)
@@ -190,11 +204,7 @@ static void buffer_sync_with_screen()
 
 static void buffer_scroll_up()
 {
-    for(size_t x = 1; x < BUFFER_MAX_ROWS; x++) {
-        for(size_t y = 0; y < BUFFER_MAX_COLUMNS; y++) {
-            g_buffer[x - 1][y] = g_buffer[x][y];
-        }
-    }
+    memmove(g_buffer[0], g_buffer[1], sizeof(g_buffer) - sizeof(g_buffer[0]));
 
     // And clear the last row
     for(size_t i = 0; i < BUFFER_MAX_COLUMNS; i++) {
@@ -217,13 +227,17 @@ static void buffer_increase_offset()
 
 bool terminal_erase_char_last()
 {
+    uint32_t flags = spinlock_lock_irqsave(&g_lock);
+
     if(g_current_column > 0) {
         // Easy, just step back a column!
         g_current_column--;
     }
     else {
-        if(g_current_row <= 0)
+        if(g_current_row <= 0) {
+            spinlock_unlock_irqrestore(&g_lock, flags);
             return false;
+        }
 
         g_current_row--;
         g_current_column = BUFFER_MAX_COLUMNS - 1;
@@ -233,14 +247,23 @@ bool terminal_erase_char_last()
 
     buffer_sync_with_screen();
 
+    spinlock_unlock_irqrestore(&g_lock, flags);
     return true;
 }
 
 void terminal_write_char(const char c)
+{
+    uint32_t flags = spinlock_lock_irqsave(&g_lock);
+    put_char(c);
+    spinlock_unlock_irqrestore(&g_lock, flags);
+}
+
+// Called with the lock held
+static void put_char(const char c)
 {
     if(c == '\t') {
         for(int i = 0; i < SPACES_PER_TAB; i++) {
-            terminal_write_char(' ');
+            put_char(' ');
         }
         return;
     }
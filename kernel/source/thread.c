@@ -0,0 +1,663 @@
+#include <types.h>
+#include <kernel.h>
+#include <terminal.h>
+#include <interrupt.h>
+#include <mem_mgr.h>
+#include <apic.h>
+#include <timer.h>
+#include <thread.h>
+#include <string.h>
+#include <smp.h>
+#include <softirq.h>
+#include <arch/x86/cpu.h>
+#include <arch/x86/fpu.h>
+
+// -------------------------------------------------------------------------
+// Static Defines
+// -------------------------------------------------------------------------
+#define RUN_QUEUE_SLOTS     128     // Per priority and CPU, a power of two
+#define RUN_QUEUE_MASK      (RUN_QUEUE_SLOTS - 1)
+#define BALANCE_PERIOD_NS   100000000ull
+#define CACHE_LINE_SIZE     64
+
+// -------------------------------------------------------------------------
+// Static Types
+// -------------------------------------------------------------------------
+
+// Only the owning CPU pushes, at the bottom. Everybody takes from the top,
+// the owner to go round robin and other CPUs to steal the thread that has
+// waited the longest. Taking is a single compare and swap, and the owner's
+// is nearly always uncontended.
+struct run_deque {
+    volatile uint32_t   top;
+    volatile uint32_t   bottom;
+    struct thread*      slots[RUN_QUEUE_SLOTS];
+};
+
+// One per CPU, only touched by other CPUs to steal or to hand over wake ups
+struct run_queue {
+    struct run_deque    deques[THREAD_PRIORITY_LEVELS];
+
+    // A bit per priority that may have threads, cleared lazily
+    volatile uint32_t   ready_mask;
+
+    // Threads woken on other CPUs, we make them ready ourselves
+    struct thread*      inbox;
+
+    // Switched away from, but still on our stack until finish_switch
+    struct thread*      prev;
+
+    volatile bool       balance;
+    uint32_t            random;
+    struct timer        slice_timer;
+} ALIGN(CACHE_LINE_SIZE);
+
+// -------------------------------------------------------------------------
+// Forward Declarations
+// -------------------------------------------------------------------------
+void thread_switch_context(uintptr_t* old_esp, uintptr_t new_esp);
+
+static struct thread* allocate_thread(const char* name, thread_entry entry, void* arg, uint8_t priority);
+static void schedule();
+static void finish_switch();
+static void thread_start();
+static void idle_main(void* arg);
+static void wake_local(struct cpu* cpu, struct thread* thread);
+static void drain_inbox(struct cpu* cpu);
+static void push(struct run_queue* queue, struct thread* thread);
+static struct thread* take(struct run_queue* queue);
+static struct thread* steal(uint32_t self);
+static bool can_steal(uint32_t self);
+static uint32_t queue_length(struct run_queue* queue);
+static void pull_from_busiest(struct cpu* cpu);
+static void kick_idle_cpu();
+static void slice_expired(struct timer* timer, void* data);
+static void balance_tick(struct timer* timer, void* data);
+static void isr_reschedule(uint8_t irq, struct irq_regs* regs);
+
+// -------------------------------------------------------------------------
+// Globals
+// -------------------------------------------------------------------------
+static struct thread g_boot_thread;
+static uint8_t g_boot_fpu_state[FPU_STATE_SIZE] ALIGN(FPU_STATE_ALIGN);
+static struct run_queue* g_run_queues[SMP_MAX_CPUS];
+
+// CPUs halted in their idle loop, the ones worth kicking when work shows up
+static volatile uint32_t g_idle_mask;
+
+static struct timer g_balance_timer;
+static volatile uint32_t g_next_id;
+
+// Saves the callee saved registers on the old stack, swaps stacks and pops
+// them off the new one. The return then lands wherever the new thread left
+// off, or in thread_start for a fresh one.
+__asm(
+    ".global thread_switch_context\n"
+    "thread_switch_context:\n"
+    "    push %ebp\n"
+    "    push %ebx\n"
+    "    push %esi\n"
+    "    push %edi\n"
+    "    mov 20(%esp), %eax\n"
+    "    mov %esp, (%eax)\n"
+    "    mov 24(%esp), %esp\n"
+    "    pop %edi\n"
+    "    pop %esi\n"
+    "    pop %ebx\n"
+    "    pop %ebp\n"
+    "    ret\n"
+);
+
+// -------------------------------------------------------------------------
+// Public Contract
+// -------------------------------------------------------------------------
+void thread_init()
+{
+    // We're already running on the boot stack, it just needs a name. User
+    // mode entered from here gets a stack as big as any other thread's for
+    // its interrupts and syscalls, the page from the GDT setup is only
+    // enough for what comes in before there are threads.
+    struct cpu* cpu = smp_cpu();
+
+    void* kernel_stack = mem_page_get_many(THREAD_STACK_PAGES, mem_tag_thread);
+    if(kernel_stack == NULL)
+        KPANIC("Failed to allocate the boot thread's kernel stack");
+
+    g_boot_thread.stack_top = (uintptr_t)kernel_stack + THREAD_STACK_PAGES * PAGE_SIZE;
+    mem_mgr_set_kernel_stack(cpu->index, g_boot_thread.stack_top);
+    g_boot_thread.state = thread_state_running;
+    g_boot_thread.priority = thread_priority_normal;
+    g_boot_thread.id = g_next_id++;
+    g_boot_thread.cpu = cpu->index;
+    g_boot_thread.on_cpu = true;
+    g_boot_thread.fpu_state = g_boot_fpu_state;
+    kstrcpy_n(g_boot_thread.name, 5, "boot");
+
+    cpu->current = &g_boot_thread;
+
+    cpu->idle = thread_create_idle(cpu->index);
+    if(cpu->idle == NULL)
+        KPANIC("Failed to create the idle thread");
+
+    interrupt_receive(SMP_RESCHEDULE_VECTOR, isr_reschedule);
+}
+
+// Never queued, each CPU runs its own whenever nothing else can
+struct thread* thread_create_idle(uint32_t cpu)
+{
+    // A CPU that failed to start may be retried, its queue is still there
+    if(g_run_queues[cpu] == NULL) {
+        size_t pages = (sizeof(struct run_queue) + PAGE_SIZE - 1) / PAGE_SIZE;
+        struct run_queue* queue = mem_page_get_many(pages, mem_tag_thread);
+        if(queue == NULL)
+            return NULL;
+
+        uint8_t* bytes = (uint8_t*)queue;
+        for(size_t i = 0; i < sizeof(struct run_queue); i++)
+            bytes[i] = 0;
+
+        queue->random = cpu + 1;
+        g_run_queues[cpu] = queue;
+    }
+
+    struct thread* idle = allocate_thread("idle", idle_main, NULL, THREAD_PRIORITY_LEVELS - 1);
+    if(idle != NULL)
+        idle->cpu = cpu;
+
+    return idle;
+}
+
+void thread_run_idle()
+{
+    struct cpu* cpu = smp_cpu();
+
+    cpu->current = cpu->idle;
+    cpu->idle->state = thread_state_running;
+    cpu->idle->on_cpu = true;
+    mem_mgr_set_kernel_stack(cpu->index, cpu->idle->stack_top);
+
+    idle_main(NULL);
+}
+
+void thread_start_balancing()
+{
+    timer_start_periodic(&g_balance_timer, BALANCE_PERIOD_NS, balance_tick, NULL);
+}
+
+struct thread* thread_create(const char* name, thread_entry entry, void* arg, uint8_t priority)
+{
+    struct thread* thread = allocate_thread(name, entry, arg, priority);
+    if(thread == NULL)
+        return NULL;
+
+    // Starts out on our CPU, an idle one will come and steal it
+    uint32_t flags = cpu_irq_save();
+    thread->cpu = smp_cpu_index();
+    thread_wake(thread);
+    cpu_irq_restore(flags);
+
+    return thread;
+}
+
+struct thread* thread_current()
+{
+    return smp_cpu()->current;
+}
+
+void thread_yield()
+{
+    uint32_t flags = cpu_irq_save();
+    schedule();
+    cpu_irq_restore(flags);
+}
+
+void thread_exit()
+{
+    cpu_irq_save();
+
+    smp_cpu()->current->state = thread_state_dead;
+    schedule();
+
+    KPANIC("Dead thread was scheduled");
+}
+
+void thread_block()
+{
+    smp_cpu()->current->state = thread_state_blocked;
+    schedule();
+}
+
+void thread_wake(struct thread* thread)
+{
+    uint32_t flags = cpu_irq_save();
+
+    struct cpu* cpu = smp_cpu();
+    if(thread->cpu == cpu->index) {
+        wake_local(cpu, thread);
+    }
+    else if(__sync_bool_compare_and_swap(&thread->wake_pending, false, true)) {
+        // Blocking and waking a thread both happen on its own CPU with
+        // interrupts off, so the two can't race. The IPI gets there once
+        // it's done switching away.
+        struct run_queue* queue = g_run_queues[thread->cpu];
+
+        struct thread* head;
+        do {
+            head = queue->inbox;
+            thread->wake_next = head;
+        } while(!__sync_bool_compare_and_swap(&queue->inbox, head, thread));
+
+        smp_send_ipi(thread->cpu, SMP_RESCHEDULE_VECTOR);
+    }
+
+    cpu_irq_restore(flags);
+}
+
+void thread_preempt()
+{
+    struct cpu* cpu = smp_cpu();
+    if(cpu->current == NULL || !cpu->need_resched)
+        return;
+
+    uint32_t flags = cpu_irq_save();
+    schedule();
+    cpu_irq_restore(flags);
+}
+
+// -------------------------------------------------------------------------
+// Static Functions
+// -------------------------------------------------------------------------
+
+// Comes back blocked, it's up to the caller to wake it
+static struct thread* allocate_thread(const char* name, thread_entry entry, void* arg, uint8_t priority)
+{
+    if(priority >= THREAD_PRIORITY_LEVELS) {
+        KWARN("Invalid thread priority");
+        return NULL;
+    }
+
+    void* stack = mem_page_get_many(THREAD_STACK_PAGES, mem_tag_thread);
+    if(stack == NULL)
+        return NULL;
+
+    struct thread* thread = (struct thread*)stack;
+    *thread = (struct thread) {
+        .stack = stack,
+        .stack_top = (uintptr_t)stack + THREAD_STACK_PAGES * PAGE_SIZE,
+        .entry = entry,
+        .arg = arg,
+        .state = thread_state_blocked,
+        .priority = priority,
+        .id = __sync_fetch_and_add(&g_next_id, 1)
+    };
+
+    // Right above the thread, the stack won't grow down that far
+    uintptr_t fpu_state = (uintptr_t)(thread + 1);
+    thread->fpu_state = (void*)((fpu_state + FPU_STATE_ALIGN - 1) & ~(FPU_STATE_ALIGN - 1));
+
+    for(size_t i = 0; i < THREAD_NAME_LENGTH - 1 && name[i] != '\0'; i++)
+        thread->name[i] = name[i];
+
+    // What thread_switch_context expects to pop, the fake return address
+    // is never used since thread_start doesn't return
+    uint32_t* esp = (uint32_t*)thread->stack_top;
+    *--esp = 0;
+    *--esp = (uint32_t)(uintptr_t)thread_start;
+    *--esp = 0; // EBP
+    *--esp = 0; // EBX
+    *--esp = 0; // ESI
+    *--esp = 0; // EDI
+    thread->esp = (uintptr_t)esp;
+
+    return thread;
+}
+
+// Called with interrupts disabled
+static void schedule()
+{
+    struct cpu* cpu = smp_cpu();
+    struct run_queue* queue = g_run_queues[cpu->index];
+
+    cpu->need_resched = false;
+    drain_inbox(cpu);
+
+    struct thread* prev = cpu->current;
+    if(prev == cpu->idle) {
+        prev->state = thread_state_ready;
+    }
+    else if(prev->state == thread_state_running) {
+        prev->state = thread_state_ready;
+        push(queue, prev);
+    }
+
+    struct thread* next = take(queue);
+    if(next == NULL)
+        next = steal(cpu->index);
+    if(next == NULL)
+        next = cpu->idle;
+
+    next->state = thread_state_running;
+
+    // Only worth slicing the time if someone is waiting for it
+    if(queue->ready_mask != 0)
+        timer_start(&queue->slice_timer, THREAD_SLICE_NS, slice_expired, cpu);
+    else
+        timer_cancel(&queue->slice_timer);
+
+    if(next == prev)
+        return;
+
+    // Whoever ran it last may not have gotten off its stack yet
+    while(next->on_cpu) {
+        __asm("pause");
+    }
+
+    next->on_cpu = true;
+    next->cpu = cpu->index;
+
+    fpu_switch_out(prev);
+
+    cpu->current = next;
+    queue->prev = prev;
+    mem_mgr_set_kernel_stack(cpu->index, next->stack_top);
+
+    thread_switch_context(&prev->esp, next->esp);
+    finish_switch();
+}
+
+// Runs on the new thread's stack right after a switch
+static void finish_switch()
+{
+    struct run_queue* queue = g_run_queues[smp_cpu_index()];
+
+    struct thread* prev = queue->prev;
+    queue->prev = NULL;
+
+    // Other CPUs may pick it up from here on
+    __sync_synchronize();
+    prev->on_cpu = false;
+
+    if(prev->state == thread_state_dead)
+        mem_page_free(prev->stack);
+}
+
+static void thread_start()
+{
+    finish_switch();
+    __asm("sti");
+
+    struct thread* thread = smp_cpu()->current;
+    thread->entry(thread->arg);
+    thread_exit();
+}
+
+static void idle_main(void* arg)
+{
+    struct cpu* cpu = smp_cpu();
+    struct run_queue* queue = g_run_queues[cpu->index];
+    uint32_t bit = 1u << cpu->index;
+
+    while(true) {
+        // Leftovers from interrupts that gave up on work that kept coming
+        // back, nobody else is waiting for this CPU
+        softirq_run();
+
+        // Get pages zeroed before anyone needs them, a few at a time so
+        // the queue gets looked at in between
+        bool zeroing = mem_zero_pool_refill();
+
+        __asm("cli");
+        drain_inbox(cpu);
+
+        if(queue->ready_mask != 0 || can_steal(cpu->index)) {
+            schedule();
+            continue;
+        }
+
+        if(zeroing) {
+            __asm("sti");
+            continue;
+        }
+
+        // Look once more after saying we're idle, work pushed before that
+        // didn't know to kick us
+        __sync_fetch_and_or(&g_idle_mask, bit);
+        if(can_steal(cpu->index) || softirq_pending()) {
+            __sync_fetch_and_and(&g_idle_mask, ~bit);
+            continue;
+        }
+
+        // STI only takes effect after the HLT has started
+        __asm("sti; hlt");
+        __sync_fetch_and_and(&g_idle_mask, ~bit);
+    }
+}
+
+// Interrupts disabled, on the thread's own CPU
+static void wake_local(struct cpu* cpu, struct thread* thread)
+{
+    if(thread->state != thread_state_blocked)
+        return;
+
+    thread->state = thread_state_ready;
+    push(g_run_queues[cpu->index], thread);
+
+    // Run it right away if it's more important, otherwise make sure
+    // whoever is running now gives it a turn eventually
+    struct run_queue* queue = g_run_queues[cpu->index];
+    if(thread->priority < cpu->current->priority || cpu->current == cpu->idle)
+        cpu->need_resched = true;
+    else if(!timer_is_pending(&queue->slice_timer))
+        timer_start(&queue->slice_timer, THREAD_SLICE_NS, slice_expired, cpu);
+}
+
+static void drain_inbox(struct cpu* cpu)
+{
+    struct run_queue* queue = g_run_queues[cpu->index];
+    if(queue->inbox == NULL)
+        return;
+
+    struct thread* thread = __sync_lock_test_and_set(&queue->inbox, NULL);
+    while(thread != NULL) {
+        struct thread* next = thread->wake_next;
+        thread->wake_pending = false;
+
+        wake_local(cpu, thread);
+        thread = next;
+    }
+}
+
+// Only ever called by the queue's own CPU, with interrupts disabled
+static void push(struct run_queue* queue, struct thread* thread)
+{
+    struct run_deque* deque = &queue->deques[thread->priority];
+
+    uint32_t bottom = deque->bottom;
+    if(bottom - deque->top >= RUN_QUEUE_SLOTS)
+        KPANIC("Run queue overflow");
+
+    deque->slots[bottom & RUN_QUEUE_MASK] = thread;
+
+    // The slot has to be visible before anyone can see it counted
+    __sync_synchronize();
+    deque->bottom = bottom + 1;
+    __sync_fetch_and_or(&queue->ready_mask, 1u << thread->priority);
+
+    kick_idle_cpu();
+}
+
+// Most important and longest waiting thread first
+static struct thread* take(struct run_queue* queue)
+{
+    uint32_t mask = queue->ready_mask;
+
+    while(mask != 0) {
+        uint32_t priority = __builtin_ctz(mask);
+        struct run_deque* deque = &queue->deques[priority];
+
+        uint32_t top = deque->top;
+        __sync_synchronize();
+        uint32_t bottom = deque->bottom;
+
+        if(top != bottom) {
+            // The slot can't be reused before top moves past it, so if
+            // the swap works the thread we read is ours
+            struct thread* thread = deque->slots[top & RUN_QUEUE_MASK];
+            if(__sync_bool_compare_and_swap(&deque->top, top, top + 1))
+                return thread;
+
+            continue;
+        }
+
+        // Empty, drop the hint. The owner sets it after pushing, so a push
+        // that raced with us shows up when we look again.
+        uint32_t bit = 1u << priority;
+        __sync_fetch_and_and(&queue->ready_mask, ~bit);
+        if(deque->bottom != deque->top)
+            __sync_fetch_and_or(&queue->ready_mask, bit);
+        else
+            mask &= ~bit;
+    }
+
+    return NULL;
+}
+
+// Starts at a random CPU so thieves don't all pile onto the same one
+static struct thread* steal(uint32_t self)
+{
+    uint32_t count = smp_cpu_count();
+    if(count == 1)
+        return NULL;
+
+    struct run_queue* own = g_run_queues[self];
+    own->random ^= own->random << 13;
+    own->random ^= own->random >> 17;
+    own->random ^= own->random << 5;
+
+    uint32_t start = own->random % count;
+    for(uint32_t i = 0; i < count; i++) {
+        uint32_t victim = (start + i) % count;
+        if(victim == self || g_run_queues[victim] == NULL)
+            continue;
+
+        struct thread* thread = take(g_run_queues[victim]);
+        if(thread != NULL)
+            return thread;
+    }
+
+    return NULL;
+}
+
+static bool can_steal(uint32_t self)
+{
+    for(uint32_t i = 0; i < smp_cpu_count(); i++) {
+        if(i != self && g_run_queues[i] != NULL && g_run_queues[i]->ready_mask != 0)
+            return true;
+    }
+
+    return false;
+}
+
+// Only a guess while others push and take
+static uint32_t queue_length(struct run_queue* queue)
+{
+    uint32_t length = 0;
+
+    for(uint32_t mask = queue->ready_mask; mask != 0; mask &= mask - 1) {
+        struct run_deque* deque = &queue->deques[__builtin_ctz(mask)];
+        length += deque->bottom - deque->top;
+    }
+
+    return length;
+}
+
+// Stealing only happens once a CPU runs dry, this evens out CPUs that are
+// busy but have very different amounts of work waiting
+static void pull_from_busiest(struct cpu* cpu)
+{
+    struct run_queue* queue = g_run_queues[cpu->index];
+    uint32_t own = queue_length(queue);
+
+    struct run_queue* busiest = NULL;
+    uint32_t busiest_length = own + 1;
+
+    for(uint32_t i = 0; i < smp_cpu_count(); i++) {
+        if(i == cpu->index || g_run_queues[i] == NULL)
+            continue;
+
+        uint32_t length = queue_length(g_run_queues[i]);
+        if(length > busiest_length) {
+            busiest = g_run_queues[i];
+            busiest_length = length;
+        }
+    }
+
+    if(busiest == NULL)
+        return;
+
+    struct thread* thread = take(busiest);
+    if(thread == NULL)
+        return;
+
+    push(queue, thread);
+    if(thread->priority < cpu->current->priority || cpu->current == cpu->idle)
+        cpu->need_resched = true;
+}
+
+static void kick_idle_cpu()
+{
+    uint32_t idle = g_idle_mask & ~(1u << smp_cpu_index());
+    if(idle == 0)
+        return;
+
+    // Claim it, so everyone pushing at once doesn't kick the same CPU
+    uint32_t index = __builtin_ctz(idle);
+    if(__sync_fetch_and_and(&g_idle_mask, ~(1u << index)) & (1u << index))
+        smp_send_ipi(index, SMP_RESCHEDULE_VECTOR);
+}
+
+static void slice_expired(struct timer* timer, void* data)
+{
+    struct cpu* cpu = data;
+    cpu->need_resched = true;
+
+    // The timer interrupt may well have gone to another CPU
+    if(cpu->index != smp_cpu_index())
+        smp_send_ipi(cpu->index, SMP_RESCHEDULE_VECTOR);
+}
+
+static void balance_tick(struct timer* timer, void* data)
+{
+    uint32_t self = smp_cpu_index();
+
+    for(uint32_t i = 0; i < smp_cpu_count(); i++) {
+        if(g_run_queues[i] == NULL)
+            continue;
+
+        g_run_queues[i]->balance = true;
+        if(i != self)
+            smp_send_ipi(i, SMP_RESCHEDULE_VECTOR);
+    }
+
+    pull_from_busiest(smp_cpu());
+    g_run_queues[self]->balance = false;
+}
+
+static void isr_reschedule(uint8_t irq, struct irq_regs* regs)
+{
+    apic_send_eoi();
+
+    struct cpu* cpu = smp_cpu();
+    struct run_queue* queue = g_run_queues[cpu->index];
+
+    drain_inbox(cpu);
+
+    if(queue->balance) {
+        queue->balance = false;
+        pull_from_busiest(cpu);
+    }
+
+    // Idle CPUs get kicked to go and steal
+    if(cpu->current == cpu->idle)
+        cpu->need_resched = true;
+}
@@ -0,0 +1,381 @@
+#include <types.h>
+#include <kernel.h>
+#include <terminal.h>
+#include <pic.h>
+#include <irq.h>
+#include <pit.h>
+#include <apic.h>
+#include <clock.h>
+#include <timer.h>
+#include <wait_queue.h>
+#include <lock.h>
+#include <softirq.h>
+#include <arch/x86/cpu.h>
+
+// -------------------------------------------------------------------------
+// Static Defines
+// -------------------------------------------------------------------------
+
+// A wheel tick is 2^17ns (~131us). Each level has 64 slots, a slot on
+// level n covers 64^n ticks, so five levels reach out ~39 hours. Later
+// timers wait on the last level and get put back there until they fit.
+#define TIMER_TICK_SHIFT   17
+#define TIMER_WHEEL_BITS   6
+#define TIMER_WHEEL_SLOTS  (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK   (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS 5
+#define TIMER_WHEEL_RANGE  (1ull << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+#define TIMER_NO_EVENT     0xFFFFFFFFFFFFFFFFull
+
+// -------------------------------------------------------------------------
+// Forward Declarations
+// -------------------------------------------------------------------------
+static void timer_interrupt();
+static void run_timers();
+static void start_locked(struct timer* timer, uint64_t delay_ns, uint64_t period_ns, timer_callback callback, void* data);
+static void program_next();
+static bool next_event(uint64_t* tick);
+static void enqueue(struct timer* timer);
+static void dequeue(struct timer* timer);
+static void cascade();
+static void detach_slot(uint32_t level, uint32_t index, struct timer** list);
+static uint64_t ns_to_tick(uint64_t ns);
+static void wake_sleeper(struct timer* timer, void* data);
+
+// -------------------------------------------------------------------------
+// Globals
+// -------------------------------------------------------------------------
+static struct timer* g_wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+static uint64_t g_occupied[TIMER_WHEEL_LEVELS]; // Bit per non-empty slot
+
+// The next tick to run, everything before it has fired
+static uint64_t g_current;
+
+// The tick the APIC is armed for
+static uint64_t g_armed = TIMER_NO_EVENT;
+static bool g_tickless;
+
+// Covers the wheel and every pending timer on it. Callbacks run without it.
+static struct spinlock g_lock = SPINLOCK_INIT("timers");
+
+// -------------------------------------------------------------------------
+// Public Contract
+// -------------------------------------------------------------------------
+void timer_init()
+{
+    g_current = clock_now_ns() >> TIMER_TICK_SHIFT;
+    softirq_register(softirq_timer, run_timers);
+
+    // Without the TSC there is no clock to program deadlines against
+    if(clock_tsc_khz() != 0 && apic_init() && apic_timer_init(timer_interrupt)) {
+        g_tickless = true;
+
+        // Nobody needs the periodic tick anymore
+        irq_disable(pic_irq_timer);
+        KINFO("Timers are tickless");
+        return;
+    }
+
+    pit_set_tick_handler(timer_interrupt);
+}
+
+bool timer_is_tickless()
+{
+    return g_tickless;
+}
+
+void timer_start(struct timer* timer, uint64_t delay_ns, timer_callback callback, void* data)
+{
+    uint32_t flags = spinlock_lock_irqsave(&g_lock);
+    start_locked(timer, delay_ns, 0, callback, data);
+    spinlock_unlock_irqrestore(&g_lock, flags);
+}
+
+void timer_start_periodic(struct timer* timer, uint64_t period_ns, timer_callback callback, void* data)
+{
+    // A zero period would fire forever without the clock moving
+    if(period_ns == 0)
+        period_ns = 1;
+
+    uint32_t flags = spinlock_lock_irqsave(&g_lock);
+    start_locked(timer, period_ns, period_ns, callback, data);
+    spinlock_unlock_irqrestore(&g_lock, flags);
+}
+
+bool timer_cancel(struct timer* timer)
+{
+    uint32_t flags = spinlock_lock_irqsave(&g_lock);
+
+    // The APIC may still go off for it, which is harmless
+    bool pending = timer->pprev != NULL;
+    if(pending)
+        dequeue(timer);
+
+    timer->period_ns = 0;
+
+    spinlock_unlock_irqrestore(&g_lock, flags);
+    return pending;
+}
+
+bool timer_is_pending(struct timer* timer)
+{
+    return timer->pprev != NULL;
+}
+
+void sleep_ns(uint64_t ns)
+{
+    struct wait_queue queue;
+    wait_queue_init(&queue);
+
+    // The queue stays locked until we're on it, so the timer can't fire
+    // before there's anyone to wake
+    uint32_t flags = spinlock_lock_irqsave(&queue.lock);
+
+    struct timer timer = {};
+    timer_start(&timer, ns, wake_sleeper, &queue);
+    wait_queue_wait(&queue);
+
+    spinlock_unlock_irqrestore(&queue.lock, flags);
+}
+
+void sleep_ms(uint32_t ms)
+{
+    sleep_ns((uint64_t)ms * 1000000);
+}
+
+// -------------------------------------------------------------------------
+// Static Functions
+// -------------------------------------------------------------------------
+
+// The interrupt only gets the wheel going, callbacks can take their time
+// without holding up the next one
+static void timer_interrupt()
+{
+    softirq_raise(softirq_timer);
+}
+
+// Runs as a softirq, catches the wheel up with the clock
+static void run_timers()
+{
+    uint64_t now = clock_now_ns();
+    uint64_t now_tick = now >> TIMER_TICK_SHIFT;
+
+    uint32_t flags = spinlock_lock_irqsave(&g_lock);
+
+    while(g_current <= now_tick) {
+        uint32_t index = g_current & TIMER_WHEEL_MASK;
+        if(index == 0)
+            cascade();
+
+        // Moving on before the callbacks run means anything they start
+        // for this tick lands in the next slot instead of this one
+        struct timer* expired;
+        detach_slot(0, index, &expired);
+        g_current++;
+
+        while(expired != NULL) {
+            struct timer* timer = expired;
+            dequeue(timer);
+
+            // Re-armed first, so the callback is free to cancel or
+            // restart it. Missed periods are dropped, not caught up on.
+            if(timer->period_ns != 0) {
+                timer->expires += timer->period_ns;
+                if(timer->expires <= now)
+                    timer->expires = now + timer->period_ns;
+                enqueue(timer);
+            }
+
+            // The callback may well start or cancel timers itself
+            timer_callback callback = timer->callback;
+            void* data = timer->data;
+
+            spinlock_unlock_irqrestore(&g_lock, flags);
+            callback(timer, data);
+            flags = spinlock_lock_irqsave(&g_lock);
+        }
+
+        // Skip over empty slots, stopping at the next cascade. Never past
+        // now though, new timers are placed relative to g_current.
+        index = g_current & TIMER_WHEEL_MASK;
+        if(index != 0) {
+            uint64_t ahead = g_occupied[0] >> index;
+            uint64_t next = ahead != 0
+                ? g_current + (uint32_t)__builtin_ctzll(ahead)
+                : g_current + (TIMER_WHEEL_SLOTS - index);
+
+            if(next > now_tick + 1)
+                next = now_tick + 1;
+            if(next > g_current)
+                g_current = next;
+        }
+    }
+
+    program_next();
+    spinlock_unlock_irqrestore(&g_lock, flags);
+}
+
+// Called with the lock held
+static void start_locked(struct timer* timer, uint64_t delay_ns, uint64_t period_ns, timer_callback callback, void* data)
+{
+    if(timer->pprev != NULL)
+        dequeue(timer);
+
+    timer->expires = clock_now_ns() + delay_ns;
+    timer->period_ns = period_ns;
+    timer->callback = callback;
+    timer->data = data;
+    enqueue(timer);
+
+    // Only an earlier deadline changes when we need to wake up
+    if(g_tickless && ns_to_tick(timer->expires) < g_armed)
+        program_next();
+}
+
+static void program_next()
+{
+    if(!g_tickless)
+        return;
+
+    uint64_t tick;
+    if(!next_event(&tick)) {
+        g_armed = TIMER_NO_EVENT;
+        apic_timer_stop();
+        return;
+    }
+
+    g_armed = tick;
+
+    uint64_t at = tick << TIMER_TICK_SHIFT;
+    uint64_t now = clock_now_ns();
+    apic_timer_oneshot_ns(at > now ? at - now : 0);
+}
+
+// The first tick something happens on, either a level 0 slot firing or a
+// higher slot being cascaded down. Each level is one bitmap scan.
+static bool next_event(uint64_t* tick)
+{
+    uint64_t best = TIMER_NO_EVENT;
+
+    for(uint32_t level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        uint64_t occupied = g_occupied[level];
+        if(occupied == 0)
+            continue;
+
+        uint32_t shift = TIMER_WHEEL_BITS * level;
+        uint64_t base = g_current >> shift;
+        uint32_t index = base & TIMER_WHEEL_MASK;
+
+        // Rotate so the current slot is bit 0
+        if(index != 0)
+            occupied = (occupied >> index) | (occupied << (TIMER_WHEEL_SLOTS - index));
+
+        uint64_t at = (base + (uint32_t)__builtin_ctzll(occupied)) << shift;
+
+        // A higher level's current slot was already cascaded this lap,
+        // anything in it now belongs to the next one
+        if(at < g_current)
+            at += (uint64_t)TIMER_WHEEL_SLOTS << shift;
+
+        if(at < best)
+            best = at;
+    }
+
+    *tick = best;
+    return best != TIMER_NO_EVENT;
+}
+
+// Files the timer on the lowest level whose range covers it
+static void enqueue(struct timer* timer)
+{
+    uint64_t tick = ns_to_tick(timer->expires);
+    if(tick < g_current)
+        tick = g_current;
+
+    uint64_t delta = tick - g_current;
+    if(delta >= TIMER_WHEEL_RANGE) {
+        delta = TIMER_WHEEL_RANGE - 1;
+        tick = g_current + delta;
+    }
+
+    uint32_t level = 0;
+    while(delta >= (1ull << (TIMER_WHEEL_BITS * (level + 1))))
+        level++;
+
+    uint32_t index = (tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    struct timer** head = &g_wheel[level][index];
+
+    timer->next = *head;
+    if(timer->next != NULL)
+        timer->next->pprev = &timer->next;
+
+    timer->pprev = head;
+    *head = timer;
+
+    g_occupied[level] |= 1ull << index;
+}
+
+static void dequeue(struct timer* timer)
+{
+    struct timer** pprev = timer->pprev;
+
+    *pprev = timer->next;
+    if(timer->next != NULL)
+        timer->next->pprev = pprev;
+
+    timer->next = NULL;
+    timer->pprev = NULL;
+
+    // Only the first timer of a slot points back into the wheel
+    struct timer** first = &g_wheel[0][0];
+    if(pprev >= first && pprev < first + TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS && *pprev == NULL) {
+        uint32_t slot = pprev - first;
+        g_occupied[slot / TIMER_WHEEL_SLOTS] &= ~(1ull << (slot % TIMER_WHEEL_SLOTS));
+    }
+}
+
+// Called when level 0 wraps. Moves the next slot of level 1 down, and if
+// that wrapped too the next slot of level 2, and so on.
+static void cascade()
+{
+    for(uint32_t level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+        uint32_t index = (g_current >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+
+        struct timer* list;
+        detach_slot(level, index, &list);
+
+        while(list != NULL) {
+            struct timer* timer = list;
+            dequeue(timer);
+            enqueue(timer);
+        }
+
+        if(index != 0)
+            break;
+    }
+}
+
+// Moves a whole slot onto a local list. It stays a proper list, so
+// callbacks can still cancel any timer on it.
+static void detach_slot(uint32_t level, uint32_t index, struct timer** list)
+{
+    *list = g_wheel[level][index];
+    g_wheel[level][index] = NULL;
+
+    g_occupied[level] &= ~(1ull << index);
+
+    if(*list != NULL)
+        (*list)->pprev = list;
+}
+
+// Rounded up, so nothing ever fires early
+static uint64_t ns_to_tick(uint64_t ns)
+{
+    return (ns + (1ull << TIMER_TICK_SHIFT) - 1) >> TIMER_TICK_SHIFT;
+}
+
+static void wake_sleeper(struct timer* timer, void* data)
+{
+    wait_queue_wake_all((struct wait_queue*)data);
+}
@@ -7,7 +7,7 @@
 #include <pci.h>
 #include <kernel.h>
 #include <interrupt.h>
-#include <pit.h>
+#include <timer.h>
 #include <mem_mgr.h>
 
 //#define USB_DEBUG
@@ -223,7 +223,7 @@ static int32_t detect_root(uint16_t base_addr, bool memory_mapped)
     for(int i = 0; i < 5; i++)
     {
         OUTW(base_addr + UHCI_CMD_OFFSET, uhci_cmd_global_reset);
-        pit_wait(25);
+        sleep_ms(25);
         OUTW(base_addr + UHCI_CMD_OFFSET, 0x0);
     }
 
@@ -249,7 +249,7 @@ static int32_t detect_root(uint16_t base_addr, bool memory_mapped)
     OUTW(base_addr + UHCI_CMD_OFFSET, uhci_cmd_host_reset);
 
     // Supposedly, we have to give the HC at least 42ms to reset
-    pit_wait(42);
+    sleep_ms(42);
 
     if((INW(base_addr + UHCI_CMD_OFFSET) & uhci_cmd_host_reset) == uhci_cmd_host_reset) {
         KERROR("Controller did not reset bit :(");
@@ -279,7 +279,7 @@ static void setup(uint32_t base_addr, uint8_t irq, bool memory_mapped)
     OUTW(base_addr + UHCI_FRAME_NUM_OFFSET, 0x0000);
 
     // Allocate a stack for use by the driver
-    uint32_t stack_frame = (uint32_t)(uintptr_t)mem_page_get();
+    uint32_t stack_frame = (uint32_t)(uintptr_t)mem_page_get(mem_tag_usb);
     OUTD(base_addr + UHCI_FRAME_BASEADDR_OFFSET, stack_frame);
 
     // The sofmod regisster *should* already be set to 0x40
@@ -386,7 +386,7 @@ static bool enable_hc_port(uint32_t base_addr, uint8_t port)
 
         OUTW(base_addr + offset, portsc);
 
-        pit_wait(10);
+        sleep_ms(10);
 
         portsc = INW(base_addr + offset);
         attempts++;
@@ -411,7 +411,7 @@ static bool reset_hc_port(uint32_t base_addr, uint8_t port)
     OUTW(base_addr + offset, portsc);
 
     // USB specification says to give the HC 50ms to reset
-    pit_wait(50);
+    sleep_ms(50);
 
     // Clear the bit, the port should be reset now
     portsc = INW(base_addr + offset);
@@ -420,7 +420,7 @@ static bool reset_hc_port(uint32_t base_addr, uint8_t port)
     OUTW(base_addr + offset, portsc);
 
     // Wait 10ms for the recovery time
-    pit_wait(10);
+    sleep_ms(10);
 
     return true;
 }
@@ -0,0 +1,406 @@
+#include <types.h>
+#include <kernel.h>
+#include <terminal.h>
+#include <string.h>
+#include <mem_mgr.h>
+#include <vfs.h>
+#include <lock.h>
+#include <page_cache.h>
+
+// -------------------------------------------------------------------------
+// Static Types
+// -------------------------------------------------------------------------
+
+// Sequential access detection for one open file
+struct vfs_readahead {
+    uint32_t        last_index;     // Page the previous read ended in
+    uint32_t        window;         // Pages to read ahead next time, 0 when off
+    uint32_t        next_index;     // First page not read ahead yet
+    uint32_t        trigger_index;  // Reaching this page starts the next window
+};
+
+// One per open(), so that every opener has its own read cursor
+struct vfs_file {
+    struct vnode*           node;
+    uint32_t                offset;
+    struct vfs_readahead    readahead;
+};
+
+// -------------------------------------------------------------------------
+// Forward Declarations
+// -------------------------------------------------------------------------
+static struct vnode* vnode_find(const char* name);
+static bool vnode_load(const char* name, struct vnode* result);
+static struct vnode* vnode_install(struct vnode* loaded);
+static void vnode_put(struct vnode* node);
+static struct vfs_file* file_get(int32_t fd);
+static void vnode_evict(struct vnode* node);
+static void readahead_update(struct vfs_file* file, uint32_t index);
+
+// -------------------------------------------------------------------------
+// Globals
+// -------------------------------------------------------------------------
+static struct vfs_fs_ops* g_root_ops;
+static void* g_root_fs;
+
+static struct vnode g_vnodes[VFS_MAX_VNODES];
+static struct vfs_file g_files[VFS_MAX_OPEN_FILES];
+static uint32_t g_vnode_clock;
+
+// Bumped by every vfs_forget, a lookup that raced one may have read the
+// file as it was before and has to be done again
+static uint32_t g_forget_count;
+
+// Guards the two tables and the reference counts. Looking a file up reads
+// the disk, so that's done with it dropped and it's only ever held briefly,
+// with interrupts off. Once open, a descriptor's cursor belongs to whoever
+// opened it.
+static struct spinlock g_lock = SPINLOCK_INIT("vfs");
+
+// -------------------------------------------------------------------------
+// Public Contract
+// -------------------------------------------------------------------------
+void vfs_mount(struct vfs_fs_ops* ops, void* fs)
+{
+    g_root_ops = ops;
+    g_root_fs = fs;
+}
+
+int32_t vfs_open(const char* name)
+{
+    uint32_t flags = spinlock_lock_irqsave(&g_lock);
+
+    struct vnode* node;
+    while((node = vnode_find(name)) == NULL) {
+        uint32_t forget_count = g_forget_count;
+        spinlock_unlock_irqrestore(&g_lock, flags);
+
+        struct vnode loaded;
+        if(!vnode_load(name, &loaded))
+            return -1;
+
+        flags = spinlock_lock_irqsave(&g_lock);
+        if(forget_count != g_forget_count) {
+            if(loaded.ops->release != NULL)
+                loaded.ops->release(&loaded);
+            continue;
+        }
+
+        node = vnode_install(&loaded);
+        if(node == NULL) {
+            spinlock_unlock_irqrestore(&g_lock, flags);
+            return -1;
+        }
+        break;
+    }
+
+    for(int32_t fd = 0; fd < VFS_MAX_OPEN_FILES; fd++) {
+        struct vfs_file* file = &g_files[fd];
+        if(file->node != NULL)
+            continue;
+
+        file->node = node;
+        file->offset = 0;
+        file->readahead.last_index = UINT32_MAX;
+        file->readahead.window = VFS_READAHEAD_MIN;
+        file->readahead.next_index = 0;
+        file->readahead.trigger_index = 0;
+
+        spinlock_unlock_irqrestore(&g_lock, flags);
+        return fd;
+    }
+
+    vnode_put(node);
+    spinlock_unlock_irqrestore(&g_lock, flags);
+    KWARN("VFS: Too many open files");
+    return -1;
+}
+
+int32_t vfs_read(int32_t fd, intptr_t buffer, size_t length)
+{
+    struct vfs_file* file = file_get(fd);
+    if(file == NULL)
+        return -1;
+
+    struct vnode* node = file->node;
+    if(file->offset >= node->size)
+        return 0;
+
+    if(length > node->size - file->offset)
+        length = node->size - file->offset;
+
+    // All file data is served from the page cache
+    size_t total = 0;
+    while(total < length) {
+        uint32_t page_offset = file->offset % PAGE_SIZE;
+        size_t chunk = PAGE_SIZE - page_offset;
+        if(chunk > length - total)
+            chunk = length - total;
+
+        uint32_t index = file->offset / PAGE_SIZE;
+        struct page_cache_entry* entry = page_cache_get(node, index);
+        if(entry == NULL)
+            return total > 0 ? (int32_t)total : -1;
+
+        // Get the drive going on what comes next before copying this page
+        readahead_update(file, index);
+
+        memcpy((uint8_t*)buffer + total, (uint8_t*)entry->page + page_offset, chunk);
+        page_cache_put(entry);
+
+        total += chunk;
+        file->offset += chunk;
+
+        page_cache_poll();
+    }
+
+    return (int32_t)total;
+}
+
+int32_t vfs_seek(int32_t fd, int32_t offset, enum vfs_seek whence)
+{
+    struct vfs_file* file = file_get(fd);
+    if(file == NULL)
+        return -1;
+
+    int32_t base;
+    switch(whence) {
+        case vfs_seek_set: base = 0; break;
+        case vfs_seek_cur: base = (int32_t)file->offset; break;
+        case vfs_seek_end: base = (int32_t)file->node->size; break;
+        default: return -1;
+    }
+
+    if(base + offset < 0)
+        return -1;
+
+    file->offset = (uint32_t)(base + offset);
+    return (int32_t)file->offset;
+}
+
+int32_t vfs_size(int32_t fd)
+{
+    struct vfs_file* file = file_get(fd);
+    if(file == NULL)
+        return -1;
+
+    return (int32_t)file->node->size;
+}
+
+bool vfs_close(int32_t fd)
+{
+    uint32_t flags = spinlock_lock_irqsave(&g_lock);
+
+    struct vfs_file* file = file_get(fd);
+    if(file != NULL) {
+        vnode_put(file->node);
+        file->node = NULL;
+        file->offset = 0;
+    }
+
+    spinlock_unlock_irqrestore(&g_lock, flags);
+    return file != NULL;
+}
+
+struct vnode* vfs_get_vnode(int32_t fd)
+{
+    uint32_t flags = spinlock_lock_irqsave(&g_lock);
+
+    struct vfs_file* file = file_get(fd);
+    struct vnode* node = file != NULL ? file->node : NULL;
+    if(node != NULL)
+        node->ref_count++;
+
+    spinlock_unlock_irqrestore(&g_lock, flags);
+    return node;
+}
+
+void vfs_put_vnode(struct vnode* node)
+{
+    uint32_t flags = spinlock_lock_irqsave(&g_lock);
+    vnode_put(node);
+    spinlock_unlock_irqrestore(&g_lock, flags);
+}
+
+void vfs_forget(const char* name)
+{
+    uint32_t flags = spinlock_lock_irqsave(&g_lock);
+
+    g_forget_count++;
+
+    // Still open, the next open gets a vnode of its own and this one goes
+    // when it's closed. Its pages still hold what was read, and the file
+    // system finds its clusters from what it looked up back then.
+    for(size_t i = 0; i < VFS_MAX_VNODES; i++) {
+        struct vnode* node = &g_vnodes[i];
+        if(node->ops == NULL || node->stale || !kstrcmp_n(node->name, name, VFS_NAME_LENGTH))
+            continue;
+
+        if(node->ref_count > 0)
+            node->stale = true;
+        else
+            vnode_evict(node);
+        break;
+    }
+
+    spinlock_unlock_irqrestore(&g_lock, flags);
+}
+
+// -------------------------------------------------------------------------
+// Static Functions
+// -------------------------------------------------------------------------
+static struct vfs_file* file_get(int32_t fd)
+{
+    if(fd < 0 || fd >= VFS_MAX_OPEN_FILES || g_files[fd].node == NULL)
+        return NULL;
+
+    return &g_files[fd];
+}
+
+// With the lock held, as is everything else touching the tables. Everyone
+// opening the same file shares the vnode, and so its pages.
+static struct vnode* vnode_find(const char* name)
+{
+    for(size_t i = 0; i < VFS_MAX_VNODES; i++) {
+        struct vnode* node = &g_vnodes[i];
+
+        if(node->ops != NULL && !node->stale && kstrcmp_n(node->name, name, VFS_NAME_LENGTH)) {
+            node->ref_count++;
+            node->last_used = ++g_vnode_clock;
+            return node;
+        }
+    }
+
+    return NULL;
+}
+
+// Without the lock, the file system reads the disk to find the file
+static bool vnode_load(const char* name, struct vnode* result)
+{
+    if(g_root_ops == NULL) {
+        KWARN("VFS: Nothing mounted");
+        return false;
+    }
+
+    kstrcpy_n(result->name, VFS_NAME_LENGTH, (char*)name);
+    result->fs = g_root_fs;
+    result->fs_data = NULL;
+    result->size = 0;
+    result->stale = false;
+
+    if(!g_root_ops->lookup(g_root_fs, name, result))
+        return false;
+
+    result->ops = g_root_ops;
+    return true;
+}
+
+// Back with the lock held. Someone may have opened the same file while we
+// were looking it up, then theirs wins and ours is let go.
+static struct vnode* vnode_install(struct vnode* loaded)
+{
+    struct vnode* node = vnode_find(loaded->name);
+    if(node != NULL) {
+        if(loaded->ops->release != NULL)
+            loaded->ops->release(loaded);
+        return node;
+    }
+
+    struct vnode* empty_node = NULL;
+    struct vnode* unused_node = NULL;
+    for(size_t i = 0; i < VFS_MAX_VNODES; i++) {
+        node = &g_vnodes[i];
+
+        if(node->ops == NULL) {
+            empty_node = node;
+            break;
+        }
+
+        if(node->ref_count == 0 && (unused_node == NULL || node->last_used < unused_node->last_used))
+            unused_node = node;
+    }
+
+    node = empty_node;
+    if(node == NULL && unused_node != NULL) {
+        vnode_evict(unused_node);
+        node = unused_node;
+    }
+
+    if(node == NULL) {
+        if(loaded->ops->release != NULL)
+            loaded->ops->release(loaded);
+        KWARN("VFS: Out of vnodes");
+        return NULL;
+    }
+
+    *node = *loaded;
+    node->ref_count = 1;
+    node->last_used = ++g_vnode_clock;
+    return node;
+}
+
+static void vnode_put(struct vnode* node)
+{
+    // The vnode stays cached until its slot is needed for another file,
+    // unless what it has cached is out of date
+    node->ref_count--;
+    if(node->ref_count == 0 && node->stale)
+        vnode_evict(node);
+}
+
+// The window grows while the file is read sequentially and shrinks on
+// every jump. The next window is issued as soon as the reader enters the
+// previous one, so the drive stays a window ahead of the reader.
+static void readahead_update(struct vfs_file* file, uint32_t index)
+{
+    struct vfs_readahead* ra = &file->readahead;
+
+    if(index == ra->last_index)
+        return;
+
+    bool sequential = index == ra->last_index + 1;
+    ra->last_index = index;
+
+    if(!sequential) {
+        ra->window /= 2;
+        if(ra->window < VFS_READAHEAD_MIN)
+            ra->window = 0;
+
+        ra->next_index = index + 1;
+        ra->trigger_index = index + 1;
+        return;
+    }
+
+    if(ra->window == 0)
+        ra->window = VFS_READAHEAD_MIN;
+
+    if(index < ra->trigger_index)
+        return;
+
+    if(ra->next_index <= index)
+        ra->next_index = index + 1;
+
+    // The drive may still be busy, or the file may not be laid out
+    // contiguously, then we try again on the next page
+    uint32_t issued = page_cache_readahead(file->node, ra->next_index, ra->window);
+    if(issued == 0)
+        return;
+
+    ra->trigger_index = ra->next_index;
+    ra->next_index += issued;
+
+    ra->window *= 2;
+    if(ra->window > VFS_READAHEAD_MAX)
+        ra->window = VFS_READAHEAD_MAX;
+}
+
+static void vnode_evict(struct vnode* node)
+{
+    page_cache_invalidate(node);
+
+    if(node->ops->release != NULL)
+        node->ops->release(node);
+
+    node->ops = NULL;
+    node->fs_data = NULL;
+}
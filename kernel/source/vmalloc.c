@@ -0,0 +1,204 @@
+#include <types.h>
+#include <kernel.h>
+#include <terminal.h>
+#include <mem_mgr.h>
+#include <paging.h>
+#include <lock.h>
+#include <vmalloc.h>
+
+// -------------------------------------------------------------------------
+// Static Defines
+// -------------------------------------------------------------------------
+#define WINDOW_PAGES ((PAGING_WINDOW_END - PAGING_WINDOW_START) / PAGE_SIZE)
+#define WINDOW_MAP_PAGES (WINDOW_PAGES / 8 / PAGE_SIZE)
+
+// -------------------------------------------------------------------------
+// Forward Declarations
+// -------------------------------------------------------------------------
+static bool window_map_create();
+static uintptr_t window_alloc(uint32_t page_count);
+static void unmap_pages(uintptr_t address);
+
+// -------------------------------------------------------------------------
+// Globals
+// -------------------------------------------------------------------------
+
+// One bit per page of the kernel window, set when in use. Allocated on
+// first use so it doesn't bloat the boot loader, which shares this file.
+static uint32_t* g_window_map;
+
+// Where the last search ended, the next one starts there
+static uint32_t g_window_hint;
+
+static struct spinlock g_window_lock = SPINLOCK_INIT("vmalloc");
+
+// -------------------------------------------------------------------------
+// Public Contract
+// -------------------------------------------------------------------------
+void* vmalloc(size_t size, enum mem_tag tag)
+{
+    uint32_t page_count = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    if(page_count == 0)
+        return NULL;
+
+    // Without paging there's no window, it has to be in one piece
+    if(!paging_enabled())
+        return mem_page_get_many(page_count, tag);
+
+    uintptr_t address = vmalloc_reserve(page_count + 1);
+    if(address == 0)
+        return NULL;
+
+    for(uint32_t i = 0; i < page_count; i++) {
+        void* page = mem_page_get(tag);
+        if(page == NULL) {
+            KWARN("vmalloc: Out of memory");
+            unmap_pages(address);
+            vmalloc_release(address, page_count + 1);
+            return NULL;
+        }
+
+        if(!paging_map(address + i * PAGE_SIZE, (uintptr_t)page, paging_flag_present | paging_flag_write)) {
+            mem_page_free(page);
+            unmap_pages(address);
+            vmalloc_release(address, page_count + 1);
+            return NULL;
+        }
+    }
+
+    return (void*)address;
+}
+
+void vmalloc_free(void* address)
+{
+    uintptr_t start = (uintptr_t)address;
+    if(start < PAGING_WINDOW_START && !paging_enabled()) {
+        mem_page_free(address);
+        return;
+    }
+
+    if(start < PAGING_WINDOW_START || start >= PAGING_WINDOW_END || start % PAGE_SIZE != 0) {
+        KWARN("vmalloc: Freeing something that isn't ours");
+        return;
+    }
+
+    // The guard page is where it ends
+    uint32_t page_count = 0;
+    uintptr_t phys;
+    uint32_t flags;
+    while(paging_get(start + page_count * PAGE_SIZE, &phys, &flags))
+        page_count++;
+
+    unmap_pages(start);
+    vmalloc_release(start, page_count + 1);
+}
+
+uintptr_t vmalloc_reserve(uint32_t page_count)
+{
+    if(page_count == 0 || page_count > WINDOW_PAGES)
+        return 0;
+
+    if(g_window_map == NULL && !window_map_create())
+        return 0;
+
+    uint32_t flags = spinlock_lock_irqsave(&g_window_lock);
+    uintptr_t address = window_alloc(page_count);
+    spinlock_unlock_irqrestore(&g_window_lock, flags);
+
+    if(address == 0)
+        KWARN("vmalloc: Kernel window is full");
+
+    return address;
+}
+
+void vmalloc_release(uintptr_t address, uint32_t page_count)
+{
+    uint32_t first = (address - PAGING_WINDOW_START) / PAGE_SIZE;
+
+    uint32_t flags = spinlock_lock_irqsave(&g_window_lock);
+
+    for(uint32_t i = first; i < first + page_count; i++)
+        g_window_map[i / 32] &= ~(1u << (i % 32));
+
+    if(first < g_window_hint)
+        g_window_hint = first;
+
+    spinlock_unlock_irqrestore(&g_window_lock, flags);
+}
+
+// -------------------------------------------------------------------------
+// Static Functions
+// -------------------------------------------------------------------------
+
+// Allocating can mean reclaiming, which mustn't happen under the lock.
+// Whoever loses a race to install theirs gives it back.
+static bool window_map_create()
+{
+    uint32_t* map = (uint32_t*)mem_page_get_many(WINDOW_MAP_PAGES, mem_tag_kernel);
+    if(map == NULL)
+        return false;
+
+    for(size_t i = 0; i < WINDOW_PAGES / 32; i++)
+        map[i] = 0;
+
+    uint32_t flags = spinlock_lock_irqsave(&g_window_lock);
+    bool installed = g_window_map == NULL;
+    if(installed)
+        g_window_map = map;
+    spinlock_unlock_irqrestore(&g_window_lock, flags);
+
+    if(!installed)
+        mem_page_free(map);
+
+    return true;
+}
+
+// With the lock held. First fit from the hint, the space below it is
+// usually taken already, then once more from the bottom.
+static uintptr_t window_alloc(uint32_t page_count)
+{
+    for(int pass = 0; pass < 2; pass++) {
+        uint32_t start = pass == 0 ? g_window_hint & ~31u : 0;
+        uint32_t end = pass == 0 ? WINDOW_PAGES : g_window_hint + page_count;
+        if(end > WINDOW_PAGES)
+            end = WINDOW_PAGES;
+
+        uint32_t run = 0;
+        for(uint32_t page = start; page < end; page++) {
+            if(g_window_map[page / 32] == 0xFFFFFFFF) {
+                run = 0;
+                page += 31 - (page % 32);
+                continue;
+            }
+
+            if(g_window_map[page / 32] & (1u << (page % 32))) {
+                run = 0;
+                continue;
+            }
+
+            if(++run < page_count)
+                continue;
+
+            uint32_t first = page + 1 - page_count;
+            for(uint32_t i = first; i <= page; i++)
+                g_window_map[i / 32] |= 1u << (i % 32);
+
+            g_window_hint = page + 1;
+            return PAGING_WINDOW_START + first * PAGE_SIZE;
+        }
+    }
+
+    return 0;
+}
+
+// Frees the pages from address up to the first hole
+static void unmap_pages(uintptr_t address)
+{
+    uintptr_t phys;
+    uint32_t flags;
+
+    for(uintptr_t virt = address; paging_get(virt, &phys, &flags); virt += PAGE_SIZE) {
+        paging_unmap(virt);
+        mem_page_free((void*)phys);
+    }
+}
@@ -0,0 +1,106 @@
+#include <types.h>
+#include <kernel.h>
+#include <wait_queue.h>
+#include <thread.h>
+#include <lock.h>
+#include <arch/x86/cpu.h>
+
+// -------------------------------------------------------------------------
+// Forward Declarations
+// -------------------------------------------------------------------------
+static struct wait_queue_entry* pop_entry(struct wait_queue* queue);
+static void wake_entry(struct wait_queue_entry* entry);
+
+// -------------------------------------------------------------------------
+// Public Contract
+// -------------------------------------------------------------------------
+void wait_queue_init(struct wait_queue* queue)
+{
+    spinlock_init(&queue->lock, "wait_queue");
+    queue->head = NULL;
+    queue->tail = &queue->head;
+}
+
+void wait_queue_wait(struct wait_queue* queue)
+{
+    struct wait_queue_entry entry = {
+        .woken = false,
+        .thread = thread_current(),
+        .next = NULL
+    };
+    *queue->tail = &entry;
+    queue->tail = &entry.next;
+
+    spinlock_unlock(&queue->lock);
+
+    while(!entry.woken) {
+        if(entry.thread != NULL) {
+            thread_block();
+            continue;
+        }
+
+        // Early on there's nothing to switch to, so we halt until an
+        // interrupt wakes us. STI only takes effect after the next
+        // instruction, so nothing slips in before the HLT.
+        __asm("sti; hlt; cli");
+    }
+
+    // The waker still holds the lock while it's done with the queue, which
+    // may well live on our stack
+    spinlock_lock(&queue->lock);
+}
+
+uint32_t wait_queue_wake_one(struct wait_queue* queue)
+{
+    uint32_t flags = spinlock_lock_irqsave(&queue->lock);
+
+    struct wait_queue_entry* entry = pop_entry(queue);
+    if(entry != NULL)
+        wake_entry(entry);
+
+    spinlock_unlock_irqrestore(&queue->lock, flags);
+    return entry != NULL ? 1 : 0;
+}
+
+uint32_t wait_queue_wake_all(struct wait_queue* queue)
+{
+    uint32_t flags = spinlock_lock_irqsave(&queue->lock);
+
+    uint32_t count = 0;
+    struct wait_queue_entry* entry;
+    while((entry = pop_entry(queue)) != NULL) {
+        wake_entry(entry);
+        count++;
+    }
+
+    spinlock_unlock_irqrestore(&queue->lock, flags);
+    return count;
+}
+
+// -------------------------------------------------------------------------
+// Static Functions
+// -------------------------------------------------------------------------
+static struct wait_queue_entry* pop_entry(struct wait_queue* queue)
+{
+    struct wait_queue_entry* entry = queue->head;
+    if(entry == NULL)
+        return NULL;
+
+    queue->head = entry->next;
+    if(queue->head == NULL)
+        queue->tail = &queue->head;
+
+    // The waiter owns the entry again once woken, don't touch it after
+    entry->next = NULL;
+    return entry;
+}
+
+static void wake_entry(struct wait_queue_entry* entry)
+{
+    // Read before the waiter can see woken and drop the entry
+    struct thread* thread = entry->thread;
+    entry->woken = true;
+
+    if(thread != NULL)
+        thread_wake(thread);
+}
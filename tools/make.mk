@@ -0,0 +1,36 @@
+# Programs for the development machine, built with its own compiler
+TOOLS_MODULE := $(dir $(lastword $(MAKEFILE_LIST)))
+TOOLS_SOURCE_DIR := $(TOOLS_MODULE)source
+TOOLS_OBJ_DIR := $(TOOLS_MODULE)obj
+TOOLS_KERNEL_DIR := $(TOOLS_MODULE)../kernel
+
+CLEAN_DIRS += $(TOOLS_OBJ_DIR)
+
+HOST_CC ?= cc
+HOST_CFLAGS := -std=c11 \
+               -O2 \
+               -Wall \
+               -Werror \
+               -D _POSIX_C_SOURCE=199309L \
+               -D PLATFORM_BITS=$(shell getconf LONG_BIT)
+
+tools: $(BUILD_DIR)/allocbench
+
+# The kernel's page map, as is. It only gets the kernel headers, the
+# harness only gets to quote include them so it can have the host's libc.
+$(BUILD_DIR)/allocbench: $(TOOLS_OBJ_DIR)/allocbench.o $(TOOLS_OBJ_DIR)/page_alloc.o
+	@mkdir -p $(dir $@)
+	@echo "$(TIME) HOSTLD   $@"
+	@$(HOST_CC) $^ -o $@
+
+$(TOOLS_OBJ_DIR)/page_alloc.o: $(TOOLS_KERNEL_DIR)/source/page_alloc.c $(TOOLS_KERNEL_DIR)/include/page_alloc.h
+	@mkdir -p $(dir $@)
+	@echo "$(TIME) HOSTCC   $<"
+	@$(HOST_CC) $(HOST_CFLAGS) -ffreestanding -I $(TOOLS_KERNEL_DIR)/include -c $< -o $@
+
+$(TOOLS_OBJ_DIR)/allocbench.o: $(TOOLS_SOURCE_DIR)/allocbench.c $(TOOLS_KERNEL_DIR)/include/page_alloc.h
+	@mkdir -p $(dir $@)
+	@echo "$(TIME) HOSTCC   $<"
+	@$(HOST_CC) $(HOST_CFLAGS) -iquote $(TOOLS_KERNEL_DIR)/include -c $< -o $@
+
+.PHONY: tools
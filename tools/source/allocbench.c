@@ -0,0 +1,537 @@
+// Runs the kernel's page map (kernel/source/page_alloc.c) on the host.
+//
+//   allocbench bench  [-p pages] [-n ops] [-s seed]
+//   allocbench fuzz   [-p pages] [-n ops] [-s seed]
+//   allocbench replay <file> [-p pages]
+//
+// bench times a synthetic mix of allocations and frees. fuzz does the
+// same against a shadow copy of who owns which page, and also throws
+// double frees and frees of pages in the middle of allocations at it.
+// replay runs what 'mem trace' printed on a kernel built with MEM_TRACE.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "kernel.h"
+#include "page_alloc.h"
+
+// -------------------------------------------------------------------------
+// Static Defines
+// -------------------------------------------------------------------------
+#define DEFAULT_PAGES   (32 * 1024)     // 128 MiB worth
+#define DEFAULT_OPS     200000
+#define DEFAULT_SEED    1
+
+// Same as the kernel, the page map comes from mem_mgr_init there
+#define PAGE_SIZE       4096
+#define MAGAZINE_BATCH  16
+
+// Everything below this stays reserved, like the BIOS pages do
+#define RESERVED_PAGES  8
+
+// -------------------------------------------------------------------------
+// Static Types
+// -------------------------------------------------------------------------
+struct allocation {
+    size_t first;
+    size_t count;
+};
+
+struct stats {
+    uint64_t alloc_ns;
+    uint64_t allocs;
+    uint64_t free_ns;
+    uint64_t frees;
+    uint64_t batch_ns;
+    uint64_t batches;
+    uint64_t failures;          // No run long enough, although enough was free
+    size_t   live_pages;
+    size_t   peak_pages;
+    double   worst_fragmentation;
+};
+
+struct options {
+    size_t      pages;
+    size_t      ops;
+    uint32_t    seed;
+    const char* file;
+};
+
+// -------------------------------------------------------------------------
+// Forward Declarations
+// -------------------------------------------------------------------------
+static int run_bench(struct options* options);
+static int run_fuzz(struct options* options);
+static int run_replay(struct options* options);
+static void map_create(struct page_map* map, size_t pages);
+static size_t random_size();
+static uint32_t random_next();
+static uint64_t now_ns();
+static double fragmentation(struct page_map* map);
+static void track_usage(struct stats* stats, struct page_map* map, size_t pages, bool allocated);
+static void print_stats(struct stats* stats, struct page_map* map);
+static bool check_map(struct page_map* map, uint32_t* owners, uint64_t op);
+static void usage();
+
+// -------------------------------------------------------------------------
+// Globals
+// -------------------------------------------------------------------------
+static uint32_t g_random;
+
+// -------------------------------------------------------------------------
+// Public Contract
+// -------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+    if(argc < 2) {
+        usage();
+        return 2;
+    }
+
+    struct options options = {
+        .pages = DEFAULT_PAGES,
+        .ops = DEFAULT_OPS,
+        .seed = DEFAULT_SEED,
+        .file = NULL
+    };
+
+    int arg = 2;
+    if(strcmp(argv[1], "replay") == 0) {
+        if(argc < 3) {
+            usage();
+            return 2;
+        }
+
+        options.file = argv[arg++];
+    }
+
+    for(; arg < argc; arg++) {
+        if(arg + 1 >= argc) {
+            usage();
+            return 2;
+        }
+
+        unsigned long value = strtoul(argv[arg + 1], NULL, 0);
+        if(strcmp(argv[arg], "-p") == 0)
+            options.pages = value;
+        else if(strcmp(argv[arg], "-n") == 0)
+            options.ops = value;
+        else if(strcmp(argv[arg], "-s") == 0)
+            options.seed = (uint32_t)value;
+        else {
+            usage();
+            return 2;
+        }
+
+        arg++;
+    }
+
+    if(options.pages <= RESERVED_PAGES || options.seed == 0) {
+        fprintf(stderr, "Need more than %d pages and a seed that isn't 0\n", RESERVED_PAGES);
+        return 2;
+    }
+
+    g_random = options.seed;
+
+    if(strcmp(argv[1], "bench") == 0)
+        return run_bench(&options);
+    if(strcmp(argv[1], "fuzz") == 0)
+        return run_fuzz(&options);
+    if(strcmp(argv[1], "replay") == 0)
+        return run_replay(&options);
+
+    usage();
+    return 2;
+}
+
+// -------------------------------------------------------------------------
+// Static Functions
+// -------------------------------------------------------------------------
+static int run_bench(struct options* options)
+{
+    struct page_map map;
+    map_create(&map, options->pages);
+
+    struct allocation* live = calloc(options->pages, sizeof(struct allocation));
+    size_t live_count = 0;
+    struct stats stats = { 0 };
+
+    // Wanders between a third and nine tenths full, so the searches see
+    // both an easy map and a crowded, fragmented one
+    for(size_t op = 0; op < options->ops; op++) {
+        size_t target = options->pages / 3 + (op / 20000 % 2) * (options->pages * 17 / 30);
+        bool allocate = live_count == 0 || (stats.live_pages < target && random_next() % 4 != 0);
+
+        if(allocate) {
+            size_t count = random_size();
+
+            uint64_t start = now_ns();
+            size_t first = page_map_alloc(&map, count);
+            stats.alloc_ns += now_ns() - start;
+            stats.allocs++;
+
+            if(first == PAGE_MAP_NONE) {
+                stats.failures++;
+                continue;
+            }
+
+            live[live_count].first = first;
+            live[live_count].count = count;
+            live_count++;
+            track_usage(&stats, &map, count, true);
+        }
+        else {
+            size_t victim = random_next() % live_count;
+            struct allocation allocation = live[victim];
+            live[victim] = live[--live_count];
+
+            uint64_t start = now_ns();
+            page_map_free(&map, allocation.first);
+            stats.free_ns += now_ns() - start;
+            stats.frees++;
+
+            track_usage(&stats, &map, allocation.count, false);
+        }
+
+        // What a magazine refill costs, handed straight back
+        if(op % 64 == 0) {
+            size_t pages[MAGAZINE_BATCH];
+
+            uint64_t start = now_ns();
+            size_t found = page_map_alloc_cached(&map, pages, MAGAZINE_BATCH);
+            stats.batch_ns += now_ns() - start;
+            stats.batches++;
+
+            for(size_t i = 0; i < found; i++) {
+                map.pages[pages[i]].flags &= ~PAGE_CACHED;
+                page_map_free(&map, pages[i]);
+            }
+        }
+    }
+
+    print_stats(&stats, &map);
+
+    free(live);
+    free(map.pages);
+    return 0;
+}
+
+static int run_fuzz(struct options* options)
+{
+    struct page_map map;
+    map_create(&map, options->pages);
+
+    // Who owns each page according to us, 0 for nobody
+    uint32_t* owners = calloc(options->pages, sizeof(uint32_t));
+    struct allocation* live = calloc(options->pages, sizeof(struct allocation));
+    size_t live_count = 0;
+    uint32_t next_owner = 1;
+
+    for(size_t i = 0; i < RESERVED_PAGES; i++)
+        owners[i] = UINT32_MAX;
+
+    for(uint64_t op = 0; op < options->ops; op++) {
+        uint32_t choice = random_next() % 16;
+
+        if(choice < 8 || live_count == 0) {
+            size_t count = random_size();
+            size_t first = page_map_alloc(&map, count);
+            if(first == PAGE_MAP_NONE)
+                continue;
+
+            if(first + count > map.count) {
+                printf("op %llu: allocation of %zu at %zu runs off the map\n", (unsigned long long)op, count, first);
+                return 1;
+            }
+
+            for(size_t i = first; i < first + count; i++) {
+                if(owners[i] != 0) {
+                    printf("op %llu: allocation of %zu at %zu overlaps page %zu\n", (unsigned long long)op, count, first, i);
+                    return 1;
+                }
+
+                owners[i] = next_owner;
+            }
+
+            next_owner = next_owner == UINT32_MAX - 1 ? 1 : next_owner + 1;
+            live[live_count].first = first;
+            live[live_count].count = count;
+            live_count++;
+        }
+        else if(choice < 14) {
+            size_t victim = random_next() % live_count;
+            struct allocation allocation = live[victim];
+            live[victim] = live[--live_count];
+
+            enum page_map_result result = page_map_free(&map, allocation.first);
+            if(result != page_map_ok) {
+                printf("op %llu: freeing %zu pages at %zu failed with %d\n", (unsigned long long)op, allocation.count, allocation.first, result);
+                return 1;
+            }
+
+            for(size_t i = allocation.first; i < allocation.first + allocation.count; i++)
+                owners[i] = 0;
+        }
+        else if(choice == 14) {
+            // A page that's free, or in the middle of something, was
+            // never handed out and can't be freed
+            size_t page = random_next() % map.count;
+            bool is_start = false;
+            for(size_t i = 0; i < live_count; i++)
+                is_start = is_start || live[i].first == page;
+
+            if(!is_start && page_map_free(&map, page) == page_map_ok) {
+                printf("op %llu: freeing page %zu worked, it isn't the start of anything\n", (unsigned long long)op, page);
+                return 1;
+            }
+        }
+        else {
+            // A magazine's worth, each of them freed twice while cached
+            size_t pages[MAGAZINE_BATCH];
+            size_t found = page_map_alloc_cached(&map, pages, MAGAZINE_BATCH);
+
+            for(size_t i = 0; i < found; i++) {
+                if(owners[pages[i]] != 0) {
+                    printf("op %llu: cached page %zu is already owned\n", (unsigned long long)op, pages[i]);
+                    return 1;
+                }
+
+                if(page_map_free(&map, pages[i]) != page_map_cached) {
+                    printf("op %llu: freeing cached page %zu wasn't refused\n", (unsigned long long)op, pages[i]);
+                    return 1;
+                }
+
+                map.pages[pages[i]].flags &= ~PAGE_CACHED;
+                page_map_free(&map, pages[i]);
+            }
+        }
+
+        if(op % 1024 == 0 && !check_map(&map, owners, op))
+            return 1;
+    }
+
+    if(!check_map(&map, owners, options->ops))
+        return 1;
+
+    printf("%zu ops on %zu pages with seed %u, no problems found\n", options->ops, options->pages, options->seed);
+
+    free(live);
+    free(owners);
+    free(map.pages);
+    return 0;
+}
+
+// The lines look like "alloc <tag> 0x00123000 x4 from 0x00101234", the
+// tag may have spaces in it. Kernel addresses are mapped to wherever the
+// same allocation landed here.
+static int run_replay(struct options* options)
+{
+    FILE* file = fopen(options->file, "r");
+    if(file == NULL) {
+        perror(options->file);
+        return 1;
+    }
+
+    struct page_map map;
+    map_create(&map, options->pages);
+
+    size_t capacity = options->pages;
+    struct allocation* live = calloc(capacity, sizeof(struct allocation));
+    uintptr_t* addresses = calloc(capacity, sizeof(uintptr_t));
+    size_t live_count = 0;
+    uint64_t unmatched = 0;
+    struct stats stats = { 0 };
+
+    char line[256];
+    while(fgets(line, sizeof(line), file) != NULL) {
+        bool is_alloc = strncmp(line, "alloc ", 6) == 0;
+        bool is_free = strncmp(line, "free ", 5) == 0;
+        char* hex = strstr(line, " 0x");
+        if((!is_alloc && !is_free) || hex == NULL)
+            continue;
+
+        char* end;
+        uintptr_t address = strtoul(hex + 1, &end, 16);
+        size_t count = 1;
+        if(strncmp(end, " x", 2) == 0)
+            count = strtoul(end + 2, NULL, 10);
+
+        if(is_alloc) {
+            if(live_count == capacity)
+                continue;
+
+            uint64_t start = now_ns();
+            size_t first = page_map_alloc(&map, count);
+            stats.alloc_ns += now_ns() - start;
+            stats.allocs++;
+
+            if(first == PAGE_MAP_NONE) {
+                stats.failures++;
+                continue;
+            }
+
+            live[live_count].first = first;
+            live[live_count].count = count;
+            addresses[live_count] = address;
+            live_count++;
+            track_usage(&stats, &map, count, true);
+            continue;
+        }
+
+        // The ring only has the latest entries, the allocation may be
+        // from before it starts
+        size_t index = 0;
+        while(index < live_count && addresses[index] != address)
+            index++;
+
+        if(index == live_count) {
+            unmatched++;
+            continue;
+        }
+
+        struct allocation allocation = live[index];
+        live[index] = live[--live_count];
+        addresses[index] = addresses[live_count];
+
+        uint64_t start = now_ns();
+        page_map_free(&map, allocation.first);
+        stats.free_ns += now_ns() - start;
+        stats.frees++;
+
+        track_usage(&stats, &map, allocation.count, false);
+    }
+
+    fclose(file);
+
+    print_stats(&stats, &map);
+    if(unmatched > 0)
+        printf("frees of allocations from before the trace: %llu\n", (unsigned long long)unmatched);
+
+    free(addresses);
+    free(live);
+    free(map.pages);
+    return 0;
+}
+
+static void map_create(struct page_map* map, size_t pages)
+{
+    struct page* entries = malloc(pages * sizeof(struct page));
+    if(entries == NULL) {
+        fprintf(stderr, "Out of memory for %zu pages\n", pages);
+        exit(1);
+    }
+
+    page_map_init(map, entries, pages);
+    page_map_reserve(map, 0, RESERVED_PAGES);
+}
+
+// Mostly single pages, like the kernel asks for, with the odd stack or
+// table of a few pages and now and then something big
+static size_t random_size()
+{
+    uint32_t roll = random_next() % 100;
+    if(roll < 85)
+        return 1;
+    if(roll < 97)
+        return 2 + random_next() % 7;
+
+    return 9 + random_next() % 56;
+}
+
+// xorshift32, the same seed gives the same run everywhere
+static uint32_t random_next()
+{
+    g_random ^= g_random << 13;
+    g_random ^= g_random >> 17;
+    g_random ^= g_random << 5;
+
+    return g_random;
+}
+
+static uint64_t now_ns()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return (uint64_t)time.tv_sec * 1000000000ull + (uint64_t)time.tv_nsec;
+}
+
+// How much of the free memory can't be had in one piece
+static double fragmentation(struct page_map* map)
+{
+    size_t free_pages = page_map_count(map, false);
+    if(free_pages == 0)
+        return 0.0;
+
+    return 1.0 - (double)page_map_largest_free(map) / (double)free_pages;
+}
+
+static void track_usage(struct stats* stats, struct page_map* map, size_t pages, bool allocated)
+{
+    stats->live_pages = allocated ? stats->live_pages + pages : stats->live_pages - pages;
+    if(stats->live_pages <= stats->peak_pages)
+        return;
+
+    stats->peak_pages = stats->live_pages;
+
+    // Counting is a walk over the whole map, only done on a new peak
+    double now = fragmentation(map);
+    if(now > stats->worst_fragmentation)
+        stats->worst_fragmentation = now;
+}
+
+static void print_stats(struct stats* stats, struct page_map* map)
+{
+    printf("alloc:  %10llu ops %8.1f ns/op\n", (unsigned long long)stats->allocs,
+            stats->allocs ? (double)stats->alloc_ns / stats->allocs : 0.0);
+    printf("free:   %10llu ops %8.1f ns/op\n", (unsigned long long)stats->frees,
+            stats->frees ? (double)stats->free_ns / stats->frees : 0.0);
+    printf("batch:  %10llu ops %8.1f ns/op (%d pages)\n", (unsigned long long)stats->batches,
+            stats->batches ? (double)stats->batch_ns / stats->batches : 0.0, MAGAZINE_BATCH);
+    printf("failed: %10llu allocations\n", (unsigned long long)stats->failures);
+    printf("peak:   %10zu pages (%zu KiB) of %zu\n", stats->peak_pages, stats->peak_pages * PAGE_SIZE / 1024, map->count);
+    printf("fragmentation: %.1f%% at the end, %.1f%% at worst on a new peak\n",
+            fragmentation(map) * 100.0, stats->worst_fragmentation * 100.0);
+}
+
+// Every page the map calls used has an owner and the other way round, and
+// every allocation is marked the way page_map_free expects
+static bool check_map(struct page_map* map, uint32_t* owners, uint64_t op)
+{
+    for(size_t i = 0; i < map->count; i++) {
+        uint8_t flags = map->pages[i].flags;
+
+        if(IS_PAGE_USED(flags) != (owners[i] != 0)) {
+            printf("op %llu: page %zu is %s in the map but %s here\n", (unsigned long long)op, i,
+                    IS_PAGE_USED(flags) ? "used" : "free", owners[i] != 0 ? "owned" : "free");
+            return false;
+        }
+
+        bool starts = owners[i] != 0 && owners[i] != UINT32_MAX && (i == 0 || owners[i - 1] != owners[i]);
+        if(starts != IS_FIRST_IN_ALLOCATION(flags)) {
+            printf("op %llu: page %zu %s the first of an allocation\n", (unsigned long long)op, i,
+                    starts ? "should be" : "shouldn't be");
+            return false;
+        }
+
+        if(starts) {
+            size_t last = i + map->pages[i].consecutive_pages_allocated;
+            if(last >= map->count || owners[last] != owners[i] || (last + 1 < map->count && owners[last + 1] == owners[i])) {
+                printf("op %llu: allocation at %zu has the wrong length\n", (unsigned long long)op, i);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: allocbench bench  [-p pages] [-n ops] [-s seed]\n");
+    fprintf(stderr, "       allocbench fuzz   [-p pages] [-n ops] [-s seed]\n");
+    fprintf(stderr, "       allocbench replay <file> [-p pages]\n");
+}
@@ -1,6 +1,150 @@
 #ifndef USERLAND_H
 #define USERLAND_H
 
-// TODO:
+#include <types.h>
+
+// Mirrors the kernel's syscall.h. The number goes in EAX, up to three
+// arguments in EBX, ESI and EDI, the result comes back in EAX.
+#define SYSCALL_ERROR 0xFFFFFFFF
+
+enum syscall_number {
+    syscall_exit,
+    syscall_write,
+    syscall_sleep,
+    syscall_yield
+};
+
+// CPUID.1:EDX.SEP, the kernel sets SYSENTER up whenever it's there
+static inline bool syscall_has_sysenter()
+{
+    uint32_t eax = 1, ebx, ecx = 0, edx;
+    __asm volatile("cpuid"
+            : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+
+    return (edx & (1 << 11)) != 0;
+}
+
+// The kernel comes back to the stack in ECX and the label in EDX
+static inline uint32_t syscall_fast(uint32_t number, uint32_t arg0, uint32_t arg1, uint32_t arg2)
+{
+    uint32_t result;
+    __asm volatile("mov %%esp, %%ecx\n"
+                   "mov $1f, %%edx\n"
+                   "sysenter\n"
+                   "1:\n"
+            : "=a"(result)
+            : "a"(number), "b"(arg0), "S"(arg1), "D"(arg2)
+            : "ecx", "edx", "memory", "cc");
+
+    return result;
+}
+
+static inline uint32_t syscall_slow(uint32_t number, uint32_t arg0, uint32_t arg1, uint32_t arg2)
+{
+    uint32_t result;
+    __asm volatile("int $0x80"
+            : "=a"(result)
+            : "a"(number), "b"(arg0), "S"(arg1), "D"(arg2)
+            : "ecx", "edx", "memory", "cc");
+
+    return result;
+}
+
+// Mirrors the kernel's shared_page.h, mapped read-only into every program
+#define SHARED_PAGE_ADDRESS     0x7FFF0000
+#define SHARED_PAGE_APIC_IDS    256
+
+enum shared_page_flag {
+    shared_page_flag_tsc    = 1 << 0,
+    shared_page_flag_rdtscp = 1 << 1
+};
+
+struct shared_page {
+    volatile uint32_t   sequence;
+    uint32_t            version;
+    uint32_t            flags;
+    uint64_t            tsc_base;
+    uint32_t            tsc_mult;
+    uint32_t            tsc_shift;
+    uint32_t            tsc_khz;
+    uint64_t            ticks;
+    uint64_t            tick_ns;
+    uint32_t            cpu_count;
+    uint32_t            page_size;
+    uint8_t             cpu_by_apic_id[SHARED_PAGE_APIC_IDS];
+};
+
+#define g_shared_page ((const struct shared_page*)SHARED_PAGE_ADDRESS)
+
+// The kernel makes the sequence odd while it writes, so a read is only
+// good if it was even and didn't change until we were done
+static inline uint32_t shared_page_read_begin()
+{
+    uint32_t sequence;
+    do {
+        sequence = g_shared_page->sequence;
+    } while(sequence & 1);
+
+    __asm volatile("" ::: "memory");
+    return sequence;
+}
+
+static inline bool shared_page_read_retry(uint32_t sequence)
+{
+    __asm volatile("" ::: "memory");
+    return g_shared_page->sequence != sequence;
+}
+
+static inline uint64_t shared_page_read_tsc()
+{
+    uint32_t low, high;
+    __asm volatile("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+// Nanoseconds on the kernel's clock without entering the kernel. Only as
+// fine as the tick when there's no TSC.
+static inline uint64_t shared_page_now_ns()
+{
+    uint64_t ns;
+    uint32_t sequence;
+
+    do {
+        sequence = shared_page_read_begin();
+
+        if(g_shared_page->flags & shared_page_flag_tsc) {
+            uint64_t delta = shared_page_read_tsc() - g_shared_page->tsc_base;
+            uint32_t mult = g_shared_page->tsc_mult;
+            uint32_t shift = g_shared_page->tsc_shift;
+
+            // (delta * mult) >> shift, the product needs 96 bits
+            uint64_t low = (delta & 0xFFFFFFFF) * mult;
+            uint64_t high = (delta >> 32) * mult;
+            ns = (high << (32 - shift)) + (low >> shift);
+        }
+        else {
+            ns = g_shared_page->tick_ns;
+        }
+    } while(shared_page_read_retry(sequence));
+
+    return ns;
+}
+
+// The kernel's index of the CPU we're on, which may well have changed by
+// the time the caller looks at it
+static inline uint32_t shared_page_cpu_index()
+{
+    uint32_t eax, ebx, ecx, edx;
+
+    if(g_shared_page->flags & shared_page_flag_rdtscp) {
+        __asm volatile("rdtscp" : "=a"(eax), "=d"(edx), "=c"(ecx));
+        return ecx;
+    }
+
+    eax = 1;
+    ecx = 0;
+    __asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    return g_shared_page->cpu_by_apic_id[ebx >> 24];
+}
 
 #endif
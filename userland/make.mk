@@ -12,6 +12,9 @@ CLEAN_DIRS += $(OBJ_DIR) $(DEP_DIR)
 FS_FILES += $(FS_DIR)/USERLAND.ELF
 
 C_HEADERS := $(patsubst %,-I%, $(shell find $(INCLUDE_DIR) -type d))
+
+# The kernel saves SSE state for us, so programs may use it freely
+USERLAND_CFLAGS := -msse2 -mfpmath=sse
 -include $(addprefix $(DEP_DIR)/, $(notdir $(COBJECTS:.o=.d)))
 
 userland: $(BUILD_DIR)/USERLAND.ELF
@@ -25,6 +28,6 @@ $(OBJ_DIR)/%.o : $(SOURCE_DIR)/%.c
 	@mkdir -p $(DEP_DIR)/$(dir $*)
 
 	@echo "$(TIME) CC       $<"
-	@$(TOOL)-gcc $< -o $@ $(C_HEADERS) $(CFLAGS) -MD -MF $(DEP_DIR)/$*.d
+	@$(TOOL)-gcc $< -o $@ $(C_HEADERS) $(CFLAGS) $(USERLAND_CFLAGS) -MD -MF $(DEP_DIR)/$*.d
 
 .PHONY: userland
@@ -6,6 +6,7 @@
 static const size_t VGA_WIDTH = 80;
 static const size_t VGA_HEIGHT = 25;
 static uint16_t* g_terminal = (uint16_t*)0xB8000;
+static bool g_sysenter;
 
 enum vga_color
 {
@@ -40,14 +41,62 @@ void screen_put_entry(uint16_t entry, size_t x, size_t y)
     g_terminal[index] = entry;
 }
 
+static uint32_t syscall(uint32_t number, uint32_t arg0, uint32_t arg1, uint32_t arg2)
+{
+    if(g_sysenter)
+        return syscall_fast(number, arg0, arg1, arg2);
+
+    return syscall_slow(number, arg0, arg1, arg2);
+}
+
+static void write_string(const char* string)
+{
+    size_t length = 0;
+    while(string[length] != '\0')
+        length++;
+
+    syscall(syscall_write, (uint32_t)string, length, 0);
+}
+
+static void write_uint32(uint32_t value)
+{
+    char buffer[11];
+    size_t i = sizeof(buffer) - 1;
+    buffer[i] = '\0';
+
+    do {
+        buffer[--i] = '0' + value % 10;
+        value /= 10;
+    } while(value != 0);
+
+    write_string(&buffer[i]);
+}
+
 SECTION_START int main()
 {
+    g_sysenter = syscall_has_sysenter();
+
     screen_put_entry(screen_create_entry('H', vga_color_light_blue), 0, 10);
     screen_put_entry(screen_create_entry('E', vga_color_light_blue), 1, 10);
     screen_put_entry(screen_create_entry('L', vga_color_light_blue), 2, 10);
     screen_put_entry(screen_create_entry('L', vga_color_light_blue), 3, 10);
     screen_put_entry(screen_create_entry('O', vga_color_light_blue), 4, 10);
 
+    write_string(g_sysenter ? "Hello from user mode, via SYSENTER\n" : "Hello from user mode, via int 0x80\n");
+
+    // Neither of these enter the kernel
+    uint64_t start = shared_page_now_ns();
+    uint32_t cpu = shared_page_cpu_index();
+    uint64_t took = shared_page_now_ns() - start;
+
+    write_string("On CPU ");
+    write_uint32(cpu);
+    write_string(", reading the clock took ");
+    write_uint32((uint32_t)took);
+    write_string(" ns\n");
+
+    // There's nothing to return to
+    syscall(syscall_exit, 1, 0, 0);
     return 1;
 }
 